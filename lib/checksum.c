@@ -26,6 +26,7 @@
 
 
 #include "checksum.h"
+#include <string.h>
 
 uint32_t add_checksum(void *buffer, uint16_t length) {
         uint32_t sum = 0;
@@ -99,4 +100,40 @@ uint32_t ipv6_pseudo_checksum(libtrace_ip6_t *ip) {
 
 }
 
+DLLEXPORT void trace_checksum_update(uint16_t *csum, const void *olddata,
+		const void *newdata, size_t len) {
+
+	const uint8_t *o = (const uint8_t *)olddata;
+	const uint8_t *n = (const uint8_t *)newdata;
+	uint16_t oldval, newval, check;
+	uint32_t sum;
+	size_t i;
+
+	/* RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m'). One's complement sums
+	 * give the same result in either byte order, so the words can be
+	 * used as they are in memory. The checksum may not be aligned */
+	memcpy(&check, csum, sizeof(uint16_t));
+	sum = (uint16_t)~check;
+	for (i = 0; i + 1 < len; i += 2) {
+		memcpy(&oldval, o + i, sizeof(uint16_t));
+		memcpy(&newval, n + i, sizeof(uint16_t));
+		sum += (uint16_t)~oldval;
+		sum += newval;
+	}
+
+	/* A trailing byte is the first byte of a word whose other byte is
+	 * unchanged, so it cancels out and can be taken as zero */
+	if (len & 1) {
+		oldval = 0;
+		newval = 0;
+		memcpy(&oldval, o + len - 1, 1);
+		memcpy(&newval, n + len - 1, 1);
+		sum += (uint16_t)~oldval;
+		sum += newval;
+	}
 
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	check = (uint16_t)~sum;
+	memcpy(csum, &check, sizeof(uint16_t));
+}
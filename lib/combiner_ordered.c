@@ -93,11 +93,11 @@ inline static int peek_queue(libtrace_t *trace, libtrace_combine_t *c,
         }
 
         if (peeked->type == RESULT_TICK_COUNT) {
-                if (peeked->key > c->last_count_tick) {
-                        c->last_count_tick = peeked->key;
+                /* Tick doesn't match packet order */
+                if (trace_is_parallel(trace)) {
+                        if (peeked->key > c->last_count_tick) {
+                                c->last_count_tick = peeked->key;
 
-                        /* Tick doesn't match packet order */
-                        if (trace_is_parallel(trace)) {
                                 /* Pass straight to reporter */
                                 libtrace_generic_t gt = {.res = peeked};
                                 ASSERT_RET (libtrace_deque_pop_front(v, (void *) peeked), == 1);
@@ -105,23 +105,41 @@ inline static int peek_queue(libtrace_t *trace, libtrace_combine_t *c,
                                                 MESSAGE_RESULT, gt,
                                                 &trace->reporter_thread);
                                 return 0;
+                        } else {
+                                /* Duplicate -- pop it */
+                                ASSERT_RET (libtrace_deque_pop_front(v, (void *) peeked), == 1);
+                                return 0;
                         }
-                        /* Tick matches packet order */
-                        *key = peeked->key;
-                        return 1;
-
-                        /* Tick doesn't match packet order */
-                } else {
-                        /* Duplicate -- pop it */
-                        ASSERT_RET (libtrace_deque_pop_front(v, (void *) peeked), == 1);
-                        return 0;
                 }
+
+                /* Tick matches packet order. Every thread's copy holds its
+                 * place in the order, otherwise a thread with nothing else
+                 * to publish would hold up the rest. The duplicates are
+                 * dropped when they reach the front, in send_result() */
+                *key = peeked->key;
+                return 1;
         }
 
         *key = peeked->key;
         return 1;
 }
 
+/* Passes a result on to the reporter, only the first copy of a tick that
+ * matches packet order gets through */
+inline static void send_result(libtrace_t *trace, libtrace_combine_t *c,
+                libtrace_result_t *r) {
+
+        libtrace_generic_t gt = {.res = r};
+
+        if (r->type == RESULT_TICK_COUNT) {
+                if (r->key <= c->last_count_tick)
+                        return;
+                c->last_count_tick = r->key;
+        }
+        send_message(trace, &trace->reporter_thread, MESSAGE_RESULT, gt,
+                        NULL);
+}
+
 inline static uint64_t next_message(libtrace_t *trace, libtrace_combine_t *c,
                 libtrace_queue_t *v) {
 
@@ -174,15 +192,12 @@ inline static void read_internal(libtrace_t *trace, libtrace_combine_t *c, const
         while (allactive || (live_count && final)) {
 		/* Get the minimum queue and then do stuff */
 		libtrace_result_t r;
-		libtrace_generic_t gt = {.res = &r};
 
 		ASSERT_RET (libtrace_deque_pop_front(&queues[min_queue], (void *) &r), == 1);
 
                 //printf("%lu %lu %lu %lu %d\n", key[0], key[1], key[2], key[3], min_queue);
 
-                send_message(trace, &trace->reporter_thread,
-                                MESSAGE_RESULT, gt,
-                                NULL);
+                send_result(trace, c, &r);
 
 		// Now update the one we just removed
                 peeked = next_message(trace, c, &queues[min_queue]);
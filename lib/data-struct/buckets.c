@@ -31,11 +31,15 @@
 
 #define MAX_OUTSTANDING (200000)
 
-static void clear_bucket_node(void *node) {
+static void clear_bucket_node(libtrace_bucket_t *b, void *node) {
 
         libtrace_bucket_node_t *bnode = (libtrace_bucket_node_t *)node;
-        if (bnode->buffer)
-                free(bnode->buffer);
+        if (bnode->buffer) {
+                if (b->release)
+                        b->release(bnode->buffer, b->release_data);
+                else
+                        free(bnode->buffer);
+        }
         if (bnode->released)
                 free(bnode->released);
 }
@@ -49,6 +53,8 @@ DLLEXPORT libtrace_bucket_t *libtrace_bucket_init() {
 
         b->nextid = 199999;
         b->node = NULL;
+        b->release = NULL;
+        b->release_data = NULL;
         b->nodelist = libtrace_list_init(sizeof(libtrace_bucket_node_t));
 
         pthread_mutex_init(&b->lock, NULL);
@@ -62,7 +68,7 @@ DLLEXPORT void libtrace_bucket_destroy(libtrace_bucket_t *b) {
 
         pthread_mutex_lock(&b->lock);
         if (b->node) {
-                clear_bucket_node(b->node);
+                clear_bucket_node(b, b->node);
                 free(b->node);
         }
 
@@ -74,6 +80,15 @@ DLLEXPORT void libtrace_bucket_destroy(libtrace_bucket_t *b) {
         free(b);
 }
 
+DLLEXPORT void libtrace_bucket_set_release(libtrace_bucket_t *b,
+                libtrace_bucket_release_t release, void *data) {
+
+        pthread_mutex_lock(&b->lock);
+        b->release = release;
+        b->release_data = data;
+        pthread_mutex_unlock(&b->lock);
+}
+
 DLLEXPORT void libtrace_create_new_bucket(libtrace_bucket_t *b, void *buffer) {
 
         libtrace_bucket_node_t tmp;
@@ -86,7 +101,7 @@ DLLEXPORT void libtrace_create_new_bucket(libtrace_bucket_t *b, void *buffer) {
          */
         pthread_mutex_lock(&b->lock);
         if (b->node && b->node->startindex == 0) {
-                clear_bucket_node(b->node);
+                clear_bucket_node(b, b->node);
                 libtrace_list_pop_back(b->nodelist, &tmp);
                 free(b->node);
         }
@@ -238,7 +253,7 @@ DLLEXPORT void libtrace_release_bucket_id(libtrace_bucket_t *b, uint64_t id) {
                         }
                 }
 
-                clear_bucket_node(front);
+                clear_bucket_node(b, front);
                 libtrace_list_pop_front(b->nodelist, &tmp);
                 free(front);
                 pthread_cond_signal(&b->cond);
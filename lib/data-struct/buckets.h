@@ -37,6 +37,9 @@ typedef struct bucket_node {
         void *buffer;
 } libtrace_bucket_node_t;
 
+/* Called instead of free() with a buffer that no packets refer to */
+typedef void (*libtrace_bucket_release_t)(void *buffer, void *data);
+
 typedef struct buckets {
         uint64_t nextid;
         libtrace_bucket_node_t *node;
@@ -44,10 +47,14 @@ typedef struct buckets {
         libtrace_list_t *nodelist;
         pthread_mutex_t lock;
         pthread_cond_t cond;
+        libtrace_bucket_release_t release;
+        void *release_data;
 } libtrace_bucket_t;
 
 libtrace_bucket_t *libtrace_bucket_init(void);
 void libtrace_bucket_destroy(libtrace_bucket_t *b);
+void libtrace_bucket_set_release(libtrace_bucket_t *b,
+                libtrace_bucket_release_t release, void *data);
 void libtrace_create_new_bucket(libtrace_bucket_t *b, void *buffer);
 uint64_t libtrace_push_into_bucket(libtrace_bucket_t *b);
 void libtrace_release_bucket_id(libtrace_bucket_t *b, uint64_t id);
@@ -0,0 +1,499 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#include "flow_table.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define FLOWTABLE_MIN_SLOTS 64
+/* The number of slots in the timer wheel, each covers 1/FLOWTABLE_WHEEL_SLOTS
+ * of the idle timeout */
+#define FLOWTABLE_WHEEL_SLOTS 64
+#define FLOWTABLE_NONE UINT32_MAX
+
+#define ALIGN8(x) (((x) + 7) & ~(size_t)7)
+
+/* The header of each flow in the entry array, followed by the key and the
+ * value */
+struct flow_entry {
+	uint64_t hash;
+	double last_seen;
+	/* The timer wheel tick the flow was last seen in */
+	uint64_t tick;
+	/* The neighbours of the flow in its timer wheel slot */
+	uint32_t prev;
+	uint32_t next;
+};
+
+/* A slot in the open addressing index, the upper half of the hash saves
+ * comparing keys that can't match */
+struct flow_slot {
+	uint32_t hash;
+	uint32_t entry;
+};
+
+struct libtrace_flowtable {
+	size_t key_size;
+	size_t value_size;
+	size_t value_offset;
+	size_t entry_size;
+
+	struct flow_slot *slots;
+	size_t mask;
+
+	uint8_t *entries;
+	size_t count;
+	size_t capacity;
+
+	double timeout;
+	double tick_width;
+	uint64_t expired_tick;
+	uint32_t wheel[FLOWTABLE_WHEEL_SLOTS];
+	libtrace_flowtable_fn expire_fn;
+	void *expire_data;
+};
+
+#define ENTRY(ft, i) ((struct flow_entry *)((ft)->entries + \
+		(size_t)(i) * (ft)->entry_size))
+#define KEY(e) ((uint8_t *)(e) + sizeof(struct flow_entry))
+#define VALUE(ft, e) ((uint8_t *)(e) + (ft)->value_offset)
+
+static inline uint64_t mix64(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint64_t hash_key(const void *key, size_t len) {
+	const uint8_t *p = key;
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+	uint64_t v;
+
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		h = (h ^ mix64(v)) * 0x100000001b3ULL;
+		p += 8;
+		len -= 8;
+	}
+	if (len > 0) {
+		v = 0;
+		memcpy(&v, p, len);
+		h = (h ^ mix64(v)) * 0x100000001b3ULL;
+	}
+	return mix64(h);
+}
+
+static inline uint32_t slot_tag(uint64_t hash) {
+	return (uint32_t)(hash >> 32);
+}
+
+DLLEXPORT int libtrace_flow_key_from_packet(libtrace_packet_t *packet,
+		libtrace_flow_key_t *key, bool bidirectional) {
+	uint16_t ethertype;
+	uint32_t rem;
+	void *l3;
+
+	memset(key, 0, sizeof(libtrace_flow_key_t));
+	l3 = trace_get_layer3(packet, &ethertype, &rem);
+	if (l3 == NULL)
+		return -1;
+
+	if (ethertype == TRACE_ETHERTYPE_IP) {
+		libtrace_ip_t *ip = (libtrace_ip_t *)l3;
+		if (rem < sizeof(libtrace_ip_t))
+			return -1;
+		key->family = AF_INET;
+		key->protocol = ip->ip_p;
+		memcpy(key->addr_a, &ip->ip_src, 4);
+		memcpy(key->addr_b, &ip->ip_dst, 4);
+	} else if (ethertype == TRACE_ETHERTYPE_IPV6) {
+		libtrace_ip6_t *ip6 = (libtrace_ip6_t *)l3;
+		if (rem < sizeof(libtrace_ip6_t))
+			return -1;
+		key->family = AF_INET6;
+		memcpy(key->addr_a, &ip6->ip_src, 16);
+		memcpy(key->addr_b, &ip6->ip_dst, 16);
+		/* Skip any extension headers to find the protocol */
+		if (trace_get_transport(packet, &key->protocol, &rem) == NULL)
+			key->protocol = ip6->nxt;
+	} else {
+		return -1;
+	}
+	key->port_a = trace_get_source_port(packet);
+	key->port_b = trace_get_destination_port(packet);
+
+	if (bidirectional) {
+		int c = memcmp(key->addr_a, key->addr_b, sizeof(key->addr_a));
+		if (c > 0 || (c == 0 && key->port_a > key->port_b)) {
+			uint8_t addr[16];
+			uint16_t port;
+
+			memcpy(addr, key->addr_a, sizeof(addr));
+			memcpy(key->addr_a, key->addr_b, sizeof(addr));
+			memcpy(key->addr_b, addr, sizeof(addr));
+			port = key->port_a;
+			key->port_a = key->port_b;
+			key->port_b = port;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+DLLEXPORT libtrace_flowtable_t *libtrace_flowtable_create(size_t key_size,
+		size_t value_size) {
+	libtrace_flowtable_t *ft = calloc(1, sizeof(libtrace_flowtable_t));
+
+	if (ft == NULL)
+		return NULL;
+	ft->key_size = key_size;
+	ft->value_size = value_size;
+	ft->value_offset = ALIGN8(sizeof(struct flow_entry) + key_size);
+	ft->entry_size = ft->value_offset + ALIGN8(value_size);
+
+	ft->slots = malloc(sizeof(struct flow_slot) * FLOWTABLE_MIN_SLOTS);
+	if (ft->slots == NULL) {
+		free(ft);
+		return NULL;
+	}
+	memset(ft->slots, 0xff, sizeof(struct flow_slot) * FLOWTABLE_MIN_SLOTS);
+	ft->mask = FLOWTABLE_MIN_SLOTS - 1;
+	memset(ft->wheel, 0xff, sizeof(ft->wheel));
+	return ft;
+}
+
+DLLEXPORT void libtrace_flowtable_destroy(libtrace_flowtable_t *ft) {
+	free(ft->slots);
+	free(ft->entries);
+	free(ft);
+}
+
+/* Finds the slot holding a key, or the empty slot it would go in */
+static size_t find_slot(libtrace_flowtable_t *ft, const void *key,
+		uint64_t hash) {
+	uint32_t tag = slot_tag(hash);
+	size_t pos = hash & ft->mask;
+
+	for (;; pos = (pos + 1) & ft->mask) {
+		struct flow_slot *s = &ft->slots[pos];
+		if (s->entry == FLOWTABLE_NONE)
+			return pos;
+		if (s->hash == tag && memcmp(KEY(ENTRY(ft, s->entry)), key,
+					ft->key_size) == 0)
+			return pos;
+	}
+}
+
+/* Finds the slot that refers to an entry */
+static size_t entry_slot(libtrace_flowtable_t *ft, uint32_t index) {
+	size_t pos = ENTRY(ft, index)->hash & ft->mask;
+
+	while (ft->slots[pos].entry != index)
+		pos = (pos + 1) & ft->mask;
+	return pos;
+}
+
+static bool grow_slots(libtrace_flowtable_t *ft) {
+	size_t nslots = (ft->mask + 1) * 2;
+	struct flow_slot *slots = malloc(sizeof(struct flow_slot) * nslots);
+	size_t i;
+
+	if (slots == NULL)
+		return false;
+	memset(slots, 0xff, sizeof(struct flow_slot) * nslots);
+	free(ft->slots);
+	ft->slots = slots;
+	ft->mask = nslots - 1;
+
+	for (i = 0; i < ft->count; i++) {
+		uint64_t hash = ENTRY(ft, i)->hash;
+		size_t pos = hash & ft->mask;
+		while (slots[pos].entry != FLOWTABLE_NONE)
+			pos = (pos + 1) & ft->mask;
+		slots[pos].hash = slot_tag(hash);
+		slots[pos].entry = i;
+	}
+	return true;
+}
+
+static void wheel_link(libtrace_flowtable_t *ft, uint32_t index) {
+	struct flow_entry *e = ENTRY(ft, index);
+	uint32_t *head = &ft->wheel[e->tick % FLOWTABLE_WHEEL_SLOTS];
+
+	e->prev = FLOWTABLE_NONE;
+	e->next = *head;
+	if (*head != FLOWTABLE_NONE)
+		ENTRY(ft, *head)->prev = index;
+	*head = index;
+}
+
+static void wheel_unlink(libtrace_flowtable_t *ft, uint32_t index) {
+	struct flow_entry *e = ENTRY(ft, index);
+
+	if (e->prev != FLOWTABLE_NONE)
+		ENTRY(ft, e->prev)->next = e->next;
+	else
+		ft->wheel[e->tick % FLOWTABLE_WHEEL_SLOTS] = e->next;
+	if (e->next != FLOWTABLE_NONE)
+		ENTRY(ft, e->next)->prev = e->prev;
+}
+
+/* Removes the entry referred to by a slot. The last entry is moved into its
+ * place to keep the entries packed. */
+static void remove_at(libtrace_flowtable_t *ft, size_t pos) {
+	uint32_t index = ft->slots[pos].entry;
+	uint32_t last = ft->count - 1;
+	size_t i = pos, j = pos;
+
+	/* Shift back the slots after it that are out of place, rather than
+	 * leaving a tombstone */
+	ft->slots[i].entry = FLOWTABLE_NONE;
+	for (;;) {
+		size_t home;
+
+		j = (j + 1) & ft->mask;
+		if (ft->slots[j].entry == FLOWTABLE_NONE)
+			break;
+		home = ENTRY(ft, ft->slots[j].entry)->hash & ft->mask;
+		/* Leave it if its home is cyclically within (i, j] */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		ft->slots[i] = ft->slots[j];
+		ft->slots[j].entry = FLOWTABLE_NONE;
+		i = j;
+	}
+
+	if (ft->timeout > 0)
+		wheel_unlink(ft, index);
+
+	if (index != last) {
+		struct flow_entry *e = ENTRY(ft, index);
+
+		memcpy(e, ENTRY(ft, last), ft->entry_size);
+		ft->slots[entry_slot(ft, last)].entry = index;
+		if (ft->timeout > 0) {
+			if (e->prev != FLOWTABLE_NONE)
+				ENTRY(ft, e->prev)->next = index;
+			else
+				ft->wheel[e->tick % FLOWTABLE_WHEEL_SLOTS] =
+					index;
+			if (e->next != FLOWTABLE_NONE)
+				ENTRY(ft, e->next)->prev = index;
+		}
+	}
+	ft->count--;
+}
+
+DLLEXPORT void *libtrace_flowtable_find(libtrace_flowtable_t *ft,
+		const void *key) {
+	size_t pos = find_slot(ft, key, hash_key(key, ft->key_size));
+
+	if (ft->slots[pos].entry == FLOWTABLE_NONE)
+		return NULL;
+	return VALUE(ft, ENTRY(ft, ft->slots[pos].entry));
+}
+
+DLLEXPORT void *libtrace_flowtable_get(libtrace_flowtable_t *ft,
+		const void *key, double now, bool *created) {
+	uint64_t hash = hash_key(key, ft->key_size);
+	size_t pos = find_slot(ft, key, hash);
+	struct flow_entry *e;
+	uint32_t index;
+
+	if (ft->slots[pos].entry != FLOWTABLE_NONE) {
+		index = ft->slots[pos].entry;
+		e = ENTRY(ft, index);
+		if (ft->timeout > 0) {
+			uint64_t tick = (uint64_t)(now / ft->tick_width);
+			if (tick != e->tick) {
+				wheel_unlink(ft, index);
+				e->tick = tick;
+				wheel_link(ft, index);
+			}
+		}
+		e->last_seen = now;
+		if (created)
+			*created = false;
+		return VALUE(ft, e);
+	}
+
+	/* Keep the index at most three quarters full */
+	if ((ft->count + 1) * 4 > (ft->mask + 1) * 3) {
+		if (!grow_slots(ft))
+			return NULL;
+		pos = find_slot(ft, key, hash);
+	}
+	if (ft->count == ft->capacity) {
+		size_t capacity = ft->capacity ? ft->capacity * 2 : 64;
+		uint8_t *entries = realloc(ft->entries,
+				capacity * ft->entry_size);
+		if (entries == NULL)
+			return NULL;
+		ft->entries = entries;
+		ft->capacity = capacity;
+	}
+
+	index = ft->count++;
+	e = ENTRY(ft, index);
+	e->hash = hash;
+	e->last_seen = now;
+	memcpy(KEY(e), key, ft->key_size);
+	memset(VALUE(ft, e), 0, ft->value_size);
+	ft->slots[pos].hash = slot_tag(hash);
+	ft->slots[pos].entry = index;
+	if (ft->timeout > 0) {
+		e->tick = (uint64_t)(now / ft->tick_width);
+		wheel_link(ft, index);
+	}
+
+	if (created)
+		*created = true;
+	return VALUE(ft, e);
+}
+
+DLLEXPORT bool libtrace_flowtable_remove(libtrace_flowtable_t *ft,
+		const void *key) {
+	size_t pos = find_slot(ft, key, hash_key(key, ft->key_size));
+
+	if (ft->slots[pos].entry == FLOWTABLE_NONE)
+		return false;
+	remove_at(ft, pos);
+	return true;
+}
+
+DLLEXPORT size_t libtrace_flowtable_size(libtrace_flowtable_t *ft) {
+	return ft->count;
+}
+
+DLLEXPORT void *libtrace_flowtable_entry(libtrace_flowtable_t *ft,
+		size_t index, const void **key) {
+	struct flow_entry *e;
+
+	if (index >= ft->count)
+		return NULL;
+	e = ENTRY(ft, index);
+	if (key)
+		*key = KEY(e);
+	return VALUE(ft, e);
+}
+
+DLLEXPORT void libtrace_flowtable_foreach(libtrace_flowtable_t *ft,
+		libtrace_flowtable_fn fn, void *data) {
+	size_t i;
+
+	for (i = 0; i < ft->count; i++) {
+		struct flow_entry *e = ENTRY(ft, i);
+		fn(KEY(e), VALUE(ft, e), data);
+	}
+}
+
+DLLEXPORT void libtrace_flowtable_clear(libtrace_flowtable_t *ft) {
+	memset(ft->slots, 0xff, sizeof(struct flow_slot) * (ft->mask + 1));
+	memset(ft->wheel, 0xff, sizeof(ft->wheel));
+	ft->count = 0;
+	ft->expired_tick = 0;
+}
+
+DLLEXPORT void libtrace_flowtable_merge(libtrace_flowtable_t *dst,
+		libtrace_flowtable_t *src, libtrace_flowtable_merge_fn fn,
+		void *data) {
+	size_t i;
+
+	for (i = 0; i < src->count; i++) {
+		struct flow_entry *e = ENTRY(src, i);
+		bool created;
+		void *value = libtrace_flowtable_get(dst, KEY(e), e->last_seen,
+				&created);
+
+		if (value == NULL)
+			return;
+		if (created)
+			memcpy(value, VALUE(src, e), dst->value_size);
+		else if (fn)
+			fn(value, VALUE(src, e), data);
+	}
+}
+
+DLLEXPORT void libtrace_flowtable_set_timeout(libtrace_flowtable_t *ft,
+		double timeout, libtrace_flowtable_fn fn, void *data) {
+	ft->timeout = timeout;
+	ft->tick_width = timeout / FLOWTABLE_WHEEL_SLOTS;
+	ft->expire_fn = fn;
+	ft->expire_data = data;
+}
+
+DLLEXPORT size_t libtrace_flowtable_expire(libtrace_flowtable_t *ft,
+		double now) {
+	uint64_t tick, last, t;
+	size_t expired = 0;
+
+	if (ft->timeout <= 0)
+		return 0;
+
+	/* Flows last seen in a tick at least a full wheel ago may be idle,
+	 * those in earlier ticks certainly are */
+	tick = (uint64_t)(now / ft->tick_width);
+	if (tick < FLOWTABLE_WHEEL_SLOTS)
+		return 0;
+	last = tick - FLOWTABLE_WHEEL_SLOTS;
+	t = ft->expired_tick;
+	if (last < t)
+		return 0;
+	if (last - t >= FLOWTABLE_WHEEL_SLOTS)
+		t = last - FLOWTABLE_WHEEL_SLOTS + 1;
+
+	for (; t <= last; t++) {
+		uint32_t index = ft->wheel[t % FLOWTABLE_WHEEL_SLOTS];
+
+		while (index != FLOWTABLE_NONE) {
+			struct flow_entry *e = ENTRY(ft, index);
+			uint32_t next = e->next;
+
+			if (e->last_seen + ft->timeout <= now) {
+				uint32_t moved = ft->count - 1;
+
+				if (ft->expire_fn)
+					ft->expire_fn(KEY(e), VALUE(ft, e),
+							ft->expire_data);
+				remove_at(ft, entry_slot(ft, index));
+				/* The last entry now lives here */
+				if (next == moved)
+					next = index;
+				expired++;
+			}
+			index = next;
+		}
+	}
+	/* The last tick may still hold flows that are not idle yet */
+	ft->expired_tick = last;
+	return expired;
+}
@@ -0,0 +1,182 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+/* Need libtrace.h for DLLEXPORT defines */
+#include "../libtrace.h"
+
+#ifndef LIBTRACE_FLOW_TABLE_H
+#define LIBTRACE_FLOW_TABLE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A hash table of per-flow values, keyed on fixed size keys.
+ *
+ * Keys and values are stored together in one array, so adding a flow does
+ * not allocate and reporting walks memory in order. The array is indexed by
+ * an open addressing table. Pointers to values stay valid until a flow is
+ * added or removed.
+ *
+ * A table is not thread safe. Parallel programs give each perpkt thread its
+ * own table, and with a bidirectional hasher (HASHER_BIDIRECTIONAL) each flow
+ * is only ever seen by one thread, so the tables are shards of one table that
+ * can be combined with libtrace_flowtable_merge() when reporting.
+ *
+ * If an idle timeout is set, flows are kept on a timer wheel by when they
+ * were last seen, so expiring idle flows only looks at those that are due.
+ */
+
+typedef struct libtrace_flowtable libtrace_flowtable_t;
+
+/** The addresses, ports and protocol of a flow
+ *
+ * Addresses are in network byte order, IPv4 addresses only use the first four
+ * bytes. Ports are in host byte order. Unused bytes are zero, so keys can be
+ * compared and hashed as memory.
+ */
+typedef struct libtrace_flow_key {
+	uint8_t addr_a[16];
+	uint8_t addr_b[16];
+	uint16_t port_a;
+	uint16_t port_b;
+	/* AF_INET or AF_INET6 */
+	uint8_t family;
+	uint8_t protocol;
+	uint8_t pad[2];
+} libtrace_flow_key_t;
+
+/* Called with the key and value of a flow */
+typedef void (*libtrace_flowtable_fn)(const void *key, void *value, void *data);
+
+/* Called to combine the value of a flow in another table into this table */
+typedef void (*libtrace_flowtable_merge_fn)(void *value, const void *other,
+                void *data);
+
+/** Fills in a flow key from a packet
+ *
+ * @param packet	The packet
+ * @param[out] key	The flow key
+ * @param bidirectional	If true, the endpoint with the lower address and port
+ * 			is always a, so both directions of a flow share a key.
+ * 			Otherwise a is always the source.
+ * @return 0 if a is the source of the packet, 1 if a is the destination or -1
+ * if the packet is not IP
+ */
+DLLEXPORT int libtrace_flow_key_from_packet(libtrace_packet_t *packet,
+                libtrace_flow_key_t *key, bool bidirectional);
+
+/** Creates a flow table
+ *
+ * @param key_size	The size of each key
+ * @param value_size	The size of the value kept for each flow
+ * @return The new table, or NULL if memory could not be allocated
+ */
+DLLEXPORT libtrace_flowtable_t *libtrace_flowtable_create(size_t key_size,
+                size_t value_size);
+DLLEXPORT void libtrace_flowtable_destroy(libtrace_flowtable_t *ft);
+
+/** Finds the value of a flow, or NULL if the flow is not in the table */
+DLLEXPORT void *libtrace_flowtable_find(libtrace_flowtable_t *ft,
+                const void *key);
+
+/** Finds the value of a flow, adding the flow if it is not in the table
+ *
+ * @param ft		The table
+ * @param key		The key of the flow
+ * @param now		The time in seconds the flow was seen, used for the
+ * 			idle timeout
+ * @param[out] created	If not NULL, set to true if the flow was added. New
+ * 			values are zeroed.
+ * @return The value of the flow, or NULL if memory could not be allocated
+ */
+DLLEXPORT void *libtrace_flowtable_get(libtrace_flowtable_t *ft,
+                const void *key, double now, bool *created);
+
+/** Removes a flow, returns false if the flow was not in the table */
+DLLEXPORT bool libtrace_flowtable_remove(libtrace_flowtable_t *ft,
+                const void *key);
+
+/** Returns the number of flows in the table */
+DLLEXPORT size_t libtrace_flowtable_size(libtrace_flowtable_t *ft);
+
+/** Returns the value of the flow at a position in the table
+ *
+ * Flows are stored in positions 0 to libtrace_flowtable_size() - 1, in no
+ * particular order, which allows a table to be walked or divided up
+ * directly.
+ *
+ * @param ft		The table
+ * @param index		The position of the flow
+ * @param[out] key	If not NULL, set to the key of the flow
+ * @return The value of the flow, or NULL if index is past the end
+ */
+DLLEXPORT void *libtrace_flowtable_entry(libtrace_flowtable_t *ft,
+                size_t index, const void **key);
+
+/** Calls a function with every flow in the table, which must not be changed
+ * until it returns */
+DLLEXPORT void libtrace_flowtable_foreach(libtrace_flowtable_t *ft,
+                libtrace_flowtable_fn fn, void *data);
+
+/** Removes every flow from the table, the memory is kept for reuse */
+DLLEXPORT void libtrace_flowtable_clear(libtrace_flowtable_t *ft);
+
+/** Adds every flow in one table to another
+ *
+ * Flows that are only in src are copied, for flows in both fn is called to
+ * combine the value from src into dst. src is left unchanged.
+ */
+DLLEXPORT void libtrace_flowtable_merge(libtrace_flowtable_t *dst,
+                libtrace_flowtable_t *src, libtrace_flowtable_merge_fn fn,
+                void *data);
+
+/** Sets the idle timeout of the table
+ *
+ * Must be set before any flows are added.
+ *
+ * @param ft		The table
+ * @param timeout	The number of seconds a flow can go unseen before it
+ * 			is expired
+ * @param fn		If not NULL, called with each flow as it is expired
+ * @param data		Passed to fn
+ */
+DLLEXPORT void libtrace_flowtable_set_timeout(libtrace_flowtable_t *ft,
+                double timeout, libtrace_flowtable_fn fn, void *data);
+
+/** Removes the flows that have not been seen for the idle timeout
+ *
+ * @param ft		The table
+ * @param now		The current time in seconds
+ * @return The number of flows removed
+ */
+DLLEXPORT size_t libtrace_flowtable_expire(libtrace_flowtable_t *ft,
+                double now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -31,15 +31,36 @@
 #include <string.h>
 
 
+/* Objects are cached per thread in magazines, fixed size stacks of objects
+ * (thread_cache_size). Each thread holds two magazines, loaded and previous,
+ * previous is always either full or empty. Once both are full (or empty)
+ * a whole magazine is exchanged with the depot, a pair of stacks of full and
+ * empty magazines shared between all threads. This means objects freed on a
+ * different thread to that which allocated them are passed back in groups
+ * rather than individually.
+ *
+ * Pushing to the depot is lock-free. Pops are serialised by depot_spin, with
+ * only one thread popping a magazine cannot be popped and pushed again while
+ * another pop is in progress, which avoids the ABA problem. Pops are already
+ * rare compared to the objects they carry.
+ *
+ * The ring buffer only holds objects which do not fit in a magazine, such as
+ * those from a thread cache which has been unregistered.
+ */
+struct magazine {
+	struct magazine *next;
+	size_t used;
+	void *objects[];
+};
+
 // pthread tls is most likely slower than __thread, but they have destructors so
 // we use a combination of the two here!!
 // Note Apples implementation of TLS means that memory is not available / has
 // been zeroed by the time the pthread destructor is called.
 struct local_cache {
 	libtrace_ocache_t *oc;
-	size_t total;
-	size_t used;
-	void **cache;
+	struct magazine *loaded;
+	struct magazine *previous;
 	bool invalid;
 };
 
@@ -66,6 +87,122 @@ static pthread_key_t memory_destructor_key;
 static pthread_once_t memory_destructor_once = PTHREAD_ONCE_INIT;
 static inline struct local_caches *get_local_caches();
 
+static inline void depot_push(struct magazine *volatile *top,
+                              struct magazine *mag) {
+	struct magazine *old;
+
+	do {
+		old = *top;
+		mag->next = old;
+	} while (!__sync_bool_compare_and_swap(top, old, mag));
+}
+
+static inline struct magazine *depot_pop(libtrace_ocache_t *oc,
+                                         struct magazine *volatile *top) {
+	struct magazine *mag;
+
+	if (!*top)
+		return NULL;
+	pthread_spin_lock(&oc->depot_spin);
+	do {
+		mag = *top;
+	} while (mag && !__sync_bool_compare_and_swap(top, mag, mag->next));
+	pthread_spin_unlock(&oc->depot_spin);
+	return mag;
+}
+
+/**
+ * @brief Gets an empty magazine from the depot, otherwise allocates one
+ */
+static inline struct magazine *get_empty_magazine(libtrace_ocache_t *oc) {
+	struct magazine *mag = depot_pop(oc, &oc->empty_magazines);
+
+	if (!mag) {
+		mag = malloc(sizeof(struct magazine) +
+		             sizeof(void *) * oc->thread_cache_size);
+		if (!mag)
+			return NULL;
+	}
+	mag->used = 0;
+	return mag;
+}
+
+/**
+ * @brief Wakes any threads waiting in wait_for_objects(), called after
+ * objects are returned to the depot or ring buffer of a limited cache
+ */
+static inline void wake_waiters(libtrace_ocache_t *oc) {
+	/* Pairs with the barrier in wait_for_objects(), either the waiter
+	 * sees the objects or we see the waiter */
+	__sync_synchronize();
+	if (oc->nb_waiters) {
+		pthread_mutex_lock(&oc->wait_lock);
+		pthread_cond_broadcast(&oc->wait_cond);
+		pthread_mutex_unlock(&oc->wait_lock);
+	}
+}
+
+/**
+ * @brief Blocks until a full magazine or objects in the ring buffer are
+ * available, used when every object of a limited cache is in use
+ */
+static void wait_for_objects(libtrace_ocache_t *oc) {
+	pthread_mutex_lock(&oc->wait_lock);
+	oc->nb_waiters++;
+	__sync_synchronize();
+	while (!oc->full_magazines && libtrace_ringbuffer_is_empty(&oc->rb))
+		pthread_cond_wait(&oc->wait_cond, &oc->wait_lock);
+	oc->nb_waiters--;
+	pthread_mutex_unlock(&oc->wait_lock);
+}
+
+/**
+ * @brief Passes a magazine full of objects to the depot
+ */
+static inline void put_full_magazine(libtrace_ocache_t *oc,
+                                     struct magazine *mag) {
+	__sync_fetch_and_add(&oc->nb_full_magazines, 1);
+	depot_push(&oc->full_magazines, mag);
+	if (oc->max_allocations)
+		wake_waiters(oc);
+}
+
+static inline struct magazine *get_full_magazine(libtrace_ocache_t *oc) {
+	struct magazine *mag = depot_pop(oc, &oc->full_magazines);
+
+	if (mag)
+		__sync_fetch_and_sub(&oc->nb_full_magazines, 1);
+	return mag;
+}
+
+/**
+ * @brief Empties a magazine that is being released by a thread, full
+ * magazines are passed to the depot, otherwise objects are written to the
+ * ring buffer or free'd if the cache size is not limited.
+ */
+static void release_magazine(libtrace_ocache_t *oc, struct magazine *mag) {
+	size_t i;
+
+	if (!mag)
+		return;
+	if (oc->max_allocations) {
+		if (mag->used == oc->thread_cache_size) {
+			put_full_magazine(oc, mag);
+			return;
+		}
+		libtrace_ringbuffer_swrite_bulk(&oc->rb, mag->objects,
+		                                mag->used, mag->used);
+		wake_waiters(oc);
+	} else {
+		// We just run the free these
+		for (i = 0; i < mag->used; ++i) {
+			oc->free(mag->objects[i]);
+		}
+	}
+	mag->used = 0;
+	depot_push(&oc->empty_magazines, mag);
+}
+
 /**
  * @brief unregister_thread assumes we DONT hold spin
  */
@@ -92,15 +229,10 @@ static inline void unregister_thread(struct local_cache *lc) {
 	}
 	lc->invalid = true;
 
-	if (lc->oc->max_allocations) {
-		libtrace_ringbuffer_swrite_bulk(&lc->oc->rb, lc->cache, lc->used, lc->used);
-	} else {
-		size_t i;
-		// We just run the free these
-		for(i = 0; i < lc->used; ++i) {
-			lc->oc->free(lc->cache[i]);
-		}
-	}
+	release_magazine(lc->oc, lc->loaded);
+	release_magazine(lc->oc, lc->previous);
+	lc->loaded = NULL;
+	lc->previous = NULL;
 	pthread_spin_unlock(&lc->oc->spin);
 }
 
@@ -124,16 +256,14 @@ static void destroy_memory_caches(void *tlsaddr) {
 	struct local_caches *lcs = tlsaddr;
 
 	for (a = 0; a < lcs->t_mem_caches_used; ++a) {
+		// Our magazines are passed back to the depot
 		unregister_thread(&lcs->t_mem_caches[a]);
-		// Write these all back to the main buffer, this might have issues we would want to free these
-		free(lcs->t_mem_caches[a].cache);
 	}
 	free(lcs->t_mem_caches);
 	lcs->t_mem_caches = NULL;
 	free(lcs);
 
 }
-
 static void once_memory_cache_key_init() {
 	ASSERT_RET(pthread_key_create(&memory_destructor_key, &destroy_memory_caches), == 0);
 }
@@ -179,6 +309,7 @@ static inline struct local_caches *get_local_caches() {
 	}
 }
 
+
 static inline struct local_cache * find_cache(libtrace_ocache_t *oc) {
 	size_t i;
 	struct local_cache *lc = NULL;
@@ -199,11 +330,11 @@ static inline struct local_cache * find_cache(libtrace_ocache_t *oc) {
 		if (lcs->t_mem_caches_used == lcs->t_mem_caches_total)
 			resize_memory_caches(lcs);
 		lcs->t_mem_caches[lcs->t_mem_caches_used].oc = oc;
-		lcs->t_mem_caches[lcs->t_mem_caches_used].used = 0;
-		lcs->t_mem_caches[lcs->t_mem_caches_used].total = oc->thread_cache_size;
-		lcs->t_mem_caches[lcs->t_mem_caches_used].cache = malloc(sizeof(void*) * oc->thread_cache_size);
+		lcs->t_mem_caches[lcs->t_mem_caches_used].loaded = get_empty_magazine(oc);
+		lcs->t_mem_caches[lcs->t_mem_caches_used].previous = get_empty_magazine(oc);
 		lcs->t_mem_caches[lcs->t_mem_caches_used].invalid = false;
 		lc = &lcs->t_mem_caches[lcs->t_mem_caches_used];
+		assert(lc->loaded && lc->previous);
 		// Register it with the underlying ring_buffer
 		register_thread(lc->oc, lc);
 		++lcs->t_mem_caches_used;
@@ -225,15 +356,15 @@ static inline struct local_cache * find_cache(libtrace_ocache_t *oc) {
   *
   * NOTE: If limit_size is true do not attempt to 'free' any objects that were
   * not created by this pool back otherwise the 'free' might deadlock. Also
-  * be cautious when picking the buffer size, upto thread_cache_size*(threads-1)
+  * be cautious when picking the buffer size, upto 2*thread_cache_size*(threads-1)
   * could be unusable at any given time if these are stuck in thread local caches.
   *
   * @param oc A pointer to the object cache structure which is to be initialised.
   * @param alloc The allocation method, must not be NULL. [void *alloc()]
   * @param free The free method used to destroy packets. [void free(void * obj)]
-  * @param thread_cache_size A small cache kept on a per thread basis, this can be 0
-  *		however should only be done if bulk reads of packets are being performed
-  *		or contention is minimal.
+  * @param thread_cache_size The size of the magazines cached on a per thread
+  *		basis, this can be 0 however should only be done if bulk reads
+  *		of packets are being performed or contention is minimal.
   * @param buffer_size The number of packets to be stored in the main buffer.
   * @param limit_size If true no more objects than buffer_size will be allocated,
   *		reads will block (free never should).Otherwise packets can be freely
@@ -263,6 +394,16 @@ DLLEXPORT int libtrace_ocache_init(libtrace_ocache_t *oc, void *(*alloc)(void),
 		return -1;
 	}
 	pthread_spin_init(&oc->spin, 0);
+	pthread_spin_init(&oc->depot_spin, 0);
+	pthread_mutex_init(&oc->wait_lock, NULL);
+	pthread_cond_init(&oc->wait_cond, NULL);
+	oc->nb_waiters = 0;
+	oc->full_magazines = NULL;
+	oc->empty_magazines = NULL;
+	oc->nb_full_magazines = 0;
+	// The depot holds no more than the main buffer
+	oc->max_full_magazines = thread_cache_size ?
+	                         buffer_size / thread_cache_size + 1 : 0;
 	if (limit_size)
 		oc->max_allocations = buffer_size;
 	else
@@ -281,6 +422,8 @@ DLLEXPORT int libtrace_ocache_init(libtrace_ocache_t *oc, void *(*alloc)(void),
   */
 DLLEXPORT int libtrace_ocache_destroy(libtrace_ocache_t *oc) {
 	void *ele;
+	struct magazine *mag;
+	size_t i;
 
 	while (oc->nb_thread_list)
 		unregister_thread(oc->thread_list[0]);
@@ -291,6 +434,16 @@ DLLEXPORT int libtrace_ocache_destroy(libtrace_ocache_t *oc) {
 		if (oc->max_allocations)
 			--oc->current_allocations;
 	}
+	while ((mag = get_full_magazine(oc)) != NULL) {
+		for (i = 0; i < mag->used; ++i) {
+			oc->free(mag->objects[i]);
+			if (oc->max_allocations)
+				--oc->current_allocations;
+		}
+		free(mag);
+	}
+	while ((mag = depot_pop(oc, &oc->empty_magazines)) != NULL)
+		free(mag);
 	pthread_spin_unlock(&oc->spin);
 
 	if (oc->current_allocations)
@@ -298,6 +451,9 @@ DLLEXPORT int libtrace_ocache_destroy(libtrace_ocache_t *oc) {
 
 	libtrace_ringbuffer_destroy(&oc->rb);
 	pthread_spin_destroy(&oc->spin);
+	pthread_spin_destroy(&oc->depot_spin);
+	pthread_mutex_destroy(&oc->wait_lock);
+	pthread_cond_destroy(&oc->wait_cond);
 	free(oc->thread_list);
 	libtrace_zero_ocache(oc);
 	if (oc->current_allocations)
@@ -306,63 +462,63 @@ DLLEXPORT int libtrace_ocache_destroy(libtrace_ocache_t *oc) {
 		return 0;
 }
 
+static inline size_t magazine_take(struct magazine *mag, void *values[],
+                                   size_t nb_buffers) {
+	size_t nb = MIN(mag->used, nb_buffers);
+
+	mag->used -= nb;
+	memcpy(values, &mag->objects[mag->used], sizeof(void *) * nb);
+	return nb;
+}
+
+static inline size_t magazine_put(struct magazine *mag, size_t total,
+                                  void *values[], size_t nb_buffers) {
+	size_t nb = MIN(total - mag->used, nb_buffers);
+
+	memcpy(&mag->objects[mag->used], values, sizeof(void *) * nb);
+	mag->used += nb;
+	return nb;
+}
+
 static inline size_t libtrace_ocache_alloc_cache(libtrace_ocache_t *oc, void *values[], size_t nb_buffers, size_t min_nb_buffers,
 										 struct local_cache *lc) {
-	libtrace_ringbuffer_t *rb = &oc->rb;
-	size_t i;
+	struct magazine *mag;
+	size_t i = 0;
 
-	// We have enough cached!! Yay
-	if (nb_buffers <= lc->used) {
-		// Copy all from cache
-		memcpy(values, &lc->cache[lc->used - nb_buffers], sizeof(void *) * nb_buffers);
-		lc->used -= nb_buffers;
-#ifdef ENABLE_MEM_STATS
-		mem_hits.read.cache_hit += nb_buffers;
-		mem_hits.readbulk.cache_hit += 1;
-#endif
-		return nb_buffers;
-	}
-	// Cache is not big enough try read all from ringbuffer
-	else if (nb_buffers > lc->total) {
-		i = libtrace_ringbuffer_sread_bulk(rb, values, nb_buffers, min_nb_buffers);
-#ifdef ENABLE_MEM_STATS
-		if (i)
-			mem_hits.readbulk.ring_hit += 1;
-		else
-			mem_hits.readbulk.miss += 1;
-		mem_hits.read.ring_hit += i;
-#endif
-	} else { // Not enough cached
-		// Empty the cache and re-fill it and then see what we're left with
-		i = lc->used;
-		memcpy(values, lc->cache, sizeof(void *) * lc->used);
-#ifdef ENABLE_MEM_STATS
-		mem_hits.read.cache_hit += i;
-#endif
-
-		// Make sure we still meet the minimum requirement
-		if (i < min_nb_buffers)
-			lc->used = libtrace_ringbuffer_sread_bulk(rb, lc->cache, lc->total, min_nb_buffers - i);
-		else
-			lc->used = libtrace_ringbuffer_sread_bulk(rb, lc->cache, lc->total, 0);
+	for (;;) {
+		i += magazine_take(lc->loaded, &values[i], nb_buffers - i);
+		if (i == nb_buffers)
+			break;
+		if (lc->previous->used) {
+			// Previous is full, swap it in
+			mag = lc->loaded;
+			lc->loaded = lc->previous;
+			lc->previous = mag;
+			continue;
+		}
+		// Both are empty, exchange one with a full magazine
+		mag = get_full_magazine(oc);
+		if (!mag) {
+			if (i < nb_buffers) {
+				// Try objects which never made it into a magazine
+				i += libtrace_ringbuffer_sread_bulk(&oc->rb,
+					&values[i], nb_buffers - i, 0);
+			}
+			if (i >= min_nb_buffers)
+				break;
+			// Everything is in use, wait for a thread to free some
+			wait_for_objects(oc);
+			continue;
+		}
 #ifdef ENABLE_MEM_STATS
-		if (lc->used == lc->total)
-			mem_hits.readbulk.ring_hit += 1;
-		else
-			mem_hits.readbulk.miss += 1;
-		mem_hits.read.ring_hit += lc->used;
+		mem_hits.readbulk.ring_hit += 1;
 #endif
-	}
-
-	// Try fill the remaining
-	if (i < nb_buffers && lc->used) {
-		size_t remaining;
-		remaining = MIN(lc->used, nb_buffers - i);
-		memcpy(&values[i], &lc->cache[lc->used - remaining], sizeof(void *) * remaining);
-		lc->used -= remaining;
-		i += remaining;
+		depot_push(&oc->empty_magazines, lc->previous);
+		lc->previous = lc->loaded;
+		lc->loaded = mag;
 	}
 #ifdef ENABLE_MEM_STATS
+	mem_hits.read.cache_hit += i;
 	mem_hits.read.miss += nb_buffers - i;
 #endif
 	assert(i >= min_nb_buffers);
@@ -416,64 +572,45 @@ DLLEXPORT size_t libtrace_ocache_alloc(libtrace_ocache_t *oc, void *values[], si
 
 static inline size_t libtrace_ocache_free_cache(libtrace_ocache_t *oc, void *values[], size_t nb_buffers, size_t min_nb_buffers,
 											struct local_cache *lc) {
-	libtrace_ringbuffer_t *rb = &oc->rb;
-	size_t i;
+	struct magazine *mag;
+	size_t i = 0;
 
-	// We have enough cached!! Yay
-	if (nb_buffers <= lc->total - lc->used) {
-		// Copy all to the cache
-		memcpy(&lc->cache[lc->used], values, sizeof(void *) * nb_buffers);
-		lc->used += nb_buffers;
+	for (;;) {
+		i += magazine_put(lc->loaded, oc->thread_cache_size, &values[i],
+		                  nb_buffers - i);
+		if (i == nb_buffers)
+			break;
+		if (!lc->previous->used) {
+			// Previous is empty, swap it in
+			mag = lc->loaded;
+			lc->loaded = lc->previous;
+			lc->previous = mag;
+			continue;
+		}
+		// Both are full, exchange one with an empty magazine
+		if (!oc->max_allocations &&
+		    oc->nb_full_magazines >= oc->max_full_magazines)
+			break;
+		mag = get_empty_magazine(oc);
+		if (!mag)
+			break;
 #ifdef ENABLE_MEM_STATS
-		mem_hits.write.cache_hit += nb_buffers;
-		mem_hits.writebulk.cache_hit += 1;
+		mem_hits.writebulk.ring_hit += 1;
 #endif
-		return nb_buffers;
+		put_full_magazine(oc, lc->previous);
+		lc->previous = lc->loaded;
+		lc->loaded = mag;
 	}
-	// Cache is not big enough try write all to the ringbuffer
-	else if (nb_buffers > lc->total) {
-		i = libtrace_ringbuffer_swrite_bulk(rb, values, nb_buffers, min_nb_buffers);
-#ifdef ENABLE_MEM_STATS
-		if (i)
-			mem_hits.writebulk.ring_hit += 1;
-		else
-			mem_hits.writebulk.miss += 1;
-		mem_hits.write.ring_hit += i;
-#endif
-	} else { // Not enough cache space but there might later
-		// Fill the cache and empty it and then see what we're left with
-		i = (lc->total - lc->used);
-		memcpy(&lc->cache[lc->used], values, sizeof(void *) * i);
 #ifdef ENABLE_MEM_STATS
-		mem_hits.write.cache_hit += i;
+	mem_hits.write.cache_hit += i;
 #endif
 
-		// Make sure we still meet the minimum requirement
-		if (i < min_nb_buffers)
-			lc->used = lc->total - libtrace_ringbuffer_swrite_bulk(rb, lc->cache, lc->total, min_nb_buffers - i);
-		else
-			lc->used = lc->total - libtrace_ringbuffer_swrite_bulk(rb, lc->cache, lc->total, 0);
-
-		// Re originise fulls to the front
-		if (lc->used)
-			memmove(lc->cache, &lc->cache[lc->total - lc->used], sizeof(void *) * lc->used);
-
-#ifdef ENABLE_MEM_STATS
-		if (lc->used)
-			mem_hits.writebulk.miss += 1;
-		else
-			mem_hits.writebulk.ring_hit += 1;
-		mem_hits.write.ring_hit += lc->total - lc->used;
-#endif
-	}
-
-	// Try empty the remaining
-	if (i < nb_buffers && lc->used != lc->total) {
-		size_t remaining;
-		remaining = MIN(lc->total - lc->used, nb_buffers - i);
-		memcpy(&lc->cache[lc->used], &values[i], sizeof(void *) * remaining);
-		lc->used += remaining;
-		i += remaining;
+	// The depot is full, try the ring buffer
+	if (i < nb_buffers) {
+		i += libtrace_ringbuffer_swrite_bulk(&oc->rb, &values[i],
+			nb_buffers - i, min_nb_buffers > i ? min_nb_buffers - i : 0);
+		if (oc->max_allocations)
+			wake_waiters(oc);
 	}
 #ifdef ENABLE_MEM_STATS
 	mem_hits.write.miss += nb_buffers - i;
@@ -493,7 +630,9 @@ DLLEXPORT size_t libtrace_ocache_free(libtrace_ocache_t *oc, void *values[], siz
 	else
 		i = libtrace_ringbuffer_swrite_bulk(&oc->rb, values, nb_buffers, min);
 
-	if (!oc->max_allocations) {
+	if (oc->max_allocations) {
+		wake_waiters(oc);
+	} else {
 		// Free these normally
 		for (;i < min_nb_buffers; ++i) {
 			oc->free(values[i]);
@@ -512,6 +651,11 @@ DLLEXPORT void libtrace_zero_ocache(libtrace_ocache_t *oc) {
 	oc->nb_thread_list = 0;
 	oc->max_nb_thread_list = 0;
 	oc->thread_list = NULL;
+	oc->full_magazines = NULL;
+	oc->empty_magazines = NULL;
+	oc->nb_full_magazines = 0;
+	oc->max_full_magazines = 0;
+	oc->nb_waiters = 0;
 }
 
 /**
@@ -528,7 +672,6 @@ DLLEXPORT void libtrace_ocache_unregister_thread(libtrace_ocache_t *oc) {
 			if (&lcs->t_mem_caches[i] == lc) {
 				// Free the cache against the ocache
 				unregister_thread(&lcs->t_mem_caches[i]);
-				free(lcs->t_mem_caches[i].cache);
 				// And remove it from the thread itself
 				--lcs->t_mem_caches_used;
 				lcs->t_mem_caches[i] = lcs->t_mem_caches[lcs->t_mem_caches_used];
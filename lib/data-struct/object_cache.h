@@ -31,6 +31,7 @@
 
 
 struct local_cache;
+struct magazine;
 typedef struct libtrace_ocache {
 	libtrace_ringbuffer_t rb;
 	void *(*alloc)(void);
@@ -42,6 +43,16 @@ typedef struct libtrace_ocache {
 	size_t nb_thread_list;
 	size_t max_nb_thread_list;
 	struct local_cache **thread_list;
+	/* The depot, magazines exchanged between thread caches */
+	struct magazine *volatile full_magazines;
+	struct magazine *volatile empty_magazines;
+	pthread_spinlock_t depot_spin;
+	size_t nb_full_magazines;
+	size_t max_full_magazines;
+	/* Threads waiting for objects to be freed when the size is limited */
+	pthread_mutex_t wait_lock;
+	pthread_cond_t wait_cond;
+	volatile size_t nb_waiters;
 } libtrace_ocache_t;
 
 DLLEXPORT int libtrace_ocache_init(libtrace_ocache_t *oc, void *(*alloc)(void), void (*free)(void*),
@@ -0,0 +1,286 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#include "time_bins.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TIMEBINS_NONE UINT64_MAX
+#define TIMEBINS_MIN_WINDOW 2
+
+/* The ring of bins of one writer. Each bin is its index followed by its
+ * counters. Bins in positions tail to head - 1 have been filled and are
+ * waiting to be merged, the bin at head is being filled.
+ *
+ * The writer and reader each only write their own half, which are kept on
+ * separate cache lines.
+ */
+struct timebins_writer {
+	/* Written by the writer */
+	uint64_t head;
+	/* Every interval before this one is complete */
+	uint64_t closed;
+	/* The interval being filled, or TIMEBINS_NONE */
+	uint64_t current;
+	uint64_t *counters;
+	uint64_t *bins;
+
+	/* Written by the reader */
+	uint64_t tail ALIGN_STRUCT(CACHE_LINE_SIZE);
+} ALIGN_STRUCT(CACHE_LINE_SIZE);
+
+struct libtrace_timebins {
+	/* The length of an interval in nanoseconds */
+	uint64_t width;
+	size_t ncounters;
+	/* The number of uint64_t in each bin */
+	size_t stride;
+	uint64_t mask;
+	int nwriters;
+	struct timebins_writer *writers;
+	/* The reader's scratch space */
+	uint64_t *heads;
+	uint64_t *sum;
+};
+
+static inline uint64_t *get_bin(libtrace_timebins_t *tb,
+		struct timebins_writer *w, uint64_t pos) {
+	return w->bins + (pos & tb->mask) * tb->stride;
+}
+
+/* Intervals are measured in nanoseconds rather than ERF units, so decimal
+ * intervals such as 0.1 seconds start exactly on their boundaries */
+static inline uint64_t erf_to_ns(uint64_t ts) {
+	return (ts >> 32) * 1000000000ULL +
+		(((ts & 0xffffffffULL) * 1000000000ULL) >> 32);
+}
+
+/* Rounds up, so the ERF timestamp falls within the same interval */
+static inline uint64_t ns_to_erf(uint64_t ns) {
+	return ((ns / 1000000000ULL) << 32) +
+		(((ns % 1000000000ULL) << 32) + 999999999ULL) / 1000000000ULL;
+}
+
+DLLEXPORT libtrace_timebins_t *libtrace_timebins_create(double interval,
+		size_t ncounters, int nwriters, size_t window) {
+	libtrace_timebins_t *tb;
+	/* Round to the nearest nanosecond, 0.1 seconds is not exact */
+	double width = interval * 1000000000.0 + 0.5;
+	size_t size = TIMEBINS_MIN_WINDOW;
+	int i;
+
+	if (width < 1 || nwriters < 1)
+		return NULL;
+
+	while (size < window)
+		size <<= 1;
+
+	tb = calloc(1, sizeof(libtrace_timebins_t));
+	if (!tb)
+		return NULL;
+	if (width >= 18446744073709551615.0)
+		tb->width = UINT64_MAX;
+	else
+		tb->width = (uint64_t)width;
+	tb->ncounters = ncounters;
+	tb->stride = ncounters + 1;
+	tb->mask = size - 1;
+	tb->nwriters = nwriters;
+
+	if (posix_memalign((void **)&tb->writers, CACHE_LINE_SIZE,
+				sizeof(struct timebins_writer) * nwriters) != 0) {
+		free(tb);
+		return NULL;
+	}
+	memset(tb->writers, 0, sizeof(struct timebins_writer) * nwriters);
+	tb->heads = calloc(nwriters, sizeof(uint64_t));
+	tb->sum = calloc(tb->stride, sizeof(uint64_t));
+	if (!tb->heads || !tb->sum) {
+		libtrace_timebins_destroy(tb);
+		return NULL;
+	}
+	for (i = 0; i < nwriters; i++) {
+		tb->writers[i].bins = calloc(size * tb->stride,
+				sizeof(uint64_t));
+		if (!tb->writers[i].bins) {
+			libtrace_timebins_destroy(tb);
+			return NULL;
+		}
+		tb->writers[i].current = TIMEBINS_NONE;
+	}
+	return tb;
+}
+
+DLLEXPORT void libtrace_timebins_destroy(libtrace_timebins_t *tb) {
+	int i;
+
+	if (tb->writers) {
+		for (i = 0; i < tb->nwriters; i++)
+			free(tb->writers[i].bins);
+		free(tb->writers);
+	}
+	free(tb->heads);
+	free(tb->sum);
+	free(tb);
+}
+
+/* Passes the writer's current bin to the reader, marking every interval
+ * before closed as complete */
+static inline void commit_bin(struct timebins_writer *w, uint64_t closed) {
+	__atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELEASE);
+	w->current = TIMEBINS_NONE;
+	__atomic_store_n(&w->closed, closed, __ATOMIC_RELEASE);
+}
+
+DLLEXPORT uint64_t *libtrace_timebins_get(libtrace_timebins_t *tb, int writer,
+		uint64_t ts, bool *closed) {
+	struct timebins_writer *w = &tb->writers[writer];
+	uint64_t interval = erf_to_ns(ts) / tb->width;
+	uint64_t *bin;
+
+	if (closed)
+		*closed = false;
+
+	if (w->current != TIMEBINS_NONE) {
+		/* Late packets are counted in the current bin */
+		if (interval <= w->current)
+			return w->counters;
+		commit_bin(w, interval);
+		if (closed)
+			*closed = true;
+	} else if (interval < w->closed) {
+		interval = w->closed;
+	}
+
+	/* Wait for the reader to merge the oldest bin if the ring is full */
+	while (w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) > tb->mask)
+		sched_yield();
+
+	/* The reader zeroed the counters when it merged the bin */
+	bin = get_bin(tb, w, w->head);
+	bin[0] = interval;
+	w->current = interval;
+	w->counters = bin + 1;
+	return w->counters;
+}
+
+DLLEXPORT bool libtrace_timebins_advance(libtrace_timebins_t *tb, int writer,
+		uint64_t ts) {
+	struct timebins_writer *w = &tb->writers[writer];
+	uint64_t interval = erf_to_ns(ts) / tb->width;
+
+	if (w->current != TIMEBINS_NONE) {
+		if (interval <= w->current)
+			return false;
+		commit_bin(w, interval);
+	} else {
+		if (interval <= w->closed)
+			return false;
+		__atomic_store_n(&w->closed, interval, __ATOMIC_RELEASE);
+	}
+	return true;
+}
+
+DLLEXPORT void libtrace_timebins_finish(libtrace_timebins_t *tb, int writer) {
+	struct timebins_writer *w = &tb->writers[writer];
+
+	if (w->current != TIMEBINS_NONE)
+		commit_bin(w, TIMEBINS_NONE);
+	else
+		__atomic_store_n(&w->closed, TIMEBINS_NONE, __ATOMIC_RELEASE);
+}
+
+DLLEXPORT size_t libtrace_timebins_merge(libtrace_timebins_t *tb,
+		libtrace_timebins_fn fn, void *data) {
+	uint64_t closed = TIMEBINS_NONE;
+	uint64_t next, *bin;
+	size_t merged = 0, j;
+	int i;
+
+	/* Read each writer's closed interval before its head, so every bin
+	 * before the closed interval has been committed */
+	for (i = 0; i < tb->nwriters; i++) {
+		uint64_t c = __atomic_load_n(&tb->writers[i].closed,
+				__ATOMIC_ACQUIRE);
+		if (c < closed)
+			closed = c;
+	}
+	for (i = 0; i < tb->nwriters; i++)
+		tb->heads[i] = __atomic_load_n(&tb->writers[i].head,
+				__ATOMIC_ACQUIRE);
+
+	while (1) {
+		/* Each writer's bins are in time order, so the earliest
+		 * interval is at the tail of one of the rings */
+		next = TIMEBINS_NONE;
+		for (i = 0; i < tb->nwriters; i++) {
+			struct timebins_writer *w = &tb->writers[i];
+			if (w->tail == tb->heads[i])
+				continue;
+			bin = get_bin(tb, w, w->tail);
+			if (bin[0] < closed && bin[0] < next)
+				next = bin[0];
+		}
+		if (next == TIMEBINS_NONE)
+			break;
+
+		memset(tb->sum, 0, tb->ncounters * sizeof(uint64_t));
+		for (i = 0; i < tb->nwriters; i++) {
+			struct timebins_writer *w = &tb->writers[i];
+			if (w->tail == tb->heads[i])
+				continue;
+			bin = get_bin(tb, w, w->tail);
+			if (bin[0] != next)
+				continue;
+			for (j = 0; j < tb->ncounters; j++)
+				tb->sum[j] += bin[j + 1];
+			memset(bin + 1, 0, tb->ncounters * sizeof(uint64_t));
+			__atomic_store_n(&w->tail, w->tail + 1,
+					__ATOMIC_RELEASE);
+		}
+
+		fn(ns_to_erf(next * tb->width), tb->sum, data);
+		merged++;
+	}
+	return merged;
+}
+
+DLLEXPORT void libtrace_timebins_reset(libtrace_timebins_t *tb) {
+	int i;
+
+	for (i = 0; i < tb->nwriters; i++) {
+		struct timebins_writer *w = &tb->writers[i];
+
+		memset(w->bins, 0, (tb->mask + 1) * tb->stride *
+				sizeof(uint64_t));
+		w->head = w->tail = 0;
+		w->closed = 0;
+		w->current = TIMEBINS_NONE;
+		w->counters = NULL;
+	}
+}
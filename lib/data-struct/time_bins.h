@@ -0,0 +1,129 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+/* Need libtrace.h for DLLEXPORT defines */
+#include "../libtrace.h"
+
+#ifndef LIBTRACE_TIME_BINS_H
+#define LIBTRACE_TIME_BINS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Counters aggregated into fixed length time intervals by several threads.
+ *
+ * Each writer (normally a perpkt thread) adds to the counters of the bin for
+ * its packets' timestamps in a ring of bins of its own, so counting needs no
+ * locks or allocation. Intervals are aligned to multiples of the interval
+ * since the epoch, so the same bin index means the same interval in every
+ * thread, and may be as short as a nanosecond.
+ *
+ * A writer closes its bins as its packets move into later intervals, or when
+ * told the time has passed by a tick. A single reader (normally the reporter)
+ * merges each interval once every writer has closed it, in time order, and
+ * returns the bins to their writers for reuse.
+ *
+ * Writers must keep moving forward, through packets or ticks, as a writer
+ * whose ring is full waits until the reader has merged its oldest bin, and
+ * that can only happen once every other writer has closed it.
+ */
+
+typedef struct libtrace_timebins libtrace_timebins_t;
+
+/** Called by libtrace_timebins_merge() with the start of an interval, as an
+ * ERF timestamp, and the sum of every writer's counters for that interval */
+typedef void (*libtrace_timebins_fn)(uint64_t start, const uint64_t *counters,
+                void *data);
+
+/** Creates a set of time bins
+ *
+ * @param interval	The length of each interval in seconds, which is
+ * 			rounded to the nearest nanosecond
+ * @param ncounters	The number of counters in each bin
+ * @param nwriters	The number of writers, numbered from 0
+ * @param window	The number of bins each writer can fill before they must
+ * 			be merged, rounded up to a power of two
+ * @return The new time bins, or NULL if interval is too small or memory could
+ * not be allocated
+ */
+DLLEXPORT libtrace_timebins_t *libtrace_timebins_create(double interval,
+                size_t ncounters, int nwriters, size_t window);
+DLLEXPORT void libtrace_timebins_destroy(libtrace_timebins_t *tb);
+
+/** Returns the counters a writer should add a packet to
+ *
+ * Packets older than the bins the writer has already closed are counted in
+ * its current bin.
+ *
+ * @param tb		The time bins
+ * @param writer	The writer
+ * @param ts		The ERF timestamp of the packet
+ * @param[out] closed	If not NULL, set to true if the writer closed any
+ * 			intervals, so there may be intervals ready to merge
+ * @return The counters of the writer's bin for the timestamp, which are valid
+ * until the writer next calls a time bins function
+ */
+DLLEXPORT uint64_t *libtrace_timebins_get(libtrace_timebins_t *tb, int writer,
+                uint64_t ts, bool *closed);
+
+/** Closes a writer's bins for intervals that end at or before a time, such as
+ * the time of a tick
+ *
+ * @param tb		The time bins
+ * @param writer	The writer
+ * @param ts		The ERF timestamp the writer has reached
+ * @return true if any intervals were closed
+ */
+DLLEXPORT bool libtrace_timebins_advance(libtrace_timebins_t *tb, int writer,
+                uint64_t ts);
+
+/** Closes all of a writer's bins, once it will not see any more packets */
+DLLEXPORT void libtrace_timebins_finish(libtrace_timebins_t *tb, int writer);
+
+/** Merges the intervals that every writer has closed
+ *
+ * Intervals that no writer asked for counters for are skipped. Only one
+ * thread may merge at a time.
+ *
+ * @param tb		The time bins
+ * @param fn		Called with each merged interval in time order
+ * @param data		Passed to fn
+ * @return The number of intervals merged
+ */
+DLLEXPORT size_t libtrace_timebins_merge(libtrace_timebins_t *tb,
+                libtrace_timebins_fn fn, void *data);
+
+/** Makes the time bins ready to be used again with every writer starting
+ * afresh, such as for the next input trace. Any intervals that have not been
+ * merged are lost. Must not be called while writers are using the bins.
+ */
+DLLEXPORT void libtrace_timebins_reset(libtrace_timebins_t *tb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,616 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+#include "libtrace.h"
+#include "libtrace_int.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Filter sets run every program with their own interpreter rather than
+ * bpf_filter(), so that a program can pick up where another program with the
+ * same leading instructions left off.
+ *
+ * Each program has a parent, the earlier program sharing the most leading
+ * instructions with it. BPF only jumps forwards, so a program behaves exactly
+ * like its parent until it first reaches an instruction past the shared
+ * ones. While running the parent, the state at that point is saved for the
+ * child, or if the parent returns first, the child returns the same result.
+ * pcap generates the same link type and protocol checks at the start of
+ * most filters, so these are only run once per packet.
+ */
+
+#ifdef HAVE_BPF
+
+/* Sets with up to this many programs keep their per-packet state on the
+ * stack */
+#define FILTER_SET_STACK_PROGS 32
+
+#define EXTRACT_SHORT(p) ((uint16_t)((uint16_t)(p)[0] << 8 | (p)[1]))
+#define EXTRACT_LONG(p) ((uint32_t)(p)[0] << 24 | (uint32_t)(p)[1] << 16 | \
+		(uint32_t)(p)[2] << 8 | (uint32_t)(p)[3])
+
+/* A program in the set, filters with the same string share a program */
+struct filter_set_prog {
+	libtrace_filter_t *filter;
+	/* False if the filter could not be compiled */
+	bool valid;
+	/* The earlier program sharing the most leading instructions with this
+	 * one, or -1 if none do */
+	int parent;
+	/* The number of leading instructions shared with the parent */
+	uint32_t shared;
+	/* The programs this one is the parent of, in order of the number of
+	 * instructions they share */
+	int *children;
+	int nchildren;
+};
+
+struct libtrace_filter_set_t {
+	struct filter_set_prog *progs;
+	int nprogs;
+	/* The program of each filter added to the set */
+	int *members;
+	int nfilters;
+	/* Set once the programs have been compiled and linked to their
+	 * parents */
+	volatile bool compiled;
+	pthread_mutex_t lock;
+};
+
+/* The state of a program, saved by its parent where they stop sharing
+ * instructions */
+struct filter_state {
+	uint32_t A;
+	uint32_t X;
+	uint32_t pc;
+	/* True if the program has returned */
+	bool done;
+	uint32_t ret;
+	uint32_t mem[BPF_MEMWORDS];
+};
+
+/* Counts the leading instructions two programs have in common */
+static uint32_t common_prefix(const struct bpf_program *a,
+		const struct bpf_program *b) {
+	uint32_t i;
+
+	for (i = 0; i < a->bf_len && i < b->bf_len; i++) {
+		const struct bpf_insn *x = &a->bf_insns[i];
+		const struct bpf_insn *y = &b->bf_insns[i];
+		if (x->code != y->code || x->jt != y->jt || x->jf != y->jf ||
+				x->k != y->k)
+			break;
+	}
+	return i;
+}
+
+/* Compiles every program in the set and finds each program's parent */
+static int compile_set(libtrace_filter_set_t *set,
+		const libtrace_packet_t *packet, void *linkptr,
+		libtrace_linktype_t linktype) {
+	int i, j, ret = 0;
+
+	ASSERT_RET(pthread_mutex_lock(&set->lock), == 0);
+	if (set->compiled) {
+		ASSERT_RET(pthread_mutex_unlock(&set->lock), == 0);
+		return 0;
+	}
+
+	for (i = 0; i < set->nprogs; i++) {
+		struct filter_set_prog *prog = &set->progs[i];
+
+		prog->valid = trace_bpf_compile(prog->filter, packet, linkptr,
+				linktype) != -1;
+		if (!prog->valid) {
+			ret = -1;
+			continue;
+		}
+
+		/* Ties go to the earliest program, so a child always shares
+		 * more instructions with its parent than its parent does with
+		 * the grandparent */
+		for (j = 0; j < i; j++) {
+			uint32_t shared;
+
+			if (!set->progs[j].valid)
+				continue;
+			shared = common_prefix(&set->progs[j].filter->filter,
+					&prog->filter->filter);
+			if (shared > prog->shared) {
+				prog->shared = shared;
+				prog->parent = j;
+			}
+		}
+		if (prog->parent == -1)
+			continue;
+
+		/* Insert into the parent's children, ordered by shared */
+		{
+			struct filter_set_prog *parent =
+				&set->progs[prog->parent];
+			parent->children = realloc(parent->children,
+					sizeof(int) * (parent->nchildren + 1));
+			for (j = parent->nchildren; j > 0; j--) {
+				if (set->progs[parent->children[j - 1]].shared
+						<= prog->shared)
+					break;
+				parent->children[j] = parent->children[j - 1];
+			}
+			parent->children[j] = i;
+			parent->nchildren++;
+		}
+	}
+
+	set->compiled = true;
+	ASSERT_RET(pthread_mutex_unlock(&set->lock), == 0);
+	return ret;
+}
+
+/* Runs a program from its current state until it returns, following the
+ * semantics of pcap's bpf_filter(). The state of each child is saved once
+ * the program runs past the instructions they share. */
+static uint32_t run_prog(const libtrace_filter_set_t *set,
+		const struct filter_set_prog *prog,
+		struct filter_state *states, struct filter_state *st,
+		const uint8_t *p, uint32_t buflen) {
+	const struct bpf_insn *ins;
+	const struct bpf_insn *insns = prog->filter->filter.bf_insns;
+	uint32_t *mem = st->mem;
+	uint32_t A = st->A;
+	uint32_t X = st->X;
+	uint32_t pc = st->pc;
+	uint32_t k, ret;
+	uint32_t split = UINT32_MAX;
+	int next = 0;
+
+	if (prog->nchildren > 0)
+		split = set->progs[prog->children[0]].shared;
+
+	for (;;) {
+		while (pc >= split) {
+			struct filter_state *child =
+				&states[prog->children[next]];
+			child->A = A;
+			child->X = X;
+			child->pc = pc;
+			child->done = false;
+			memcpy(child->mem, mem, sizeof(child->mem));
+			if (++next < prog->nchildren)
+				split = set->progs[prog->children[next]].shared;
+			else
+				split = UINT32_MAX;
+		}
+
+		ins = &insns[pc++];
+		switch (ins->code) {
+		case BPF_RET|BPF_K:
+			ret = ins->k;
+			goto finished;
+
+		case BPF_RET|BPF_A:
+			ret = A;
+			goto finished;
+
+		case BPF_LD|BPF_W|BPF_ABS:
+			k = ins->k;
+			if (k > buflen || sizeof(uint32_t) > buflen - k)
+				goto reject;
+			A = EXTRACT_LONG(&p[k]);
+			break;
+
+		case BPF_LD|BPF_H|BPF_ABS:
+			k = ins->k;
+			if (k > buflen || sizeof(uint16_t) > buflen - k)
+				goto reject;
+			A = EXTRACT_SHORT(&p[k]);
+			break;
+
+		case BPF_LD|BPF_B|BPF_ABS:
+			k = ins->k;
+			if (k >= buflen)
+				goto reject;
+			A = p[k];
+			break;
+
+		case BPF_LD|BPF_W|BPF_LEN:
+			A = buflen;
+			break;
+
+		case BPF_LDX|BPF_W|BPF_LEN:
+			X = buflen;
+			break;
+
+		case BPF_LD|BPF_W|BPF_IND:
+			k = X + ins->k;
+			if (ins->k > buflen || X > buflen - ins->k ||
+					sizeof(uint32_t) > buflen - k)
+				goto reject;
+			A = EXTRACT_LONG(&p[k]);
+			break;
+
+		case BPF_LD|BPF_H|BPF_IND:
+			k = X + ins->k;
+			if (ins->k > buflen || X > buflen - ins->k ||
+					sizeof(uint16_t) > buflen - k)
+				goto reject;
+			A = EXTRACT_SHORT(&p[k]);
+			break;
+
+		case BPF_LD|BPF_B|BPF_IND:
+			k = X + ins->k;
+			if (ins->k >= buflen || X >= buflen - ins->k)
+				goto reject;
+			A = p[k];
+			break;
+
+		case BPF_LDX|BPF_MSH|BPF_B:
+			k = ins->k;
+			if (k >= buflen)
+				goto reject;
+			X = (p[k] & 0xf) << 2;
+			break;
+
+		case BPF_LD|BPF_IMM:
+			A = ins->k;
+			break;
+
+		case BPF_LDX|BPF_IMM:
+			X = ins->k;
+			break;
+
+		case BPF_LD|BPF_MEM:
+			A = mem[ins->k];
+			break;
+
+		case BPF_LDX|BPF_MEM:
+			X = mem[ins->k];
+			break;
+
+		case BPF_ST:
+			mem[ins->k] = A;
+			break;
+
+		case BPF_STX:
+			mem[ins->k] = X;
+			break;
+
+		case BPF_JMP|BPF_JA:
+			pc += ins->k;
+			break;
+
+		case BPF_JMP|BPF_JGT|BPF_K:
+			pc += (A > ins->k) ? ins->jt : ins->jf;
+			break;
+
+		case BPF_JMP|BPF_JGE|BPF_K:
+			pc += (A >= ins->k) ? ins->jt : ins->jf;
+			break;
+
+		case BPF_JMP|BPF_JEQ|BPF_K:
+			pc += (A == ins->k) ? ins->jt : ins->jf;
+			break;
+
+		case BPF_JMP|BPF_JSET|BPF_K:
+			pc += (A & ins->k) ? ins->jt : ins->jf;
+			break;
+
+		case BPF_JMP|BPF_JGT|BPF_X:
+			pc += (A > X) ? ins->jt : ins->jf;
+			break;
+
+		case BPF_JMP|BPF_JGE|BPF_X:
+			pc += (A >= X) ? ins->jt : ins->jf;
+			break;
+
+		case BPF_JMP|BPF_JEQ|BPF_X:
+			pc += (A == X) ? ins->jt : ins->jf;
+			break;
+
+		case BPF_JMP|BPF_JSET|BPF_X:
+			pc += (A & X) ? ins->jt : ins->jf;
+			break;
+
+		case BPF_ALU|BPF_ADD|BPF_X:
+			A += X;
+			break;
+
+		case BPF_ALU|BPF_SUB|BPF_X:
+			A -= X;
+			break;
+
+		case BPF_ALU|BPF_MUL|BPF_X:
+			A *= X;
+			break;
+
+		case BPF_ALU|BPF_DIV|BPF_X:
+			if (X == 0)
+				goto reject;
+			A /= X;
+			break;
+
+#ifdef BPF_MOD
+		case BPF_ALU|BPF_MOD|BPF_X:
+			if (X == 0)
+				goto reject;
+			A %= X;
+			break;
+#endif
+
+		case BPF_ALU|BPF_AND|BPF_X:
+			A &= X;
+			break;
+
+		case BPF_ALU|BPF_OR|BPF_X:
+			A |= X;
+			break;
+
+#ifdef BPF_XOR
+		case BPF_ALU|BPF_XOR|BPF_X:
+			A ^= X;
+			break;
+#endif
+
+		case BPF_ALU|BPF_LSH|BPF_X:
+			A = X < 32 ? A << X : 0;
+			break;
+
+		case BPF_ALU|BPF_RSH|BPF_X:
+			A = X < 32 ? A >> X : 0;
+			break;
+
+		case BPF_ALU|BPF_ADD|BPF_K:
+			A += ins->k;
+			break;
+
+		case BPF_ALU|BPF_SUB|BPF_K:
+			A -= ins->k;
+			break;
+
+		case BPF_ALU|BPF_MUL|BPF_K:
+			A *= ins->k;
+			break;
+
+		case BPF_ALU|BPF_DIV|BPF_K:
+			if (ins->k == 0)
+				goto reject;
+			A /= ins->k;
+			break;
+
+#ifdef BPF_MOD
+		case BPF_ALU|BPF_MOD|BPF_K:
+			if (ins->k == 0)
+				goto reject;
+			A %= ins->k;
+			break;
+#endif
+
+		case BPF_ALU|BPF_AND|BPF_K:
+			A &= ins->k;
+			break;
+
+		case BPF_ALU|BPF_OR|BPF_K:
+			A |= ins->k;
+			break;
+
+#ifdef BPF_XOR
+		case BPF_ALU|BPF_XOR|BPF_K:
+			A ^= ins->k;
+			break;
+#endif
+
+		case BPF_ALU|BPF_LSH|BPF_K:
+			A = ins->k < 32 ? A << ins->k : 0;
+			break;
+
+		case BPF_ALU|BPF_RSH|BPF_K:
+			A = ins->k < 32 ? A >> ins->k : 0;
+			break;
+
+		case BPF_ALU|BPF_NEG:
+			A = -A;
+			break;
+
+		case BPF_MISC|BPF_TAX:
+			X = A;
+			break;
+
+		case BPF_MISC|BPF_TXA:
+			A = X;
+			break;
+
+		default:
+			goto reject;
+		}
+	}
+
+reject:
+	ret = 0;
+finished:
+	/* The instruction that returned is shared with the remaining
+	 * children, so they return the same */
+	for (; next < prog->nchildren; next++) {
+		states[prog->children[next]].done = true;
+		states[prog->children[next]].ret = ret;
+	}
+	return ret;
+}
+#endif
+
+DLLEXPORT libtrace_filter_set_t *trace_create_filter_set(void) {
+#ifdef HAVE_BPF
+	libtrace_filter_set_t *set = calloc(1, sizeof(libtrace_filter_set_t));
+
+	if (set == NULL)
+		return NULL;
+	ASSERT_RET(pthread_mutex_init(&set->lock, NULL), == 0);
+	return set;
+#else
+	fprintf(stderr,"This version of libtrace does not have bpf filter support\n");
+	return NULL;
+#endif
+}
+
+DLLEXPORT int trace_filter_set_add(libtrace_filter_set_t *set,
+		const char *filterstring) {
+#ifdef HAVE_BPF
+	struct filter_set_prog *prog;
+	int i;
+
+	if (set->compiled)
+		return -1;
+
+	for (i = 0; i < set->nprogs; i++) {
+		if (strcmp(set->progs[i].filter->filterstring,
+					filterstring) == 0)
+			break;
+	}
+
+	if (i == set->nprogs) {
+		set->progs = realloc(set->progs, sizeof(struct filter_set_prog)
+				* (set->nprogs + 1));
+		prog = &set->progs[set->nprogs++];
+		memset(prog, 0, sizeof(struct filter_set_prog));
+		prog->filter = trace_create_filter(filterstring);
+		prog->parent = -1;
+	}
+
+	set->members = realloc(set->members, sizeof(int) * (set->nfilters + 1));
+	set->members[set->nfilters] = i;
+	return set->nfilters++;
+#else
+	return -1;
+#endif
+}
+
+DLLEXPORT int trace_apply_filter_set(libtrace_filter_set_t *set,
+		const libtrace_packet_t *packet, uint64_t *matches) {
+#ifdef HAVE_BPF
+	struct filter_state stack_states[FILTER_SET_STACK_PROGS];
+	struct filter_state *states = stack_states;
+	libtrace_packet_t *packet_copy = NULL;
+	libtrace_linktype_t linktype;
+	void *linkptr = NULL;
+	uint32_t clen = 0;
+	int i, ret, matched = 0;
+
+	assert(set);
+	assert(packet);
+
+	memset(matches, 0, sizeof(uint64_t) * ((set->nfilters + 63) / 64));
+
+	ret = trace_bpf_prepare_packet(packet, &packet_copy, &linkptr, &clen,
+			&linktype);
+	if (ret == -1)
+		return -1;
+	if (ret == 1) {
+		/* Non-data packets match everything, as they do for
+		 * trace_apply_filter() */
+		for (i = 0; i < set->nfilters; i++)
+			matches[i / 64] |= (uint64_t)1 << (i % 64);
+		return set->nfilters;
+	}
+
+	if (!linkptr) {
+		if (packet_copy)
+			trace_destroy_packet(packet_copy);
+		return 0;
+	}
+
+	/* We need to compile the filters now, because before we didn't know
+	 * what the link type was */
+	if (!set->compiled && compile_set(set,
+				packet_copy ? packet_copy : packet,
+				linkptr, linktype) == -1)
+		matched = -1;
+
+	if (set->nprogs > FILTER_SET_STACK_PROGS)
+		states = malloc(sizeof(struct filter_state) * set->nprogs);
+
+	for (i = 0; i < set->nprogs; i++) {
+		const struct filter_set_prog *prog = &set->progs[i];
+		struct filter_state *st = &states[i];
+		int j;
+
+		if (!prog->valid) {
+			st->ret = 0;
+			continue;
+		}
+
+		if (prog->parent == -1) {
+			st->A = 0;
+			st->X = 0;
+			st->pc = 0;
+		} else if (st->done) {
+			/* The parent returned before this program stopped
+			 * sharing its instructions, and so the children of
+			 * this program return before they stop sharing
+			 * instructions with it */
+			for (j = 0; j < prog->nchildren; j++) {
+				states[prog->children[j]].done = true;
+				states[prog->children[j]].ret = st->ret;
+			}
+			continue;
+		}
+		st->ret = run_prog(set, prog, states, st, linkptr, clen);
+	}
+
+	for (i = 0; i < set->nfilters; i++) {
+		if (states[set->members[i]].ret == 0)
+			continue;
+		matches[i / 64] |= (uint64_t)1 << (i % 64);
+		if (matched != -1)
+			matched++;
+	}
+
+	if (states != stack_states)
+		free(states);
+	if (packet_copy)
+		trace_destroy_packet(packet_copy);
+	return matched;
+#else
+	fprintf(stderr,"This version of libtrace does not have bpf filter support\n");
+	return 0;
+#endif
+}
+
+DLLEXPORT void trace_destroy_filter_set(libtrace_filter_set_t *set) {
+#ifdef HAVE_BPF
+	int i;
+
+	for (i = 0; i < set->nprogs; i++) {
+		trace_destroy_filter(set->progs[i].filter);
+		free(set->progs[i].children);
+	}
+	free(set->progs);
+	free(set->members);
+	ASSERT_RET(pthread_mutex_destroy(&set->lock), == 0);
+	free(set);
+#endif
+}
@@ -201,6 +201,7 @@ static struct libtrace_format_t atmhdr = {
         atmhdr_prepare_packet,		/* prepare_packet */
 	NULL,                           /* fin_packet */
         NULL,                           /* write_packet */
+        NULL,                           /* write_packets */
         atmhdr_get_link_type,        	/* get_link_type */
         NULL,                           /* get_direction */
         NULL,                           /* set_direction */
@@ -228,6 +228,7 @@ static int dag_config_input(libtrace_t *libtrace, trace_option_t option,
 			 * filtering */
                         return -1;
 		case TRACE_OPTION_EVENT_REALTIME:
+		case TRACE_OPTION_REPLAY_SPEEDUP:
 			/* Live capture is always going to be realtime */
 			return -1;
         }
@@ -528,6 +529,7 @@ static struct libtrace_format_t dag = {
         dag_prepare_packet,		/* prepare_packet */
 	NULL,                           /* fin_packet */
         NULL,                           /* write_packet */
+        NULL,                           /* write_packets */
         erf_get_link_type,              /* get_link_type */
         erf_get_direction,              /* get_direction */
         erf_set_direction,              /* set_direction */
@@ -85,6 +85,22 @@ static pthread_mutex_t dpdk_lock = PTHREAD_MUTEX_INITIALIZER;
 /* Memory pools Per NUMA node */
 static struct rte_mempool * mem_pools[4][RTE_MAX_LCORE] = {{0}};
 
+static struct libtrace_format_t dpdk;
+
+/* A TX queue on the port, more than one writing thread can share a queue
+ * if there are more threads than queues */
+struct dpdk_tx_queue {
+	uint16_t queue_id;
+	pthread_spinlock_t lock; /* Held while transmitting a burst */
+};
+
+/* The packets waiting to be sent by a single writing thread */
+struct dpdk_tx_thread {
+	struct dpdk_tx_queue *queue; /* The queue claimed by this thread */
+	struct rte_mbuf* burst_pkts[BURST_SIZE];
+	int burst_size; /* The number waiting in the burst */
+};
+
 /* Used by both input and output however some fields are not used
  * for output */
 struct dpdk_format_data_t {
@@ -114,6 +130,13 @@ struct dpdk_format_data_t {
 
 	/* Our parallel streams */
 	libtrace_list_t *per_stream;
+
+	/* Output only, each writing thread claims a TX queue of its own */
+	uint16_t nb_tx_queues; /* The number of TX queues to configure */
+	struct dpdk_tx_queue *tx_queues;
+	int next_tx_queue; /* The next queue to be claimed by a thread */
+	pthread_key_t tx_key; /* The calling thread's dpdk_tx_thread */
+	libtrace_list_t *tx_threads; /* Every dpdk_tx_thread, to flush on close */
 };
 
 enum dpdk_addt_hdr_flags {
@@ -599,6 +622,9 @@ int dpdk_init_input (libtrace_t *libtrace) {
 	FORMAT(libtrace)->burst_offset = 0;
 	FORMAT(libtrace)->hasher_type = HASHER_BALANCE;
 	FORMAT(libtrace)->rss_key = NULL;
+	FORMAT(libtrace)->nb_tx_queues = 1;
+	FORMAT(libtrace)->tx_queues = NULL;
+	FORMAT(libtrace)->tx_threads = NULL;
 
 	/* Make our first stream */
 	FORMAT(libtrace)->per_stream = libtrace_list_init(sizeof(struct dpdk_per_stream_t));
@@ -637,6 +663,12 @@ static int dpdk_init_output(libtrace_out_t *libtrace)
 	memset(FORMAT(libtrace)->burst_pkts, 0, sizeof(FORMAT(libtrace)->burst_pkts[0]) * BURST_SIZE);
 	FORMAT(libtrace)->burst_size = 0;
 	FORMAT(libtrace)->burst_offset = 0;
+	FORMAT(libtrace)->rss_key = NULL;
+	FORMAT(libtrace)->nb_tx_queues = NB_TX_QUEUES;
+	FORMAT(libtrace)->tx_queues = NULL;
+	FORMAT(libtrace)->next_tx_queue = 0;
+	FORMAT(libtrace)->tx_threads = libtrace_list_init(sizeof(struct dpdk_tx_thread *));
+	pthread_key_create(&FORMAT(libtrace)->tx_key, NULL);
 
 	FORMAT(libtrace)->per_stream = libtrace_list_init(sizeof(struct dpdk_per_stream_t));
 	libtrace_list_push_back(FORMAT(libtrace)->per_stream, &stream);
@@ -695,6 +727,7 @@ int dpdk_config_input (libtrace_t *libtrace,
 		/* TODO filtering */
 	case TRACE_OPTION_META_FREQ:
 	case TRACE_OPTION_EVENT_REALTIME:
+	case TRACE_OPTION_REPLAY_SPEEDUP:
 		break;
 	/* Avoid default: so that future options will cause a warning
 	 * here to remind us to implement it, or flag it as
@@ -1105,7 +1138,8 @@ static int dpdk_start_streams(struct dpdk_format_data_t *format_data,
 #if DEBUG
 		fprintf(stderr, "Creating mempool named %s\n", format_data->mempool_name);
 #endif
-		format_data->pktmbuf_pool = dpdk_alloc_memory(format_data->nb_tx_buf*2,
+		format_data->pktmbuf_pool = dpdk_alloc_memory(format_data->nb_tx_buf*2
+		                                              * format_data->nb_tx_queues,
 		                                              format_data->snaplen,
 		                                              format_data->nic_numa_node);
 
@@ -1149,8 +1183,9 @@ static int dpdk_start_streams(struct dpdk_format_data_t *format_data,
 	 */
 
 	/* This must be called first before another *eth* function
-	 * 1+ rx, 1 tx queues, port_conf sets checksum stripping etc */
-	ret = rte_eth_dev_configure(format_data->port, rx_queues, 1, &port_conf);
+	 * 1+ rx, 1+ tx queues, port_conf sets checksum stripping etc */
+	ret = rte_eth_dev_configure(format_data->port, rx_queues,
+	                            format_data->nb_tx_queues, &port_conf);
 	if (ret < 0) {
 		snprintf(err, errlen, "Intel DPDK - Cannot configure device port"
 		         " %"PRIu8" : %s", format_data->port,
@@ -1160,19 +1195,21 @@ static int dpdk_start_streams(struct dpdk_format_data_t *format_data,
 #if DEBUG
 	fprintf(stderr, "Doing dev configure\n");
 #endif
-	/* Initialise the TX queue a minimum value if using this port for
+	/* Initialise the TX queues a minimum value if using this port for
 	 * receiving. Otherwise a larger size if writing packets.
 	 */
-	ret = rte_eth_tx_queue_setup(format_data->port,
-	                             0 /* queue XXX */,
-	                             format_data->nb_tx_buf,
-	                             SOCKET_ID_ANY,
-	                             DPDK_USE_NULL_QUEUE_CONFIG ? NULL : &tx_conf);
-	if (ret < 0) {
-		snprintf(err, errlen, "Intel DPDK - Cannot configure TX queue"
-		         " on port %"PRIu8" : %s", format_data->port,
-		         strerror(-ret));
-		return -1;
+	for (i=0; i < format_data->nb_tx_queues; i++) {
+		ret = rte_eth_tx_queue_setup(format_data->port,
+		                             i,
+		                             format_data->nb_tx_buf,
+		                             SOCKET_ID_ANY,
+		                             DPDK_USE_NULL_QUEUE_CONFIG ? NULL : &tx_conf);
+		if (ret < 0) {
+			snprintf(err, errlen, "Intel DPDK - Cannot configure TX queue"
+			         " %d on port %"PRIu8" : %s", i, format_data->port,
+			         strerror(-ret));
+			return -1;
+		}
 	}
 
 	/* Attach memory to our RX queues */
@@ -1451,14 +1488,30 @@ void dpdk_punregister_thread(libtrace_t *libtrace UNUSED, libtrace_thread_t *t U
 static int dpdk_start_output(libtrace_out_t *libtrace)
 {
 	char err[500];
+	struct rte_eth_dev_info dev_info;
+	int i;
 	err[0] = 0;
 
+	/* One TX queue per writing thread, up to what the NIC supports */
+	rte_eth_dev_info_get(FORMAT(libtrace)->port, &dev_info);
+	if (dev_info.max_tx_queues < FORMAT(libtrace)->nb_tx_queues)
+		FORMAT(libtrace)->nb_tx_queues = dev_info.max_tx_queues;
+	if (FORMAT(libtrace)->nb_tx_queues < 1)
+		FORMAT(libtrace)->nb_tx_queues = 1;
+
 	if (dpdk_start_streams(FORMAT(libtrace), err, sizeof(err), 1) != 0) {
 		trace_set_err_out(libtrace, TRACE_ERR_INIT_FAILED, "%s", err);
 		free(libtrace->format_data);
 		libtrace->format_data = NULL;
 		return -1;
 	}
+
+	FORMAT(libtrace)->tx_queues = calloc(FORMAT(libtrace)->nb_tx_queues,
+	                                     sizeof(struct dpdk_tx_queue));
+	for (i = 0; i < FORMAT(libtrace)->nb_tx_queues; i++) {
+		FORMAT(libtrace)->tx_queues[i].queue_id = i;
+		pthread_spin_init(&FORMAT(libtrace)->tx_queues[i].lock, 0);
+	}
 	return 0;
 }
 
@@ -1490,9 +1543,87 @@ int dpdk_pause_input(libtrace_t * libtrace) {
 	return 0;
 }
 
-static int dpdk_write_packet(libtrace_out_t *trace,
-                             libtrace_packet_t *packet){
-	struct rte_mbuf* m_buff[1];
+/**
+ * Get the TX state of the calling thread, the first time a thread writes
+ * it claims the next TX queue. Once every queue is claimed threads
+ * share queues round robin.
+ */
+static struct dpdk_tx_thread *dpdk_get_tx_thread(libtrace_out_t *trace) {
+	struct dpdk_tx_thread *txt;
+	int id;
+
+	txt = pthread_getspecific(FORMAT(trace)->tx_key);
+	if (txt)
+		return txt;
+
+	txt = calloc(1, sizeof(struct dpdk_tx_thread));
+	id = __sync_fetch_and_add(&FORMAT(trace)->next_tx_queue, 1);
+	txt->queue = &FORMAT(trace)->tx_queues[id % FORMAT(trace)->nb_tx_queues];
+	pthread_setspecific(FORMAT(trace)->tx_key, txt);
+
+	pthread_mutex_lock(&dpdk_lock);
+	libtrace_list_push_back(FORMAT(trace)->tx_threads, &txt);
+	pthread_mutex_unlock(&dpdk_lock);
+	return txt;
+}
+
+/**
+ * Send every packet waiting in a thread's burst, the queue lock is
+ * only ever contended if threads are sharing a queue.
+ */
+static void dpdk_flush_tx(struct dpdk_format_data_t *format_data,
+                          struct dpdk_tx_thread *txt) {
+	int sent = 0;
+
+	pthread_spin_lock(&txt->queue->lock);
+	while (sent < txt->burst_size) {
+		sent += rte_eth_tx_burst(format_data->port,
+		                         txt->queue->queue_id,
+		                         &txt->burst_pkts[sent],
+		                         txt->burst_size - sent);
+	}
+	pthread_spin_unlock(&txt->queue->lock);
+	txt->burst_size = 0;
+}
+
+/**
+ * Get a mbuf holding the packet to send. A packet read from a DPDK input
+ * is already in a mbuf so we send a clone of it, which shares the data
+ * but leaves the input's mbuf as it was. Otherwise the packet is copied
+ * into a new mbuf.
+ */
+static struct rte_mbuf *dpdk_packet_to_mbuf(libtrace_out_t *trace,
+                                            libtrace_packet_t *packet,
+                                            int caplen) {
+	struct rte_mbuf *m;
+
+#if RTE_VERSION >= RTE_VERSION_NUM(1, 8, 0, 1)
+	if (packet->trace && packet->trace->format == &dpdk &&
+	    packet->buf_control == TRACE_CTRL_EXTERNAL) {
+		/* The clone holds a reference to the packet's mbuf, which
+		 * is released when the NIC frees the clone once sent */
+		m = rte_pktmbuf_clone(MBUF(packet->buffer),
+		                      FORMAT(trace)->pktmbuf_pool);
+		if (m == NULL)
+			return NULL;
+		m->data_off = (char *) packet->payload - (char *) m->buf_addr;
+		rte_pktmbuf_data_len(m) = caplen;
+		rte_pktmbuf_pkt_len(m) = caplen;
+		return m;
+	}
+#endif
+	m = rte_pktmbuf_alloc(FORMAT(trace)->pktmbuf_pool);
+	if (m == NULL)
+		return NULL;
+	memcpy(rte_pktmbuf_append(m, caplen), packet->payload, caplen);
+	return m;
+}
+
+/* Adds a packet to the calling thread's burst, sending the burst if full */
+static int dpdk_queue_packet(libtrace_out_t *trace,
+                             struct dpdk_tx_thread *txt,
+                             libtrace_packet_t *packet) {
+	struct rte_mbuf *m;
 
 	int wirelen = trace_get_wire_length(packet);
 	int caplen = trace_get_capture_length(packet);
@@ -1502,19 +1633,51 @@ static int dpdk_write_packet(libtrace_out_t *trace,
 	    wirelen == caplen)
 		caplen -= ETHER_CRC_LEN;
 
-	m_buff[0] = rte_pktmbuf_alloc(FORMAT(trace)->pktmbuf_pool);
-	if (m_buff[0] == NULL) {
+	m = dpdk_packet_to_mbuf(trace, packet, caplen);
+	if (m == NULL) {
 		trace_set_err_out(trace, errno, "Cannot get an empty packet buffer");
 		return -1;
-	} else {
-		int ret;
-		memcpy(rte_pktmbuf_append(m_buff[0], caplen), packet->payload, caplen);
-		do {
-			ret = rte_eth_tx_burst(0 /*queue TODO*/, FORMAT(trace)->port, m_buff, 1);
-		} while (ret != 1);
 	}
 
-	return 0;
+	txt->burst_pkts[txt->burst_size++] = m;
+	if (txt->burst_size == BURST_SIZE)
+		dpdk_flush_tx(FORMAT(trace), txt);
+
+	return caplen;
+}
+
+static int dpdk_write_packet(libtrace_out_t *trace,
+                             libtrace_packet_t *packet){
+	struct dpdk_tx_thread *txt = dpdk_get_tx_thread(trace);
+	int ret;
+
+	/* A single packet may be the last for a while, so send it now
+	 * rather than waiting for a full burst */
+	ret = dpdk_queue_packet(trace, txt, packet);
+	if (txt->burst_size > 0)
+		dpdk_flush_tx(FORMAT(trace), txt);
+	return ret;
+}
+
+static int dpdk_write_packets(libtrace_out_t *trace,
+                              libtrace_packet_t *packets[],
+                              size_t nb_packets) {
+	struct dpdk_tx_thread *txt = dpdk_get_tx_thread(trace);
+	size_t i;
+	int ret, total = 0;
+
+	for (i = 0; i < nb_packets; i++) {
+		ret = dpdk_queue_packet(trace, txt, packets[i]);
+		if (ret < 0)
+			break;
+		total += ret;
+	}
+	/* Don't leave the end of the batch waiting for the next write */
+	if (txt->burst_size > 0)
+		dpdk_flush_tx(FORMAT(trace), txt);
+	if (i < nb_packets)
+		return -1;
+	return total;
 }
 
 int dpdk_fin_input(libtrace_t * libtrace) {
@@ -1552,8 +1715,24 @@ int dpdk_fin_input(libtrace_t * libtrace) {
 
 
 static int dpdk_fin_output(libtrace_out_t * libtrace) {
+	libtrace_list_node_t * n;
+	int i;
 	/* Free our memory structures */
 	if (libtrace->format_data != NULL) {
+		/* Send anything left waiting in a burst */
+		for (n = FORMAT(libtrace)->tx_threads->head; n ; n = n->next) {
+			struct dpdk_tx_thread *txt = *(struct dpdk_tx_thread **) n->data;
+			dpdk_flush_tx(FORMAT(libtrace), txt);
+			free(txt);
+		}
+		libtrace_list_deinit(FORMAT(libtrace)->tx_threads);
+		pthread_key_delete(FORMAT(libtrace)->tx_key);
+		if (FORMAT(libtrace)->tx_queues) {
+			for (i = 0; i < FORMAT(libtrace)->nb_tx_queues; i++)
+				pthread_spin_destroy(&FORMAT(libtrace)->tx_queues[i].lock);
+			free(FORMAT(libtrace)->tx_queues);
+		}
+
 		/* Close the device completely, device cannot be restarted */
 		if (FORMAT(libtrace)->port != 0xFF)
 			rte_eth_dev_close(FORMAT(libtrace)->port);
@@ -2145,6 +2324,7 @@ static struct libtrace_format_t dpdk = {
 	dpdk_prepare_packet,                /* prepare_packet */
 	dpdk_fin_packet,                    /* fin_packet */
 	dpdk_write_packet,                  /* write_packet */
+	dpdk_write_packets,                 /* write_packets */
 	dpdk_get_link_type,                 /* get_link_type */
 	dpdk_get_direction,                 /* get_direction */
 	dpdk_set_direction,                 /* set_direction */
@@ -174,6 +174,12 @@
  */
 #define NB_TX_MBUF 1024
 
+/* The maximum number of TX queues used when writing, each writing thread
+ * claims its own queue. Limited further by the NIC and threads will share
+ * queues if there are more threads than queues.
+ */
+#define NB_TX_QUEUES 8
+
 /* The size of the PCI blacklist needs to be big enough to contain
  * every PCI device address (listed by lspci every bus:device.function tuple).
  */
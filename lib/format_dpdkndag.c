@@ -732,6 +732,7 @@ static struct libtrace_format_t dpdkndag = {
         NULL,			/* prepare_packet */
         NULL,                   /* fin_packet */
         NULL,                   /* write_packet */
+        NULL,                   /* write_packets */
         erf_get_link_type,      /* get_link_type */
         erf_get_direction,      /* get_direction */
         erf_set_direction,      /* set_direction */
@@ -31,6 +31,8 @@
 #include "libtrace.h"
 #include "libtrace_int.h"
 #include "format_helper.h"
+#include "parallel_compress.h"
+#include "trace_index.h"
 #include "format_erf.h"
 #include "wandio.h"
 
@@ -76,10 +78,8 @@ struct erf_format_data_t {
         
 	/* Index used for seeking within a trace */
 	struct {
-		/* The index itself */
-		io_t *index;
-		/* The offset of the index */
-		off_t index_len;
+		/* The index itself, loaded by the first seek */
+		libtrace_index_t *index;
 		/* Indicates the existence of an index */
 		enum { INDEX_UNKNOWN=0, INDEX_NONE, INDEX_EXISTS } exists;
 	} seek;
@@ -107,17 +107,21 @@ struct erf_format_data_out_t {
 		int compress_type;
 		/* File flags used to open the file, e.g. O_CREATE */
 		int fileflag;
+		/* Bytes of trace between index entries, 0 for no index */
+		int index_spacing;
 	} options;
 
 	/* The output file itself */
 	iow_t *file;
-	
-};
 
-typedef struct erf_index_t {
-	uint64_t timestamp;
-	uint64_t offset; 
-} erf_index_t;
+	/* The index being written alongside the file, if any */
+	libtrace_index_writer_t *index;
+	/* The uncompressed offset of the next record, for the index */
+	uint64_t offset;
+
+	/* Coalesces the records written by erf_write_packets */
+	libtrace_write_buffer_t wbuf;
+};
 
 /* Ethernet packets have a 2 byte padding before the packet
  * so that the IP header is aligned on a 32 bit boundary.
@@ -230,6 +234,8 @@ static int erf_init_input(libtrace_t *libtrace)
 	
 	IN_OPTIONS.real_time = 0;
 	DATA(libtrace)->drops = 0;
+	DATA(libtrace)->seek.index = NULL;
+	DATA(libtrace)->seek.exists = INDEX_UNKNOWN;
 	
 	return 0; /* success */
 }
@@ -291,47 +297,15 @@ static int rawerf_start_input(libtrace_t *libtrace)
 	return 0; /* success */
 }
 
-/* Binary search through the index to find the closest point before
- * the packet.  Consider in future having a btree index perhaps?
+/* Jumps to the nearest indexed packet before the one we want. The index
+ * is only read once, then searched in memory.
  */
 static int erf_fast_seek_start(libtrace_t *libtrace,uint64_t erfts)
 {
-	size_t max_off = DATA(libtrace)->seek.index_len/sizeof(erf_index_t);
-	size_t min_off = 0;
-	off_t current;
-	erf_index_t record;
-	do {
-		current=(max_off+min_off)>>2;
-
-		wandio_seek(DATA(libtrace)->seek.index,
-				(int64_t)(current*sizeof(record)),
-				SEEK_SET);
-		wandio_read(DATA(libtrace)->seek.index,
-				&record,sizeof(record));
-		if (record.timestamp < erfts) {
-			min_off=current;
-		}
-		if (record.timestamp > erfts) {
-			max_off=current;
-		}
-		if (record.timestamp == erfts)
-			break;
-	} while(min_off<max_off);
-
-	/* If we've passed it, seek backwards.  This loop shouldn't
-	 * execute more than twice.
-	 */
-	do {
-		wandio_seek(DATA(libtrace)->seek.index,
-				(int64_t)(current*sizeof(record)),SEEK_SET);
-		wandio_read(DATA(libtrace)->seek.index,
-				&record,sizeof(record));
-		current--;
-	} while(record.timestamp>erfts);
-
-	/* We've found our location in the trace, now use it. */
-	wandio_seek(libtrace->io,(int64_t) record.offset,SEEK_SET);
+	int64_t off = trace_index_find(DATA(libtrace)->seek.index, erfts);
 
+	if (wandio_seek(libtrace->io, off, SEEK_SET) != off)
+		return -1;
 	return 0; /* success */
 }
 
@@ -349,16 +323,37 @@ static int erf_slow_seek_start(libtrace_t *libtrace,uint64_t erfts UNUSED)
 	return 0;
 }
 
+/* Reads forward from the current position to the first packet that isn't
+ * before erfts */
+static int erf_seek_forward(libtrace_t *libtrace, uint64_t erfts)
+{
+	libtrace_packet_t *packet;
+	off_t off = wandio_tell(libtrace->io);
+
+	packet=trace_create_packet();
+	for (;;) {
+		/* Stop at the end of the trace */
+		if (trace_read_packet(libtrace,packet) <= 0)
+			break;
+		if (trace_get_erf_timestamp(packet) >= erfts)
+			break;
+		off=wandio_tell(libtrace->io);
+	}
+	trace_destroy_packet(packet);
+
+	wandio_seek(libtrace->io,off,SEEK_SET);
+
+	return 0;
+}
+
 /* Seek within an ERF trace based on an ERF timestamp */
 static int erf_seek_erf(libtrace_t *libtrace,uint64_t erfts)
 {
-	libtrace_packet_t *packet;
-	off_t off = 0;
+	/* Files compressed in chunks carry their own index */
+	int64_t off = pcompress_seek_timestamp(libtrace->io, erfts);
 
 	if (DATA(libtrace)->seek.exists==INDEX_UNKNOWN) {
-		char buffer[PATH_MAX];
-		snprintf(buffer,sizeof(buffer),"%s.idx",libtrace->uridata);
-		DATA(libtrace)->seek.index=wandio_create(buffer);
+		DATA(libtrace)->seek.index=trace_index_load(libtrace->uridata);
 		if (DATA(libtrace)->seek.index) {
 			DATA(libtrace)->seek.exists=INDEX_EXISTS;
 		}
@@ -373,10 +368,23 @@ static int erf_seek_erf(libtrace_t *libtrace,uint64_t erfts)
 	 */
 	switch(DATA(libtrace)->seek.exists) {
 		case INDEX_EXISTS:
-			erf_fast_seek_start(libtrace,erfts);
+			/* Unless the chunk index found somewhere closer */
+			if (off >= 0 && (uint64_t)off >= trace_index_find(
+						DATA(libtrace)->seek.index, erfts))
+				break;
+			if (erf_fast_seek_start(libtrace,erfts) == 0)
+				break;
+			/* The file can't seek backwards, reopen it and seek
+			 * forwards instead */
+			if (erf_slow_seek_start(libtrace,erfts) < 0 ||
+					erf_fast_seek_start(libtrace,erfts) < 0)
+				return -1;
 			break;
 		case INDEX_NONE:
-			erf_slow_seek_start(libtrace,erfts);
+			if (off >= 0)
+				break;
+			if (erf_slow_seek_start(libtrace,erfts) < 0)
+				return -1;
 			break;
 		case INDEX_UNKNOWN:
 			assert(0);
@@ -384,17 +392,7 @@ static int erf_seek_erf(libtrace_t *libtrace,uint64_t erfts)
 	}
 
 	/* Now seek forward looking for the correct timestamp */
-	packet=trace_create_packet();
-	do {
-		trace_read_packet(libtrace,packet);
-		if (trace_get_erf_timestamp(packet)==erfts)
-			break;
-		off=wandio_tell(libtrace->io);
-	} while(trace_get_erf_timestamp(packet)<erfts);
-
-	wandio_seek(libtrace->io,off,SEEK_SET);
-
-	return 0;
+	return erf_seek_forward(libtrace, erfts);
 }
 
 static int erf_init_output(libtrace_out_t *libtrace) {
@@ -403,7 +401,12 @@ static int erf_init_output(libtrace_out_t *libtrace) {
 	OUT_OPTIONS.level = 0;
 	OUT_OPTIONS.compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
 	OUT_OPTIONS.fileflag = O_CREAT | O_WRONLY;
+	OUT_OPTIONS.index_spacing = 0;
 	OUTPUT->file = 0;
+	OUTPUT->index = NULL;
+	OUTPUT->offset = 0;
+	OUTPUT->wbuf.buf = NULL;
+	OUTPUT->wbuf.used = 0;
 
 	return 0;
 }
@@ -421,6 +424,9 @@ static int erf_config_output(libtrace_out_t *libtrace,
 		case TRACE_OPTION_OUTPUT_FILEFLAGS:
 			OUT_OPTIONS.fileflag = *(int*)value;
 			return 0;
+		case TRACE_OPTION_OUTPUT_INDEX:
+			OUT_OPTIONS.index_spacing = *(int*)value;
+			return 0;
 		default:
 			/* Unknown option */
 			trace_set_err_out(libtrace,TRACE_ERR_UNKNOWN_OPTION,
@@ -434,6 +440,7 @@ static int erf_config_output(libtrace_out_t *libtrace,
 static int erf_fin_input(libtrace_t *libtrace) {
 	if (libtrace->io)
 		wandio_destroy(libtrace->io);
+	trace_index_destroy(DATA(libtrace)->seek.index);
 	free(libtrace->format_data);
 	return 0;
 }
@@ -441,6 +448,9 @@ static int erf_fin_input(libtrace_t *libtrace) {
 static int erf_fin_output(libtrace_out_t *libtrace) {
 	if (OUTPUT->file)
 		wandio_wdestroy(OUTPUT->file);
+	if (OUTPUT->index)
+		trace_index_wclose(OUTPUT->index, true);
+	trace_buffer_free(&OUTPUT->wbuf);
 	free(libtrace->format_data);
 	return 0;
 }
@@ -573,14 +583,23 @@ static int erf_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet) {
 
 static int erf_dump_packet(libtrace_out_t *libtrace,
 		dag_record_t *erfptr, int framinglen, void *buffer,
-                int caplen) {
+                int caplen, libtrace_write_buffer_t *wbuf) {
 	int numbytes = 0;
 
         if (caplen + framinglen != ntohs(erfptr->rlen))
                 erfptr->rlen = htons(caplen + framinglen);
 
+	trace_buffer_mark(OUTPUT->file, wbuf, bswap_le_to_host64(erfptr->ts));
+	if (OUTPUT->index && trace_index_add(OUTPUT->index,
+				bswap_le_to_host64(erfptr->ts),
+				OUTPUT->offset) < 0) {
+		trace_set_err_out(libtrace,errno,
+				"Unable to write index for %s",
+				libtrace->uridata);
+		return -1;
+	}
 	if ((numbytes = 
-		wandio_wwrite(OUTPUT->file, 
+		trace_buffer_write(OUTPUT->file, wbuf,
 				erfptr,
 				(size_t)(framinglen))) 
 			!= (int)(framinglen)) {
@@ -589,12 +608,14 @@ static int erf_dump_packet(libtrace_out_t *libtrace,
 		return -1;
 	}
 
-        numbytes=wandio_wwrite(OUTPUT->file, buffer, (size_t)caplen);
+        numbytes=trace_buffer_write(OUTPUT->file, wbuf, buffer,
+			(size_t)caplen);
 	if (numbytes != caplen) {
 		trace_set_err_out(libtrace,errno,
 				"write(%s)",libtrace->uridata);
 		return -1;
 	}
+	OUTPUT->offset += numbytes + framinglen;
 	return numbytes + framinglen;
 }
 
@@ -608,6 +629,29 @@ static int erf_start_output(libtrace_out_t *libtrace)
 	if (!OUTPUT->file) {
 		return -1;
 	}
+
+	if (OUT_OPTIONS.index_spacing > 0) {
+		char *name;
+
+		/* Offsets would be relative to the end of the old file */
+		if (OUT_OPTIONS.fileflag & O_APPEND) {
+			trace_set_err_out(libtrace, TRACE_ERR_OPTION_UNAVAIL,
+					"Cannot index a trace being appended to");
+			return -1;
+		}
+		name = trace_index_name(libtrace->uridata);
+		if (name)
+			OUTPUT->index = trace_index_wopen(name,
+					OUT_OPTIONS.index_spacing);
+		if (!OUTPUT->index) {
+			trace_set_err_out(libtrace, name ? errno : ENOMEM,
+					"Unable to create index for %s",
+					libtrace->uridata);
+			free(name);
+			return -1;
+		}
+		free(name);
+	}
 	return 0;
 }
 
@@ -636,8 +680,9 @@ static bool find_compatible_linktype(libtrace_out_t *libtrace,
 	return true;
 }
 		
-static int erf_write_packet(libtrace_out_t *libtrace, 
-		libtrace_packet_t *packet) 
+/* Writes a single packet, via the write buffer if wbuf is not NULL */
+static int erf_write_one(libtrace_out_t *libtrace,
+		libtrace_packet_t *packet, libtrace_write_buffer_t *wbuf)
 {
 	int numbytes = 0;
 	unsigned int pad = 0;
@@ -670,8 +715,8 @@ static int erf_write_packet(libtrace_out_t *libtrace,
 				(dag_record_t *)packet->header,
 				trace_get_framing_length(packet),
 				payload,
-                                trace_get_capture_length(packet)
-				);
+                                trace_get_capture_length(packet),
+				wbuf);
 	} else {
 		dag_record_t erfhdr;
 		int rlen;
@@ -716,11 +761,42 @@ static int erf_write_packet(libtrace_out_t *libtrace,
 				&erfhdr,
 				framing,
 				payload,
-                                trace_get_capture_length(packet));
+                                trace_get_capture_length(packet),
+				wbuf);
 	}
 	return numbytes;
 }
 
+static int erf_write_packet(libtrace_out_t *libtrace,
+		libtrace_packet_t *packet)
+{
+	return erf_write_one(libtrace, packet, NULL);
+}
+
+static int erf_write_packets(libtrace_out_t *libtrace,
+		libtrace_packet_t *packets[], size_t nb_packets)
+{
+	size_t i;
+	int ret, total = 0;
+
+	/* Gather the records together and write them out in one go */
+	for (i = 0; i < nb_packets; i++) {
+		ret = erf_write_one(libtrace, packets[i], &OUTPUT->wbuf);
+		if (ret < 0) {
+			/* Still write out the packets before this one */
+			trace_buffer_flush(OUTPUT->file, &OUTPUT->wbuf);
+			return -1;
+		}
+		total += ret;
+	}
+	if (trace_buffer_flush(OUTPUT->file, &OUTPUT->wbuf) < 0) {
+		trace_set_err_out(libtrace, errno, "write(%s)",
+				libtrace->uridata);
+		return -1;
+	}
+	return total;
+}
+
 libtrace_linktype_t erf_get_link_type(const libtrace_packet_t *packet) {
 	dag_record_t *erfptr = 0;
 	erfptr = (dag_record_t *)packet->header;
@@ -867,6 +943,7 @@ static struct libtrace_format_t erfformat = {
 	erf_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	erf_write_packet,		/* write_packet */
+	erf_write_packets,		/* write_packets */
 	erf_get_link_type,		/* get_link_type */
 	erf_get_direction,		/* get_direction */
 	erf_set_direction,		/* set_direction */
@@ -911,6 +988,7 @@ static struct libtrace_format_t rawerfformat = {
 	erf_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	erf_write_packet,		/* write_packet */
+	erf_write_packets,		/* write_packets */
 	erf_get_link_type,		/* get_link_type */
 	erf_get_direction,		/* get_direction */
 	erf_set_direction,		/* set_direction */
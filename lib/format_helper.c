@@ -37,6 +37,7 @@
 #include <errno.h>
 #include <time.h>
 #include "format_helper.h"
+#include "parallel_compress.h"
 
 #include <assert.h>
 #include <stdarg.h>
@@ -128,6 +129,8 @@ struct libtrace_eventobj_t trace_event_trace(struct libtrace_t *trace, struct li
 	double now;
 #ifdef WIN32
 	struct __timeb64 tstruct;
+#elif HAVE_CLOCK_GETTIME
+	struct timespec sts;
 #else
 	struct timeval stv;
 #endif
@@ -169,11 +172,16 @@ struct libtrace_eventobj_t trace_event_trace(struct libtrace_t *trace, struct li
 
 	ts=trace_get_seconds(trace->event.packet);
 
-	/* Get the current walltime */
+	/* Get the current walltime, from a monotonic clock where available so
+	 * that the replay is not disturbed if the system time is changed */
 #ifdef WIN32
 	_ftime64(&tstruct);
 	now = tstruct.time + 
 		((double)tstruct.millitm / 1000.0);
+#elif HAVE_CLOCK_GETTIME
+	clock_gettime(CLOCK_MONOTONIC, &sts);
+	now = sts.tv_sec + 
+		((double)sts.tv_nsec / 1000000000.0);
 #else
 	gettimeofday(&stv, NULL);
 	now = stv.tv_sec + 
@@ -183,14 +191,19 @@ struct libtrace_eventobj_t trace_event_trace(struct libtrace_t *trace, struct li
 	
 	if (fabs(trace->event.tdelta)>1e-9) {
 		/* Subtract the tdelta from the walltime to get a suitable
-		 * "relative" time */
+		 * "relative" time, then scale the time elapsed since the
+		 * first packet by the replay speed up */
 		now -= trace->event.tdelta; 
+		now = trace->event.trace_first_ts + (now -
+			trace->event.trace_first_ts) * trace->replayspeedup;
 
 		/* If the trace timestamp is still in the future, return a 
-		 * SLEEP event, otherwise return the packet */
+		 * SLEEP event, otherwise return the packet. The sleep is
+		 * measured against the walltime, rather than the previous
+		 * packet, so that time spent processing is not added to
+		 * each gap. */
 		if (ts > now) {
-			event.seconds = ts - 
-				trace->event.trace_last_ts;
+			event.seconds = (ts - now) / trace->replayspeedup;
 			trace->event.trace_last_ts = ts;
 			event.type = TRACE_EVENT_SLEEP;
 			trace->event.waiting = true;
@@ -204,6 +217,7 @@ struct libtrace_eventobj_t trace_event_trace(struct libtrace_t *trace, struct li
 		 * trace file.
 		 */
 		trace->event.tdelta = now - ts;
+		trace->event.trace_first_ts = ts;
 	}
 
 	/* The packet that we had read earlier is now ready to be returned
@@ -234,11 +248,25 @@ struct libtrace_eventobj_t trace_event_trace(struct libtrace_t *trace, struct li
 #  define O_BINARY 0
 #endif
 
+io_t *trace_open_io(const char *filename, int threads)
+{
+	io_t *io;
+
+	/* Files we compressed in blocks can be decompressed in parallel,
+	 * anything else falls back to wandio. Only regular files are probed
+	 * for blocks, so pipes are only ever opened once. */
+	io = pcompress_open(filename, threads);
+	if (!io)
+		io = wandio_create(filename);
+	return io;
+}
+
 /* Open a file for reading using the new Libtrace IO system */
 io_t *trace_open_file(libtrace_t *trace)
 {
-	io_t *io=wandio_create(trace->uridata);
+	io_t *io;
 
+	io = trace_open_io(trace->uridata, trace->config.decompress_threads);
 	if (!io) {
 		if (errno != 0) {
 			trace_set_err(trace,errno,"Unable to open %s",trace->uridata);
@@ -268,6 +296,32 @@ iow_t *trace_open_file_out(libtrace_out_t *trace, int compress_type, int level,
                 return NULL;
         }
 
+	/* wandio doesn't write zstd or lz4, and only compresses gzip on a
+	 * single thread */
+	if (level > 0 && (compress_type == TRACE_OPTION_COMPRESSTYPE_ZSTD ||
+			compress_type == TRACE_OPTION_COMPRESSTYPE_LZ4 ||
+			(compress_type == TRACE_OPTION_COMPRESSTYPE_ZLIB &&
+			 trace->compress_threads > 1))) {
+		iow_t *child = wandio_wcreate(trace->uridata,
+				TRACE_OPTION_COMPRESSTYPE_NONE, 0, fileflag);
+		if (!child) {
+			trace_set_err_out(trace, errno, "Unable to create output file %s", trace->uridata);
+			return NULL;
+		}
+		io = pcompress_wopen(child, compress_type, level,
+				trace->compress_threads);
+		if (io)
+			return io;
+		wandio_wdestroy(child);
+		if (compress_type != TRACE_OPTION_COMPRESSTYPE_ZLIB) {
+			trace_set_err_out(trace, TRACE_ERR_UNSUPPORTED_COMPRESS,
+					"libtrace was built without support for compression type %d",
+					compress_type);
+			return NULL;
+		}
+		/* Built without zlib, let wandio compress it instead */
+	}
+
 	io = wandio_wcreate(trace->uridata, compress_type, level, fileflag);
 
 	if (!io) {
@@ -276,6 +330,59 @@ iow_t *trace_open_file_out(libtrace_out_t *trace, int compress_type, int level,
 	return io;
 }
 
+void trace_buffer_mark(iow_t *file, libtrace_write_buffer_t *wbuf,
+		uint64_t ts)
+{
+	pcompress_mark(file, ts, wbuf ? wbuf->used : 0);
+}
+
+int trace_buffer_write(iow_t *file, libtrace_write_buffer_t *wbuf,
+		const void *data, size_t len)
+{
+	if (wbuf == NULL)
+		return wandio_wwrite(file, data, len);
+
+	if (wbuf->used + len > WRITE_BUFFER_SIZE &&
+			trace_buffer_flush(file, wbuf) < 0)
+		return -1;
+
+	/* Too big to be worth copying */
+	if (len > WRITE_BUFFER_SIZE) {
+		if (wandio_wwrite(file, data, len) != (int64_t)len)
+			return -1;
+		return len;
+	}
+
+	if (wbuf->buf == NULL) {
+		wbuf->buf = malloc(WRITE_BUFFER_SIZE);
+		if (wbuf->buf == NULL)
+			return -1;
+	}
+	memcpy(wbuf->buf + wbuf->used, data, len);
+	wbuf->used += len;
+	return len;
+}
+
+int trace_buffer_flush(iow_t *file, libtrace_write_buffer_t *wbuf)
+{
+	size_t used = wbuf->used;
+
+	if (used == 0)
+		return 0;
+	wbuf->used = 0;
+	if (wandio_wwrite(file, wbuf->buf, used) != (int64_t)used)
+		return -1;
+	return 0;
+}
+
+void trace_buffer_free(libtrace_write_buffer_t *wbuf)
+{
+	if (wbuf->buf)
+		free(wbuf->buf);
+	wbuf->buf = NULL;
+	wbuf->used = 0;
+}
+
 
 /** Sets the error status for an input trace
  * @param errcode either an Econstant from libc, or a LIBTRACE_ERROR
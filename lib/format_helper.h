@@ -64,6 +64,17 @@ struct libtrace_eventobj_t trace_event_device(libtrace_t *trace, libtrace_packet
  */
 struct libtrace_eventobj_t trace_event_trace(libtrace_t *trace, libtrace_packet_t *packet);
 
+/** Opens a file for reading, decompressing it in parallel if it was
+ * compressed in blocks by libtrace, otherwise through wandio
+ *
+ * @param filename	The name of the file to open
+ * @param threads	The number of threads to decompress blocks with, 0
+ * 			picks a number based on the number of CPU cores
+ * @return A libtrace IO reader for the file or NULL if it was unable to be
+ * opened
+ */
+io_t *trace_open_io(const char *filename, int threads);
+
 /** Opens an input trace file for reading
  *
  * @param libtrace	The input trace to be opened
@@ -87,6 +98,59 @@ iow_t *trace_open_file_out(libtrace_out_t *libtrace,
 		int level,
 		int filemode);
 
+/** The size of the buffer used to coalesce writes in write_packets */
+#define WRITE_BUFFER_SIZE (128 * 1024)
+
+/** A buffer used by write_packets implementations to coalesce the headers
+ * and payloads of a batch of packets into a few large wandio writes */
+typedef struct libtrace_write_buffer {
+	/** The buffered data, allocated on first use */
+	char *buf;
+	/** The number of bytes waiting to be written */
+	size_t used;
+} libtrace_write_buffer_t;
+
+/** Writes data to an output file via a write buffer
+ *
+ * @param file		The wandio writer for the output file
+ * @param wbuf		The write buffer, if NULL the data is written directly
+ * @param data		The data to write
+ * @param len		The length of the data
+ * @return The number of bytes written (or buffered), or -1 if an error
+ * occurred writing to the file
+ *
+ * Data larger than the buffer is written directly, after first flushing any
+ * data already in the buffer.
+ */
+int trace_buffer_write(iow_t *file, libtrace_write_buffer_t *wbuf,
+		const void *data, size_t len);
+
+/** Marks the start of a record about to be written via a write buffer
+ *
+ * Files compressed in chunks use this to start chunks on a record and to
+ * index them by timestamp, otherwise this does nothing.
+ *
+ * @param file		The wandio writer for the output file
+ * @param wbuf		The write buffer, or NULL if writing directly
+ * @param ts		The ERF timestamp of the record
+ */
+void trace_buffer_mark(iow_t *file, libtrace_write_buffer_t *wbuf,
+		uint64_t ts);
+
+/** Writes any data remaining in a write buffer out to the file
+ *
+ * @param file		The wandio writer for the output file
+ * @param wbuf		The write buffer to flush
+ * @return 0 if successful, or -1 if an error occurred
+ */
+int trace_buffer_flush(iow_t *file, libtrace_write_buffer_t *wbuf);
+
+/** Frees the memory used by a write buffer, any data remaining is lost
+ *
+ * @param wbuf		The write buffer to free
+ */
+void trace_buffer_free(libtrace_write_buffer_t *wbuf);
+
 
 /** Attempts to determine the direction for a pcap (or pcapng) packet.
  *
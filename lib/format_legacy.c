@@ -522,6 +522,7 @@ static struct libtrace_format_t legacyatm = {
 	legacy_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	NULL,				/* write_packet */
+	NULL,				/* write_packets */
 	legacyatm_get_link_type,	/* get_link_type */
 	NULL,				/* get_direction */
 	NULL,				/* set_direction */
@@ -566,6 +567,7 @@ static struct libtrace_format_t legacyeth = {
 	legacy_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	NULL,				/* write_packet */
+	NULL,				/* write_packets */
 	legacyeth_get_link_type,	/* get_link_type */
 	NULL,				/* get_direction */
 	NULL,				/* set_direction */
@@ -610,6 +612,7 @@ static struct libtrace_format_t legacypos = {
 	legacy_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	NULL,				/* write_packet */
+	NULL,				/* write_packets */
 	legacypos_get_link_type,	/* get_link_type */
 	NULL,				/* get_direction */
 	NULL,				/* set_direction */
@@ -654,6 +657,7 @@ static struct libtrace_format_t legacynzix = {
 	legacy_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	NULL,				/* write_packet */
+	NULL,				/* write_packets */
 	legacynzix_get_link_type,	/* get_link_type */
 	NULL,				/* get_direction */
 	NULL,				/* set_direction */
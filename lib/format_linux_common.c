@@ -161,6 +161,7 @@ int linuxcommon_config_input(libtrace_t *libtrace,
 			/* No meta-data for this format */
 			break;
 		case TRACE_OPTION_EVENT_REALTIME:
+		case TRACE_OPTION_REPLAY_SPEEDUP:
 			/* Live captures are always going to be in trace time */
 			break;
 		/* Avoid default: so that future options will cause a warning
@@ -630,8 +630,10 @@ static void linuxring_fin_packet(libtrace_packet_t *packet)
 	}
 }
 
-static int linuxring_write_packet(libtrace_out_t *libtrace,
-				  libtrace_packet_t *packet)
+/* Copies a packet into the next free frame in the TX ring, without
+ * notifying the kernel */
+static int linuxring_fill_frame(libtrace_out_t *libtrace,
+				libtrace_packet_t *packet)
 {
 	struct tpacket2_hdr *header;
 	struct pollfd pollset;
@@ -693,24 +695,76 @@ static int linuxring_write_packet(libtrace_out_t *libtrace,
 	header->tp_status = TP_STATUS_SEND_REQUEST;
 	FORMAT_DATA_OUT->txring_offset = (FORMAT_DATA_OUT->txring_offset + 1) %
 		FORMAT_DATA_OUT->req.tp_frame_nr;
+	return header->tp_len;
+}
+
+/* Notify kernel there are frames to send */
+static int linuxring_kick_tx(libtrace_out_t *libtrace)
+{
+	int ret;
+
+	ret = sendto(FORMAT_DATA_OUT->fd,
+			NULL,
+			0,
+			MSG_DONTWAIT,
+			(void *)&FORMAT_DATA_OUT->sock_hdr,
+			sizeof(FORMAT_DATA_OUT->sock_hdr));
+	if (ret < 0) {
+		trace_set_err_out(libtrace, errno, "sendto failed");
+		return -1;
+	}
+	return 0;
+}
+
+static int linuxring_write_packet(libtrace_out_t *libtrace,
+				  libtrace_packet_t *packet)
+{
+	int len = linuxring_fill_frame(libtrace, packet);
+
+	if (len <= 0)
+		return len;
 
 	/* Notify kernel there are frames to send */
 	FORMAT_DATA_OUT->queue ++;
 	FORMAT_DATA_OUT->queue %= TX_MAX_QUEUE;
 	if(FORMAT_DATA_OUT->queue == 0){
-		ret = sendto(FORMAT_DATA_OUT->fd,
-				NULL,
-				0,
-				MSG_DONTWAIT,
-				(void *)&FORMAT_DATA_OUT->sock_hdr,
-				sizeof(FORMAT_DATA_OUT->sock_hdr));
-		if (ret < 0) {
-			trace_set_err_out(libtrace, errno, "sendto failed");
+		if (linuxring_kick_tx(libtrace) < 0)
 			return -1;
+	}
+	return len;
+}
+
+static int linuxring_write_packets(libtrace_out_t *libtrace,
+				   libtrace_packet_t *packets[],
+				   size_t nb_packets)
+{
+	size_t i;
+	int len, total = 0, queued = 0;
+
+	/* Fill the ring with the whole batch, then notify the kernel once.
+	 * A batch larger than the ring is sent half a ring at a time. */
+	for (i = 0; i < nb_packets; i++) {
+		len = linuxring_fill_frame(libtrace, packets[i]);
+		if (len < 0)
+			break;
+		if (len > 0)
+			queued++;
+		total += len;
+		if (queued >= (int) FORMAT_DATA_OUT->req.tp_frame_nr / 2) {
+			if (linuxring_kick_tx(libtrace) < 0)
+				return -1;
+			queued = 0;
 		}
 	}
-	return header->tp_len;
 
+	if (queued > 0) {
+		FORMAT_DATA_OUT->queue = 0;
+		if (linuxring_kick_tx(libtrace) < 0)
+			return -1;
+	}
+	if (i < nb_packets)
+		return -1;
+	return total;
 }
 
 static void linuxring_help(void)
@@ -744,6 +798,7 @@ static struct libtrace_format_t linuxring = {
 	linuxring_prepare_packet,	/* prepare_packet */
 	linuxring_fin_packet,		/* fin_packet */
 	linuxring_write_packet,		/* write_packet */
+	linuxring_write_packets,	/* write_packets */
 	linuxring_get_link_type,	/* get_link_type */
 	linuxring_get_direction,	/* get_direction */
 	linuxring_set_direction,	/* set_direction */
@@ -806,6 +861,7 @@ static struct libtrace_format_t linuxring = {
 	linuxring_prepare_packet,	/* prepare_packet */
 	NULL,				/* fin_packet */
 	NULL,				/* write_packet */
+	NULL,				/* write_packets */
 	linuxring_get_link_type,	/* get_link_type */
 	linuxring_get_direction,	/* get_direction */
 	linuxring_set_direction,	/* set_direction */
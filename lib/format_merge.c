@@ -0,0 +1,582 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "common.h"
+#include "libtrace.h"
+#include "libtrace_int.h"
+#include "data-struct/ring_buffer.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A virtual input that merges several traces into a single stream of packets
+ * in timestamp order.
+ *
+ * Each input is read by its own thread, which passes batches of packets to
+ * the merge through a ring buffer. The merge keeps the next packet from each
+ * input in a heap ordered by timestamp. The data of the earliest packet is
+ * moved into the caller's packet: if the input packet owns its buffer the
+ * two packets swap buffers, otherwise the data is copied so the input's
+ * format can release its buffer. The input packet is then given back to the
+ * reader thread.
+ */
+
+#define MERGE_INFO ((struct merge_format_data_t *)libtrace->format_data)
+
+/* The number of packets each input can have buffered */
+#define MERGE_QUEUE_SIZE 256
+
+/* The most packets a reader thread reads before passing them on */
+#define MERGE_BATCH_SIZE 32
+
+struct merge_input_t {
+	/* The URI of the input */
+	char *uri;
+	/* The input trace, read by the reader thread */
+	libtrace_t *trace;
+	/* The reader thread */
+	pthread_t thread;
+	bool thread_running;
+	/* Packets read from the input, waiting to be merged. A NULL marks the
+	 * end of the input */
+	libtrace_ringbuffer_t full;
+	/* Packets that the reader can read into. A NULL asks the reader to
+	 * stop */
+	libtrace_ringbuffer_t empty;
+	/* Every packet belonging to this input */
+	libtrace_packet_t *packets[MERGE_QUEUE_SIZE];
+	/* Packets taken from full in one go, waiting to be merged */
+	void *ready[MERGE_BATCH_SIZE];
+	size_t nb_ready;
+	size_t next_ready;
+	/* Merged packets waiting to be given back to the reader */
+	void *used[MERGE_BATCH_SIZE];
+	size_t nb_used;
+	/* The next packet to be merged from this input */
+	libtrace_packet_t *next;
+	/* The timestamp of next */
+	uint64_t nextts;
+	/* Set once the reader has reached the end of the input */
+	bool finished;
+	/* Set if reading stopped because of an error */
+	bool error;
+};
+
+struct merge_format_data_t {
+	struct merge_input_t *inputs;
+	int nb_inputs;
+
+	/* Inputs with a packet waiting to be merged, as a min-heap ordered by
+	 * the timestamp of that packet */
+	struct merge_input_t **heap;
+	int heapsize;
+
+	/* Inputs that need their next packet before the merge can continue */
+	struct merge_input_t **pending;
+	int nb_pending;
+};
+
+static void heap_sift_up(struct merge_format_data_t *data, int h) {
+	struct merge_input_t *in = data->heap[h];
+
+	while (h > 0) {
+		int parent = (h - 1) / 2;
+		if (data->heap[parent]->nextts <= in->nextts)
+			break;
+		data->heap[h] = data->heap[parent];
+		h = parent;
+	}
+	data->heap[h] = in;
+}
+
+static struct merge_input_t *heap_pop(struct merge_format_data_t *data) {
+	struct merge_input_t *top = data->heap[0];
+	struct merge_input_t *in;
+	int h = 0, child;
+
+	data->heapsize --;
+	if (data->heapsize == 0)
+		return top;
+
+	in = data->heap[data->heapsize];
+	while ((child = h * 2 + 1) < data->heapsize) {
+		if (child + 1 < data->heapsize && data->heap[child + 1]->nextts
+				< data->heap[child]->nextts)
+			child ++;
+		if (in->nextts <= data->heap[child]->nextts)
+			break;
+		data->heap[h] = data->heap[child];
+		h = child;
+	}
+	data->heap[h] = in;
+	return top;
+}
+
+static void *merge_reader_run(void *arg) {
+	struct merge_input_t *in = (struct merge_input_t *)arg;
+	void *batch[MERGE_BATCH_SIZE];
+	size_t nb_packets, nb_read;
+	int ret = 1;
+
+	while (ret > 0) {
+		nb_packets = libtrace_ringbuffer_read_bulk(&in->empty, batch,
+				MERGE_BATCH_SIZE, 1);
+
+		for (nb_read = 0; nb_read < nb_packets; nb_read ++) {
+			if (batch[nb_read] == NULL) {
+				/* Asked to stop */
+				ret = 0;
+				break;
+			}
+			ret = trace_read_packet(in->trace,
+					(libtrace_packet_t *)batch[nb_read]);
+			if (ret <= 0) {
+				in->error = (ret < 0);
+				break;
+			}
+			((libtrace_packet_t *)batch[nb_read])->error = ret;
+		}
+
+		if (nb_read > 0)
+			libtrace_ringbuffer_write_bulk(&in->full, batch,
+					nb_read, nb_read);
+
+		/* Packets that weren't used are not handed back, the merge
+		 * thread is the only writer to empty. Nothing follows the
+		 * NULL asking us to stop, and a finished input is never
+		 * read again, so they aren't needed */
+		if (ret <= 0 && nb_read < nb_packets &&
+				batch[nb_read] != NULL) {
+			/* End of the input, not asked to stop */
+			in->finished = true;
+			libtrace_ringbuffer_write(&in->full, NULL);
+		}
+	}
+	return NULL;
+}
+
+static int merge_init_input(libtrace_t *libtrace) {
+	char *uris, *uri, *saveptr = NULL;
+	struct merge_input_t *in;
+	int count = 1;
+	char *scan;
+
+	libtrace->format_data = calloc(1, sizeof(struct merge_format_data_t));
+
+	for (scan = libtrace->uridata; *scan; scan++) {
+		if (*scan == ',')
+			count ++;
+	}
+	MERGE_INFO->inputs = calloc(count, sizeof(struct merge_input_t));
+	MERGE_INFO->heap = calloc(count, sizeof(struct merge_input_t *));
+	MERGE_INFO->pending = calloc(count, sizeof(struct merge_input_t *));
+
+	uris = strdup(libtrace->uridata);
+	for (uri = strtok_r(uris, ",", &saveptr); uri != NULL;
+			uri = strtok_r(NULL, ",", &saveptr)) {
+		in = &MERGE_INFO->inputs[MERGE_INFO->nb_inputs];
+		in->uri = strdup(uri);
+		MERGE_INFO->nb_inputs ++;
+
+		in->trace = trace_create(uri);
+		if (trace_is_err(in->trace)) {
+			libtrace_err_t err = trace_get_err(in->trace);
+			trace_set_err(libtrace, err.err_num, "%s: %s", uri,
+					err.problem);
+			free(uris);
+			return -1;
+		}
+	}
+	free(uris);
+
+	if (MERGE_INFO->nb_inputs == 0) {
+		trace_set_err(libtrace, TRACE_ERR_BAD_FORMAT,
+				"Bad merge URI. Should be merge:<uri>,<uri>,...");
+		return -1;
+	}
+	return 0;
+}
+
+static int merge_config_input(libtrace_t *libtrace, trace_option_t option,
+		void *value) {
+	int i;
+
+	switch (option) {
+		case TRACE_OPTION_PROMISC:
+		case TRACE_OPTION_META_FREQ:
+			/* Options for the capture itself apply to every
+			 * input */
+			for (i = 0; i < MERGE_INFO->nb_inputs; i++) {
+				if (trace_config(MERGE_INFO->inputs[i].trace,
+						option, value) == -1)
+					return -1;
+			}
+			return 0;
+		default:
+			/* Filtering and snapping is done on the merged
+			 * packets */
+			return -1;
+	}
+}
+
+static int merge_start_input(libtrace_t *libtrace) {
+	struct merge_input_t *in;
+	int i, j;
+
+	for (i = 0; i < MERGE_INFO->nb_inputs; i++) {
+		in = &MERGE_INFO->inputs[i];
+
+		if (in->packets[0] == NULL) {
+			/* First start, room for every packet plus a NULL */
+			libtrace_ringbuffer_init(&in->full,
+					MERGE_QUEUE_SIZE + 1,
+					LIBTRACE_RINGBUFFER_BLOCKING);
+			libtrace_ringbuffer_init(&in->empty,
+					MERGE_QUEUE_SIZE + 1,
+					LIBTRACE_RINGBUFFER_BLOCKING);
+			for (j = 0; j < MERGE_QUEUE_SIZE; j++) {
+				in->packets[j] = trace_create_packet();
+				libtrace_ringbuffer_write(&in->empty,
+						in->packets[j]);
+			}
+			MERGE_INFO->pending[MERGE_INFO->nb_pending++] = in;
+		}
+
+		if (in->finished)
+			continue;
+
+		if (trace_start(in->trace) == -1) {
+			libtrace_err_t err = trace_get_err(in->trace);
+			trace_set_err(libtrace, err.err_num, "%s: %s", in->uri,
+					err.problem);
+			return -1;
+		}
+
+		if (pthread_create(&in->thread, NULL, merge_reader_run,
+					in) != 0) {
+			trace_set_err(libtrace, errno,
+					"Failed to start reader thread for %s",
+					in->uri);
+			return -1;
+		}
+		in->thread_running = true;
+	}
+	return 0;
+}
+
+/* Gives merged packets back to the reader */
+static void merge_return_used(struct merge_input_t *in) {
+	if (in->nb_used > 0) {
+		libtrace_ringbuffer_write_bulk(&in->empty, in->used,
+				in->nb_used, in->nb_used);
+		in->nb_used = 0;
+	}
+}
+
+static int merge_pause_input(libtrace_t *libtrace) {
+	struct merge_input_t *in;
+	int i;
+
+	for (i = 0; i < MERGE_INFO->nb_inputs; i++) {
+		in = &MERGE_INFO->inputs[i];
+		if (!in->thread_running)
+			continue;
+
+		/* Packets already read stay queued for when we restart */
+		merge_return_used(in);
+		libtrace_ringbuffer_write(&in->empty, NULL);
+		ASSERT_RET(pthread_join(in->thread, NULL), == 0);
+		in->thread_running = false;
+
+		if (!in->finished)
+			trace_pause(in->trace);
+	}
+	return 0;
+}
+
+static int merge_fin_input(libtrace_t *libtrace) {
+	struct merge_input_t *in;
+	int i, j;
+
+	for (i = 0; i < MERGE_INFO->nb_inputs; i++) {
+		in = &MERGE_INFO->inputs[i];
+
+		/* The packets must let go of the input before it is
+		 * destroyed */
+		for (j = 0; j < MERGE_QUEUE_SIZE && in->packets[j]; j++) {
+			trace_fin_packet(in->packets[j]);
+			trace_destroy_packet(in->packets[j]);
+		}
+		if (in->packets[0]) {
+			libtrace_ringbuffer_destroy(&in->full);
+			libtrace_ringbuffer_destroy(&in->empty);
+		}
+		if (in->trace)
+			trace_destroy(in->trace);
+		free(in->uri);
+	}
+
+	free(MERGE_INFO->inputs);
+	free(MERGE_INFO->heap);
+	free(MERGE_INFO->pending);
+	free(libtrace->format_data);
+	return 0;
+}
+
+/* Gets the next packet from every input that needs one. Returns 1 once the
+ * merge can continue, 0 if block is false and an input has nothing ready,
+ * or -1 if an input failed. */
+static int merge_fill(libtrace_t *libtrace, bool block) {
+	struct merge_input_t *in;
+	void *packet;
+
+	while (MERGE_INFO->nb_pending > 0) {
+		in = MERGE_INFO->pending[MERGE_INFO->nb_pending - 1];
+
+		if (in->next_ready == in->nb_ready) {
+			merge_return_used(in);
+			in->nb_ready = libtrace_ringbuffer_read_bulk(&in->full,
+					in->ready, MERGE_BATCH_SIZE,
+					block ? 1 : 0);
+			in->next_ready = 0;
+			if (in->nb_ready == 0)
+				return 0;
+		}
+		packet = in->ready[in->next_ready++];
+
+		MERGE_INFO->nb_pending --;
+		if (packet == NULL) {
+			/* This input has no more packets */
+			if (in->error) {
+				libtrace_err_t err = trace_get_err(in->trace);
+				trace_set_err(libtrace, err.err_num, "%s: %s",
+						in->uri, err.problem);
+				return -1;
+			}
+			continue;
+		}
+
+		in->next = (libtrace_packet_t *)packet;
+		in->nextts = trace_get_erf_timestamp(in->next);
+		MERGE_INFO->heap[MERGE_INFO->heapsize++] = in;
+		heap_sift_up(MERGE_INFO, MERGE_INFO->heapsize - 1);
+	}
+	return 1;
+}
+
+/* Moves the earliest packet into the caller's packet */
+static int merge_take_packet(libtrace_t *libtrace, libtrace_packet_t *packet) {
+	struct merge_input_t *in = heap_pop(MERGE_INFO);
+	libtrace_packet_t *src = in->next;
+	void *buffer;
+	size_t framing;
+
+	if (src->buf_control == TRACE_CTRL_PACKET) {
+		buffer = (packet->buf_control == TRACE_CTRL_PACKET) ?
+				packet->buffer : NULL;
+		packet->buffer = src->buffer;
+		packet->header = src->header;
+		packet->payload = src->payload;
+		src->buffer = buffer;
+		src->header = NULL;
+		src->payload = NULL;
+	} else {
+		/* The input's format owns the buffer and gets it back when
+		 * the reader reuses the packet */
+		if (packet->buf_control != TRACE_CTRL_PACKET ||
+				!packet->buffer) {
+			packet->buffer = malloc(LIBTRACE_PACKET_BUFSIZE);
+			if (!packet->buffer) {
+				trace_set_err(libtrace, ENOMEM,
+					"Unable to allocate packet buffer");
+				return -1;
+			}
+		}
+		framing = trace_get_framing_length(src);
+		memcpy(packet->buffer, src->header, framing);
+		packet->header = packet->buffer;
+		if (src->payload) {
+			packet->payload = (char *)packet->buffer + framing;
+			memcpy(packet->payload, src->payload,
+					trace_get_capture_length(src));
+		} else {
+			packet->payload = NULL;
+		}
+	}
+
+	packet->buf_control = TRACE_CTRL_PACKET;
+	packet->trace = src->trace;
+	packet->type = src->type;
+	packet->error = src->error;
+	trace_clear_cache(packet);
+
+	in->used[in->nb_used++] = src;
+	if (in->nb_used == MERGE_BATCH_SIZE)
+		merge_return_used(in);
+	in->next = NULL;
+	MERGE_INFO->pending[MERGE_INFO->nb_pending++] = in;
+	return packet->error;
+}
+
+static int merge_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet) {
+	if (merge_fill(libtrace, true) == -1)
+		return -1;
+	if (MERGE_INFO->heapsize == 0)
+		return 0;
+	return merge_take_packet(libtrace, packet);
+}
+
+static libtrace_eventobj_t trace_event_merge(libtrace_t *libtrace,
+		libtrace_packet_t *packet) {
+	libtrace_eventobj_t event = {0,0,0.0,0};
+	int ret;
+
+	do {
+		ret = merge_fill(libtrace, false);
+		if (ret == -1) {
+			event.type = TRACE_EVENT_TERMINATE;
+			break;
+		}
+		if (ret == 0) {
+			/* Still waiting on a packet from an input */
+			event.type = TRACE_EVENT_SLEEP;
+			event.seconds = 0.0001;
+			break;
+		}
+		if (MERGE_INFO->heapsize == 0) {
+			event.type = TRACE_EVENT_TERMINATE;
+			break;
+		}
+
+		if (merge_take_packet(libtrace, packet) < 0) {
+			event.type = TRACE_EVENT_TERMINATE;
+			break;
+		}
+		event.type = TRACE_EVENT_PACKET;
+		event.size = trace_get_capture_length(packet) +
+				trace_get_framing_length(packet);
+
+		if (libtrace->filter) {
+			if (!trace_apply_filter(libtrace->filter, packet)) {
+				trace_clear_cache(packet);
+				libtrace->filtered_packets ++;
+				continue;
+			}
+		}
+		if (libtrace->snaplen > 0)
+			trace_set_capture_length(packet, libtrace->snaplen);
+		libtrace->accepted_packets ++;
+		break;
+	} while (1);
+
+	return event;
+}
+
+static void merge_get_statistics(libtrace_t *libtrace, libtrace_stat_t *stat) {
+	libtrace_stat_t *instat;
+	int i;
+
+	/* Everything the inputs counted, filtering is done on the merged
+	 * packets so it is already counted against the merge */
+#define X(x) stat->x = 0; stat->x ##_valid = 1;
+	X(received) X(dropped) X(captured) X(missing) X(errors)
+#undef X
+	for (i = 0; i < MERGE_INFO->nb_inputs; i++) {
+		instat = trace_get_statistics(MERGE_INFO->inputs[i].trace,
+				NULL);
+#define X(x) if (instat->x ##_valid) stat->x += instat->x; \
+		else stat->x ##_valid = 0;
+		X(received) X(dropped) X(captured) X(missing) X(errors)
+#undef X
+	}
+}
+
+static void merge_help(void) {
+	printf("merge format module\n");
+	printf("Supported input URIs:\n");
+	printf("\tmerge:uri,uri,...\n");
+	printf("\n");
+	printf("\te.g.: merge:erf:link0.erf.gz,pcapfile:link1.pcap\n");
+	printf("\n");
+	printf("\tPackets from every input are returned in timestamp order.\n");
+	printf("\tThe URIs of the inputs cannot contain commas.\n");
+	printf("\n");
+}
+
+static struct libtrace_format_t merge = {
+	"merge",
+	"$Id$",
+	TRACE_FORMAT_MERGE,
+	NULL,				/* probe filename */
+	NULL,				/* probe magic */
+	merge_init_input,		/* init_input */
+	merge_config_input,		/* config_input */
+	merge_start_input,		/* start_input */
+	merge_pause_input,		/* pause_input */
+	NULL,				/* init_output */
+	NULL,				/* config_output */
+	NULL,				/* start_output */
+	merge_fin_input,		/* fin_input */
+	NULL,				/* fin_output */
+	merge_read_packet,		/* read_packet */
+	NULL,				/* prepare_packet */
+	NULL,				/* fin_packet */
+	NULL,				/* write_packet */
+	NULL,				/* write_packets */
+	NULL,				/* get_link_type */
+	NULL,				/* get_direction */
+	NULL,				/* set_direction */
+	NULL,				/* get_erf_timestamp */
+	NULL,				/* get_timeval */
+	NULL,				/* get_timespec */
+	NULL,				/* get_seconds */
+	NULL,				/* seek_erf */
+	NULL,				/* seek_timeval */
+	NULL,				/* seek_seconds */
+	NULL,				/* get_capture_length */
+	NULL,				/* get_wire_length */
+	NULL,				/* get_framing_length */
+	NULL,				/* set_capture_length */
+	NULL,				/* get_received_packets */
+	NULL,				/* get_filtered_packets */
+	NULL,				/* get_dropped_packets */
+	merge_get_statistics,		/* get_statistics */
+	NULL,				/* get_fd */
+	trace_event_merge,		/* trace_event */
+	merge_help,			/* help */
+	NULL,				/* next pointer */
+	NON_PARALLEL(false)
+};
+
+void merge_constructor(void) {
+	register_format(&merge);
+}
@@ -44,7 +44,11 @@
 #include <net/if.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <netdb.h>
+#if HAVE_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 #include "format_ndag.h"
 
@@ -55,6 +59,17 @@
 
 #define RECV_BATCH_SIZE (50)
 
+/* The encap buffers for a stream are one region, rounded up to a whole
+ * number of huge pages so it can be backed by them */
+#define NDAG_HUGEPAGE_SIZE (2 * 1024 * 1024)
+#define ENCAP_REGION_SIZE ((((ENCAP_BUFFERS * ENCAP_BUFSIZE) - 1) / \
+                NDAG_HUGEPAGE_SIZE + 1) * NDAG_HUGEPAGE_SIZE)
+
+/* How long a receiver waits for data before checking for messages (ms) */
+#define NDAG_WAIT_TIMEOUT (10)
+
+#define NDAG_EPOLL_EVENTS (64)
+
 #define FORMAT_DATA ((ndag_format_data_t *)libtrace->format_data)
 
 static struct libtrace_format_t ndag;
@@ -87,6 +102,8 @@ typedef struct streamsock {
         int nextwriteind;
         int savedsize[ENCAP_BUFFERS];
 	uint64_t nextts;
+        /* Position in the receiver's heap, -1 if no records are waiting */
+        int heapindex;
         uint32_t startidle;
         uint64_t recordcount;
 
@@ -113,8 +130,17 @@ typedef struct recvstream {
         uint64_t missing_records;
         uint64_t received_packets;
 
+#if HAVE_EPOLL_CREATE1
+        int epollfd;
+#else
 	fd_set allsocks;
 	int maxfd;
+#endif
+
+        /* Sources with records waiting, as a min-heap of indexes into
+         * sources ordered by the timestamp of their next record */
+        uint16_t *heap;
+        uint16_t heapsize;
 } recvstream_t;
 
 typedef struct ndag_format_data {
@@ -188,6 +214,7 @@ static int join_multicast_group(char *groupaddr, char *localiface,
         char pstr[16];
         struct group_req greq;
         int bufsize;
+        int optval;
 
         int sock;
 
@@ -230,6 +257,33 @@ static int join_multicast_group(char *groupaddr, char *localiface,
                 goto sockcreateover;
         }
 
+        /* Allow other sockets on this host to bind to the same port, e.g.
+         * other nDAG inputs for monitors that export on the same ports */
+        optval = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval,
+                                (socklen_t)sizeof(int)) < 0) {
+                fprintf(stderr,
+                        "Failed to set SO_REUSEADDR for multicast group %s:%s -- %s\n",
+                                groupaddr, portstr, strerror(errno));
+        }
+#ifdef SO_REUSEPORT
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval,
+                                (socklen_t)sizeof(int)) < 0) {
+                fprintf(stderr,
+                        "Failed to set SO_REUSEPORT for multicast group %s:%s -- %s\n",
+                                groupaddr, portstr, strerror(errno));
+        }
+#endif
+#ifdef IP_MULTICAST_ALL
+        /* Otherwise a socket bound to the port receives every group joined
+         * on it by any socket on this host */
+        if (gotten->ai_family == AF_INET) {
+                optval = 0;
+                setsockopt(sock, IPPROTO_IP, IP_MULTICAST_ALL, &optval,
+                                (socklen_t)sizeof(int));
+        }
+#endif
+
         if (bind(sock, (struct sockaddr *)gotten->ai_addr, gotten->ai_addrlen) < 0)
         {
                 fprintf(stderr,
@@ -487,8 +541,19 @@ static int ndag_start_threads(libtrace_t *libtrace, uint32_t maxthreads)
                 FORMAT_DATA->receivers[i].dropped_upstream = 0;
                 FORMAT_DATA->receivers[i].received_packets = 0;
                 FORMAT_DATA->receivers[i].missing_records = 0;
+                FORMAT_DATA->receivers[i].heap = NULL;
+                FORMAT_DATA->receivers[i].heapsize = 0;
+#if HAVE_EPOLL_CREATE1
+                FORMAT_DATA->receivers[i].epollfd = epoll_create1(0);
+                if (FORMAT_DATA->receivers[i].epollfd == -1) {
+                        trace_set_err(libtrace, errno,
+                                "Unable to create epoll fd for nDAG receiver");
+                        return -1;
+                }
+#else
 		FD_ZERO(&(FORMAT_DATA->receivers[i].allsocks));
 		FORMAT_DATA->receivers[i].maxfd = -1;
+#endif
 
                 libtrace_message_queue_init(&(FORMAT_DATA->receivers[i].mqueue),
                                 sizeof(ndag_internal_message_t));
@@ -519,17 +584,16 @@ static int ndag_pstart_input(libtrace_t *libtrace) {
 static void halt_ndag_receiver(recvstream_t *receiver) {
         int j, i;
         libtrace_message_queue_destroy(&(receiver->mqueue));
+#if HAVE_EPOLL_CREATE1
+        close(receiver->epollfd);
+#endif
 
         if (receiver->sources == NULL)
                 return;
         for (i = 0; i < receiver->sourcecount; i++) {
                 streamsock_t src = receiver->sources[i];
                 if (src.saved) {
-                        for (j = 0; j < ENCAP_BUFFERS; j++) {
-                                if (src.saved[j]) {
-                                        free(src.saved[j]);
-                                }
-                        }
+                        munmap(src.saved[0], ENCAP_REGION_SIZE);
                         free(src.saved);
                 }
 
@@ -552,6 +616,10 @@ static void halt_ndag_receiver(recvstream_t *receiver) {
         if (receiver->sources) {
                 free(receiver->sources);
         }
+
+        if (receiver->heap) {
+                free(receiver->heap);
+        }
 }
 
 static int ndag_pause_input(libtrace_t *libtrace) {
@@ -583,6 +651,118 @@ static int ndag_fin_input(libtrace_t *libtrace) {
         return 0;
 }
 
+static inline int readable_data(streamsock_t *ssock) {
+
+        if (ssock->sock == -1) {
+                return 0;
+        }
+        if (ssock->savedsize[ssock->nextreadind] == 0) {
+                return 0;
+        }
+        /*
+        if (ssock->nextread - ssock->saved[ssock->nextreadind] >=
+                        ssock->savedsize[ssock->nextreadind]) {
+                return 0;
+        }
+        */
+        return 1;
+
+
+}
+
+static inline void heap_set(recvstream_t *rt, int h, uint16_t srcind) {
+        rt->heap[h] = srcind;
+        rt->sources[srcind].heapindex = h;
+}
+
+static void heap_sift_up(recvstream_t *rt, int h) {
+        uint16_t srcind = rt->heap[h];
+        uint64_t ts = rt->sources[srcind].nextts;
+
+        while (h > 0) {
+                int parent = (h - 1) / 2;
+                if (rt->sources[rt->heap[parent]].nextts <= ts) {
+                        break;
+                }
+                heap_set(rt, h, rt->heap[parent]);
+                h = parent;
+        }
+        heap_set(rt, h, srcind);
+}
+
+static void heap_sift_down(recvstream_t *rt, int h) {
+        uint16_t srcind = rt->heap[h];
+        uint64_t ts = rt->sources[srcind].nextts;
+        int child;
+
+        while ((child = h * 2 + 1) < rt->heapsize) {
+                if (child + 1 < rt->heapsize &&
+                                rt->sources[rt->heap[child + 1]].nextts <
+                                rt->sources[rt->heap[child]].nextts) {
+                        child ++;
+                }
+                if (ts <= rt->sources[rt->heap[child]].nextts) {
+                        break;
+                }
+                heap_set(rt, h, rt->heap[child]);
+                h = child;
+        }
+        heap_set(rt, h, srcind);
+}
+
+/* Restores the heap order after the key at h has changed */
+static void heap_fix(recvstream_t *rt, int h) {
+        uint16_t srcind = rt->heap[h];
+
+        heap_sift_down(rt, h);
+        if (rt->sources[srcind].heapindex == h) {
+                heap_sift_up(rt, h);
+        }
+}
+
+static void heap_remove(recvstream_t *rt, streamsock_t *ssock) {
+        int h = ssock->heapindex;
+
+        if (h == -1) {
+                return;
+        }
+        ssock->heapindex = -1;
+        rt->heapsize --;
+        if (h == rt->heapsize) {
+                return;
+        }
+        heap_set(rt, h, rt->heap[rt->heapsize]);
+        heap_fix(rt, h);
+}
+
+static inline uint64_t next_record_ts(streamsock_t *ssock) {
+        dag_record_t *daghdr = (dag_record_t *)(ssock->nextread);
+        return bswap_le_to_host64(daghdr->ts);
+}
+
+/* Adds a source that has just received records to the heap */
+static void heap_add(recvstream_t *rt, streamsock_t *ssock) {
+
+        if (ssock->heapindex != -1 || !readable_data(ssock)) {
+                return;
+        }
+        ssock->nextts = next_record_ts(ssock);
+        heap_set(rt, rt->heapsize, (uint16_t)(ssock - rt->sources));
+        rt->heapsize ++;
+        heap_sift_up(rt, rt->heapsize - 1);
+}
+
+/* Reorders a source after a record has been read from it */
+static void heap_update(recvstream_t *rt, streamsock_t *ssock) {
+
+        if (!readable_data(ssock)) {
+                heap_remove(rt, ssock);
+                return;
+        }
+        ssock->nextts = next_record_ts(ssock);
+        heap_fix(rt, ssock->heapindex);
+}
+
 static int ndag_prepare_packet_stream(libtrace_t *libtrace,
                 recvstream_t *rt,
                 streamsock_t *ssock, libtrace_packet_t *packet,
@@ -642,7 +822,6 @@ static int ndag_prepare_packet_stream(libtrace_t *libtrace,
 		rlen = ntohs(erfptr->rlen);
 	}
         ssock->nextread += rlen;
-	ssock->nextts = 0;
 
 	assert(ssock->nextread - ssock->saved[nr] <= ssock->savedsize[nr]);
 
@@ -661,6 +840,8 @@ static int ndag_prepare_packet_stream(libtrace_t *libtrace,
                 ssock->nextreadind = nr;
         }
 
+        heap_update(rt, ssock);
+
         packet->order = erf_get_erf_timestamp(packet);
         packet->error = rlen;
         return rlen;
@@ -697,11 +878,50 @@ static ndag_monitor_t *add_new_knownmonitor(recvstream_t *rt, uint16_t monid) {
         return mon;
 }
 
+/* Allocates the encap buffers for a stream as a single region, which is
+ * backed by huge pages if any are available */
+static char *alloc_encap_region(void) {
+        void *region;
+
+#ifdef MAP_HUGETLB
+        region = mmap(NULL, ENCAP_REGION_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region != MAP_FAILED) {
+                return (char *)region;
+        }
+#endif
+        region = mmap(NULL, ENCAP_REGION_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) {
+                return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        /* Ask for transparent huge pages instead */
+        madvise(region, ENCAP_REGION_SIZE, MADV_HUGEPAGE);
+#endif
+        return (char *)region;
+}
+
+/* Stops receiving from a stream, any records already received from it are
+ * dropped */
+static void close_streamsock(recvstream_t *rt, streamsock_t *ssock) {
+#if !HAVE_EPOLL_CREATE1
+	FD_CLR(ssock->sock, &(rt->allsocks));
+#endif
+        heap_remove(rt, ssock);
+        close(ssock->sock);
+        ssock->sock = -1;
+}
+
 static int add_new_streamsock(recvstream_t *rt, streamsource_t src) {
 
         streamsock_t *ssock = NULL;
         ndag_monitor_t *mon = NULL;
+        char *region;
         int i;
+#if HAVE_EPOLL_CREATE1
+        struct epoll_event ev;
+#endif
 
         /* TODO consider replacing this with a list or vector so we can
          * easily remove sources that are no longer in use, rather than
@@ -710,9 +930,12 @@ static int add_new_streamsock(recvstream_t *rt, streamsource_t src) {
          */
         if (rt->sourcecount == 0) {
                 rt->sources = (streamsock_t *)malloc(sizeof(streamsock_t) * 10);
+                rt->heap = (uint16_t *)malloc(sizeof(uint16_t) * 10);
         } else if ((rt->sourcecount % 10) == 0) {
                 rt->sources = (streamsock_t *)realloc(rt->sources,
                         sizeof(streamsock_t) * (rt->sourcecount + 10));
+                rt->heap = (uint16_t *)realloc(rt->heap,
+                        sizeof(uint16_t) * (rt->sourcecount + 10));
         }
 
         ssock = &(rt->sources[rt->sourcecount]);
@@ -739,14 +962,23 @@ static int add_new_streamsock(recvstream_t *rt, streamsource_t src) {
         ssock->groupaddr = src.groupaddr;
         ssock->expectedseq = 0;
         ssock->monitorptr = mon;
+        region = alloc_encap_region();
+        if (region == NULL) {
+                fprintf(stderr, "Failed to allocate buffers for %s:%u -- %s\n",
+                                src.groupaddr, src.port, strerror(errno));
+                close(ssock->sock);
+                return -1;
+        }
+
         ssock->saved = (char **)malloc(sizeof(char *) * ENCAP_BUFFERS);
         ssock->bufavail = ENCAP_BUFFERS;
 	ssock->bufwaiting = 0;
         ssock->startidle = 0;
 	ssock->nextts = 0;
+        ssock->heapindex = -1;
 
         for (i = 0; i < ENCAP_BUFFERS; i++) {
-                ssock->saved[i] = (char *)malloc(ENCAP_BUFSIZE);
+                ssock->saved[i] = region + (i * ENCAP_BUFSIZE);
                 ssock->savedsize[i] = 0;
         }
 
@@ -769,11 +1001,22 @@ static int add_new_streamsock(recvstream_t *rt, streamsource_t src) {
         ssock->nextreadind = 0;
         ssock->nextwriteind = 0;
         ssock->recordcount = 0;
-        rt->sourcecount += 1;
+#if HAVE_EPOLL_CREATE1
+        ev.events = EPOLLIN;
+        ev.data.u32 = rt->sourcecount;
+        if (epoll_ctl(rt->epollfd, EPOLL_CTL_ADD, ssock->sock, &ev) < 0) {
+                fprintf(stderr, "Failed to add %s:%u to epoll set -- %s\n",
+                                src.groupaddr, src.port, strerror(errno));
+                close(ssock->sock);
+                ssock->sock = -1;
+        }
+#else
 	FD_SET(ssock->sock, &(rt->allsocks));
 	if (ssock->sock > rt->maxfd) {
 		rt->maxfd = ssock->sock;
 	}
+#endif
+        rt->sourcecount += 1;
 
         fprintf(stderr, "Added new stream %s:%u to thread %d\n",
                         ssock->groupaddr, ssock->port, rt->threadindex);
@@ -801,25 +1044,6 @@ static int receiver_read_messages(recvstream_t *rt) {
 
 }
 
-static inline int readable_data(streamsock_t *ssock) {
-
-        if (ssock->sock == -1) {
-                return 0;
-        }
-        if (ssock->savedsize[ssock->nextreadind] == 0) {
-                return 0;
-        }
-        /*
-        if (ssock->nextread - ssock->saved[ssock->nextreadind] >=
-                        ssock->savedsize[ssock->nextreadind]) {
-                return 0;
-        }
-        */
-        return 1;
-
-
-}
-
 static inline void reset_expected_seqs(recvstream_t *rt, ndag_monitor_t *mon) {
 
         int i;
@@ -880,9 +1104,7 @@ static int check_ndag_received(streamsock_t *ssock, int index,
         } else if (rectype != NDAG_PKT_ENCAPERF) {
                 fprintf(stderr, "Received invalid record on the channel for %s:%u.\n",
                                 ssock->groupaddr, ssock->port);
-		FD_CLR(ssock->sock, &(rt->allsocks));
-                close(ssock->sock);
-                ssock->sock = -1;
+		close_streamsock(rt, ssock);
                 return -1;
         }
 
@@ -986,9 +1208,7 @@ static int receive_from_single_socket(streamsock_t *ssock, struct timeval *tv,
                                         ssock->groupaddr,
                                         ssock->port);
 
-				FD_CLR(ssock->sock, &(rt->allsocks));
-                                close(ssock->sock);
-                                ssock->sock = -1;
+				close_streamsock(rt, ssock);
                         }
                 } else {
 
@@ -996,9 +1216,7 @@ static int receive_from_single_socket(streamsock_t *ssock, struct timeval *tv,
                                 "Error receiving encapsulated records from %s:%u -- %s \n",
                                 ssock->groupaddr, ssock->port,
                                 strerror(errno));
-			FD_CLR(ssock->sock, &(rt->allsocks));
-                        close(ssock->sock);
-                        ssock->sock = -1;
+			close_streamsock(rt, ssock);
                 }
                 return toret;
         }
@@ -1029,39 +1247,72 @@ static int receive_from_single_socket(streamsock_t *ssock, struct timeval *tv,
         return toret;
 }
 
-static int receive_from_sockets(recvstream_t *rt) {
+/* Receives from every socket with data waiting, waiting up to timeout
+ * milliseconds if no records have been received yet. Returns the number of
+ * sources with records ready to be read. */
+static int receive_from_sockets(recvstream_t *rt, int timeout) {
 
-        int i, readybufs, gottime;
+        int i, gottime, nfds;
         struct timeval tv;
+#if HAVE_EPOLL_CREATE1
+        struct epoll_event events[NDAG_EPOLL_EVENTS];
+#else
 	fd_set fds;
-	struct timeval zerotv;
+	struct timeval waittv;
+#endif
 
-        readybufs = 0;
         gottime = 0;
 
+        /* Don't wait if we already have something to return */
+        if (rt->heapsize > 0) {
+                timeout = 0;
+        }
+
+#if HAVE_EPOLL_CREATE1
+        nfds = epoll_wait(rt->epollfd, events, NDAG_EPOLL_EVENTS, timeout);
+        if (nfds == -1) {
+                if (errno == EINTR) {
+                        return rt->heapsize;
+                }
+                return -1;
+        }
+
+        for (i = 0; i < nfds; i++) {
+                streamsock_t *ssock = &(rt->sources[events[i].data.u32]);
+
+                receive_from_single_socket(ssock, &tv, &gottime, rt);
+                heap_add(rt, ssock);
+        }
+#else
 	fds = rt->allsocks;
 
 	if (rt->maxfd == -1) {
 		return 0;
 	}
 
-	zerotv.tv_sec = 0;
-	zerotv.tv_usec = 0;
+	waittv.tv_sec = timeout / 1000;
+	waittv.tv_usec = (timeout % 1000) * 1000;
 
-	if (select(rt->maxfd + 1, &fds, NULL, NULL, &zerotv) == -1) {
-		/* log the error? XXX */
+	nfds = select(rt->maxfd + 1, &fds, NULL, NULL, &waittv);
+	if (nfds == -1) {
+		if (errno == EINTR) {
+			return rt->heapsize;
+		}
 		return -1;
 	}
 
-	for (i = 0; i < rt->sourcecount; i++) {
-		if (!FD_ISSET(rt->sources[i].sock, &fds)) {
+	for (i = 0; nfds > 0 && i < rt->sourcecount; i++) {
+		streamsock_t *ssock = &(rt->sources[i]);
+
+		if (ssock->sock == -1 || !FD_ISSET(ssock->sock, &fds)) {
 			continue;
 		}
-                readybufs += receive_from_single_socket(&(rt->sources[i]),
-                                &tv, &gottime, rt);
+                receive_from_single_socket(ssock, &tv, &gottime, rt);
+                heap_add(rt, ssock);
         }
+#endif
 
-        return readybufs;
+        return rt->heapsize;
 
 }
 
@@ -1097,7 +1348,8 @@ static int receive_encap_records_block(libtrace_t *libtrace, recvstream_t *rt,
                         continue;
                 }
 
-                if ((iserr = receive_from_sockets(rt)) < 0) {
+                if ((iserr = receive_from_sockets(rt,
+                                NDAG_WAIT_TIMEOUT)) < 0) {
                         return iserr;
                 } else if (iserr > 0) {
                         /* At least one of our input sockets has available
@@ -1105,13 +1357,6 @@ static int receive_encap_records_block(libtrace_t *libtrace, recvstream_t *rt,
                         break;
                 }
 
-                /* None of our sources have anything available, we can take
-                 * a short break rather than immediately trying again.
-                 */
-                if (iserr == 0) {
-                        usleep(100);
-                }
-
         } while (1);
 
         return iserr;
@@ -1137,46 +1382,16 @@ static int receive_encap_records_nonblock(libtrace_t *libtrace, recvstream_t *rt
                 return 0;
         }
 
-        return receive_from_sockets(rt);
+        return receive_from_sockets(rt, 0);
 }
 
-static streamsock_t *select_next_packet(recvstream_t *rt) {
-        int i;
-        streamsock_t *ssock = NULL;
-        uint64_t earliest = 0;
-        uint64_t currentts = 0;
-        dag_record_t *daghdr;
-
-	/* If we only have one source, then no need to do any
-         * timestamp parsing or byteswapping.
-	 */
-	if (rt->sourcecount == 1) {
-		if (readable_data(&(rt->sources[0]))) {
-			return &(rt->sources[0]);
-		}
-		return NULL;
-	}
-
-
-        for (i = 0; i < rt->sourcecount; i ++) {
-                if (!readable_data(&(rt->sources[i]))) {
-                        continue;
-                }
+/* Finds the source whose next record is the earliest */
+static inline streamsock_t *select_next_packet(recvstream_t *rt) {
 
-		if (rt->sources[i].nextts == 0) {
-               		daghdr = (dag_record_t *)(rt->sources[i].nextread);
-	                currentts = bswap_le_to_host64(daghdr->ts);
-			rt->sources[i].nextts = currentts;
-		} else {
-			currentts = rt->sources[i].nextts;
-		}
-
-                if (earliest == 0 || earliest > currentts) {
-                        earliest = currentts;
-                        ssock = &(rt->sources[i]);
-                }
+        if (rt->heapsize == 0) {
+                return NULL;
         }
-        return ssock;
+        return &(rt->sources[rt->heap[0]]);
 }
 
 static int ndag_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet) {
@@ -1222,6 +1437,15 @@ static int ndag_pread_packets(libtrace_t *libtrace, libtrace_thread_t *t,
                 if (read_packets == 0) {
                         rem = receive_encap_records_block(libtrace, rt,
                                 packets[read_packets]);
+                } else if (rt->heapsize > 0) {
+                        /* Use up the records we already have before
+                         * polling the sockets again */
+                        if (packets[read_packets]->buf_control ==
+                                        TRACE_CTRL_PACKET) {
+                                free(packets[read_packets]->buffer);
+                                packets[read_packets]->buffer = NULL;
+                        }
+                        rem = rt->heapsize;
                 } else {
                         rem = receive_encap_records_nonblock(libtrace, rt,
                                 packets[read_packets]);
@@ -1422,6 +1646,7 @@ static struct libtrace_format_t ndag = {
         ndag_prepare_packet,    /* prepare_packet */
         NULL,                   /* fin_packet */
         NULL,                   /* write_packet */
+        NULL,                   /* write_packets */
         erf_get_link_type,      /* get_link_type */
         erf_get_direction,      /* get_direction */
         erf_set_direction,      /* set_direction */
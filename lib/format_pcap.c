@@ -778,6 +778,7 @@ static struct libtrace_format_t pcap = {
 	pcap_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	pcap_write_packet,		/* write_packet */
+	NULL,				/* write_packets */
 	pcap_get_link_type,		/* get_link_type */
 	pcapint_get_direction,		/* get_direction */
 	pcap_set_direction,		/* set_direction */
@@ -822,6 +823,7 @@ static struct libtrace_format_t pcapint = {
 	pcap_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	pcapint_write_packet,		/* write_packet */
+	NULL,				/* write_packets */
 	pcap_get_link_type,		/* get_link_type */
 	pcapint_get_direction,		/* get_direction */
 	pcap_set_direction,		/* set_direction */
@@ -28,6 +28,8 @@
 #include "libtrace.h"
 #include "libtrace_int.h"
 #include "format_helper.h"
+#include "parallel_compress.h"
+#include "trace_index.h"
 
 #include <sys/stat.h>
 #include <assert.h>
@@ -93,6 +95,9 @@ struct pcapfile_format_data_t {
 	pcapfile_header_t header;
 	/* Indicates whether the input trace is started */
 	bool started;
+	/* The timestamp index for seeking, loaded by the first seek */
+	libtrace_index_t *index;
+	bool index_loaded;
 };
 
 struct pcapfile_format_data_out_t {
@@ -100,7 +105,8 @@ struct pcapfile_format_data_out_t {
 	int compress_type;
 	int level;
 	int flag;
-
+	/* Coalesces the records written by pcapfile_write_packets */
+	libtrace_write_buffer_t wbuf;
 };
 
 static int pcapfile_probe_magic(io_t *io)
@@ -132,6 +138,8 @@ static int pcapfile_init_input(libtrace_t *libtrace) {
 
 	IN_OPTIONS.real_time = 0;
 	DATA(libtrace)->started = false;
+	DATA(libtrace)->index = NULL;
+	DATA(libtrace)->index_loaded = false;
 	return 0;
 }
 
@@ -143,6 +151,8 @@ static int pcapfile_init_output(libtrace_out_t *libtrace) {
 	DATAOUT(libtrace)->compress_type=TRACE_OPTION_COMPRESSTYPE_NONE;
 	DATAOUT(libtrace)->level=0;
 	DATAOUT(libtrace)->flag=O_CREAT|O_WRONLY;
+	DATAOUT(libtrace)->wbuf.buf=NULL;
+	DATAOUT(libtrace)->wbuf.used=0;
 
 	return 0;
 }
@@ -256,6 +266,7 @@ static int pcapfile_config_input(libtrace_t *libtrace,
 		case TRACE_OPTION_PROMISC:
 		case TRACE_OPTION_FILTER:
 		case TRACE_OPTION_HASHER:
+		case TRACE_OPTION_REPLAY_SPEEDUP:
 			/* All these are either unsupported or handled
 			 * by trace_config */
 			break;
@@ -270,6 +281,7 @@ static int pcapfile_fin_input(libtrace_t *libtrace)
 {
 	if (libtrace->io)
 		wandio_destroy(libtrace->io);
+	trace_index_destroy(DATA(libtrace)->index);
 	free(libtrace->format_data);
 	return 0; /* success */
 }
@@ -278,6 +290,7 @@ static int pcapfile_fin_output(libtrace_out_t *libtrace)
 {
 	if (DATAOUT(libtrace)->file)
 		wandio_wdestroy(DATAOUT(libtrace)->file);
+	trace_buffer_free(&DATAOUT(libtrace)->wbuf);
 	free(libtrace->format_data);
 	libtrace->format_data=NULL;
 	return 0; /* success */
@@ -415,8 +428,9 @@ static int pcapfile_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet)
 	return sizeof(libtrace_pcapfile_pkt_hdr_t) + bytes_to_read;
 }
 
-static int pcapfile_write_packet(libtrace_out_t *out,
-		libtrace_packet_t *packet)
+/* Writes a single packet, via the write buffer if wbuf is not NULL */
+static int pcapfile_write_one(libtrace_out_t *out,
+		libtrace_packet_t *packet, libtrace_write_buffer_t *wbuf)
 {
 	struct libtrace_pcapfile_pkt_hdr_t hdr;
 	struct timeval tv = trace_get_timeval(packet);
@@ -475,7 +489,7 @@ static int pcapfile_write_packet(libtrace_out_t *out,
 		pcaphdr.network = 
 			libtrace_to_pcap_linktype(linktype);
 
-		wandio_wwrite(DATAOUT(out)->file, 
+		trace_buffer_write(DATAOUT(out)->file, wbuf,
 				&pcaphdr, sizeof(pcaphdr));
 	}
 
@@ -515,14 +529,16 @@ static int pcapfile_write_packet(libtrace_out_t *out,
 		hdr.caplen = hdr.wirelen;
 
 	/* Write the packet header */
-	numbytes=wandio_wwrite(DATAOUT(out)->file,
+	trace_buffer_mark(DATAOUT(out)->file, wbuf,
+			trace_get_erf_timestamp(packet));
+	numbytes=trace_buffer_write(DATAOUT(out)->file, wbuf,
 			&hdr, sizeof(hdr));
 
 	if (numbytes!=sizeof(hdr)) 
 		return -1;
 
 	/* Write the rest of the packet now */
-	ret=wandio_wwrite(DATAOUT(out)->file,
+	ret=trace_buffer_write(DATAOUT(out)->file, wbuf,
 			ptr,
 			hdr.caplen);
 
@@ -532,6 +548,38 @@ static int pcapfile_write_packet(libtrace_out_t *out,
 	return numbytes+ret;
 }
 
+static int pcapfile_write_packet(libtrace_out_t *out,
+		libtrace_packet_t *packet)
+{
+	return pcapfile_write_one(out, packet, NULL);
+}
+
+static int pcapfile_write_packets(libtrace_out_t *out,
+		libtrace_packet_t *packets[], size_t nb_packets)
+{
+	size_t i;
+	int ret, total = 0;
+
+	/* Gather the records together and write them out in one go */
+	for (i = 0; i < nb_packets; i++) {
+		ret = pcapfile_write_one(out, packets[i], &DATAOUT(out)->wbuf);
+		if (ret < 0) {
+			/* Still write out the packets before this one */
+			if (DATAOUT(out)->file)
+				trace_buffer_flush(DATAOUT(out)->file,
+						&DATAOUT(out)->wbuf);
+			return -1;
+		}
+		total += ret;
+	}
+	if (DATAOUT(out)->file && trace_buffer_flush(DATAOUT(out)->file,
+				&DATAOUT(out)->wbuf) < 0) {
+		trace_set_err_out(out, errno, "Unable to write to file");
+		return -1;
+	}
+	return total;
+}
+
 static libtrace_linktype_t pcapfile_get_link_type(
 		const libtrace_packet_t *packet) 
 {
@@ -581,6 +629,72 @@ static struct timespec pcapfile_get_timespec(
 	return ts;
 }
 
+/* Seeks to an offset in the file. Compressed files can often only seek
+ * forwards, so to go backwards the file is opened again. */
+static int pcapfile_seek_offset(libtrace_t *libtrace, int64_t off)
+{
+	if (wandio_seek(libtrace->io, off, SEEK_SET) == off)
+		return 0;
+
+	if (off < wandio_tell(libtrace->io)) {
+		wandio_destroy(libtrace->io);
+		libtrace->io = trace_open_file(libtrace);
+		if (!libtrace->io)
+			return -1;
+		if (wandio_seek(libtrace->io, off, SEEK_SET) == off)
+			return 0;
+	}
+	trace_set_err(libtrace, TRACE_ERR_OPTION_UNAVAIL,
+			"Unable to seek in %s", libtrace->uridata);
+	return -1;
+}
+
+/* Seeks to the first packet that isn't before erfts. Reading forward starts
+ * from the closest record in the chunk index of a compressed file or in the
+ * .idx index beside the trace, or from the first packet if neither has one */
+static int pcapfile_seek_erf(libtrace_t *libtrace, uint64_t erfts)
+{
+	libtrace_packet_t *packet;
+	int64_t off;
+	int ret;
+
+	if (!libtrace->io) {
+		trace_set_err(libtrace, TRACE_ERR_BAD_STATE,
+				"Trace must be started before seeking");
+		return -1;
+	}
+
+	/* Start from the closest record either index knows of */
+	off = pcompress_seek_timestamp(libtrace->io, erfts);
+	if (!DATA(libtrace)->index_loaded) {
+		DATA(libtrace)->index = trace_index_load(libtrace->uridata);
+		DATA(libtrace)->index_loaded = true;
+	}
+	if (DATA(libtrace)->index) {
+		uint64_t idxoff = trace_index_find(DATA(libtrace)->index, erfts);
+		if ((int64_t)idxoff > off)
+			off = idxoff;
+	}
+	if (off < (int64_t)sizeof(pcapfile_header_t))
+		off = sizeof(pcapfile_header_t);
+	if (pcapfile_seek_offset(libtrace, off) < 0)
+		return -1;
+
+	packet = trace_create_packet();
+	for (;;) {
+		if ((ret = trace_read_packet(libtrace, packet)) <= 0)
+			break;
+		if (trace_get_erf_timestamp(packet) >= erfts)
+			break;
+		off = wandio_tell(libtrace->io);
+	}
+	trace_destroy_packet(packet);
+
+	if (ret < 0)
+		return -1;
+
+	return pcapfile_seek_offset(libtrace, off);
+}
 
 static int pcapfile_get_capture_length(const libtrace_packet_t *packet) {
 	libtrace_pcapfile_pkt_hdr_t *pcapptr; 
@@ -694,6 +808,7 @@ static struct libtrace_format_t pcapfile = {
 	pcapfile_prepare_packet,	/* prepare_packet */
 	NULL,				/* fin_packet */
 	pcapfile_write_packet,		/* write_packet */
+	pcapfile_write_packets,		/* write_packets */
 	pcapfile_get_link_type,		/* get_link_type */
 	pcapfile_get_direction,		/* get_direction */
 	NULL,				/* set_direction */
@@ -701,7 +816,7 @@ static struct libtrace_format_t pcapfile = {
 	pcapfile_get_timeval,		/* get_timeval */
 	pcapfile_get_timespec,		/* get_timespec */
 	NULL,				/* get_seconds */
-	NULL,				/* seek_erf */
+	pcapfile_seek_erf,		/* seek_erf */
 	NULL,				/* seek_timeval */
 	NULL,				/* seek_seconds */
 	pcapfile_get_capture_length,	/* get_capture_length */
@@ -28,6 +28,7 @@
 #include "libtrace.h"
 #include "libtrace_int.h"
 #include "format_helper.h"
+#include "trace_index.h"
 
 #include <sys/stat.h>
 #include <assert.h>
@@ -160,6 +161,10 @@ struct pcapng_format_data_t {
         pcapng_interface_t **interfaces;
         uint16_t allocatedinterfaces;
         uint16_t nextintid;
+
+        /* The timestamp index for seeking, loaded by the first seek */
+        libtrace_index_t *index;
+        bool index_loaded;
 };
 
 struct pcapng_optheader {
@@ -227,6 +232,8 @@ static int pcapng_init_input(libtrace_t *libtrace) {
                         sizeof(pcapng_interface_t));
         DATA(libtrace)->allocatedinterfaces = 10;
         DATA(libtrace)->nextintid = 0;
+        DATA(libtrace)->index = NULL;
+        DATA(libtrace)->index_loaded = false;
 
         return 0;
 }
@@ -259,6 +266,7 @@ static int pcapng_config_input(libtrace_t *libtrace, trace_option_t option,
                 case TRACE_OPTION_PROMISC:
                 case TRACE_OPTION_FILTER:
                 case TRACE_OPTION_HASHER:
+                case TRACE_OPTION_REPLAY_SPEEDUP:
                         break;
         }
 
@@ -276,6 +284,7 @@ static int pcapng_fin_input(libtrace_t *libtrace) {
         }
 
         free(DATA(libtrace)->interfaces);
+        trace_index_destroy(DATA(libtrace)->index);
 
         if (libtrace->io) {
                 wandio_destroy(libtrace->io);
@@ -514,6 +523,7 @@ static int pcapng_read_interface(libtrace_t *libtrace,
         uint16_t optcode, optlen;
         char *optval = NULL;
         char *bodyptr = NULL;
+        char *optend;
 
         err = wandio_read(libtrace->io, packet->buffer, sizeof(pcapng_int_t));
 
@@ -584,7 +594,10 @@ static int pcapng_read_interface(libtrace_t *libtrace,
                 return -1;
         }
 
-        do {
+        /* The options stop before the trailing block length, and an
+         * interface may have none at all */
+        optend = bodyptr + to_read - sizeof(uint32_t);
+        while (bodyptr + sizeof(struct pcapng_optheader) <= optend) {
                 optval = pcapng_parse_next_option(libtrace, &bodyptr,
                                 &optcode, &optlen);
                 if (optval == NULL) {
@@ -593,6 +606,9 @@ static int pcapng_read_interface(libtrace_t *libtrace,
                         return -1;
                 }
 
+                if (optcode == 0)
+                        break;
+
                 if (optcode == PCAPNG_IFOPT_TSRESOL) {
                         uint8_t *resol = (uint8_t *)optval;
 
@@ -603,8 +619,7 @@ static int pcapng_read_interface(libtrace_t *libtrace,
                                 newint->tsresol = pow(10, *resol & 0x7f);
                         }
                 }
-
-        } while (optcode != 0);
+        }
 
         return 1;
 
@@ -1124,6 +1139,136 @@ static int pcapng_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet)
 
 }
 
+/* Reopens the trace so that reading starts again from the section header,
+ * forgetting the interfaces that will be read again */
+static int pcapng_rewind(libtrace_t *libtrace) {
+
+        int i;
+
+        for (i = 0; i < DATA(libtrace)->nextintid; i++) {
+                free(DATA(libtrace)->interfaces[i]);
+                DATA(libtrace)->interfaces[i] = NULL;
+        }
+        DATA(libtrace)->nextintid = 0;
+        DATA(libtrace)->byteswapped = true;
+
+        wandio_destroy(libtrace->io);
+        libtrace->io = trace_open_file(libtrace);
+        if (!libtrace->io)
+                return -1;
+        return 0;
+}
+
+/* Reads the section, interface and other blocks at the start of the trace,
+ * stopping before the first packet block. The packet blocks that an index
+ * points at can then be read */
+static int pcapng_read_leading_blocks(libtrace_t *libtrace) {
+
+        struct pcapng_peeker peeker;
+        libtrace_packet_t *packet;
+        uint32_t btype;
+        int ret;
+
+        packet = trace_create_packet();
+        for (;;) {
+                ret = wandio_peek(libtrace->io, &peeker, sizeof(peeker));
+                if (ret < (int)sizeof(peeker)) {
+                        ret = -1;
+                        break;
+                }
+                if (DATA(libtrace)->byteswapped)
+                        btype = byteswap32(peeker.blocktype);
+                else
+                        btype = peeker.blocktype;
+                if (btype == PCAPNG_ENHANCED_PACKET_TYPE ||
+                                btype == PCAPNG_SIMPLE_PACKET_TYPE ||
+                                btype == PCAPNG_OLD_PACKET_TYPE) {
+                        ret = 0;
+                        break;
+                }
+                if (trace_read_packet(libtrace, packet) <= 0) {
+                        ret = -1;
+                        break;
+                }
+        }
+        trace_destroy_packet(packet);
+        return ret;
+}
+
+/* Reads forward from the current position to the first packet that isn't
+ * before erfts, meta records passed on the way are not read again */
+static int pcapng_seek_forward(libtrace_t *libtrace, uint64_t erfts) {
+
+        libtrace_packet_t *packet;
+        int64_t off = wandio_tell(libtrace->io);
+        int ret;
+
+        packet = trace_create_packet();
+        for (;;) {
+                if ((ret = trace_read_packet(libtrace, packet)) <= 0)
+                        break;
+                if (!IS_LIBTRACE_META_PACKET(packet) &&
+                                trace_get_erf_timestamp(packet) >= erfts)
+                        break;
+                off = wandio_tell(libtrace->io);
+        }
+        trace_destroy_packet(packet);
+
+        if (ret < 0)
+                return -1;
+        if (wandio_seek(libtrace->io, off, SEEK_SET) != off) {
+                trace_set_err(libtrace, TRACE_ERR_OPTION_UNAVAIL,
+                                "Unable to seek in %s", libtrace->uridata);
+                return -1;
+        }
+        return 0;
+}
+
+static int pcapng_seek_erf(libtrace_t *libtrace, uint64_t erfts) {
+
+        uint64_t target = 0;
+        int ret = 0;
+
+        if (!libtrace->io) {
+                trace_set_err(libtrace, TRACE_ERR_BAD_STATE,
+                                "Trace must be started before seeking");
+                return -1;
+        }
+
+        if (!DATA(libtrace)->index_loaded) {
+                DATA(libtrace)->index = trace_index_load(libtrace->uridata);
+                DATA(libtrace)->index_loaded = true;
+        }
+        if (DATA(libtrace)->index) {
+                target = trace_index_find(DATA(libtrace)->index, erfts);
+        }
+
+        if (target > 0) {
+                /* The index only points at packet blocks, so the section
+                 * and interface blocks before them must be read first.
+                 * Seeking backwards would read interface blocks we have
+                 * already seen again, so forget them and start over. */
+                if (DATA(libtrace)->nextintid == 0 ||
+                                (int64_t)target < wandio_tell(libtrace->io)) {
+                        if (pcapng_rewind(libtrace) < 0)
+                                return -1;
+                        ret = pcapng_read_leading_blocks(libtrace);
+                }
+                if (ret >= 0 && wandio_seek(libtrace->io, target, SEEK_SET)
+                                == (int64_t)target &&
+                                pcapng_seek_forward(libtrace, erfts) == 0)
+                        return 0;
+
+                /* Interfaces described between the two points were
+                 * skipped, so start again from the beginning */
+                trace_get_err(libtrace);
+        }
+
+        if (pcapng_rewind(libtrace) < 0)
+                return -1;
+        return pcapng_seek_forward(libtrace, erfts);
+}
+
 static libtrace_linktype_t pcapng_get_link_type(const libtrace_packet_t *packet)
 {
 
@@ -1193,7 +1338,7 @@ static struct timespec pcapng_get_timespec(const libtrace_packet_t *packet) {
         }
 
         ts.tv_sec = (timestamp / interface->tsresol);
-        ts.tv_nsec = (uint64_t)(timestamp - (ts.tv_sec * interface->tsresol)) / interface->tsresol * 1000000000;
+        ts.tv_nsec = (uint64_t)(timestamp - (ts.tv_sec * interface->tsresol)) * 1000000000 / interface->tsresol;
 
         return ts;
 
@@ -1467,6 +1612,7 @@ static struct libtrace_format_t pcapng = {
         pcapng_prepare_packet,          /* prepare_packet */
         NULL,                           /* fin_packet */
         NULL,                           /* write_packet */
+        NULL,                           /* write_packets */
         pcapng_get_link_type,           /* get_link_type */
         pcapng_get_direction,           /* get_direction */
         NULL,                           /* set_direction */
@@ -1474,7 +1620,7 @@ static struct libtrace_format_t pcapng = {
         NULL,                           /* get_timeval */
         pcapng_get_timespec,            /* get_timespec */
         NULL,                           /* get_seconds */
-        NULL,                           /* seek_erf */
+        pcapng_seek_erf,                /* seek_erf */
         NULL,                           /* seek_timeval */
         NULL,                           /* seek_seconds */
         pcapng_get_capture_length,      /* get_capture_length */
@@ -34,6 +34,7 @@
 #include "rt_protocol.h"
 
 #include "data-struct/buckets.h"
+#include "data-struct/ring_buffer.h"
 
 #include <sys/stat.h>
 #include <assert.h>
@@ -46,6 +47,7 @@
 
 #ifndef WIN32
 # include <netdb.h>
+# include <poll.h>
 #endif
 
 #define RT_INFO ((struct rt_format_data_t*)libtrace->format_data)
@@ -73,6 +75,24 @@ static const char *rt_deny_reason(enum rt_conn_denied_t reason)
 }
 
 
+/* Records are received straight into large buffers, so that a single recv()
+ * can pick up many packets. A record is never split across two buffers: once
+ * there is less than RT_MAX_RECORD left in a buffer, only the rest of the
+ * record being received is read into it and the next record starts a new
+ * buffer. Nothing ever has to be copied out of a full buffer.
+ */
+#define RT_BUF_SIZE (LIBTRACE_PACKET_BUFSIZE * 16)
+
+/* The largest possible record, as the length field is 16 bits */
+#define RT_MAX_RECORD (sizeof(rt_header_t) + 0xffff)
+
+/* The number of receive buffers kept for reuse once the packets in them
+ * have been released */
+#define RT_BUF_COUNT 8
+
+/* The size of the socket receive buffer we ask for */
+#define RT_SOCKET_BUF_SIZE (4 * 1024 * 1024)
+
 struct rt_format_data_t {
 	/* Name of the host to connect to */
 	char *hostname;
@@ -82,6 +102,9 @@ struct rt_format_data_t {
 	char *buf_read;
 	/* Pointer to the next unused byte in the buffer */
 	char *buf_write;
+	/* Pointer to the first record in the buffer that has not been
+	 * completely received yet */
+	char *buf_frame;
 	/* The port to connect to */
 	int port;
 	/* The file descriptor for the RT connection */
@@ -103,6 +126,16 @@ struct rt_format_data_t {
         /* Bucket structure for storing read packets until the user is
          * done with them. */
         libtrace_bucket_t *bucket;
+
+        /* Receive buffers that no packets refer to any more, ready to be
+         * reused */
+        libtrace_ringbuffer_t free_buffers;
+
+        /* Held by the perpkt thread reading from the socket */
+        pthread_mutex_t read_lock;
+
+        /* Set once the server has told us there is no more data */
+        bool end_data;
 };
 
 /* Connects to an RT server 
@@ -116,6 +149,7 @@ static int rt_connect(libtrace_t *libtrace) {
 	rt_deny_conn_t deny_hdr;	
 	rt_hello_t hello_opts;
 	uint8_t reason;
+	int bufsize;
 	
 	if ((he=gethostbyname(RT_INFO->hostname)) == NULL) {
                 trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
@@ -134,6 +168,12 @@ static int rt_connect(libtrace_t *libtrace) {
         remote.sin_port = htons(RT_INFO->port);
         remote.sin_addr = *((struct in_addr *)he->h_addr);
 
+        /* A large socket buffer lets the server keep sending while we
+         * are busy with packets. Not being able to get one is not fatal. */
+        bufsize = RT_SOCKET_BUF_SIZE;
+        setsockopt(RT_INFO->input_fd, SOL_SOCKET, SO_RCVBUF, &bufsize,
+                        sizeof(bufsize));
+
         if (connect(RT_INFO->input_fd, (struct sockaddr *)&remote,
                                 (socklen_t)sizeof(struct sockaddr)) == -1) {
                 trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
@@ -206,6 +246,15 @@ static int rt_connect(libtrace_t *libtrace) {
         return -1;
 }
 
+/* Called by the bucket once no packets refer to a buffer */
+static void rt_release_buffer(void *buffer, void *data) {
+	libtrace_ringbuffer_t *free_buffers = (libtrace_ringbuffer_t *)data;
+
+	/* Only keep as many buffers as the ring holds */
+	if (!libtrace_ringbuffer_try_swrite(free_buffers, buffer))
+		free(buffer);
+}
+
 static void rt_init_format_data(libtrace_t *libtrace) {
         libtrace->format_data = malloc(sizeof(struct rt_format_data_t));
 
@@ -218,11 +267,18 @@ static void rt_init_format_data(libtrace_t *libtrace) {
 	RT_INFO->pkt_buffer = NULL;
 	RT_INFO->buf_read = NULL;
 	RT_INFO->buf_write = NULL;
+	RT_INFO->buf_frame = NULL;
 	RT_INFO->hostname = NULL;
 	RT_INFO->port = 0;
 	RT_INFO->unacked = 0;
+	RT_INFO->end_data = false;
 
         RT_INFO->bucket = libtrace_bucket_init();
+        libtrace_ringbuffer_init(&RT_INFO->free_buffers, RT_BUF_COUNT,
+                        LIBTRACE_RINGBUFFER_POLLING);
+        libtrace_bucket_set_release(RT_INFO->bucket, rt_release_buffer,
+                        &RT_INFO->free_buffers);
+        ASSERT_RET(pthread_mutex_init(&RT_INFO->read_lock, NULL), == 0);
 }
 
 static int rt_init_input(libtrace_t *libtrace) {
@@ -269,6 +325,7 @@ static int rt_start_input(libtrace_t *libtrace) {
 
 	if (rt_connect(libtrace) == -1)
 		return -1;
+	RT_INFO->end_data = false;
 	
 	/* Need to send start message to server */
 	if (send(RT_INFO->input_fd, (void*)&start_msg, sizeof(rt_header_t) +
@@ -299,6 +356,8 @@ static int rt_pause_input(libtrace_t *libtrace) {
 }
 
 static int rt_fin_input(libtrace_t *libtrace) {
+	void *buffer;
+
 	/* Make sure we clean up any dummy traces that we have been using */
 
 	if (RT_INFO->dummy_duck)
@@ -321,6 +380,13 @@ static int rt_fin_input(libtrace_t *libtrace) {
 
         if (RT_INFO->bucket)
                 libtrace_bucket_destroy(RT_INFO->bucket);
+
+        /* Every buffer has been released by now, free the ones kept for
+         * reuse */
+        while (libtrace_ringbuffer_try_read(&RT_INFO->free_buffers, &buffer))
+                free(buffer);
+        libtrace_ringbuffer_destroy(&RT_INFO->free_buffers);
+        ASSERT_RET(pthread_mutex_destroy(&RT_INFO->read_lock), == 0);
 	free(libtrace->format_data);
         return 0;
 }
@@ -465,18 +531,6 @@ static int rt_set_format(libtrace_t *libtrace, libtrace_packet_t *packet)
 }		
 
 
-/* I've upped this to 10K to deal with jumbo-grams that have not been snapped
- * in any way. This means we have a much larger memory overhead per packet
- * (which won't be used in the vast majority of cases), so we may want to think
- * about doing something smarter, e.g. allocate a smaller block of memory and
- * only increase it as required.
- *
- * XXX Capturing off int: can still lead to packets that are larger than 10K,
- * in instances where the fragmentation is done magically by the NIC. This
- * is pretty nasty, but also very rare.
- */
-#define RT_BUF_SIZE (LIBTRACE_PACKET_BUFSIZE * 2)
-
 static int rt_process_data_packet(libtrace_t *libtrace,
                 libtrace_packet_t *packet) {
 
@@ -509,16 +563,47 @@ static int rt_process_data_packet(libtrace_t *libtrace,
 
 }
 
-/* Receives data from an RT server */
-static int rt_read(libtrace_t *libtrace, int block) {
-        int numbytes;
+/* Starts receiving into an empty buffer, reusing an old one if possible */
+static int rt_new_buffer(libtrace_t *libtrace) {
+	void *buffer;
 
-	if (!RT_INFO->pkt_buffer) {
-		RT_INFO->pkt_buffer = (char*)malloc((size_t)RT_BUF_SIZE);
-		RT_INFO->buf_write = RT_INFO->pkt_buffer;
-                RT_INFO->buf_read = RT_INFO->pkt_buffer;
-                libtrace_create_new_bucket(RT_INFO->bucket, RT_INFO->pkt_buffer);
+	if (!libtrace_ringbuffer_try_read(&RT_INFO->free_buffers, &buffer))
+		buffer = malloc((size_t)RT_BUF_SIZE);
+	if (!buffer) {
+		trace_set_err(libtrace, ENOMEM,
+				"Unable to allocate an RT receive buffer");
+		return -1;
+	}
+
+	RT_INFO->pkt_buffer = (char *)buffer;
+	RT_INFO->buf_read = RT_INFO->pkt_buffer;
+	RT_INFO->buf_write = RT_INFO->pkt_buffer;
+	RT_INFO->buf_frame = RT_INFO->pkt_buffer;
+	libtrace_create_new_bucket(RT_INFO->bucket, buffer);
+	return 0;
+}
+
+/* Moves buf_frame past every record that has been completely received */
+static void rt_update_frame(libtrace_t *libtrace) {
+	rt_header_t *rthdr;
+	size_t reclen;
+
+	while (RT_INFO->buf_write - RT_INFO->buf_frame >=
+			(int)sizeof(rt_header_t)) {
+		rthdr = (rt_header_t *)RT_INFO->buf_frame;
+		reclen = sizeof(rt_header_t) + ntohs(rthdr->length);
+		if ((size_t)(RT_INFO->buf_write - RT_INFO->buf_frame) < reclen)
+			break;
+		RT_INFO->buf_frame += reclen;
 	}
+}
+
+/* Receives data from an RT server. Must only be called once every complete
+ * record in the buffer has been read. */
+static int rt_read(libtrace_t *libtrace, int block) {
+        int numbytes;
+        char *soft_end;
+        size_t len;
 
 #ifndef MSG_DONTWAIT
 #define MSG_DONTWAIT 0
@@ -532,23 +617,34 @@ static int rt_read(libtrace_t *libtrace, int block) {
 	else
 		block=MSG_DONTWAIT;
 
-        /* If the current buffer has plenty of space left, we can continue to 
-         * read into it, otherwise create a new buffer and move anything in
-         * the old buffer over to it */
-        if (RT_INFO->buf_write - RT_INFO->pkt_buffer > RT_BUF_SIZE / 2) {
-                char *newbuf = (char*)malloc((size_t)RT_BUF_SIZE);
-
-                memcpy(newbuf, RT_INFO->buf_read, RT_INFO->buf_write - RT_INFO->buf_read);
-                RT_INFO->buf_write = newbuf + (RT_INFO->buf_write - RT_INFO->buf_read);
-                RT_INFO->buf_read = newbuf;
-                RT_INFO->pkt_buffer = newbuf;
-                libtrace_create_new_bucket(RT_INFO->bucket, newbuf);
+        assert(RT_INFO->buf_read == RT_INFO->buf_frame);
 
+        /* Once the last record to fit has been read, continue in a new
+         * buffer. The old one is reused when its packets are released. */
+        if (!RT_INFO->pkt_buffer || RT_INFO->buf_frame >=
+                        RT_INFO->pkt_buffer + RT_BUF_SIZE - RT_MAX_RECORD) {
+                if (rt_new_buffer(libtrace) == -1)
+                        return -1;
+        }
+        soft_end = RT_INFO->pkt_buffer + RT_BUF_SIZE - RT_MAX_RECORD;
+
+        if (RT_INFO->buf_write < soft_end) {
+                /* Receive as many records as we can */
+                len = soft_end - RT_INFO->buf_write;
+        } else if (RT_INFO->buf_write - RT_INFO->buf_frame <
+                        (int)sizeof(rt_header_t)) {
+                /* Only receive the header of the last record, so we know
+                 * how much more belongs in this buffer */
+                len = RT_INFO->buf_frame + sizeof(rt_header_t) -
+                                RT_INFO->buf_write;
+        } else {
+                /* Only receive the rest of the last record */
+                len = RT_INFO->buf_frame + sizeof(rt_header_t) +
+                                ntohs(((rt_header_t *)RT_INFO->buf_frame)->length)
+                                - RT_INFO->buf_write;
         }
 
-        /* Attempt to fill the buffer as much as we can */
-        if ((numbytes = recv(RT_INFO->input_fd, RT_INFO->buf_write,
-                        RT_BUF_SIZE - (RT_INFO->buf_write-RT_INFO->pkt_buffer),
+        if ((numbytes = recv(RT_INFO->input_fd, RT_INFO->buf_write, len,
                         MSG_NOSIGNAL | block)) <= 0) {
 
                 if (numbytes == 0) {
@@ -575,7 +671,8 @@ static int rt_read(libtrace_t *libtrace, int block) {
         }
 
         RT_INFO->buf_write += numbytes;
-        return (RT_INFO->buf_write - RT_INFO->buf_read);
+        rt_update_frame(libtrace);
+        return (RT_INFO->buf_frame - RT_INFO->buf_read);
 
 }
 
@@ -585,26 +682,24 @@ static int rt_get_next_packet(libtrace_t *libtrace, libtrace_packet_t *packet,
 
         rt_header_t *rthdr;
 
+        /* The last record read into this packet is no longer needed */
+        if (packet->srcbucket == RT_INFO->bucket && packet->internalid != 0) {
+                libtrace_release_bucket_id(RT_INFO->bucket,
+                                packet->internalid);
+                packet->srcbucket = NULL;
+                packet->internalid = 0;
+        }
+
         if (packet->buffer && packet->buf_control == TRACE_CTRL_PACKET)
                 free(packet->buffer);
 
-        while (RT_INFO->buf_write - RT_INFO->buf_read <
-                                (uint32_t)sizeof(rt_header_t)) {
+        while (RT_INFO->buf_read == RT_INFO->buf_frame) {
                 if (rt_read(libtrace, block) == -1)
                         return -1;
         }
 
         rthdr = (rt_header_t *)RT_INFO->buf_read;
 
-        /* Check if we have enough payload */
-        while (RT_INFO->buf_write - (RT_INFO->buf_read + sizeof(rt_header_t))
-                        < ntohs(rthdr->length)) {
-                if (rt_read(libtrace, block) == -1)
-                        return -1;
-                rthdr = (rt_header_t *)RT_INFO->buf_read;
-        }
-
-
         packet->buffer = RT_INFO->buf_read;
         packet->header = RT_INFO->buf_read;
         packet->type = ntohl(((rt_header_t *)packet->header)->type);
@@ -681,6 +776,89 @@ static int rt_read_packet(libtrace_t *libtrace,
 }
 
 
+/* Waits until the socket has data to read. Returns 1 once it does, or
+ * READ_MESSAGE, READ_EOF or READ_ERROR if the thread should stop waiting */
+static int rt_wait_for_data(libtrace_t *libtrace, libtrace_thread_t *t) {
+	struct pollfd pfds[2];
+	int ret;
+
+	pfds[0].fd = RT_INFO->input_fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = libtrace_message_queue_get_fd(&t->messages);
+	pfds[1].events = POLLIN;
+
+	while (1) {
+		ret = poll(pfds, 2, 500);
+		if (ret > 0)
+			break;
+		if (ret == -1 && errno != EINTR) {
+			trace_set_err(libtrace, errno, "Failed to poll RT socket");
+			return READ_ERROR;
+		}
+		/* Timed out, check if we have been asked to stop */
+		if ((ret = is_halted(libtrace)) != -1)
+			return ret;
+	}
+
+	if (pfds[1].revents & POLLIN)
+		return READ_MESSAGE;
+	return 1;
+}
+
+/* Reads a batch of packets for a perpkt thread. After waiting for the first
+ * record, every complete record that has already been received is returned
+ * without touching the socket again. */
+static int rt_pread_packets(libtrace_t *libtrace, libtrace_thread_t *t,
+		libtrace_packet_t **packets, size_t nb_packets) {
+	size_t i = 0;
+	int ret = 0;
+
+	ASSERT_RET(pthread_mutex_lock(&RT_INFO->read_lock), == 0);
+
+	while (i < nb_packets && !RT_INFO->end_data) {
+		if (RT_INFO->buf_read == RT_INFO->buf_frame) {
+			/* Return what we already have rather than wait */
+			if (i > 0)
+				break;
+			ret = rt_wait_for_data(libtrace, t);
+			if (ret <= 0)
+				break;
+			if (rt_read(libtrace, 1) == -1) {
+				ret = READ_ERROR;
+				break;
+			}
+			continue;
+		}
+
+		ret = rt_get_next_packet(libtrace, packets[i], 1);
+		if (ret == -1) {
+			ret = READ_ERROR;
+			break;
+		}
+
+		if (packets[i]->type == TRACE_RT_END_DATA) {
+			RT_INFO->end_data = true;
+			ret = 0;
+			break;
+		}
+
+		/* Other empty RT messages are only of interest to the
+		 * RT client itself */
+		if (ret == 0)
+			continue;
+
+		packets[i]->error = ret;
+		trace_packet_set_order(packets[i], libtrace->sequence_number++);
+		i++;
+	}
+
+	ASSERT_RET(pthread_mutex_unlock(&RT_INFO->read_lock), == 0);
+
+	if (i > 0)
+		return i;
+	return ret;
+}
+
 /* This should only get called for RT messages - RT-encapsulated data records
  * should be converted to the appropriate capture format */
 static int rt_get_capture_length(const libtrace_packet_t *packet) {
@@ -844,6 +1022,7 @@ static struct libtrace_format_t rt = {
 	rt_prepare_packet,		/* prepare_packet */
 	NULL,   			/* fin_packet */
         NULL,                           /* write_packet */
+        NULL,                           /* write_packets */
         rt_get_link_type,	        /* get_link_type */
         NULL,  		            	/* get_direction */
         NULL,              		/* set_direction */
@@ -866,7 +1045,14 @@ static struct libtrace_format_t rt = {
         trace_event_rt,             /* trace_event */
         rt_help,			/* help */
 	NULL,			/* next pointer */
-	NON_PARALLEL(true) /* This is normally live */
+	{true, 0},		/* This is normally live */
+	rt_start_input,		/* pstart_input */
+	rt_pread_packets,	/* pread_packets */
+	rt_pause_input,		/* ppause_input */
+	NULL,			/* pfin_input */
+	NULL,			/* pregister_thread */
+	NULL,			/* punregister_thread */
+	NULL			/* get_thread_statistics */
 };
 
 void rt_constructor(void) {
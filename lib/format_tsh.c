@@ -244,6 +244,7 @@ static struct libtrace_format_t tshformat = {
 	tsh_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	NULL,				/* write_packet */
+	NULL,				/* write_packets */
 	tsh_get_link_type,		/* get_link_type */
 	tsh_get_direction,		/* get_direction */
 	NULL,				/* set_direction */
@@ -293,6 +294,7 @@ static struct libtrace_format_t frplusformat = {
 	tsh_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	NULL,				/* write_packet */
+	NULL,				/* write_packets */
 	tsh_get_link_type,		/* get_link_type */
 	tsh_get_direction,		/* get_direction */
 	NULL,				/* set_direction */
@@ -160,6 +160,8 @@ struct libtrace_event_status_t {
 	double tdelta;
 	/** The timestamp of the previous PACKET event */
 	double trace_last_ts;
+	/** The timestamp of the first PACKET event */
+	double trace_first_ts;
 	/** The size of the current PACKET event */
 	int psize;
 	/** Whether there is a packet stored in *packet above waiting for an
@@ -198,11 +200,16 @@ struct libtrace_thread_t {
 	// Set to true once the first packet has been stored
 	bool recorded_first;
 	// For thread safety reason we actually must store this here
-	int64_t tracetime_offset_usec;
+	uint64_t tracetime_start_usec; // Monotonic time of the first packet
+	uint64_t tracetime_first_usec; // Trace time of the first packet
 	void* user_data; // TLS for the user to use
 	void* format_data; // TLS for the format to use
 	libtrace_message_queue_t messages; // Message handling
 	libtrace_ringbuffer_t rbuffer; // Input
+	libtrace_queue_t batches; // Packet batches queued when work stealing
+	uint64_t batch_order; // Order of the last packet taken when work stealing
+	libtrace_wait_stat_t wait_stats; // Time spent waiting for work
+	libtrace_perf_stat_t *perf_stats; // Allocated when first recorded
 	libtrace_t * trace;
 	void* ret;
 	enum thread_types type;
@@ -226,6 +233,7 @@ struct first_packets {
 	struct {
 		libtrace_packet_t * packet;
 		struct timeval tv;
+		uint64_t mono_usec; // Monotonic time, used for trace-time playback
 	} * packets;
 };
 
@@ -279,8 +287,22 @@ struct user_configuration {
 	bool reporter_polling;
 	size_t reporter_thold;
 	bool debug_state;
+	bool work_stealing;
+	enum wait_policies wait_policy;
+	size_t spin_count;
+	bool perf_stats;
+	size_t perf_stats_interval;
+	size_t tracetime_speedup;
+	size_t tracetime_window;
+	size_t decompress_threads;
 };
-#define ZERO_USER_CONFIG(config) memset(&config, 0, sizeof(struct user_configuration));
+/* Marks spin_count as unset, 0 is a valid spin count */
+#define SPIN_COUNT_DEFAULT SIZE_MAX
+
+#define ZERO_USER_CONFIG(config) do { \
+	memset(&config, 0, sizeof(struct user_configuration)); \
+	config.spin_count = SPIN_COUNT_DEFAULT; \
+} while (0)
 
 struct callback_set {
 
@@ -304,6 +326,8 @@ struct libtrace_t {
 	struct libtrace_format_t *format; 
 	/** Details of the most recent PACKET event reported by the trace */
 	struct libtrace_event_status_t event;
+	/** The factor to speed up event API replay by */
+	size_t replayspeedup;
 	/** Pointer to the "global" data for the capture format module */	
 	void *format_data; 		
 	/** A BPF filter to be applied to all packets read by the trace - 
@@ -354,6 +378,10 @@ struct libtrace_t {
         enum hash_owner hasher_owner;
 	/** The pread_packet choosen path for the configuration */
 	int (*pread)(libtrace_t *, libtrace_thread_t *, libtrace_packet_t **, size_t);
+	/** The result of the last batch read when work stealing, once this
+	 * is an EOF or error no more batches will be queued. Protected by
+	 * read_packet_lock */
+	int batch_read_status;
 
 	libtrace_thread_t hasher_thread;
 	libtrace_thread_t reporter_thread;
@@ -406,6 +434,8 @@ struct libtrace_out_t {
 	libtrace_err_t err;
 	/** Boolean flag indicating whether the trace has been started */
 	bool started;
+	/** The number of threads to compress the output file with */
+	int compress_threads;
 };
 
 /** Sets the error status on an input trace
@@ -616,6 +646,18 @@ struct libtrace_format_t {
 	 * @return The number of bytes written, or -1 if an error occurs
 	 */
 	int (*write_packet)(libtrace_out_t *libtrace, libtrace_packet_t *packet);
+
+	/** Write a batch of libtrace packets to an output trace.
+	 *
+	 * If NULL, write_packet is called for each packet in turn.
+	 *
+	 * @param libtrace	The output trace to write the packets to
+	 * @param packets	The packets to be written out
+	 * @param nb_packets	The number of packets to write
+	 * @return The number of bytes written, or -1 if an error occurs
+	 */
+	int (*write_packets)(libtrace_out_t *libtrace,
+	                     libtrace_packet_t *packets[], size_t nb_packets);
 	/** Returns the libtrace link type for a packet.
 	 *
 	 * @param packet 	The packet to get the link type for
@@ -1205,6 +1247,38 @@ struct libtrace_filter_t {
 struct libtrace_filter_t {};
 #endif
 
+/** Finds the start of a packet as a BPF program sees it
+ *
+ * @param packet	The packet that a filter is being applied to
+ * @param[out] copy	Set to a demoted copy of the packet if pcap has no
+ * 			equivalent of the packet's link type, otherwise NULL.
+ * 			The caller must destroy the copy once done with linkptr.
+ * @param[out] linkptr	Set to the start of the packet, may be NULL if the
+ * 			packet has no payload
+ * @param[out] clen	Set to the capture length from linkptr
+ * @param[out] linktype	Set to the link type at linkptr
+ * @return 1 if the packet is not data and should match every filter, 0 on
+ * success or -1 if an error occurred
+ */
+int trace_bpf_prepare_packet(const libtrace_packet_t *packet,
+		libtrace_packet_t **copy, void **linkptr, uint32_t *clen,
+		libtrace_linktype_t *linktype);
+
+/** Compiles a BPF filter for a link type, if it has not been compiled yet
+ *
+ * @param filter	The filter to compile
+ * @param packet	The packet the filter is being applied to, any error
+ * 			is set on the packet's trace
+ * @param linkptr	The start of the packet as found by
+ * 			trace_bpf_prepare_packet()
+ * @param linktype	The link type to compile the filter for
+ * @return -1 if an error occurred, otherwise 0 or 1
+ */
+int trace_bpf_compile(libtrace_filter_t *filter,
+		const libtrace_packet_t *packet,
+		void *linkptr,
+		libtrace_linktype_t linktype);
+
 /** Local definition of a PCAP header */
 typedef struct libtrace_pcapfile_pkt_hdr_t {
 	uint32_t ts_sec;	/* Seconds portion of the timestamp */
@@ -1241,6 +1315,8 @@ void duck_constructor(void);
 void atmhdr_constructor(void);
 /** Constructor for the network DAG format module */
 void ndag_constructor(void);
+/** Constructor for the merge format module */
+void merge_constructor(void);
 #ifdef HAVE_BPF
 /** Constructor for the BPF format module */
 void bpf_constructor(void);
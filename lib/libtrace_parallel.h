@@ -289,6 +289,94 @@ enum hasher_types {
 	HASHER_CUSTOM
 };
 
+/** The wait policies that are available to libtrace applications.
+ *  These can be selected using trace_set_wait_policy().
+ */
+enum wait_policies {
+	/** Block on a condition variable or the message queue whenever
+	 * there is nothing to do. This uses the least CPU but adds the
+	 * latency of waking a sleeping thread.
+	 */
+	WAIT_BLOCKING,
+
+	/** Busy-poll whenever there is nothing to do. This gives the lowest
+	 * latency at the cost of every waiting thread consuming a full CPU
+	 * core.
+	 */
+	WAIT_POLLING,
+
+	/** Spin for a fixed number of iterations, see trace_set_spin_count(),
+	 * before blocking as per WAIT_BLOCKING. Short waits avoid a sleep
+	 * whereas long waits give up the CPU.
+	 */
+	WAIT_ADAPTIVE
+};
+
+/** Statistics describing the time a thread has spent waiting for work */
+typedef struct libtrace_wait_stat_t {
+	/** The number of waits which completed while spinning */
+	uint64_t spins;
+	/** The number of waits which ended up blocking */
+	uint64_t sleeps;
+	/** Total time spent spinning, in nanoseconds */
+	uint64_t spin_ns;
+	/** Total time spent blocked, in nanoseconds */
+	uint64_t sleep_ns;
+} libtrace_wait_stat_t;
+
+/** An X Macro set of the stages of the parallel engine which are timed when
+ * performance statistics are enabled, see trace_set_perf_stats() */
+#define LIBTRACE_PERF_STAGES \
+	X(READ) \
+	X(HASH) \
+	X(ENQUEUE) \
+	X(DEQUEUE) \
+	X(CALLBACK) \
+	X(PUBLISH) \
+	X(COMBINE)
+
+/** The stages of the parallel engine which can be timed.
+ *
+ * - PERF_STAGE_READ is each read of a batch of packets from the format,
+ *   by either a processing thread or the hasher thread
+ * - PERF_STAGE_HASH is the hasher function being applied to a packet
+ * - PERF_STAGE_ENQUEUE is the hasher queuing a packet for a processing thread
+ * - PERF_STAGE_DEQUEUE is a processing thread taking a packet from its queue
+ * - PERF_STAGE_CALLBACK is the user's packet callback
+ * - PERF_STAGE_PUBLISH is trace_publish_result() passing a result to the
+ *   combiner
+ * - PERF_STAGE_COMBINE is the reporter thread reading results from the
+ *   combiner, including the user's result callbacks
+ */
+enum perf_stages {
+#define X(name) PERF_STAGE_ ## name,
+	LIBTRACE_PERF_STAGES
+#undef X
+	PERF_STAGE_MAX
+};
+
+/** The number of histogram buckets per stage. Buckets are log-linear, each
+ * power of two is split into 4 buckets giving a precision of 25%. */
+#define LIBTRACE_PERF_BUCKETS 252
+
+/** Latency statistics for a single stage, all times are in nanoseconds */
+typedef struct libtrace_perf_stage_stat_t {
+	/** The number of times the stage was timed */
+	uint64_t count;
+	/** The total time spent in the stage */
+	uint64_t total_ns;
+	/** The longest time spent in the stage */
+	uint64_t max_ns;
+	/** A histogram of the time spent in the stage, use
+	 * trace_get_perf_percentile() to interpret this */
+	uint64_t buckets[LIBTRACE_PERF_BUCKETS];
+} libtrace_perf_stage_stat_t;
+
+/** Performance statistics covering every stage, indexed by enum perf_stages */
+typedef struct libtrace_perf_stat_t {
+	libtrace_perf_stage_stat_t stages[PERF_STAGE_MAX];
+} libtrace_perf_stat_t;
+
 typedef struct libtrace_info_t {
 	/**
 	 * True if a live format (i.e. packets have to be trace-time).
@@ -779,6 +867,47 @@ DLLEXPORT int trace_set_tick_count(libtrace_t *trace, size_t count);
  */
 DLLEXPORT int trace_set_tracetime(libtrace_t *trace, bool tracetime);
 
+/**
+ * Speeds up trace-time playback, the gaps between packets are divided by
+ * this factor. To play back as fast as possible disable trace-time playback.
+ *
+ * @param trace A parallel input trace
+ * @param speedup The factor to speed up by. Defaults to 1.
+ * @return 0 if successful otherwise -1
+ *
+ * @see trace_set_tracetime()
+ */
+DLLEXPORT int trace_set_tracetime_speedup(libtrace_t *trace, size_t speedup);
+
+/**
+ * Sets the window within which trace-time playback releases packets early.
+ *
+ * Any packet due within this many microseconds is released immediately, so
+ * a burst of closely spaced packets costs a single wait. A larger window
+ * reduces overhead at high packet rates at the cost of accuracy.
+ *
+ * @param trace A parallel input trace
+ * @param usec The window in microseconds. Defaults to 0.
+ * @return 0 if successful otherwise -1
+ *
+ * @see trace_set_tracetime()
+ */
+DLLEXPORT int trace_set_tracetime_window(libtrace_t *trace, size_t usec);
+
+/**
+ * Sets the number of threads used to decompress a trace file.
+ *
+ * Only gzip files written with TRACE_OPTION_OUTPUT_COMPRESS_THREADS can be
+ * decompressed in parallel, other files are read as normal. This also
+ * applies to traces read with trace_read_packet().
+ *
+ * @param trace An input trace
+ * @param threads The number of threads, 1 disables parallel decompression.
+ * Defaults to 0, which picks a number based on the number of CPU cores.
+ * @return 0 if successful otherwise -1
+ */
+DLLEXPORT int trace_set_decompress_threads(libtrace_t *trace, size_t threads);
+
 /** Sets the maximum size of the freelist used to store empty packets
  * and their memory buffers.
  *
@@ -934,6 +1063,157 @@ DLLEXPORT int trace_set_reporter_thold(libtrace_t *trace, size_t thold);
  */
 DLLEXPORT int trace_set_debug_state(libtrace_t *trace, bool debug_state);
 
+/**
+ * Enables or disables work stealing between packet processing threads.
+ *
+ * This applies to input formats without native parallel support which are
+ * not live, such as trace files, when no hasher thread is required.
+ *
+ * If enabled, a single thread at a time reads fixed size batches of
+ * packets (see trace_set_burst_size()) and queues a batch against each
+ * processing thread. A processing thread which runs out of work steals
+ * whole batches queued against busier threads before reading more itself.
+ * Only batches newer than every packet a thread has already processed are
+ * stolen, so the results published by each thread remain in order. Ticks
+ * set with trace_set_tick_count() are queued in line with the batches.
+ *
+ * If disabled, every processing thread reads its own batch directly from
+ * the trace while holding a lock, so a thread that is slow to process its
+ * packets simply falls behind.
+ *
+ * Packets are still distributed as per HASHER_BALANCE and keep their
+ * order numbers.
+ *
+ * @param trace A parallel input trace
+ * @param stealing If true processing threads will steal batches from each
+ * other. Defaults to false.
+ * @return 0 if successful otherwise -1
+ *
+ * Work stealing helps most when the cost of processing a packet is high
+ * and varies between packets.
+ */
+DLLEXPORT int trace_set_work_stealing(libtrace_t *trace, bool stealing);
+
+/**
+ * Sets how the processing, hasher and reporter threads wait when there is
+ * no work available to them.
+ *
+ * This covers the processing threads waiting on the hasher queue, the
+ * hasher waiting for space in a processing thread's queue and the reporter
+ * waiting for messages.
+ *
+ * @param trace A parallel input trace
+ * @param policy The wait policy, see enum wait_policies. Defaults to
+ * WAIT_BLOCKING.
+ * @return 0 if successful otherwise -1
+ *
+ * @note trace_set_hasher_polling() and trace_set_reporter_polling() still
+ * force polling for their respective queues regardless of this policy.
+ * @see trace_set_spin_count(), trace_get_thread_wait_statistics()
+ */
+DLLEXPORT int trace_set_wait_policy(libtrace_t *trace,
+                                    enum wait_policies policy);
+
+/**
+ * Sets the number of iterations a thread will spin for before blocking
+ * when using the WAIT_ADAPTIVE wait policy.
+ *
+ * @param trace A parallel input trace
+ * @param count The number of times to check for work before blocking,
+ * 0 blocks straight away. Defaults to 1000.
+ * @return 0 if successful otherwise -1
+ */
+DLLEXPORT int trace_set_spin_count(libtrace_t *trace, size_t count);
+
+/**
+ * Retrieves the time a thread has spent spinning and sleeping while waiting
+ * for work, which can be used to tune trace_set_wait_policy() and
+ * trace_set_spin_count().
+ *
+ * @param trace A parallel input trace
+ * @param t The thread to retrieve statistics for, or NULL to sum the
+ * statistics of every thread in the trace
+ * @param stat The structure to fill with the statistics
+ * @return 0 if successful otherwise -1
+ *
+ * These statistics are reset when a paused trace is restarted.
+ * Values read while a trace is running are not guaranteed to be consistent
+ * with each other.
+ */
+DLLEXPORT int trace_get_thread_wait_statistics(libtrace_t *trace,
+                                               libtrace_thread_t *t,
+                                               libtrace_wait_stat_t *stat);
+
+/**
+ * Enables or disables recording performance statistics for each stage of
+ * the parallel engine, see enum perf_stages.
+ *
+ * If enabled, every thread records a count and a latency histogram of each
+ * stage it performs. This costs two reads of the system clock per stage, so
+ * while cheap it is not free.
+ *
+ * @param trace A parallel input trace
+ * @param enabled If true statistics are recorded. Defaults to false.
+ * @return 0 if successful otherwise -1
+ *
+ * @see trace_get_thread_perf_statistics(), trace_print_perf_statistics()
+ */
+DLLEXPORT int trace_set_perf_stats(libtrace_t *trace, bool enabled);
+
+/**
+ * Sets the interval at which the reporter thread will print the performance
+ * statistics for the whole trace to standard error.
+ *
+ * @param trace A parallel input trace
+ * @param millisec The interval in milliseconds, 0 disables printing.
+ * Defaults to 0.
+ * @return 0 if successful otherwise -1
+ *
+ * The statistics are only checked after the reporter handles a message, so
+ * the reporter must be receiving results for these to be printed.
+ * This has no effect unless trace_set_perf_stats() is enabled.
+ */
+DLLEXPORT int trace_set_perf_stats_interval(libtrace_t *trace, size_t millisec);
+
+/**
+ * Retrieves the performance statistics recorded by a thread.
+ *
+ * @param trace A parallel input trace
+ * @param t The thread to retrieve statistics for, or NULL to sum the
+ * statistics of every thread in the trace
+ * @param stat The structure to fill with the statistics
+ * @return 0 if successful otherwise -1
+ *
+ * Like trace_get_thread_wait_statistics(), these are reset when a paused
+ * trace is restarted and may be slightly inconsistent if read while the
+ * trace is running.
+ */
+DLLEXPORT int trace_get_thread_perf_statistics(libtrace_t *trace,
+                                               libtrace_thread_t *t,
+                                               libtrace_perf_stat_t *stat);
+
+/**
+ * Estimates a percentile of the time spent in a stage from its histogram.
+ *
+ * @param stat The statistics for the stage
+ * @param percentile The percentile to find, between 0 and 100
+ * @return The estimated time in nanoseconds, this is the lower bound of
+ * the histogram bucket containing the percentile
+ */
+DLLEXPORT uint64_t trace_get_perf_percentile(
+                const libtrace_perf_stage_stat_t *stat, double percentile);
+
+/**
+ * Prints a summary of the performance statistics of a thread, one line per
+ * stage giving the count, mean, median, 99th percentile and maximum time.
+ *
+ * @param trace A parallel input trace
+ * @param t The thread to print statistics for, or NULL for the whole trace
+ * @param out The file to print to
+ */
+DLLEXPORT void trace_print_perf_statistics(libtrace_t *trace,
+                                           libtrace_thread_t *t, FILE *out);
+
 /** Set the hasher function for a parallel trace.
  *
  * @param[in] trace The parallel trace to apply the hasher to
@@ -1303,6 +1583,14 @@ DLLEXPORT libtrace_info_t *trace_get_information(libtrace_t * libtrace);
  * * \b reporter_polling,\b rp see trace_set_reporter_polling() [bool]
  * * \b reporter_thold,\b rt see trace_set_reporter_thold() [size_t]
  * * \b debug_state,\b ds see trace_set_debug_state() [bool]
+ * * \b work_stealing,\b ws see trace_set_work_stealing() [bool]
+ * * \b wait_policy,\b wp see trace_set_wait_policy() [blocking, polling or adaptive]
+ * * \b spin_count,\b sc see trace_set_spin_count() [size_t]
+ * * \b perf_stats,\b ps see trace_set_perf_stats() [bool]
+ * * \b perf_stats_interval,\b psi see trace_set_perf_stats_interval() [size_t]
+ * * \b tracetime_speedup,\b tts see trace_set_tracetime_speedup() [size_t]
+ * * \b tracetime_window,\b ttw see trace_set_tracetime_window() [size_t]
+ * * \b decompress_threads,\b dt see trace_set_decompress_threads() [size_t]
  *
  * Booleans can be set as 0/1 or false/true.
  *
@@ -1387,6 +1675,70 @@ extern const libtrace_combine_t combiner_ordered;
  */
 extern const libtrace_combine_t combiner_sorted;
 
+/** An output trace that is split into a shard per processing thread, so
+ * that processing threads can write packets concurrently without passing
+ * them to the reporter.
+ *
+ * For file based formats each thread writes its own file, named by
+ * inserting the thread's ID before the file extension, e.g. with the URI
+ * "pcapfile:out.pcap.gz" thread 2 writes to "pcapfile:out-2.pcap.gz".
+ * Packets are not ordered between shards, the shards can be combined by
+ * timestamp afterwards using tracemerge.
+ *
+ * Live formats that support concurrent writers (such as DPDK, which gives
+ * each writing thread its own TX queue) share a single output trace
+ * between all threads. Other live formats, such as ring:, give each thread
+ * its own output trace on the same interface.
+ */
+typedef struct libtrace_out_shards libtrace_out_shards_t;
+
+/** Creates a sharded output trace, no output is created until a thread
+ * first requests its shard.
+ *
+ * @param uri The URI of the output, as for trace_create_output()
+ * @return A sharded output trace, or NULL if out of memory.
+ */
+DLLEXPORT libtrace_out_shards_t *trace_create_output_shards(const char *uri);
+
+/** Sets a config option for every shard of a sharded output trace, this
+ * must be called before any thread requests its shard.
+ *
+ * @param shards The sharded output trace
+ * @param option The output option to set
+ * @param value A pointer to the int value for the option
+ * @return 0 if successful, -1 if shards have already been created.
+ *
+ * Errors applying the option to a shard are reported by that shard.
+ */
+DLLEXPORT int trace_config_output_shards(libtrace_out_shards_t *shards,
+                                         trace_option_output_t option,
+                                         void *value);
+
+/** Gets the output shard for a processing thread, creating and starting
+ * the shard the first time it is requested.
+ *
+ * @param shards The sharded output trace
+ * @param t The processing thread, the calling thread
+ * @return The thread's output trace, or NULL if t is not a processing
+ * thread. Check trace_is_err_output() on the result for any error creating
+ * or starting the shard.
+ *
+ * The returned output trace is owned by the sharded output trace and must
+ * not be destroyed. It is best requested once in the thread's starting
+ * callback and kept in the thread's local storage.
+ */
+DLLEXPORT libtrace_out_t *trace_get_output_shard(libtrace_out_shards_t *shards,
+                                                 libtrace_thread_t *t);
+
+/** Closes every shard of a sharded output trace and frees it.
+ *
+ * @param shards The sharded output trace
+ *
+ * This should be called after trace_join() when threads have finished
+ * writing.
+ */
+DLLEXPORT void trace_destroy_output_shards(libtrace_out_shards_t *shards);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,208 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+#include "libtrace.h"
+#include "libtrace_int.h"
+#include "data-struct/linked_list.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Live formats where every writing thread can share a single output */
+static const char *shared_formats[] = {"dpdk", NULL};
+
+struct shard_option {
+	trace_option_output_t option;
+	int value;
+};
+
+struct libtrace_out_shards {
+	/* The URI given by the user, shards of files are named after this */
+	char *uri;
+	/* The options to apply to each shard as it is created */
+	libtrace_list_t *options;
+	/* Held while creating shards */
+	pthread_mutex_t lock;
+	/* The shard of each perpkt thread, indexed by the thread's ID */
+	libtrace_out_t **shards;
+	int nb_shards;
+	/* True if the format writes to a device rather than a file */
+	bool live;
+	/* A single output used by all threads, if the format supports it */
+	libtrace_out_t *shared;
+	bool shared_started;
+};
+
+/* Gets the name of a thread's shard, i.e. fmt:dir/out.pcap.gz becomes
+ * fmt:dir/out-<id>.pcap.gz */
+static char *shard_uri(const char *uri, int id) {
+	const char *uridata = strchr(uri, ':');
+	const char *base, *ext;
+	char *name;
+
+	if (uridata == NULL)
+		return strdup(uri);
+	base = strrchr(uridata, '/');
+	base = base ? base + 1 : uridata + 1;
+	/* Skip the leading '.' of a hidden file */
+	ext = strchr(*base == '.' ? base + 1 : base, '.');
+	if (ext == NULL)
+		ext = base + strlen(base);
+
+	name = malloc(strlen(uri) + 16);
+	if (name == NULL)
+		return NULL;
+	sprintf(name, "%.*s-%d%s", (int) (ext - uri), uri, id, ext);
+	return name;
+}
+
+/* Applies the options then starts an output, errors are left in the
+ * output for the caller to find */
+static void start_shard(libtrace_out_shards_t *shards, libtrace_out_t *out) {
+	libtrace_list_node_t *n;
+
+	if (trace_is_err_output(out))
+		return;
+
+	for (n = shards->options->head; n; n = n->next) {
+		struct shard_option *opt = n->data;
+		if (trace_config_output(out, opt->option, &opt->value) == -1) {
+			if (!trace_is_err_output(out))
+				trace_set_err_out(out, TRACE_ERR_OPTION_UNAVAIL,
+				                  "Unable to set output option %d",
+				                  opt->option);
+			return;
+		}
+	}
+	trace_start_output(out);
+}
+
+DLLEXPORT libtrace_out_shards_t *trace_create_output_shards(const char *uri) {
+	libtrace_out_shards_t *shards;
+	libtrace_out_t *probe;
+	int i;
+
+	shards = calloc(1, sizeof(libtrace_out_shards_t));
+	if (shards == NULL)
+		return NULL;
+	shards->uri = strdup(uri);
+	shards->options = libtrace_list_init(sizeof(struct shard_option));
+	ASSERT_RET(pthread_mutex_init(&shards->lock, NULL), == 0);
+
+	/* Find out what sort of output this is, if it is bad each shard will
+	 * report the error when created */
+	probe = trace_create_output(uri);
+	if (!trace_is_err_output(probe)) {
+		shards->live = probe->format->info.live;
+		for (i = 0; shards->live && shared_formats[i]; i++) {
+			if (strcmp(probe->format->name, shared_formats[i]) == 0) {
+				shards->shared = probe;
+				return shards;
+			}
+		}
+	}
+	trace_destroy_output(probe);
+	return shards;
+}
+
+DLLEXPORT int trace_config_output_shards(libtrace_out_shards_t *shards,
+                                         trace_option_output_t option,
+                                         void *value) {
+	struct shard_option opt;
+	int ret = 0;
+
+	ASSERT_RET(pthread_mutex_lock(&shards->lock), == 0);
+	if (shards->nb_shards > 0 || shards->shared_started) {
+		ret = -1;
+	} else {
+		opt.option = option;
+		opt.value = *(int *) value;
+		libtrace_list_push_back(shards->options, &opt);
+	}
+	ASSERT_RET(pthread_mutex_unlock(&shards->lock), == 0);
+	return ret;
+}
+
+DLLEXPORT libtrace_out_t *trace_get_output_shard(libtrace_out_shards_t *shards,
+                                                 libtrace_thread_t *t) {
+	libtrace_out_t *out;
+	int id = trace_get_perpkt_thread_id(t);
+
+	if (id < 0)
+		return NULL;
+
+	ASSERT_RET(pthread_mutex_lock(&shards->lock), == 0);
+	if (shards->shared) {
+		if (!shards->shared_started) {
+			start_shard(shards, shards->shared);
+			shards->shared_started = true;
+		}
+		ASSERT_RET(pthread_mutex_unlock(&shards->lock), == 0);
+		return shards->shared;
+	}
+
+	if (id >= shards->nb_shards) {
+		shards->shards = realloc(shards->shards,
+		                         sizeof(libtrace_out_t *) * (id + 1));
+		memset(shards->shards + shards->nb_shards, 0,
+		       sizeof(libtrace_out_t *) * (id + 1 - shards->nb_shards));
+		shards->nb_shards = id + 1;
+	}
+
+	out = shards->shards[id];
+	if (out == NULL) {
+		/* Devices are opened once per thread, files are split */
+		if (shards->live) {
+			out = trace_create_output(shards->uri);
+		} else {
+			char *name = shard_uri(shards->uri, id);
+			out = trace_create_output(name ? name : shards->uri);
+			free(name);
+		}
+		start_shard(shards, out);
+		shards->shards[id] = out;
+	}
+	ASSERT_RET(pthread_mutex_unlock(&shards->lock), == 0);
+	return out;
+}
+
+DLLEXPORT void trace_destroy_output_shards(libtrace_out_shards_t *shards) {
+	int i;
+
+	for (i = 0; i < shards->nb_shards; i++) {
+		if (shards->shards[i])
+			trace_destroy_output(shards->shards[i]);
+	}
+	if (shards->shared)
+		trace_destroy_output(shards->shared);
+	free(shards->shards);
+	libtrace_list_deinit(shards->options);
+	ASSERT_RET(pthread_mutex_destroy(&shards->lock), == 0);
+	free(shards->uri);
+	free(shards);
+}
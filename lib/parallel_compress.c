@@ -0,0 +1,1176 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+#include "libtrace.h"
+#include "parallel_compress.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+
+/* Each gzip member is laid out as
+ * +--------------------------+
+ * |  gzip header, FEXTRA set | 10 bytes
+ * +--------------------------+
+ * | XLEN, 'L' 'T' subfield   | 6 bytes
+ * +--------------------------+
+ * |  Total size of member    | 4 bytes, little endian
+ * +--------------------------+
+ * |     Deflate stream       | Variable Size
+ * +--------------------------+
+ * | CRC32, uncompressed size | 8 bytes
+ * +--------------------------+
+ */
+#define HEADER_SIZE 20
+#define TRAILER_SIZE 8
+
+/* Members claiming to be larger than this are treated as corrupt */
+#define MAX_MEMBER_SIZE (64 * 1024 * 1024)
+
+/* Once a format marks where its records start, blocks are only cut at
+ * a record, unless a block grows beyond this */
+#define MAX_CHUNK_SIZE (4 * PCOMPRESS_BLOCK_SIZE)
+
+/* zstd and lz4 files are a series of independent frames, one per chunk,
+ * followed by a skippable frame holding the chunk index
+ * +--------------------------+
+ * |  Skippable frame magic   | 4 bytes, little endian
+ * +--------------------------+
+ * |  Size of the index       | 4 bytes, little endian
+ * +--------------------------+
+ * | Compressed size, size,   | 16 bytes per chunk, little endian
+ * | first record timestamp   |
+ * +--------------------------+
+ * | Chunk count, flags, magic| 9 bytes
+ * +--------------------------+
+ * Both zstd and lz4 decoders skip this frame, so the files can still be
+ * read by the standard tools.
+ */
+#define ZSTD_FRAME_MAGIC 0xFD2FB528
+#define LZ4_FRAME_MAGIC 0x184D2204
+#define SKIPPABLE_MAGIC 0x184D2A5E
+#define INDEX_MAGIC 0x4943544C	/* "LTCI" */
+#define INDEX_ENTRY_SIZE 16
+#define INDEX_FOOTER_SIZE 9
+/* Set if each chunk records the timestamp of its first record */
+#define INDEX_TIMESTAMPS 0x01
+
+static const unsigned char member_header[HEADER_SIZE - 4] = {
+	0x1f, 0x8b,		/* gzip magic */
+	8,			/* deflate */
+	4,			/* FEXTRA */
+	0, 0, 0, 0,		/* mtime */
+	0,			/* xfl */
+	255,			/* unknown os */
+	8, 0,			/* XLEN */
+	'L', 'T',		/* Subfield ID */
+	4, 0			/* Subfield length */
+};
+
+enum block_state {
+	BLOCK_EMPTY,	/* Free for the caller to fill */
+	BLOCK_QUEUED,	/* Waiting for a worker */
+	BLOCK_BUSY,	/* Being (de)compressed by a worker */
+	BLOCK_DONE	/* Ready to be written out or read from */
+};
+
+struct pc_block {
+	enum block_state state;
+	/* Uncompressed data when writing, compressed when reading */
+	unsigned char *in;
+	size_t in_len;
+	size_t in_size;
+	/* Compressed data when writing, uncompressed when reading */
+	unsigned char *out;
+	size_t out_len;
+	size_t out_size;
+	/* The expected uncompressed size when reading, if known */
+	size_t raw_len;
+	/* The amount of out that has been read */
+	size_t offset;
+	/* The timestamp of the first record in the block, 0 if unknown */
+	uint64_t ts;
+	bool error;
+};
+
+/* An entry in the chunk index */
+struct pc_chunk {
+	/* Offset of the chunk in the compressed file */
+	uint64_t offset;
+	/* Offset of the chunk in the uncompressed data */
+	uint64_t pos;
+	uint32_t size;
+	uint32_t raw_len;
+	uint64_t ts;
+};
+
+/* A compression method, each worker has its own state */
+struct pc_codec {
+	int type;
+	/* True if the file ends with a chunk index */
+	bool indexed;
+	void *(*init)(bool writing, int level);
+	void (*fini)(void *state, bool writing);
+	bool (*compress)(void *state, int level, struct pc_block *b);
+	bool (*decompress)(void *state, struct pc_block *b);
+};
+
+struct pcompress {
+	const struct pc_codec *codec;
+	pthread_mutex_t lock;
+	/* Signalled when a block is queued, or when closing */
+	pthread_cond_t work_cond;
+	/* Signalled when a worker finishes a block */
+	pthread_cond_t done_cond;
+	pthread_t *workers;
+	int nb_workers;
+	/* A ring of blocks, kept in file order */
+	struct pc_block *blocks;
+	int nb_blocks;
+	/* The oldest block queued, the next to be written or read from */
+	int head;
+	/* The next block to be filled */
+	int tail;
+	/* The number of blocks between head and tail */
+	int pending;
+	/* The next block for a worker to take */
+	int work;
+	bool closing;
+	bool writing;
+	int level;
+	iow_t *child_out;
+	io_t *child_in;
+	bool child_eof;
+	bool failed;
+	/* Uncompressed bytes read or written so far */
+	int64_t offset;
+	/* The chunks written so far, or the index read from the file */
+	struct pc_chunk *chunks;
+	size_t nb_chunks;
+	size_t chunks_size;
+	/* The next chunk to read */
+	size_t next_chunk;
+	uint8_t index_flags;
+	/* True once the format has marked the start of a record */
+	bool marked;
+	/* A record boundary to cut the current block at */
+	bool cut_pending;
+	int64_t cut_offset;
+	uint64_t cut_ts;
+	/* The number of blocks queued so far */
+	uint64_t nb_queued;
+};
+
+static inline void put_le32(unsigned char *buf, uint32_t value) {
+	buf[0] = value & 0xff;
+	buf[1] = (value >> 8) & 0xff;
+	buf[2] = (value >> 16) & 0xff;
+	buf[3] = (value >> 24) & 0xff;
+}
+
+static inline uint32_t get_le32(const unsigned char *buf) {
+	return (uint32_t) buf[0] | ((uint32_t) buf[1] << 8) |
+	       ((uint32_t) buf[2] << 16) | ((uint32_t) buf[3] << 24);
+}
+
+static inline void put_le64(unsigned char *buf, uint64_t value) {
+	put_le32(buf, value & 0xffffffff);
+	put_le32(buf + 4, value >> 32);
+}
+
+static inline uint64_t get_le64(const unsigned char *buf) {
+	return (uint64_t) get_le32(buf) | ((uint64_t) get_le32(buf + 4) << 32);
+}
+
+static bool is_member_header(const unsigned char *hdr) {
+	/* Ignore the mtime, xfl and os */
+	return memcmp(hdr, member_header, 4) == 0 &&
+	       memcmp(hdr + 10, member_header + 10, HEADER_SIZE - 14) == 0;
+}
+
+static bool grow_buffer(unsigned char **buf, size_t *size, size_t needed) {
+	unsigned char *tmp;
+	size_t new_size = *size * 2;
+
+	if (*size >= needed)
+		return true;
+	if (new_size < needed)
+		new_size = needed;
+	tmp = realloc(*buf, new_size);
+	if (tmp == NULL)
+		return false;
+	*buf = tmp;
+	*size = new_size;
+	return true;
+}
+
+#ifdef HAVE_LIBZ
+static void *gzip_init(bool writing, int level) {
+	z_stream *z = calloc(1, sizeof(z_stream));
+	int ret;
+
+	if (z == NULL)
+		return NULL;
+	if (writing)
+		ret = deflateInit2(z, level, Z_DEFLATED, -MAX_WBITS, 8,
+		                   Z_DEFAULT_STRATEGY);
+	else
+		ret = inflateInit2(z, -MAX_WBITS);
+	if (ret != Z_OK) {
+		free(z);
+		return NULL;
+	}
+	return z;
+}
+
+static void gzip_fini(void *state, bool writing) {
+	if (writing)
+		deflateEnd((z_stream *) state);
+	else
+		inflateEnd((z_stream *) state);
+	free(state);
+}
+
+static bool gzip_compress(void *state, int level UNUSED, struct pc_block *b) {
+	z_stream *z = (z_stream *) state;
+	size_t bound = HEADER_SIZE + deflateBound(z, b->in_len) + TRAILER_SIZE;
+
+	if (!grow_buffer(&b->out, &b->out_size, bound))
+		return false;
+	if (deflateReset(z) != Z_OK)
+		return false;
+
+	z->next_in = b->in;
+	z->avail_in = b->in_len;
+	z->next_out = b->out + HEADER_SIZE;
+	z->avail_out = bound - HEADER_SIZE - TRAILER_SIZE;
+	if (deflate(z, Z_FINISH) != Z_STREAM_END)
+		return false;
+
+	b->out_len = HEADER_SIZE + z->total_out + TRAILER_SIZE;
+	memcpy(b->out, member_header, sizeof(member_header));
+	put_le32(b->out + sizeof(member_header), b->out_len);
+	put_le32(b->out + b->out_len - 8, crc32(0L, b->in, b->in_len));
+	put_le32(b->out + b->out_len - 4, b->in_len);
+	return true;
+}
+
+static bool gzip_decompress(void *state, struct pc_block *b) {
+	z_stream *z = (z_stream *) state;
+	uint32_t crc = get_le32(b->in + b->in_len - 8);
+	uint32_t isize = get_le32(b->in + b->in_len - 4);
+
+	if (isize > MAX_MEMBER_SIZE)
+		return false;
+	if (!grow_buffer(&b->out, &b->out_size, isize + 1))
+		return false;
+	if (inflateReset(z) != Z_OK)
+		return false;
+
+	z->next_in = b->in + HEADER_SIZE;
+	z->avail_in = b->in_len - HEADER_SIZE - TRAILER_SIZE;
+	z->next_out = b->out;
+	z->avail_out = isize + 1;
+	if (inflate(z, Z_FINISH) != Z_STREAM_END || z->total_out != isize)
+		return false;
+	if (crc32(0L, b->out, isize) != crc)
+		return false;
+
+	b->out_len = isize;
+	return true;
+}
+
+static const struct pc_codec gzip_codec = {
+	.type = TRACE_OPTION_COMPRESSTYPE_ZLIB,
+	.indexed = false,
+	.init = gzip_init,
+	.fini = gzip_fini,
+	.compress = gzip_compress,
+	.decompress = gzip_decompress
+};
+#endif /* HAVE_LIBZ */
+
+#ifdef HAVE_LIBZSTD
+static void *zstd_init(bool writing, int level UNUSED) {
+	if (writing)
+		return ZSTD_createCCtx();
+	return ZSTD_createDCtx();
+}
+
+static void zstd_fini(void *state, bool writing) {
+	if (writing)
+		ZSTD_freeCCtx((ZSTD_CCtx *) state);
+	else
+		ZSTD_freeDCtx((ZSTD_DCtx *) state);
+}
+
+static bool zstd_compress(void *state, int level, struct pc_block *b) {
+	size_t ret;
+
+	if (!grow_buffer(&b->out, &b->out_size, ZSTD_compressBound(b->in_len)))
+		return false;
+	ret = ZSTD_compressCCtx((ZSTD_CCtx *) state, b->out, b->out_size,
+	                        b->in, b->in_len, level);
+	if (ZSTD_isError(ret))
+		return false;
+	b->out_len = ret;
+	return true;
+}
+
+static bool zstd_decompress(void *state, struct pc_block *b) {
+	size_t ret;
+
+	if (!grow_buffer(&b->out, &b->out_size, b->raw_len))
+		return false;
+	ret = ZSTD_decompressDCtx((ZSTD_DCtx *) state, b->out, b->raw_len,
+	                          b->in, b->in_len);
+	if (ZSTD_isError(ret) || ret != b->raw_len)
+		return false;
+	b->out_len = ret;
+	return true;
+}
+
+static const struct pc_codec zstd_codec = {
+	.type = TRACE_OPTION_COMPRESSTYPE_ZSTD,
+	.indexed = true,
+	.init = zstd_init,
+	.fini = zstd_fini,
+	.compress = zstd_compress,
+	.decompress = zstd_decompress
+};
+#endif /* HAVE_LIBZSTD */
+
+#ifdef HAVE_LIBLZ4
+/* Compressing a frame needs no state of its own */
+static LZ4F_dctx *lz4_no_state;
+
+static void *lz4_init(bool writing, int level UNUSED) {
+	LZ4F_dctx **dctx;
+
+	if (writing)
+		return &lz4_no_state;
+	dctx = malloc(sizeof(LZ4F_dctx *));
+	if (dctx == NULL)
+		return NULL;
+	if (LZ4F_isError(LZ4F_createDecompressionContext(dctx, LZ4F_VERSION))) {
+		free(dctx);
+		return NULL;
+	}
+	return dctx;
+}
+
+static void lz4_fini(void *state, bool writing) {
+	if (writing)
+		return;
+	LZ4F_freeDecompressionContext(*(LZ4F_dctx **) state);
+	free(state);
+}
+
+static bool lz4_compress(void *state UNUSED, int level, struct pc_block *b) {
+	LZ4F_preferences_t prefs;
+	size_t ret;
+
+	memset(&prefs, 0, sizeof(prefs));
+	prefs.compressionLevel = level;
+	prefs.frameInfo.contentSize = b->in_len;
+	if (!grow_buffer(&b->out, &b->out_size,
+	                 LZ4F_compressFrameBound(b->in_len, &prefs)))
+		return false;
+	ret = LZ4F_compressFrame(b->out, b->out_size, b->in, b->in_len, &prefs);
+	if (LZ4F_isError(ret))
+		return false;
+	b->out_len = ret;
+	return true;
+}
+
+static bool lz4_decompress(void *state, struct pc_block *b) {
+	LZ4F_dctx **dctx = (LZ4F_dctx **) state;
+	size_t out_len = b->raw_len;
+	size_t in_len = b->in_len;
+	size_t ret;
+
+	if (!grow_buffer(&b->out, &b->out_size, b->raw_len))
+		return false;
+	/* The whole frame is available, so it is decoded in one call */
+	ret = LZ4F_decompress(*dctx, b->out, &out_len, b->in, &in_len, NULL);
+	if (ret != 0 || out_len != b->raw_len || in_len != b->in_len) {
+		/* Leave the context ready for the next frame */
+		LZ4F_freeDecompressionContext(*dctx);
+		if (LZ4F_isError(LZ4F_createDecompressionContext(dctx,
+		                                                 LZ4F_VERSION)))
+			*dctx = NULL;
+		return false;
+	}
+	b->out_len = out_len;
+	return true;
+}
+
+static const struct pc_codec lz4_codec = {
+	.type = TRACE_OPTION_COMPRESSTYPE_LZ4,
+	.indexed = true,
+	.init = lz4_init,
+	.fini = lz4_fini,
+	.compress = lz4_compress,
+	.decompress = lz4_decompress
+};
+#endif /* HAVE_LIBLZ4 */
+
+static const struct pc_codec *codecs[] = {
+#ifdef HAVE_LIBZ
+	&gzip_codec,
+#endif
+#ifdef HAVE_LIBZSTD
+	&zstd_codec,
+#endif
+#ifdef HAVE_LIBLZ4
+	&lz4_codec,
+#endif
+	NULL
+};
+
+static const struct pc_codec *find_codec(int type) {
+	int i;
+
+	for (i = 0; codecs[i]; i++) {
+		if (codecs[i]->type == type)
+			return codecs[i];
+	}
+	return NULL;
+}
+
+static void *pcompress_worker(void *data) {
+	struct pcompress *pc = (struct pcompress *) data;
+	struct pc_block *b;
+	void *state;
+	bool ok;
+
+	state = pc->codec->init(pc->writing, pc->level);
+
+	ASSERT_RET(pthread_mutex_lock(&pc->lock), == 0);
+	for (;;) {
+		/* Blocks are queued in order, so always take the next one */
+		b = &pc->blocks[pc->work];
+		while (b->state != BLOCK_QUEUED && !pc->closing) {
+			ASSERT_RET(pthread_cond_wait(&pc->work_cond, &pc->lock), == 0);
+			b = &pc->blocks[pc->work];
+		}
+		if (b->state != BLOCK_QUEUED)
+			break;
+		b->state = BLOCK_BUSY;
+		pc->work = (pc->work + 1) % pc->nb_blocks;
+		ASSERT_RET(pthread_mutex_unlock(&pc->lock), == 0);
+
+		if (state == NULL)
+			ok = false;
+		else if (pc->writing)
+			ok = pc->codec->compress(state, pc->level, b);
+		else
+			ok = pc->codec->decompress(state, b);
+
+		ASSERT_RET(pthread_mutex_lock(&pc->lock), == 0);
+		b->error = !ok;
+		b->state = BLOCK_DONE;
+		ASSERT_RET(pthread_cond_broadcast(&pc->done_cond), == 0);
+	}
+	ASSERT_RET(pthread_mutex_unlock(&pc->lock), == 0);
+
+	if (state)
+		pc->codec->fini(state, pc->writing);
+	return NULL;
+}
+
+static void pcompress_destroy(struct pcompress *pc) {
+	int i;
+
+	ASSERT_RET(pthread_mutex_lock(&pc->lock), == 0);
+	pc->closing = true;
+	ASSERT_RET(pthread_cond_broadcast(&pc->work_cond), == 0);
+	ASSERT_RET(pthread_mutex_unlock(&pc->lock), == 0);
+	for (i = 0; i < pc->nb_workers; i++)
+		ASSERT_RET(pthread_join(pc->workers[i], NULL), == 0);
+
+	for (i = 0; i < pc->nb_blocks; i++) {
+		free(pc->blocks[i].in);
+		free(pc->blocks[i].out);
+	}
+	ASSERT_RET(pthread_mutex_destroy(&pc->lock), == 0);
+	ASSERT_RET(pthread_cond_destroy(&pc->work_cond), == 0);
+	ASSERT_RET(pthread_cond_destroy(&pc->done_cond), == 0);
+	free(pc->chunks);
+	free(pc->blocks);
+	free(pc->workers);
+	free(pc);
+}
+
+static struct pcompress *pcompress_create(const struct pc_codec *codec,
+                                          int threads, bool writing,
+                                          int level) {
+	struct pcompress *pc;
+	int i;
+
+	pc = calloc(1, sizeof(struct pcompress));
+	if (pc == NULL)
+		return NULL;
+	pc->codec = codec;
+	pc->writing = writing;
+	pc->level = level;
+	/* Enough blocks to keep every worker busy while the caller
+	 * works through the ones already done */
+	pc->nb_blocks = threads * 2;
+	pc->blocks = calloc(pc->nb_blocks, sizeof(struct pc_block));
+	pc->workers = calloc(threads, sizeof(pthread_t));
+	if (pc->blocks == NULL || pc->workers == NULL) {
+		free(pc->blocks);
+		free(pc->workers);
+		free(pc);
+		return NULL;
+	}
+	ASSERT_RET(pthread_mutex_init(&pc->lock, NULL), == 0);
+	ASSERT_RET(pthread_cond_init(&pc->work_cond, NULL), == 0);
+	ASSERT_RET(pthread_cond_init(&pc->done_cond, NULL), == 0);
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&pc->workers[i], NULL, pcompress_worker,
+		                   pc) != 0)
+			break;
+		pc->nb_workers++;
+	}
+	/* Nothing would ever compress or decompress a block */
+	if (pc->nb_workers == 0) {
+		pcompress_destroy(pc);
+		return NULL;
+	}
+	return pc;
+}
+
+/* Hands the tail block to the workers */
+static void queue_tail(struct pcompress *pc) {
+	ASSERT_RET(pthread_mutex_lock(&pc->lock), == 0);
+	pc->blocks[pc->tail].state = BLOCK_QUEUED;
+	ASSERT_RET(pthread_cond_signal(&pc->work_cond), == 0);
+	ASSERT_RET(pthread_mutex_unlock(&pc->lock), == 0);
+	pc->tail = (pc->tail + 1) % pc->nb_blocks;
+	pc->pending++;
+	pc->nb_queued++;
+}
+
+/* Waits for a queued block to be finished by a worker */
+static struct pc_block *wait_block(struct pcompress *pc, int index) {
+	struct pc_block *b = &pc->blocks[index];
+
+	ASSERT_RET(pthread_mutex_lock(&pc->lock), == 0);
+	while (b->state != BLOCK_DONE)
+		ASSERT_RET(pthread_cond_wait(&pc->done_cond, &pc->lock), == 0);
+	ASSERT_RET(pthread_mutex_unlock(&pc->lock), == 0);
+	return b;
+}
+
+/* Frees the head block for reuse */
+static void release_head(struct pcompress *pc) {
+	struct pc_block *b = &pc->blocks[pc->head];
+
+	ASSERT_RET(pthread_mutex_lock(&pc->lock), == 0);
+	b->state = BLOCK_EMPTY;
+	b->in_len = 0;
+	b->out_len = 0;
+	b->raw_len = 0;
+	b->offset = 0;
+	b->ts = 0;
+	ASSERT_RET(pthread_mutex_unlock(&pc->lock), == 0);
+	pc->head = (pc->head + 1) % pc->nb_blocks;
+	pc->pending--;
+}
+
+static bool add_chunk(struct pcompress *pc, struct pc_block *b) {
+	struct pc_chunk *tmp;
+
+	if (pc->nb_chunks == pc->chunks_size) {
+		pc->chunks_size = pc->chunks_size ? pc->chunks_size * 2 : 64;
+		tmp = realloc(pc->chunks, pc->chunks_size * sizeof(struct pc_chunk));
+		if (tmp == NULL)
+			return false;
+		pc->chunks = tmp;
+	}
+	pc->chunks[pc->nb_chunks].size = b->out_len;
+	pc->chunks[pc->nb_chunks].raw_len = b->in_len;
+	pc->chunks[pc->nb_chunks].ts = b->ts;
+	pc->nb_chunks++;
+	return true;
+}
+
+/* Writes the oldest block out to the file, once it is compressed */
+static int write_head(struct pcompress *pc) {
+	struct pc_block *b = wait_block(pc, pc->head);
+	int ret = 0;
+
+	if (b->error || pc->failed || wandio_wwrite(pc->child_out, b->out,
+	                                            b->out_len) != (int64_t) b->out_len) {
+		pc->failed = true;
+		ret = -1;
+	} else if (pc->codec->indexed && !add_chunk(pc, b)) {
+		pc->failed = true;
+		ret = -1;
+	}
+	release_head(pc);
+	return ret;
+}
+
+/* Ends the current block, next_ts is the timestamp of the record
+ * starting the next block, if known */
+static int cut_tail(struct pcompress *pc, uint64_t next_ts) {
+	int ret = 0;
+
+	queue_tail(pc);
+	/* Every block is in use, wait for the oldest */
+	if (pc->pending == pc->nb_blocks)
+		ret = write_head(pc);
+	pc->blocks[pc->tail].ts = next_ts;
+	return ret;
+}
+
+/* The most data the current block can take before it must be cut */
+static size_t block_limit(struct pcompress *pc) {
+	struct pc_block *b = &pc->blocks[pc->tail];
+
+	if (pc->cut_pending)
+		return pc->cut_offset - (pc->offset - b->in_len);
+	if (pc->marked)
+		return MAX_CHUNK_SIZE;
+	return PCOMPRESS_BLOCK_SIZE;
+}
+
+static int64_t pc_wwrite(iow_t *iow, const char *buffer, int64_t len) {
+	struct pcompress *pc = (struct pcompress *) iow->data;
+	struct pc_block *b;
+	int64_t done = 0;
+	uint64_t ts;
+	size_t n, limit;
+
+	if (pc->failed)
+		return -1;
+
+	while (done < len) {
+		b = &pc->blocks[pc->tail];
+		limit = block_limit(pc);
+		n = limit - b->in_len;
+		if ((int64_t) n > len - done)
+			n = len - done;
+		if (!grow_buffer(&b->in, &b->in_size, b->in_len + n))
+			return -1;
+		memcpy(b->in + b->in_len, buffer + done, n);
+		b->in_len += n;
+		done += n;
+		pc->offset += n;
+
+		if (b->in_len == limit) {
+			ts = 0;
+			if (pc->cut_pending) {
+				ts = pc->cut_ts;
+				pc->cut_pending = false;
+			}
+			if (cut_tail(pc, ts) < 0)
+				return -1;
+		}
+	}
+	return len;
+}
+
+static bool write_index(struct pcompress *pc) {
+	size_t len = 8 + pc->nb_chunks * INDEX_ENTRY_SIZE + INDEX_FOOTER_SIZE;
+	unsigned char *buf, *p;
+	size_t i;
+	bool ret;
+
+	buf = malloc(len);
+	if (buf == NULL)
+		return false;
+	put_le32(buf, SKIPPABLE_MAGIC);
+	put_le32(buf + 4, len - 8);
+	p = buf + 8;
+	for (i = 0; i < pc->nb_chunks; i++, p += INDEX_ENTRY_SIZE) {
+		put_le32(p, pc->chunks[i].size);
+		put_le32(p + 4, pc->chunks[i].raw_len);
+		put_le64(p + 8, pc->chunks[i].ts);
+	}
+	put_le32(p, pc->nb_chunks);
+	p[4] = pc->marked ? INDEX_TIMESTAMPS : 0;
+	put_le32(p + 5, INDEX_MAGIC);
+
+	ret = wandio_wwrite(pc->child_out, buf, len) == (int64_t) len;
+	free(buf);
+	return ret;
+}
+
+static void pc_wclose(iow_t *iow) {
+	struct pcompress *pc = (struct pcompress *) iow->data;
+
+	if (pc->blocks[pc->tail].in_len > 0)
+		queue_tail(pc);
+	while (pc->pending > 0)
+		write_head(pc);
+	if (pc->codec->indexed && !pc->failed)
+		write_index(pc);
+
+	wandio_wdestroy(pc->child_out);
+	pcompress_destroy(pc);
+	free(iow);
+}
+
+static iow_source_t pc_wsource = {
+	.name = "pcompress",
+	.write = pc_wwrite,
+	.close = pc_wclose
+};
+
+iow_t *pcompress_wopen(iow_t *child, int type, int level, int threads) {
+	const struct pc_codec *codec = find_codec(type);
+	struct pcompress *pc;
+	iow_t *iow;
+
+	if (codec == NULL)
+		return NULL;
+	if (threads < 1)
+		threads = 1;
+	pc = pcompress_create(codec, threads, true, level);
+	if (pc == NULL)
+		return NULL;
+	iow = malloc(sizeof(iow_t));
+	if (iow == NULL) {
+		pcompress_destroy(pc);
+		return NULL;
+	}
+	pc->child_out = child;
+	iow->source = &pc_wsource;
+	iow->data = pc;
+	return iow;
+}
+
+void pcompress_mark(iow_t *iow, uint64_t ts, size_t buffered) {
+	struct pcompress *pc;
+	struct pc_block *b;
+	int64_t offset, start;
+
+	if (iow == NULL || iow->source != &pc_wsource)
+		return;
+	pc = (struct pcompress *) iow->data;
+	b = &pc->blocks[pc->tail];
+	offset = pc->offset + buffered;
+	start = pc->offset - b->in_len;
+	pc->marked = true;
+
+	/* The first chunk always starts at the start of the file */
+	if (b->ts == 0 && (offset == start || pc->nb_queued == 0)) {
+		b->ts = ts;
+		return;
+	}
+	if (pc->cut_pending || offset - start < PCOMPRESS_BLOCK_SIZE)
+		return;
+	if (offset == pc->offset) {
+		cut_tail(pc, ts);
+		return;
+	}
+	/* The record is still buffered by the format, cut when it arrives */
+	pc->cut_pending = true;
+	pc->cut_offset = offset;
+	pc->cut_ts = ts;
+}
+
+static bool read_fully(io_t *io, void *buffer, int64_t len) {
+	int64_t ret, done = 0;
+
+	while (done < len) {
+		ret = wandio_read(io, (char *) buffer + done, len - done);
+		if (ret <= 0)
+			return false;
+		done += ret;
+	}
+	return true;
+}
+
+/* Loads the chunk index from the end of the file */
+static bool read_index(struct pcompress *pc) {
+	unsigned char footer[INDEX_FOOTER_SIZE];
+	unsigned char *buf = NULL, *p;
+	int64_t end, start;
+	uint64_t offset = 0, pos = 0;
+	size_t i, nb, len;
+
+	end = wandio_seek(pc->child_in, -INDEX_FOOTER_SIZE, SEEK_END);
+	if (end < 0 || !read_fully(pc->child_in, footer, INDEX_FOOTER_SIZE) ||
+	    get_le32(footer + 5) != INDEX_MAGIC)
+		return false;
+
+	nb = get_le32(footer);
+	len = 8 + nb * INDEX_ENTRY_SIZE + INDEX_FOOTER_SIZE;
+	start = end + INDEX_FOOTER_SIZE - len;
+	if (start < 0)
+		return false;
+	buf = malloc(len - INDEX_FOOTER_SIZE);
+	pc->chunks = calloc(nb ? nb : 1, sizeof(struct pc_chunk));
+	if (buf == NULL || pc->chunks == NULL ||
+	    wandio_seek(pc->child_in, start, SEEK_SET) != start ||
+	    !read_fully(pc->child_in, buf, len - INDEX_FOOTER_SIZE) ||
+	    get_le32(buf) != SKIPPABLE_MAGIC || get_le32(buf + 4) != len - 8)
+		goto error;
+
+	for (i = 0, p = buf + 8; i < nb; i++, p += INDEX_ENTRY_SIZE) {
+		pc->chunks[i].offset = offset;
+		pc->chunks[i].pos = pos;
+		pc->chunks[i].size = get_le32(p);
+		pc->chunks[i].raw_len = get_le32(p + 4);
+		pc->chunks[i].ts = get_le64(p + 8);
+		if (pc->chunks[i].size > MAX_MEMBER_SIZE ||
+		    pc->chunks[i].raw_len > MAX_MEMBER_SIZE)
+			goto error;
+		offset += pc->chunks[i].size;
+		pos += pc->chunks[i].raw_len;
+	}
+	/* The chunks must fill the file up to the index */
+	if (offset != (uint64_t) start)
+		goto error;
+	pc->nb_chunks = nb;
+	pc->index_flags = footer[4];
+	free(buf);
+	return wandio_seek(pc->child_in, 0, SEEK_SET) == 0;
+
+error:
+	free(buf);
+	free(pc->chunks);
+	pc->chunks = NULL;
+	return false;
+}
+
+/* Reads the next member from the file into the tail block and queues it,
+ * returns 0 at the end of the file */
+static int read_member(struct pcompress *pc) {
+	struct pc_block *b = &pc->blocks[pc->tail];
+	unsigned char hdr[HEADER_SIZE];
+	int64_t ret;
+	uint32_t size;
+
+	if (pc->codec->indexed) {
+		struct pc_chunk *c;
+
+		if (pc->next_chunk == pc->nb_chunks) {
+			pc->child_eof = true;
+			return 0;
+		}
+		c = &pc->chunks[pc->next_chunk];
+		if (!grow_buffer(&b->in, &b->in_size, c->size) ||
+		    !read_fully(pc->child_in, b->in, c->size))
+			return -1;
+		b->in_len = c->size;
+		b->raw_len = c->raw_len;
+		pc->next_chunk++;
+		queue_tail(pc);
+		return 1;
+	}
+
+	ret = wandio_read(pc->child_in, hdr, HEADER_SIZE);
+	if (ret == 0) {
+		pc->child_eof = true;
+		return 0;
+	}
+	if (ret < 0 || (ret < HEADER_SIZE &&
+	                !read_fully(pc->child_in, hdr + ret, HEADER_SIZE - ret)))
+		return -1;
+	if (!is_member_header(hdr))
+		return -1;
+
+	size = get_le32(hdr + HEADER_SIZE - 4);
+	if (size < HEADER_SIZE + TRAILER_SIZE || size > MAX_MEMBER_SIZE)
+		return -1;
+	if (!grow_buffer(&b->in, &b->in_size, size))
+		return -1;
+	memcpy(b->in, hdr, HEADER_SIZE);
+	if (!read_fully(pc->child_in, b->in + HEADER_SIZE, size - HEADER_SIZE))
+		return -1;
+	b->in_len = size;
+	queue_tail(pc);
+	return 1;
+}
+
+/* Gets the block index places after the head, reading ahead to keep the
+ * workers busy. Returns NULL at the end of the file or on error. */
+static struct pc_block *block_at(struct pcompress *pc, int index) {
+	struct pc_block *b;
+
+	while (!pc->child_eof && !pc->failed && pc->pending < pc->nb_blocks) {
+		if (read_member(pc) < 0)
+			pc->failed = true;
+	}
+	if (index >= pc->pending)
+		return NULL;
+
+	b = wait_block(pc, (pc->head + index) % pc->nb_blocks);
+	if (b->error) {
+		pc->failed = true;
+		return NULL;
+	}
+	return b;
+}
+
+/* Copies (or skips if buffer is NULL) up to len bytes from the head */
+static int64_t consume(struct pcompress *pc, void *buffer, int64_t len) {
+	struct pc_block *b;
+	int64_t done = 0;
+	size_t n;
+
+	while (done < len) {
+		b = block_at(pc, 0);
+		if (b == NULL)
+			break;
+		n = b->out_len - b->offset;
+		if ((int64_t) n > len - done)
+			n = len - done;
+		if (buffer)
+			memcpy((char *) buffer + done, b->out + b->offset, n);
+		b->offset += n;
+		done += n;
+		if (b->offset == b->out_len)
+			release_head(pc);
+	}
+	pc->offset += done;
+	if (done == 0 && pc->failed)
+		return -1;
+	return done;
+}
+
+static int64_t pc_read(io_t *io, void *buffer, int64_t len) {
+	return consume((struct pcompress *) io->data, buffer, len);
+}
+
+static int64_t pc_peek(io_t *io, void *buffer, int64_t len) {
+	struct pcompress *pc = (struct pcompress *) io->data;
+	struct pc_block *b;
+	int64_t done = 0;
+	size_t n, offset;
+	int i;
+
+	for (i = 0; done < len && i < pc->nb_blocks; i++) {
+		b = block_at(pc, i);
+		if (b == NULL)
+			break;
+		offset = i == 0 ? b->offset : 0;
+		n = b->out_len - offset;
+		if ((int64_t) n > len - done)
+			n = len - done;
+		memcpy((char *) buffer + done, b->out + offset, n);
+		done += n;
+	}
+	if (done == 0 && pc->failed)
+		return -1;
+	return done;
+}
+
+static int64_t pc_tell(io_t *io) {
+	return ((struct pcompress *) io->data)->offset;
+}
+
+/* Finds the chunk holding an uncompressed offset */
+static size_t find_chunk(struct pcompress *pc, int64_t pos) {
+	size_t min = 0, max = pc->nb_chunks;
+
+	while (max - min > 1) {
+		size_t mid = (min + max) / 2;
+		if ((int64_t) pc->chunks[mid].pos <= pos)
+			min = mid;
+		else
+			max = mid;
+	}
+	return min;
+}
+
+/* Throws away everything read ahead and restarts from a chunk */
+static int restart_at(struct pcompress *pc, size_t chunk) {
+	while (pc->pending > 0) {
+		wait_block(pc, pc->head);
+		release_head(pc);
+	}
+	if (wandio_seek(pc->child_in, pc->chunks[chunk].offset, SEEK_SET) < 0)
+		return -1;
+	pc->next_chunk = chunk;
+	pc->child_eof = false;
+	pc->failed = false;
+	pc->offset = pc->chunks[chunk].pos;
+	return 0;
+}
+
+/* Files with a chunk index can seek anywhere, otherwise only seeking
+ * forwards is supported, by skipping data */
+static int64_t pc_seek(io_t *io, int64_t offset, int whence) {
+	struct pcompress *pc = (struct pcompress *) io->data;
+	int64_t target;
+	size_t chunk;
+
+	if (whence == SEEK_SET)
+		target = offset;
+	else if (whence == SEEK_CUR)
+		target = pc->offset + offset;
+	else if (whence == SEEK_END && pc->chunks && pc->nb_chunks > 0)
+		target = pc->chunks[pc->nb_chunks - 1].pos +
+		         pc->chunks[pc->nb_chunks - 1].raw_len + offset;
+	else
+		return -1;
+	if (target < 0)
+		return -1;
+
+	if (pc->chunks && pc->nb_chunks > 0) {
+		chunk = find_chunk(pc, target);
+		/* Jump rather than decompress chunks we don't need */
+		if (target < pc->offset || chunk > pc->next_chunk) {
+			if (restart_at(pc, chunk) < 0)
+				return -1;
+		}
+	} else if (target < pc->offset) {
+		return -1;
+	}
+
+	if (consume(pc, NULL, target - pc->offset) < 0)
+		return -1;
+	return pc->offset;
+}
+
+static void pc_close(io_t *io) {
+	struct pcompress *pc = (struct pcompress *) io->data;
+
+	wandio_destroy(pc->child_in);
+	pcompress_destroy(pc);
+	free(io);
+}
+
+static io_source_t pc_source = {
+	.name = "pcompress",
+	.read = pc_read,
+	.peek = pc_peek,
+	.tell = pc_tell,
+	.seek = pc_seek,
+	.close = pc_close
+};
+
+io_t *pcompress_open(const char *filename, int threads) {
+	unsigned char hdr[HEADER_SIZE];
+	const struct pc_codec *codec = NULL;
+	struct pcompress *pc;
+	io_t *child, *io;
+	int64_t len;
+	struct stat st;
+
+	/* We need to be able to peek and seek in the file, and opening it
+	 * separately from the reader wandio falls back to would lose the
+	 * bytes we peeked at from a pipe or FIFO */
+	if (strcmp(filename, "-") == 0 || stat(filename, &st) != 0 ||
+	    !S_ISREG(st.st_mode))
+		return NULL;
+#ifdef _SC_NPROCESSORS_ONLN
+	if (threads == 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads > PCOMPRESS_AUTO_THREADS)
+			threads = PCOMPRESS_AUTO_THREADS;
+	}
+#endif
+
+	child = wandio_create_uncompressed(filename);
+	if (child == NULL)
+		return NULL;
+	len = wandio_peek(child, hdr, HEADER_SIZE);
+	if (len == HEADER_SIZE && is_member_header(hdr)) {
+		/* wandio can read these fine with a single thread */
+		if (threads >= 2)
+			codec = find_codec(TRACE_OPTION_COMPRESSTYPE_ZLIB);
+	} else if (len >= 4 && get_le32(hdr) == ZSTD_FRAME_MAGIC) {
+		codec = find_codec(TRACE_OPTION_COMPRESSTYPE_ZSTD);
+	} else if (len >= 4 && get_le32(hdr) == LZ4_FRAME_MAGIC) {
+		codec = find_codec(TRACE_OPTION_COMPRESSTYPE_LZ4);
+	}
+	if (codec == NULL) {
+		wandio_destroy(child);
+		return NULL;
+	}
+	if (threads < 1)
+		threads = 1;
+
+	pc = pcompress_create(codec, threads, false, 0);
+	io = malloc(sizeof(io_t));
+	if (pc == NULL || io == NULL) {
+		if (pc)
+			pcompress_destroy(pc);
+		free(io);
+		wandio_destroy(child);
+		return NULL;
+	}
+	pc->child_in = child;
+	if (codec->indexed && !read_index(pc)) {
+		/* Not written by us, or truncated */
+		pcompress_destroy(pc);
+		free(io);
+		wandio_destroy(child);
+		return NULL;
+	}
+	io->source = &pc_source;
+	io->data = pc;
+	return io;
+}
+
+int64_t pcompress_seek_timestamp(io_t *io, uint64_t ts) {
+	struct pcompress *pc;
+	int64_t pos = 0;
+	size_t i;
+
+	if (io == NULL || io->source != &pc_source)
+		return -1;
+	pc = (struct pcompress *) io->data;
+	if (!pc->chunks || !(pc->index_flags & INDEX_TIMESTAMPS))
+		return -1;
+
+	/* Start in the last chunk that begins strictly before ts, as records
+	 * at ts may be at the end of the chunk before one that begins at ts.
+	 * Timestamps that go backwards only make the caller read earlier */
+	for (i = 1; i < pc->nb_chunks; i++) {
+		if (pc->chunks[i].ts == 0)
+			continue;
+		if (pc->chunks[i].ts >= ts)
+			break;
+		pos = pc->chunks[i].pos;
+	}
+	return pc_seek(io, pos, SEEK_SET);
+}
@@ -0,0 +1,105 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#ifndef PARALLEL_COMPRESS_H
+#define PARALLEL_COMPRESS_H
+#include "wandio.h"
+#include <stdint.h>
+
+/** @file
+ *
+ * @brief Block parallel compression for trace files
+ *
+ * Output is split into blocks which a pool of worker threads compresses
+ * independently. The blocks are written out in order, so the result is a
+ * standard file that the usual tools can decompress.
+ *
+ * gzip output is a multi-member gzip file. Each member carries its
+ * compressed size in a gzip extra field, which lets the reader find the next
+ * member without decompressing the current one.
+ *
+ * zstd and lz4 output is a series of frames followed by a skippable frame
+ * holding an index of the chunks. The index lets readers jump straight to any
+ * chunk, including the chunk holding a given timestamp if the format marked
+ * its records with pcompress_mark().
+ */
+
+/** The amount of uncompressed data in each block */
+#define PCOMPRESS_BLOCK_SIZE (1024 * 1024)
+
+/** The most worker threads used to decompress if not configured */
+#define PCOMPRESS_AUTO_THREADS 4
+
+/** Creates a writer that compresses blocks in parallel
+ *
+ * @param child		The writer to write the compressed file to, this is
+ * 			destroyed when the returned writer is destroyed
+ * @param type		The compression type, one of
+ * 			TRACE_OPTION_COMPRESSTYPE_ZLIB, _ZSTD or _LZ4
+ * @param level		The compression level
+ * @param threads	The number of threads compressing blocks
+ * @return A wandio writer, or NULL if the compression type is not supported
+ * or an error occurred
+ */
+iow_t *pcompress_wopen(iow_t *child, int type, int level, int threads);
+
+/** Marks the start of a record in a file being written
+ *
+ * Blocks are then only split at the start of a record, and the chunk index
+ * records the timestamp of the first record in each chunk. Does nothing if
+ * the writer was not created by pcompress_wopen().
+ *
+ * @param iow		The writer
+ * @param ts		The ERF timestamp of the record
+ * @param buffered	The number of bytes the caller has buffered but not
+ * 			written yet, the record starts after these
+ */
+void pcompress_mark(iow_t *iow, uint64_t ts, size_t buffered);
+
+/** Opens a file written by pcompress_wopen() for parallel decompression
+ *
+ * @param filename	The name of the file to open
+ * @param threads	The number of threads decompressing blocks, 0 picks
+ * 			a number based on the number of CPU cores
+ * @return A wandio reader, or NULL if the file could not be opened or
+ * was not written by pcompress_wopen(). gzip files are only opened if
+ * more than one thread is used, as wandio reads them just as well. Only
+ * regular files are opened, never pipes or FIFOs, so they can be opened
+ * again by wandio without losing data.
+ */
+io_t *pcompress_open(const char *filename, int threads);
+
+/** Seeks to the start of the chunk holding a timestamp
+ *
+ * The caller then reads forward to find the exact record.
+ *
+ * @param io		A reader opened with pcompress_open()
+ * @param ts		The ERF timestamp to find
+ * @return The new offset in the uncompressed data, the start of a record or
+ * the start of the file, or -1 if the file has no timestamp index
+ */
+int64_t pcompress_seek_timestamp(io_t *io, uint64_t ts);
+
+#endif /* PARALLEL_COMPRESS_H */
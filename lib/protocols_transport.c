@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <stdio.h> // fprintf
 #include <string.h>
+#include <stddef.h>
 
 /* This file contains all the protocol decoding functions for transport layer
  * protocols. This includes functions for access port numbers.
@@ -545,6 +546,149 @@ DLLEXPORT uint16_t *trace_checksum_transport(libtrace_packet_t *packet,
 	return (uint16_t *)csum_ptr;
 }
 
+/* Finds the transport header directly after an IP header, if this packet
+ * holds the start of it */
+static void *rewrite_get_transport(libtrace_packet_t *packet, void *l3,
+		uint16_t ethertype, uint8_t *proto, uint32_t *remaining) {
+	uint8_t more;
+
+	/* Returns NULL for later fragments */
+	if (ethertype == TRACE_ETHERTYPE_IP)
+		return trace_get_payload_from_ip((libtrace_ip_t *)l3, proto,
+				remaining);
+
+	/* trace_get_payload_from_ip6() walks past fragment headers */
+	if (trace_get_fragment_offset(packet, &more) != 0)
+		return NULL;
+	return trace_get_payload_from_ip6((libtrace_ip6_t *)l3, proto,
+			remaining);
+}
+
+/* Finds the transport checksum that covers the addresses and ports, if it
+ * was captured and is in use */
+static uint16_t *rewrite_get_checksum(void *transport, uint8_t proto,
+		uint16_t ethertype, uint32_t remaining) {
+
+	if (transport == NULL)
+		return NULL;
+
+	if (proto == TRACE_IPPROTO_TCP) {
+		libtrace_tcp_t *tcp = (libtrace_tcp_t *)transport;
+		if (remaining < offsetof(libtrace_tcp_t, check) + 2)
+			return NULL;
+		return (uint16_t *)((char *)tcp +
+				offsetof(libtrace_tcp_t, check));
+	}
+	if (proto == TRACE_IPPROTO_UDP) {
+		libtrace_udp_t *udp = (libtrace_udp_t *)transport;
+		if (remaining < sizeof(libtrace_udp_t))
+			return NULL;
+		/* Zero means no checksum, but only over IPv4 */
+		if (udp->check == 0 && ethertype == TRACE_ETHERTYPE_IP)
+			return NULL;
+		return (uint16_t *)((char *)udp +
+				offsetof(libtrace_udp_t, check));
+	}
+	/* ICMPv6 has a pseudo header, ICMP does not */
+	if (proto == TRACE_IPPROTO_ICMPV6 &&
+			ethertype == TRACE_ETHERTYPE_IPV6) {
+		libtrace_icmp6_t *icmp6 = (libtrace_icmp6_t *)transport;
+		if (remaining < sizeof(libtrace_icmp6_t))
+			return NULL;
+		return (uint16_t *)((char *)icmp6 +
+				offsetof(libtrace_icmp6_t, checksum));
+	}
+	return NULL;
+}
+
+DLLEXPORT int trace_rewrite_field(libtrace_packet_t *packet,
+		libtrace_rewrite_field_t field, const void *value) {
+
+	void *l3, *transport;
+	uint16_t ethertype;
+	uint32_t remaining;
+	uint8_t proto = 0;
+	libtrace_ip_t *ip = NULL;
+	libtrace_ip6_t *ip6 = NULL;
+	uint16_t *ipsum = NULL;
+	uint16_t *transsum = NULL;
+	uint8_t *target;
+	uint8_t old[16];
+	size_t len;
+
+	l3 = trace_get_layer3(packet, &ethertype, &remaining);
+	if (l3 == NULL)
+		return -1;
+
+	if (ethertype == TRACE_ETHERTYPE_IP) {
+		if (remaining < sizeof(libtrace_ip_t))
+			return -1;
+		ip = (libtrace_ip_t *)l3;
+		ipsum = (uint16_t *)((char *)ip +
+				offsetof(libtrace_ip_t, ip_sum));
+	} else if (ethertype == TRACE_ETHERTYPE_IPV6) {
+		if (remaining < sizeof(libtrace_ip6_t))
+			return -1;
+		ip6 = (libtrace_ip6_t *)l3;
+	} else {
+		return -1;
+	}
+
+	transport = rewrite_get_transport(packet, l3, ethertype, &proto,
+			&remaining);
+	transsum = rewrite_get_checksum(transport, proto, ethertype,
+			remaining);
+
+	switch (field) {
+		case TRACE_REWRITE_SRC_ADDR:
+			target = ip ? (uint8_t *)&ip->ip_src :
+					(uint8_t *)&ip6->ip_src;
+			len = ip ? sizeof(struct in_addr) :
+					sizeof(struct in6_addr);
+			break;
+		case TRACE_REWRITE_DST_ADDR:
+			target = ip ? (uint8_t *)&ip->ip_dst :
+					(uint8_t *)&ip6->ip_dst;
+			len = ip ? sizeof(struct in_addr) :
+					sizeof(struct in6_addr);
+			break;
+		case TRACE_REWRITE_SRC_PORT:
+		case TRACE_REWRITE_DST_PORT:
+			if (transport == NULL || remaining < 4 ||
+					(proto != TRACE_IPPROTO_TCP &&
+					 proto != TRACE_IPPROTO_UDP))
+				return -1;
+			/* Both TCP and UDP start with the ports */
+			target = (uint8_t *)transport;
+			if (field == TRACE_REWRITE_DST_PORT)
+				target += sizeof(uint16_t);
+			len = sizeof(uint16_t);
+			ipsum = NULL;
+			break;
+		case TRACE_REWRITE_TTL:
+			target = ip ? &ip->ip_ttl : &ip6->hlim;
+			len = sizeof(uint8_t);
+			transsum = NULL;
+			break;
+		default:
+			return -1;
+	}
+
+	memcpy(old, target, len);
+	memcpy(target, value, len);
+
+	if (ipsum)
+		trace_checksum_update(ipsum, old, target, len);
+	if (transsum) {
+		trace_checksum_update(transsum, old, target, len);
+		/* A UDP checksum of zero is sent as all ones */
+		if (proto == TRACE_IPPROTO_UDP &&
+				memcmp(transsum, "\0\0", 2) == 0)
+			memset(transsum, 0xff, 2);
+	}
+	return 0;
+}
+
 DLLEXPORT void *trace_get_payload_from_gre(libtrace_gre_t *gre,
         uint32_t *remaining)
 {
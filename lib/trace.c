@@ -147,6 +147,7 @@ static void trace_init(void)
 		pcapng_constructor();
                 rt_constructor();
                 ndag_constructor();
+                merge_constructor();
 #ifdef HAVE_DAG
 		dag_constructor();
 #endif
@@ -190,7 +191,9 @@ static void guess_format(libtrace_t *libtrace, const char *filename)
 		}
 	}
 
-	libtrace->io = wandio_create(filename);
+	/* The same reader is kept to read the trace once the format is
+	 * known, so nothing peeked from a pipe is lost */
+	libtrace->io = trace_open_io(filename, 0);
 	if (!libtrace->io)
 		return;
 
@@ -251,7 +254,9 @@ DLLEXPORT libtrace_t *trace_create(const char *uri) {
 	libtrace->event.packet = NULL;
 	libtrace->event.psize = 0;
 	libtrace->event.trace_last_ts = 0.0;
+	libtrace->event.trace_first_ts = 0.0;
 	libtrace->event.waiting = false;
+	libtrace->replayspeedup = 1;
 	libtrace->filter = NULL;
 	libtrace->snaplen = 0;
 	libtrace->started=false;
@@ -378,6 +383,8 @@ DLLEXPORT libtrace_t * trace_create_dead (const char *uri) {
 	libtrace->event.packet = NULL;
 	libtrace->event.psize = 0;
 	libtrace->event.trace_last_ts = 0.0;
+	libtrace->event.trace_first_ts = 0.0;
+	libtrace->replayspeedup = 1;
 	libtrace->filter = NULL;
 	libtrace->snaplen = 0;
 	libtrace->started=false;
@@ -453,6 +460,7 @@ DLLEXPORT libtrace_out_t *trace_create_output(const char *uri) {
 	strcpy(libtrace->err.problem,"Error message set\n");
         libtrace->format = NULL;
 	libtrace->uridata = NULL;
+	libtrace->compress_threads = 0;
 
         /* Parse the URI to determine what capture format we want to write */
 
@@ -579,6 +587,17 @@ DLLEXPORT int trace_config(libtrace_t *libtrace,
 		                        (enum hasher_types) *((int *) value),
 		                        NULL, NULL);
 
+	/* Replay speed is entirely managed by libtrace */
+	if (option == TRACE_OPTION_REPLAY_SPEEDUP) {
+		if (*(size_t *)value < 1) {
+			trace_set_err(libtrace, TRACE_ERR_BAD_STATE,
+				"Replay speedup must be at least 1");
+			return -1;
+		}
+		libtrace->replayspeedup = *(size_t *)value;
+		return 0;
+	}
+
 	/* If the capture format supports configuration, try using their
 	 * native configuration first */
 	if (libtrace->format->config_input) {
@@ -631,6 +650,7 @@ DLLEXPORT int trace_config(libtrace_t *libtrace,
 			}
 			return -1;
 		case TRACE_OPTION_HASHER:
+		case TRACE_OPTION_REPLAY_SPEEDUP:
 			/* Dealt with earlier */
 			return -1;
 
@@ -664,6 +684,10 @@ DLLEXPORT int trace_set_event_realtime(libtrace_t *trace, bool realtime) {
 	return trace_config(trace, TRACE_OPTION_EVENT_REALTIME, &tmp);
 }
 
+DLLEXPORT int trace_set_replay_speedup(libtrace_t *trace, size_t speedup) {
+	return trace_config(trace, TRACE_OPTION_REPLAY_SPEEDUP, &speedup);
+}
+
 DLLEXPORT int trace_config_output(libtrace_out_t *libtrace, 
 		trace_option_output_t option,
 		void *value) {
@@ -671,6 +695,13 @@ DLLEXPORT int trace_config_output(libtrace_out_t *libtrace,
 	/* Unlike the input options, libtrace does not natively support any of
 	 * the output options - the format module must be able to deal with
 	 * them. */
+	if (option == TRACE_OPTION_OUTPUT_COMPRESS_THREADS) {
+		/* Used by trace_open_file_out() */
+		if (*(int *) value < 0)
+			return -1;
+		libtrace->compress_threads = *(int *) value;
+		return 0;
+	}
 	if (libtrace->format->config_output) {
 		return libtrace->format->config_output(libtrace, option, value);
 	}
@@ -724,7 +755,10 @@ DLLEXPORT void trace_destroy(libtrace_t *libtrace) {
 		libtrace_ocache_destroy(&libtrace->packet_freelist);
 		for (i = 0; i < libtrace->perpkt_thread_count; ++i) {
                         libtrace_message_queue_destroy(&libtrace->perpkt_threads[i].messages);
+                        free(libtrace->perpkt_threads[i].perf_stats);
                 }
+                free(libtrace->hasher_thread.perf_stats);
+                free(libtrace->reporter_thread.perf_stats);
                 libtrace_message_queue_destroy(&libtrace->hasher_thread.messages);
                 libtrace_message_queue_destroy(&libtrace->keepalive_thread.messages);
                 libtrace_message_queue_destroy(&libtrace->reporter_thread.messages);
@@ -1030,6 +1064,13 @@ int trace_prepare_packet(libtrace_t *trace, libtrace_packet_t *packet,
 
 }
 
+/* Don't try to convert meta-packets across formats */
+static inline bool skip_write_packet(libtrace_out_t *libtrace,
+                libtrace_packet_t *packet) {
+        return strcmp(libtrace->format->name, packet->trace->format->name) != 0
+                        && IS_LIBTRACE_META_PACKET(packet);
+}
+
 /* Writes a packet to the specified output trace
  *
  * @param libtrace	describes the output format, destination, etc.
@@ -1046,9 +1087,7 @@ DLLEXPORT int trace_write_packet(libtrace_out_t *libtrace, libtrace_packet_t *pa
 		return -1;
 	}
 
-        /* Don't try to convert meta-packets across formats */
-        if (strcmp(libtrace->format->name, packet->trace->format->name) != 0 &&
-                        IS_LIBTRACE_META_PACKET(packet)) {
+        if (skip_write_packet(libtrace, packet)) {
                 return 0;
         }
 
@@ -1060,6 +1099,57 @@ DLLEXPORT int trace_write_packet(libtrace_out_t *libtrace, libtrace_packet_t *pa
 	return -1;
 }
 
+/* The most packets passed to a format's write_packets at once */
+#define WRITE_BATCH_SIZE 64
+
+DLLEXPORT int trace_write_packets(libtrace_out_t *libtrace,
+		libtrace_packet_t *packets[], size_t nb_packets) {
+	libtrace_packet_t *batch[WRITE_BATCH_SIZE];
+	size_t i, nb_batch = 0;
+	int ret, total = 0;
+
+	assert(libtrace);
+	assert(packets);
+	if (!libtrace->started) {
+		trace_set_err_out(libtrace,TRACE_ERR_BAD_STATE,
+			"Trace is not started before trace_write_packets");
+		return -1;
+	}
+
+	/* Fallback to writing the packets one at a time */
+	if (!libtrace->format->write_packets) {
+		for (i = 0; i < nb_packets; i++) {
+			ret = trace_write_packet(libtrace, packets[i]);
+			if (ret < 0)
+				return -1;
+			total += ret;
+		}
+		return total;
+	}
+
+	for (i = 0; i < nb_packets; i++) {
+		assert(packets[i]);
+		if (skip_write_packet(libtrace, packets[i]))
+			continue;
+		batch[nb_batch++] = packets[i];
+		if (nb_batch == WRITE_BATCH_SIZE) {
+			ret = libtrace->format->write_packets(libtrace, batch,
+			                                      nb_batch);
+			if (ret < 0)
+				return -1;
+			total += ret;
+			nb_batch = 0;
+		}
+	}
+	if (nb_batch > 0) {
+		ret = libtrace->format->write_packets(libtrace, batch, nb_batch);
+		if (ret < 0)
+			return -1;
+		total += ret;
+	}
+	return total;
+}
+
 /* Get a pointer to the first byte of the packet payload */
 DLLEXPORT void *trace_get_packet_buffer(const libtrace_packet_t *packet,
 		libtrace_linktype_t *linktype, uint32_t *remaining) {
@@ -1431,7 +1521,7 @@ DLLEXPORT void trace_destroy_filter(libtrace_filter_t *filter)
  *
  * @returns -1 on error, 0 on success
  */
-static int trace_bpf_compile(libtrace_filter_t *filter,
+int trace_bpf_compile(libtrace_filter_t *filter,
 		const libtrace_packet_t *packet,
 		void *linkptr,
 		libtrace_linktype_t linktype	) {
@@ -1497,30 +1587,32 @@ static int trace_bpf_compile(libtrace_filter_t *filter,
 #endif
 }
 
-DLLEXPORT int trace_apply_filter(libtrace_filter_t *filter,
-			const libtrace_packet_t *packet) {
+/* Find the start of a packet as a BPF program sees it, demoting a copy of
+ * the packet if pcap has no equivalent of its link type.
+ *
+ * @internal
+ *
+ * @returns 1 if the packet is not data and should match every filter, 0 on
+ * success or -1 on error. If *copy is set on success, the caller must destroy
+ * it once finished with linkptr.
+ */
+int trace_bpf_prepare_packet(const libtrace_packet_t *packet,
+		libtrace_packet_t **copy, void **linkptr, uint32_t *clen,
+		libtrace_linktype_t *linktype) {
 #ifdef HAVE_BPF
-	void *linkptr = 0;
-	uint32_t clen = 0;
-	bool free_packet_needed = false;
-	int ret;
-	libtrace_linktype_t linktype;
 	libtrace_packet_t *packet_copy = (libtrace_packet_t*)packet;
-#ifdef HAVE_LLVM
-	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif
 
-	assert(filter);
-	assert(packet);
+	*copy = NULL;
+	*linkptr = NULL;
 
 	/* Match all non-data packets as we probably want them to pass
 	 * through to the caller */
-	linktype = trace_get_link_type(packet);
+	*linktype = trace_get_link_type(packet);
 
-	if (linktype == TRACE_TYPE_NONDATA || linktype == TRACE_TYPE_ERF_META)
+	if (*linktype == TRACE_TYPE_NONDATA || *linktype == TRACE_TYPE_ERF_META)
 		return 1;
 
-	if (libtrace_to_pcap_dlt(linktype)==TRACE_DLT_ERROR) {
+	if (libtrace_to_pcap_dlt(*linktype)==TRACE_DLT_ERROR) {
 
 		/* If we cannot get a suitable DLT for the packet, it may
 		 * be because the packet is encapsulated in a link type that
@@ -1531,26 +1623,52 @@ DLLEXPORT int trace_apply_filter(libtrace_filter_t *filter,
 		/* Copy the packet, as we don't want to trash the one we
 		 * were passed in */
 		packet_copy=trace_copy_packet(packet);
-		free_packet_needed=true;
 
-		while (libtrace_to_pcap_dlt(linktype) == TRACE_DLT_ERROR) {
+		while (libtrace_to_pcap_dlt(*linktype) == TRACE_DLT_ERROR) {
 			if (!demote_packet(packet_copy)) {
 				trace_set_err(packet->trace,
 						TRACE_ERR_NO_CONVERSION,
 						"pcap does not support this format");
-				if (free_packet_needed) {
-					trace_destroy_packet(packet_copy);
-				}
+				trace_destroy_packet(packet_copy);
 				return -1;
 			}
-			linktype = trace_get_link_type(packet_copy);
+			*linktype = trace_get_link_type(packet_copy);
 		}
-
+		*copy = packet_copy;
 	}
 
-	linkptr = trace_get_packet_buffer(packet_copy,NULL,&clen);
+	*linkptr = trace_get_packet_buffer(packet_copy,NULL,clen);
+	return 0;
+#else
+	assert(!"Internal bug: This should never be called when BPF not enabled");
+	trace_set_err(packet->trace,TRACE_ERR_OPTION_UNAVAIL,
+				"Feature unavailable");
+	return -1;
+#endif
+}
+
+DLLEXPORT int trace_apply_filter(libtrace_filter_t *filter,
+			const libtrace_packet_t *packet) {
+#ifdef HAVE_BPF
+	void *linkptr = 0;
+	uint32_t clen = 0;
+	int ret;
+	libtrace_linktype_t linktype;
+	libtrace_packet_t *packet_copy = NULL;
+#ifdef HAVE_LLVM
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+	assert(filter);
+	assert(packet);
+
+	ret = trace_bpf_prepare_packet(packet, &packet_copy, &linkptr, &clen,
+			&linktype);
+	if (ret != 0)
+		return ret;
+
 	if (!linkptr) {
-		if (free_packet_needed) {
+		if (packet_copy) {
 			trace_destroy_packet(packet_copy);
 		}
 		return 0;
@@ -1560,8 +1678,9 @@ DLLEXPORT int trace_apply_filter(libtrace_filter_t *filter,
 	 * what the link type was
 	 */
 	// Note internal mutex locking used here
-	if (trace_bpf_compile(filter,packet_copy,linkptr,linktype)==-1) {
-		if (free_packet_needed) {
+	if (trace_bpf_compile(filter,packet_copy ? packet_copy : packet,
+				linkptr,linktype)==-1) {
+		if (packet_copy) {
 			trace_destroy_packet(packet_copy);
 		}
 		return -1;
@@ -1590,7 +1709,7 @@ DLLEXPORT int trace_apply_filter(libtrace_filter_t *filter,
 #endif
 
 	/* If we copied the packet earlier, make sure that we free it */
-	if (free_packet_needed) {
+	if (packet_copy) {
 		trace_destroy_packet(packet_copy);
 	}
 	return ret;
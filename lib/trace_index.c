@@ -0,0 +1,234 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+#include "libtrace.h"
+#include "libtrace_int.h"
+#include "trace_index.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The amount of trace between index entries if the caller doesn't say */
+#define DEFAULT_INDEX_SPACING (1024 * 1024)
+
+struct libtrace_index_writer {
+	FILE *file;
+	char *name;
+	/* The amount of trace between entries */
+	uint64_t spacing;
+	/* The last entry written */
+	libtrace_index_entry_t last;
+	int count;
+};
+
+char *trace_index_name(const char *filename) {
+	char *name = malloc(strlen(filename) + 5);
+
+	if (name)
+		sprintf(name, "%s.idx", filename);
+	return name;
+}
+
+libtrace_index_t *trace_index_load(const char *filename) {
+	libtrace_index_t *index = NULL;
+	char *name;
+	FILE *f;
+	long len;
+	size_t i;
+
+	name = trace_index_name(filename);
+	if (name == NULL)
+		return NULL;
+	f = fopen(name, "rb");
+	free(name);
+	if (f == NULL)
+		return NULL;
+
+	if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) <= 0 ||
+			len % sizeof(libtrace_index_entry_t) != 0 ||
+			fseek(f, 0, SEEK_SET) != 0)
+		goto fail;
+
+	index = malloc(sizeof(libtrace_index_t));
+	if (index == NULL)
+		goto fail;
+	index->count = len / sizeof(libtrace_index_entry_t);
+	index->entries = malloc(len);
+	if (index->entries == NULL)
+		goto fail;
+	if (fread(index->entries, sizeof(libtrace_index_entry_t), index->count,
+			f) != index->count)
+		goto fail;
+
+	/* Searching an unsorted index would give the wrong answer, it is
+	 * better to fall back to reading the whole trace */
+	for (i = 1; i < index->count; i++) {
+		if (index->entries[i].timestamp < index->entries[i - 1].timestamp)
+			goto fail;
+	}
+	fclose(f);
+	return index;
+
+fail:
+	trace_index_destroy(index);
+	fclose(f);
+	return NULL;
+}
+
+uint64_t trace_index_find(const libtrace_index_t *index, uint64_t ts) {
+	size_t min = 0, max = index->count;
+
+	/* Find the first entry at or after ts */
+	while (min < max) {
+		size_t mid = min + (max - min) / 2;
+		if (index->entries[mid].timestamp < ts)
+			min = mid + 1;
+		else
+			max = mid;
+	}
+	if (min == 0)
+		return 0;
+	return index->entries[min - 1].offset;
+}
+
+void trace_index_destroy(libtrace_index_t *index) {
+	if (index == NULL)
+		return;
+	free(index->entries);
+	free(index);
+}
+
+libtrace_index_writer_t *trace_index_wopen(const char *indexname,
+		uint64_t spacing) {
+	libtrace_index_writer_t *writer;
+
+	writer = calloc(1, sizeof(libtrace_index_writer_t));
+	if (writer == NULL)
+		return NULL;
+	writer->name = strdup(indexname);
+	if (writer->name == NULL) {
+		free(writer);
+		return NULL;
+	}
+	writer->file = fopen(indexname, "wb");
+	if (writer->file == NULL) {
+		free(writer->name);
+		free(writer);
+		return NULL;
+	}
+	writer->spacing = spacing ? spacing : DEFAULT_INDEX_SPACING;
+	return writer;
+}
+
+int trace_index_add(libtrace_index_writer_t *writer, uint64_t ts,
+		uint64_t offset) {
+	libtrace_index_entry_t entry;
+
+	if (writer->count > 0) {
+		if (offset < writer->last.offset + writer->spacing)
+			return 0;
+		/* Keep the index sorted if the trace is not */
+		if (ts < writer->last.timestamp)
+			return 0;
+	}
+
+	entry.timestamp = ts;
+	entry.offset = offset;
+	if (fwrite(&entry, sizeof(entry), 1, writer->file) != 1)
+		return -1;
+	writer->last = entry;
+	writer->count++;
+	return 0;
+}
+
+int trace_index_wclose(libtrace_index_writer_t *writer, bool keep) {
+	int ret = writer->count;
+
+	if (fclose(writer->file) != 0)
+		ret = -1;
+	if (ret < 0 || !keep)
+		remove(writer->name);
+	free(writer->name);
+	free(writer);
+	return ret;
+}
+
+DLLEXPORT int trace_create_index(libtrace_t *trace, const char *indexname,
+		uint64_t spacing) {
+	libtrace_index_writer_t *writer;
+	libtrace_packet_t *packet;
+	char *name;
+	int64_t off;
+	int ret;
+
+	if (!trace->started || !trace->io) {
+		trace_set_err(trace, TRACE_ERR_UNSUPPORTED,
+				"Indexes can only be made for started trace files");
+		return -1;
+	}
+
+	name = indexname ? strdup(indexname) : trace_index_name(trace->uridata);
+	if (name == NULL) {
+		trace_set_err(trace, ENOMEM, "Out of memory");
+		return -1;
+	}
+	writer = trace_index_wopen(name, spacing);
+	if (writer == NULL) {
+		trace_set_err(trace, errno, "Unable to create index %s", name);
+		free(name);
+		return -1;
+	}
+
+	packet = trace_create_packet();
+	for (;;) {
+		off = wandio_tell(trace->io);
+		if ((ret = trace_read_packet(trace, packet)) <= 0)
+			break;
+		/* Seeking to meta records may repeat them, pcapng interfaces
+		 * for instance, so only data records are indexed */
+		if (IS_LIBTRACE_META_PACKET(packet) || off < 0)
+			continue;
+		if (trace_index_add(writer, trace_get_erf_timestamp(packet),
+					off) < 0) {
+			trace_set_err(trace, errno, "Unable to write index %s",
+					name);
+			ret = -1;
+			break;
+		}
+	}
+	trace_destroy_packet(packet);
+
+	if (ret < 0) {
+		trace_index_wclose(writer, false);
+	} else if ((ret = trace_index_wclose(writer, true)) < 0) {
+		trace_set_err(trace, errno, "Unable to write index %s", name);
+	}
+	free(name);
+	return ret;
+}
@@ -0,0 +1,125 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#ifndef TRACE_INDEX_H
+#define TRACE_INDEX_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/** @file
+ *
+ * @brief Timestamp indexes for seeking in trace files
+ *
+ * An index is a sidecar file, usually named after the trace with ".idx"
+ * appended, made by trace_create_index(). It is a sorted array of entries
+ * mapping the ERF timestamp of a record to its offset in the uncompressed
+ * trace. Entries are sparse, so a seek jumps to the nearest entry at or
+ * before the wanted time and reads forward from there.
+ *
+ * Offsets are always into the uncompressed data. Chunked zstd and lz4 files
+ * map them to the right chunk when seeking.
+ */
+
+/** An entry in a timestamp index, in host byte order */
+typedef struct libtrace_index_entry {
+	/** The ERF timestamp of the record */
+	uint64_t timestamp;
+	/** The offset of the record in the uncompressed trace */
+	uint64_t offset;
+} libtrace_index_entry_t;
+
+/** A timestamp index loaded into memory */
+typedef struct libtrace_index {
+	libtrace_index_entry_t *entries;
+	size_t count;
+} libtrace_index_t;
+
+/** An index file being written */
+typedef struct libtrace_index_writer libtrace_index_writer_t;
+
+/** Gets the name of the index for a trace file
+ *
+ * @param filename	The name of the trace file
+ * @return The name of the index, which the caller must free, or NULL if out
+ * of memory
+ */
+char *trace_index_name(const char *filename);
+
+/** Loads the index for a trace file
+ *
+ * @param filename	The name of the trace file, the index is this name
+ * 			with ".idx" appended
+ * @return The index, or NULL if the trace has no index or it is not valid
+ */
+libtrace_index_t *trace_index_load(const char *filename);
+
+/** Finds where to start reading to find a timestamp
+ *
+ * @param index		The index
+ * @param ts		The ERF timestamp to find
+ * @return The offset of the last indexed record earlier than ts, or 0 if
+ * there is none
+ */
+uint64_t trace_index_find(const libtrace_index_t *index, uint64_t ts);
+
+/** Frees an index returned by trace_index_load() */
+void trace_index_destroy(libtrace_index_t *index);
+
+/** Creates an index file
+ *
+ * @param indexname	The name of the index file
+ * @param spacing	The least number of bytes of trace between entries, 0
+ * 			for the default of 1MB
+ * @return The index writer, or NULL with errno set if the file could not be
+ * created
+ */
+libtrace_index_writer_t *trace_index_wopen(const char *indexname,
+		uint64_t spacing);
+
+/** Adds a record to an index
+ *
+ * Records are passed in the order they appear in the trace. Only those at
+ * least the spacing past the last entry are added to the index, as long as
+ * they keep the index sorted.
+ *
+ * @param writer	The index writer
+ * @param ts		The ERF timestamp of the record
+ * @param offset	The offset of the record in the uncompressed trace
+ * @return 0 on success, -1 with errno set if the index could not be written
+ */
+int trace_index_add(libtrace_index_writer_t *writer, uint64_t ts,
+		uint64_t offset);
+
+/** Finishes writing an index
+ *
+ * @param writer	The index writer, which is freed
+ * @param keep		False to remove the index, e.g. if the trace failed
+ * @return The number of entries in the index, or -1 with errno set if it
+ * could not be written, in which case it is removed
+ */
+int trace_index_wclose(libtrace_index_writer_t *writer, bool keep);
+
+#endif /* TRACE_INDEX_H */
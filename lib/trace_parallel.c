@@ -92,11 +92,15 @@
 #include "hash_toeplitz.h"
 
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <unistd.h>
 #include <ctype.h>
 
 static inline int delay_tracetime(libtrace_t *libtrace, libtrace_packet_t *packet, libtrace_thread_t *t);
+static int trace_pread_packet_hasher_thread(libtrace_t *libtrace, libtrace_thread_t *t, libtrace_packet_t *packets[], size_t nb_packets);
+static int trace_pread_packet_work_stealing(libtrace_t *libtrace, libtrace_thread_t *t, libtrace_packet_t *packets[], size_t nb_packets);
+static void dispatch_queued_batches(libtrace_t *trace, libtrace_thread_t *t);
 extern int libtrace_parallel;
 
 struct mem_stats {
@@ -379,10 +383,20 @@ void libtrace_zero_thread(libtrace_thread_t * t) {
 	t->accepted_packets = 0;
 	t->filtered_packets = 0;
 	t->recorded_first = false;
-	t->tracetime_offset_usec = 0;
+	t->tracetime_start_usec = 0;
+	t->tracetime_first_usec = 0;
 	t->user_data = 0;
 	t->format_data = 0;
 	libtrace_zero_ringbuffer(&t->rbuffer);
+	libtrace_zero_deque(&t->batches);
+	t->batch_order = 0;
+	/* trace_destroy() closes the message pipes of the hasher, reporter
+	 * and keepalive threads whether they ran or not, so make sure that an
+	 * unused pipe is not stdin */
+	t->messages.pipefd[0] = -1;
+	t->messages.pipefd[1] = -1;
+	memset(&t->wait_stats, 0, sizeof(t->wait_stats));
+	t->perf_stats = NULL;
 	t->trace = NULL;
 	t->ret = NULL;
 	t->type = THREAD_EMPTY;
@@ -459,6 +473,187 @@ static void trace_thread_pause(libtrace_t *trace, libtrace_thread_t *t) {
 	ASSERT_RET(pthread_mutex_unlock(&trace->libtrace_lock), == 0);
 }
 
+/** Pauses the CPU briefly within a spin loop */
+static inline void cpu_relax(void) {
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+}
+
+/** A monotonic clock in nanoseconds, used to time waits and stages */
+static inline uint64_t monotonic_ns(void) {
+#if HAVE_CLOCK_GETTIME
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000000ull + tv.tv_usec * 1000ull;
+#endif
+}
+
+/* Adapters so that each type of wait can share spin_wait() */
+static bool try_ringbuffer_read(void *rb, void *value) {
+	return libtrace_ringbuffer_try_read((libtrace_ringbuffer_t *) rb,
+	                                    (void **) value);
+}
+
+static bool try_ringbuffer_write(void *rb, void *value) {
+	return libtrace_ringbuffer_try_write((libtrace_ringbuffer_t *) rb,
+	                                     *(void **) value);
+}
+
+static bool try_message_get(void *mq, void *message) {
+	return libtrace_message_queue_try_get((libtrace_message_queue_t *) mq,
+	                                      message) != LIBTRACE_MQ_FAILED;
+}
+
+/**
+ * Spins on the try function as allowed by the trace's wait policy.
+ * The time spent is recorded against the thread.
+ *
+ * @param start Set to the time the spin started, if it was unsuccessful the
+ *              caller should then block and call record_sleep().
+ * @return true if the try function succeeded, otherwise false
+ */
+static bool spin_wait(libtrace_t *trace, libtrace_thread_t *t,
+                      bool (*try_fn)(void *, void *), void *obj, void *arg,
+                      uint64_t *start) {
+	size_t spins;
+	bool polling = trace->config.wait_policy == WAIT_POLLING;
+
+	*start = monotonic_ns();
+	if (trace->config.wait_policy != WAIT_BLOCKING) {
+		for (spins = 0; polling || spins < trace->config.spin_count;
+		     ++spins) {
+			cpu_relax();
+			if ((*try_fn)(obj, arg)) {
+				t->wait_stats.spins++;
+				t->wait_stats.spin_ns += monotonic_ns() - *start;
+				return true;
+			}
+		}
+		t->wait_stats.spin_ns += monotonic_ns() - *start;
+		*start = monotonic_ns();
+	}
+	return false;
+}
+
+/**
+ * Starts timing a stage, if performance statistics are enabled.
+ *
+ * @return The start time to pass to perf_record(), 0 if disabled
+ */
+static inline uint64_t perf_start(libtrace_t *trace) {
+	if (trace->config.perf_stats)
+		return monotonic_ns();
+	return 0;
+}
+
+/**
+ * Maps a time to a log-linear histogram bucket. Values below 4 get their
+ * own bucket, each power of two above this is split into 4.
+ */
+static inline size_t perf_bucket(uint64_t ns) {
+	int msb;
+
+	if (ns < 4)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+}
+
+/** The smallest value which maps to a histogram bucket */
+static inline uint64_t perf_bucket_value(size_t bucket) {
+	size_t msb;
+
+	if (bucket < 4)
+		return bucket;
+	msb = bucket / 4 + 1;
+	return (uint64_t) (4 | (bucket % 4)) << (msb - 2);
+}
+
+/**
+ * Records the time spent in a stage against the thread.
+ *
+ * @param start The time returned by perf_start()
+ */
+static void perf_record(libtrace_thread_t *t, enum perf_stages stage,
+                        uint64_t start) {
+	libtrace_perf_stage_stat_t *stat;
+	uint64_t ns;
+
+	if (!start || !t)
+		return;
+	ns = monotonic_ns() - start;
+	if (!t->perf_stats) {
+		t->perf_stats = calloc(1, sizeof(libtrace_perf_stat_t));
+		if (!t->perf_stats)
+			return;
+	}
+	stat = &t->perf_stats->stages[stage];
+	stat->count++;
+	stat->total_ns += ns;
+	if (ns > stat->max_ns)
+		stat->max_ns = ns;
+	stat->buckets[perf_bucket(ns)]++;
+}
+
+static inline void record_sleep(libtrace_thread_t *t, uint64_t start) {
+	t->wait_stats.sleeps++;
+	t->wait_stats.sleep_ns += monotonic_ns() - start;
+}
+
+/**
+ * Reads from a ring buffer, waiting as per the trace's wait policy
+ */
+static void *wait_ringbuffer_read(libtrace_t *trace, libtrace_thread_t *t,
+                                  libtrace_ringbuffer_t *rb) {
+	void *value;
+	uint64_t start;
+
+	/* Fast path, nothing to wait for */
+	if (libtrace_ringbuffer_try_read(rb, &value))
+		return value;
+	if (spin_wait(trace, t, try_ringbuffer_read, rb, &value, &start))
+		return value;
+	value = libtrace_ringbuffer_read(rb);
+	record_sleep(t, start);
+	return value;
+}
+
+/**
+ * Writes to a ring buffer, waiting as per the trace's wait policy
+ */
+static void wait_ringbuffer_write(libtrace_t *trace, libtrace_thread_t *t,
+                                  libtrace_ringbuffer_t *rb, void *value) {
+	uint64_t start;
+
+	if (libtrace_ringbuffer_try_write(rb, value))
+		return;
+	if (spin_wait(trace, t, try_ringbuffer_write, rb, &value, &start))
+		return;
+	libtrace_ringbuffer_write(rb, value);
+	record_sleep(t, start);
+}
+
+/**
+ * Gets a message from a thread's queue, waiting as per the trace's wait
+ * policy
+ */
+static void wait_message_get(libtrace_t *trace, libtrace_thread_t *t,
+                             libtrace_message_t *message) {
+	uint64_t start;
+
+	if (libtrace_message_queue_try_get(&t->messages, message) != LIBTRACE_MQ_FAILED)
+		return;
+	if (spin_wait(trace, t, try_message_get, &t->messages, message, &start))
+		return;
+	libtrace_message_queue_get(&t->messages, message);
+	record_sleep(t, start);
+}
+
 /**
  * Sends a packet to the user, expects either a valid packet or a TICK packet.
  *
@@ -485,8 +680,11 @@ static inline int dispatch_packet(libtrace_t *trace,
                 if (!IS_LIBTRACE_META_PACKET((*packet))) {
         		t->accepted_packets++;
                 }
-		if (trace->perpkt_cbs->message_packet)
+		if (trace->perpkt_cbs->message_packet) {
+			uint64_t start = perf_start(trace);
 			*packet = (*trace->perpkt_cbs->message_packet)(trace, t, trace->global_blob, t->user_data, *packet);
+			perf_record(t, PERF_STAGE_CALLBACK, start);
+		}
 		trace_fin_packet(*packet);
 	} else {
 		assert((*packet)->error == READ_TICK);
@@ -583,20 +781,27 @@ static int trace_perpkt_thread_pause(libtrace_t *trace, libtrace_thread_t *t,
 			} else if (ret != READ_MESSAGE) {
 				/* Ignore messages we pick these up next loop */
 				assert (ret == READ_EOF || ret == READ_ERROR);
-				/* Verify no packets are remaining */
-				/* TODO refactor this sanity check out!! */
-				while (!libtrace_ringbuffer_is_empty(&t->rbuffer)) {
-					ASSERT_RET(trace->pread(trace, t, &packet, 1), <= 0);
+				/* Verify no packets are remaining. Once the
+				 * EOF is stored pread() only returns that, so
+				 * read the queue directly, it may still hold
+				 * the message packets sent by trace_ppause() */
+				libtrace_ocache_free(&trace->packet_freelist, (void **) &packet, 1, 1);
+				while (libtrace_ringbuffer_try_read(&t->rbuffer, (void **) &packet)) {
 					// No packets after this should have any data in them
 					assert(packet->error <= 0);
+					libtrace_ocache_free(&trace->packet_freelist, (void **) &packet, 1, 1);
 				}
-				libtrace_ocache_free(&trace->packet_freelist, (void **) &packet, 1, 1);
 				return -1;
 			}
 		}
 	}
 	libtrace_ocache_free(&trace->packet_freelist, (void **) &packet, 1, 1);
 
+	/* If work stealing, send through every batch still queued so none
+	 * are left holding packets while the format is paused */
+	if (trace->pread == trace_pread_packet_work_stealing)
+		dispatch_queued_batches(trace, t);
+
 	/* Now we do the actual pause, this returns when we resumed */
 	trace_thread_pause(trace, t);
 	send_message(trace, t, MESSAGE_RESUMING, gen_zero, t);
@@ -687,6 +892,7 @@ static void* perpkt_threads_entry(void *data) {
 						      nb_packets - empty,
 						      nb_packets - empty);
 			}
+			uint64_t start = perf_start(trace);
 			if (!trace->pread) {
 				assert(packets[0]);
 				ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
@@ -698,6 +904,9 @@ static void* perpkt_threads_entry(void *data) {
 			} else {
 				nb_packets = trace->pread(trace, t, packets, trace->config.burst_size);
 			}
+			/* With a hasher thread we are reading from our queue */
+			perf_record(t, trace->pread == trace_pread_packet_hasher_thread ?
+			            PERF_STAGE_DEQUEUE : PERF_STAGE_READ, start);
 			offset = 0;
 			empty = 0;
 		}
@@ -781,6 +990,7 @@ static void* hasher_entry(void *data) {
 	libtrace_packet_t * packet;
 	libtrace_message_t message = {0, {.uint64=0}, NULL};
 	int pkt_skipped = 0;
+	uint64_t start;
 
 	assert(trace_has_dedicated_hasher(trace));
 	/* Wait until all threads are started and objects are initialised (ring buffers) */
@@ -833,7 +1043,10 @@ static void* hasher_entry(void *data) {
 			continue;
 		}
 
-		if ((packet->error = trace_read_packet(trace, packet)) <1) {
+		start = perf_start(trace);
+		packet->error = trace_read_packet(trace, packet);
+		perf_record(t, PERF_STAGE_READ, start);
+		if (packet->error < 1) {
 			if (packet->error == READ_MESSAGE) {
 				pkt_skipped = 1;
 				continue;
@@ -843,12 +1056,16 @@ static void* hasher_entry(void *data) {
 		}
 
 		/* We are guaranteed to have a hash function i.e. != NULL */
+		start = perf_start(trace);
 		trace_packet_set_hash(packet, (*trace->hasher)(packet, trace->hasher_data));
+		perf_record(t, PERF_STAGE_HASH, start);
 		thread = trace_packet_get_hash(packet) % trace->perpkt_thread_count;
 		/* Blocking write to the correct queue - I'm the only writer */
 		if (trace->perpkt_threads[thread].state != THREAD_FINISHED) {
 			uint64_t order = trace_packet_get_order(packet);
-			libtrace_ringbuffer_write(&trace->perpkt_threads[thread].rbuffer, packet);
+			start = perf_start(trace);
+			wait_ringbuffer_write(trace, t, &trace->perpkt_threads[thread].rbuffer, packet);
+			perf_record(t, PERF_STAGE_ENQUEUE, start);
 			if (trace->config.tick_count && order % trace->config.tick_count == 0) {
 				// Write ticks to everyone else
 				libtrace_packet_t * pkts[trace->perpkt_thread_count];
@@ -857,7 +1074,7 @@ static void* hasher_entry(void *data) {
 				for (i = 0; i < trace->perpkt_thread_count; i++) {
 					pkts[i]->error = READ_TICK;
 					trace_packet_set_order(pkts[i], order);
-					libtrace_ringbuffer_write(&trace->perpkt_threads[i].rbuffer, pkts[i]);
+					wait_ringbuffer_write(trace, t, &trace->perpkt_threads[i].rbuffer, pkts[i]);
 				}
 			}
 			pkt_skipped = 0;
@@ -906,7 +1123,6 @@ static int trace_pread_packet_first_in_first_served(libtrace_t *libtrace,
                                                     libtrace_packet_t *packets[],
                                                     size_t nb_packets) {
 	size_t i = 0;
-	//bool tick_hit = false;
 
 	ASSERT_RET(pthread_mutex_lock(&libtrace->read_packet_lock), == 0);
 	/* Read nb_packets */
@@ -930,25 +1146,31 @@ static int trace_pread_packet_first_in_first_served(libtrace_t *libtrace,
 				break;
 			}
 		}
-		/*
-		if (libtrace->config.tick_count && trace_packet_get_order(packets[i]) % libtrace->config.tick_count == 0) {
-			tick_hit = true;
-		}*/
 
 	        // Doing this inside the lock ensures the first packet is
                 // always recorded first
                 if (!t->recorded_first && packets[0]->error > 0) {
 		        store_first_packet(libtrace, packets[0], t);
                 }
+
+		/* Ticks stay in order with the packets: the batch ends at the
+		 * tick and every thread is told before the lock is released,
+		 * so each sees it after the packets it already has and before
+		 * any it reads later. Playing back in tracetime can stop part
+		 * way through a batch to handle messages, so no ticks then. */
+		if (libtrace->config.tick_count && !libtrace->tracetime &&
+				trace_packet_get_order(packets[i]) %
+				libtrace->config.tick_count == 0) {
+			libtrace_message_t tick;
+			tick.code = MESSAGE_TICK_COUNT;
+			tick.data.uint64 = trace_packet_get_order(packets[i]);
+			tick.sender = t;
+			trace_message_perpkts(libtrace, &tick);
+			++i;
+			break;
+		}
 	}
 	ASSERT_RET(pthread_mutex_unlock(&libtrace->read_packet_lock), == 0);
-	/* XXX TODO this needs to be inband with packets, or we don't bother in this case
-	if (tick_hit) {
-		libtrace_message_t tick;
-		tick.additional.uint64 = trace_packet_get_order(packets[i]);
-		tick.code = MESSAGE_TICK;
-		trace_send_message_to_perpkts(libtrace, &tick);
-	} */
 	return i;
 }
 
@@ -971,7 +1193,7 @@ inline static int trace_pread_packet_hasher_thread(libtrace_t *libtrace,
 	// Always grab at least one
 	if (packets[0]) // Recycle the old get the new
 		libtrace_ocache_free(&libtrace->packet_freelist, (void **) packets, 1, 1);
-	packets[0] = libtrace_ringbuffer_read(&t->rbuffer);
+	packets[0] = wait_ringbuffer_read(libtrace, t, &t->rbuffer);
 
 	if (packets[0]->error <= 0 && packets[0]->error != READ_TICK) {
 		return packets[0]->error;
@@ -1001,6 +1223,286 @@ inline static int trace_pread_packet_hasher_thread(libtrace_t *libtrace,
 	return i;
 }
 
+/* The number of batches the work stealing reader will queue against a single
+ * perpkt thread, once reached the reader moves on to the next thread */
+#define MAX_QUEUED_BATCHES 2
+
+/** A fixed size batch of packets queued against a perpkt thread */
+struct packet_batch {
+	size_t nb_packets;
+	libtrace_packet_t *packets[];
+};
+
+/* Size of a batch, which is also the element size of each thread's deque */
+static inline size_t packet_batch_size(libtrace_t *libtrace) {
+	return sizeof(struct packet_batch) +
+	       sizeof(libtrace_packet_t *) * libtrace->config.burst_size;
+}
+
+/* Declares aligned stack storage large enough to hold a batch */
+#define PACKET_BATCH_STORAGE(libtrace, name) \
+	void *name[packet_batch_size(libtrace) / sizeof(void *) + 1]
+
+/* True if a tick is due after the given packet */
+static inline bool tick_due(libtrace_t *libtrace, libtrace_packet_t *packet) {
+	return libtrace->config.tick_count &&
+	       trace_packet_get_order(packet) % libtrace->config.tick_count == 0;
+}
+
+/**
+ * Reads up to nb packets from the trace into empty packets, stopping after
+ * a packet which is due a tick. The read_packet_lock must be held.
+ *
+ * @param status [out] The result of the last read, > 0 unless an EOF,
+ *               error or message cut the read short
+ * @return The number of packets read
+ */
+static size_t read_packets(libtrace_t *libtrace, libtrace_packet_t *packets[],
+                           size_t nb, int *status) {
+	size_t i;
+
+	*status = 1;
+	for (i = 0; i < nb; ++i) {
+		*status = trace_read_packet(libtrace, packets[i]);
+		packets[i]->error = *status;
+		if (*status <= 0)
+			break;
+		if (tick_due(libtrace, packets[i]))
+			return i + 1;
+	}
+	return i;
+}
+
+/**
+ * Queues a tick packet against every running perpkt thread, behind the
+ * batches it already has, so that each thread sees the tick after every
+ * packet read before it. The read_packet_lock must be held.
+ *
+ * A thread is skipped rather than waiting for a free packet, it will see
+ * the next tick instead. Likewise no ticks are queued once the trace starts
+ * pausing, as per fill_packet_batches().
+ */
+static void queue_tick_batches(libtrace_t *libtrace, uint64_t order) {
+	PACKET_BATCH_STORAGE(libtrace, storage);
+	struct packet_batch *batch = (struct packet_batch *) storage;
+	int i;
+
+	if (libtrace->state != STATE_RUNNING)
+		return;
+	batch->nb_packets = 1;
+	for (i = 0; i < libtrace->perpkt_thread_count; ++i) {
+		libtrace_thread_t *target = &libtrace->perpkt_threads[i];
+
+		if (target->state != THREAD_RUNNING)
+			continue;
+		if (libtrace_ocache_alloc(&libtrace->packet_freelist,
+		                          (void **) batch->packets, 1, 0) == 0)
+			continue;
+		batch->packets[0]->error = READ_TICK;
+		trace_packet_set_order(batch->packets[0], order);
+		libtrace_deque_push_back(&target->batches, batch);
+	}
+}
+
+/**
+ * Notes the result of a read by the work stealing reader, queuing a tick
+ * if one is due after the last packet read. The read_packet_lock must be
+ * held and any batch read must already be queued.
+ *
+ * Upon EOF or error, batch_read_status is updated, after which no more
+ * batches will be queued. A message will be picked up by the thread.
+ */
+static void finish_packet_read(libtrace_t *libtrace, libtrace_packet_t *last,
+                               int status) {
+	if (status <= 0) {
+		if (status != READ_MESSAGE)
+			libtrace->batch_read_status = status;
+	} else if (last && tick_due(libtrace, last)) {
+		queue_tick_batches(libtrace, trace_packet_get_order(last));
+	}
+}
+
+/**
+ * Reads a batch for every other perpkt thread with room in its queue, so
+ * that the work is spread across all threads. The read_packet_lock must be
+ * held.
+ *
+ * The packets come from the cache without waiting, as they might only be
+ * freed by a thread waiting on the lock. Filling stops once the cache has
+ * none to spare or the trace runs out of packets.
+ *
+ * Nothing is queued once the trace starts pausing, each thread sends its
+ * queue on as it pauses so none must be added behind it. Otherwise those
+ * batches would only be processed after resuming, behind newer packets.
+ */
+static void fill_packet_batches(libtrace_t *libtrace, libtrace_thread_t *t) {
+	PACKET_BATCH_STORAGE(libtrace, storage);
+	struct packet_batch *batch = (struct packet_batch *) storage;
+	int i;
+
+	for (i = 1; i < libtrace->perpkt_thread_count; ++i) {
+		libtrace_thread_t *target;
+		size_t nb;
+		int ret;
+
+		if (libtrace->state != STATE_RUNNING ||
+		    libtrace->batch_read_status <= 0)
+			return;
+		target = &libtrace->perpkt_threads[(t->perpkt_num + i) %
+		                                   libtrace->perpkt_thread_count];
+		if (target->state != THREAD_RUNNING ||
+		    libtrace_deque_get_size(&target->batches) >= MAX_QUEUED_BATCHES)
+			continue;
+
+		nb = libtrace_ocache_alloc(&libtrace->packet_freelist,
+		                           (void **) batch->packets,
+		                           libtrace->config.burst_size, 0);
+		if (nb == 0)
+			return;
+		batch->nb_packets = read_packets(libtrace, batch->packets, nb,
+		                                 &ret);
+		/* Return the packets we didn't fill */
+		if (batch->nb_packets < nb)
+			libtrace_ocache_free(&libtrace->packet_freelist,
+			                     (void **) &batch->packets[batch->nb_packets],
+			                     nb - batch->nb_packets,
+			                     nb - batch->nb_packets);
+		if (batch->nb_packets)
+			libtrace_deque_push_back(&target->batches, batch);
+		finish_packet_read(libtrace, batch->nb_packets ?
+		                   batch->packets[batch->nb_packets - 1] : NULL,
+		                   ret);
+		if (ret <= 0)
+			return;
+	}
+}
+
+/**
+ * Takes a batch from the thread's own queue, otherwise steals the oldest
+ * batch queued against another thread.
+ *
+ * Only batches newer than every packet the thread has already taken are
+ * stolen, so that the results of each thread stay in order, as the ordered
+ * combiner expects.
+ *
+ * @return 1 if a batch was found, otherwise 0
+ */
+static int take_packet_batch(libtrace_t *libtrace, libtrace_thread_t *t,
+                             struct packet_batch *batch) {
+	int i;
+
+	if (libtrace_deque_pop_front(&t->batches, batch))
+		return 1;
+
+	for (i = 1; i < libtrace->perpkt_thread_count; ++i) {
+		libtrace_thread_t *victim;
+		victim = &libtrace->perpkt_threads[(t->perpkt_num + i) %
+		                                   libtrace->perpkt_thread_count];
+		/* Each queue is in order, so the batch popped can only be
+		 * newer than the one peeked if the owner took that first */
+		if (!libtrace_deque_peek_front(&victim->batches, batch) ||
+		    trace_packet_get_order(batch->packets[0]) <= t->batch_order)
+			continue;
+		if (libtrace_deque_pop_front(&victim->batches, batch))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * For formats without parallel support, when work stealing is enabled.
+ *
+ * Whichever thread runs out of work first becomes the reader, it reads its
+ * own batch of packets and then a batch for each other thread, which is
+ * queued against that thread. A thread with an empty queue steals whole
+ * batches from other threads before becoming the reader itself. As such a
+ * thread with an expensive batch does not hold up the rest.
+ *
+ * Ticks are queued in line with the batches, see queue_tick_batches().
+ */
+static int trace_pread_packet_work_stealing(libtrace_t *libtrace,
+                                            libtrace_thread_t *t,
+                                            libtrace_packet_t *packets[],
+                                            size_t nb_packets) {
+	PACKET_BATCH_STORAGE(libtrace, storage);
+	struct packet_batch *batch = (struct packet_batch *) storage;
+	size_t i;
+
+	while (!take_packet_batch(libtrace, t, batch)) {
+		int status;
+
+		if (libtrace_message_queue_count(&t->messages) > 0)
+			return READ_MESSAGE;
+
+		ASSERT_RET(pthread_mutex_lock(&libtrace->read_packet_lock), == 0);
+		status = libtrace->batch_read_status;
+		/* Another reader might have filled our queue while we waited */
+		if (status > 0 && libtrace_deque_get_size(&t->batches) == 0) {
+			/* Our own batch is read straight into the packets
+			 * we were given, which never waits on the cache */
+			i = read_packets(libtrace, packets, nb_packets, &status);
+			if (i > 0)
+				t->batch_order = trace_packet_get_order(packets[i - 1]);
+			finish_packet_read(libtrace, i ? packets[i - 1] : NULL,
+			                   status);
+			fill_packet_batches(libtrace, t);
+			ASSERT_RET(pthread_mutex_unlock(&libtrace->read_packet_lock), == 0);
+			return i ? (int) i : status;
+		}
+		ASSERT_RET(pthread_mutex_unlock(&libtrace->read_packet_lock), == 0);
+
+		if (status <= 0) {
+			/* Nothing more will be queued, so only report the
+			 * EOF or error once every batch has been consumed */
+			if (take_packet_batch(libtrace, t, batch))
+				break;
+			return status;
+		}
+	}
+
+	/* Swap the batch in place of the empty packets we were given */
+	assert(batch->nb_packets <= nb_packets);
+	for (i = 0; i < batch->nb_packets; ++i) {
+		if (packets[i])
+			libtrace_ocache_free(&libtrace->packet_freelist,
+			                     (void **) &packets[i], 1, 1);
+		packets[i] = batch->packets[i];
+	}
+	t->batch_order = trace_packet_get_order(packets[i - 1]);
+	return batch->nb_packets;
+}
+
+/**
+ * Sends every batch queued against this perpkt thread to the user without
+ * delay, used when pausing a trace which is work stealing.
+ *
+ * The trace is already pausing, so once any reader holding the lock is done
+ * nothing more is queued and each thread only needs to send its own queue.
+ */
+static void dispatch_queued_batches(libtrace_t *trace, libtrace_thread_t *t) {
+	PACKET_BATCH_STORAGE(trace, storage);
+	struct packet_batch *batch = (struct packet_batch *) storage;
+	size_t i;
+
+	ASSERT_RET(pthread_mutex_lock(&trace->read_packet_lock), == 0);
+	ASSERT_RET(pthread_mutex_unlock(&trace->read_packet_lock), == 0);
+
+	while (libtrace_deque_pop_front(&t->batches, batch)) {
+		t->batch_order = trace_packet_get_order(
+		                 batch->packets[batch->nb_packets - 1]);
+		for (i = 0; i < batch->nb_packets; ++i) {
+			if (batch->packets[i]->error > 0)
+				store_first_packet(trace, batch->packets[i], t);
+			ASSERT_RET(dispatch_packet(trace, t, &batch->packets[i],
+			                           false), == 0);
+			if (batch->packets[i])
+				libtrace_ocache_free(&trace->packet_freelist,
+				                     (void **) &batch->packets[i],
+				                     1, 1);
+		}
+	}
+}
+
 /**
  * For the first packet of each queue we keep a copy and note the system
  * time it was received at.
@@ -1014,6 +1516,7 @@ void store_first_packet(libtrace_t *libtrace, libtrace_packet_t *packet, libtrac
 
         libtrace_message_t mesg = {0, {.uint64=0}, NULL};
         struct timeval tv;
+        uint64_t mono_usec;
         libtrace_packet_t * dup;
 
         if (t->recorded_first) {
@@ -1026,11 +1529,13 @@ void store_first_packet(libtrace_t *libtrace, libtrace_packet_t *packet, libtrac
 
         /* We mark system time against a copy of the packet */
         gettimeofday(&tv, NULL);
+        mono_usec = monotonic_ns() / 1000;
         dup = trace_copy_packet(packet);
 
         ASSERT_RET(pthread_spin_lock(&libtrace->first_packets.lock), == 0);
         libtrace->first_packets.packets[t->perpkt_num].packet = dup;
         memcpy(&libtrace->first_packets.packets[t->perpkt_num].tv, &tv, sizeof(tv));
+        libtrace->first_packets.packets[t->perpkt_num].mono_usec = mono_usec;
         libtrace->first_packets.count++;
 
         /* Now update the first */
@@ -1053,12 +1558,16 @@ void store_first_packet(libtrace_t *libtrace, libtrace_packet_t *packet, libtrac
         t->recorded_first = true;
 }
 
-DLLEXPORT int trace_get_first_packet(libtrace_t *libtrace,
-                                     libtrace_thread_t *t,
-                                     const libtrace_packet_t **packet,
-                                     const struct timeval **tv)
+/**
+ * Implements trace_get_first_packet(), additionally returning the monotonic
+ * time the packet was seen, in microseconds, if mono_usec is not NULL.
+ */
+static int get_first_packet(libtrace_t *libtrace, libtrace_thread_t *t,
+                            const libtrace_packet_t **packet,
+                            const struct timeval **tv, uint64_t *mono_usec)
 {
 	void * tmp;
+	uint64_t first_usec = 0;
 	int ret = 0;
 
 	if (t) {
@@ -1077,20 +1586,18 @@ DLLEXPORT int trace_get_first_packet(libtrace_t *libtrace,
 		/* Get the requested thread */
 		*packet = libtrace->first_packets.packets[t->perpkt_num].packet;
 		*tv = &libtrace->first_packets.packets[t->perpkt_num].tv;
+		first_usec = libtrace->first_packets.packets[t->perpkt_num].mono_usec;
 	} else if (libtrace->first_packets.count) {
 		/* Get the first packet across all threads */
 		*packet = libtrace->first_packets.packets[libtrace->first_packets.first].packet;
 		*tv = &libtrace->first_packets.packets[libtrace->first_packets.first].tv;
+		first_usec = libtrace->first_packets.packets[libtrace->first_packets.first].mono_usec;
 		if (libtrace->first_packets.count == (size_t) libtrace->perpkt_thread_count) {
 			ret = 1;
 		} else {
-			struct timeval curr_tv;
 			// If a second has passed since the first entry we will assume this is the very first packet
-			gettimeofday(&curr_tv, NULL);
-			if (curr_tv.tv_sec > (*tv)->tv_sec) {
-				if(curr_tv.tv_usec > (*tv)->tv_usec || curr_tv.tv_sec - (*tv)->tv_sec > 1) {
-					ret = 1;
-				}
+			if (monotonic_ns() / 1000 - first_usec > 1000000) {
+				ret = 1;
 			}
 		}
 	} else {
@@ -1098,9 +1605,19 @@ DLLEXPORT int trace_get_first_packet(libtrace_t *libtrace,
 		*tv = NULL;
 	}
 	ASSERT_RET(pthread_spin_unlock(&libtrace->first_packets.lock), == 0);
+	if (mono_usec)
+		*mono_usec = first_usec;
 	return ret;
 }
 
+DLLEXPORT int trace_get_first_packet(libtrace_t *libtrace,
+                                     libtrace_thread_t *t,
+                                     const libtrace_packet_t **packet,
+                                     const struct timeval **tv)
+{
+	return get_first_packet(libtrace, t, packet, tv, NULL);
+}
+
 
 DLLEXPORT uint64_t tv_to_usec(const struct timeval *tv)
 {
@@ -1120,6 +1637,10 @@ static void* reporter_entry(void *data) {
 	libtrace_message_t message = {0, {.uint64=0}, NULL};
 	libtrace_t *trace = (libtrace_t *)data;
 	libtrace_thread_t *t = &trace->reporter_thread;
+	uint64_t start;
+	uint64_t next_perf_print = 0;
+	/* Polls in a row which found no message */
+	size_t idle = 0;
 
 	/* Wait until all threads are started */
 	ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
@@ -1138,16 +1659,28 @@ static void* reporter_entry(void *data) {
 	send_message(trace, t, MESSAGE_RESUMING, (libtrace_generic_t){0}, t);
 
 	while (!trace_has_finished(trace)) {
-		if (trace->config.reporter_polling) {
-			if (libtrace_message_queue_try_get(&t->messages, &message) == LIBTRACE_MQ_FAILED)
+		if (trace->config.reporter_polling ||
+		    trace->config.wait_policy == WAIT_POLLING) {
+			if (libtrace_message_queue_try_get(&t->messages, &message) == LIBTRACE_MQ_FAILED) {
 				message.code = MESSAGE_POST_REPORTER;
+				/* Back off once idle, as the perpkt threads do
+				 * when polling their queues */
+				if (idle < trace->config.spin_count)
+					idle++;
+				else
+					sched_yield();
+			} else {
+				idle = 0;
+			}
 		} else {
-			libtrace_message_queue_get(&t->messages, &message);
+			wait_message_get(trace, t, &message);
 		}
 		switch (message.code) {
 			// Check for results
 			case MESSAGE_POST_REPORTER:
+				start = perf_start(trace);
 				trace->combiner.read(trace, &trace->combiner);
+				perf_record(t, PERF_STAGE_COMBINE, start);
 				break;
 			case MESSAGE_DO_PAUSE:
 				assert(trace->combiner.pause);
@@ -1162,10 +1695,22 @@ static void* reporter_entry(void *data) {
                         send_message(trace, t, message.code, message.data,
                                         message.sender);
 		}
+
+		if (trace->config.perf_stats && trace->config.perf_stats_interval) {
+			uint64_t now = monotonic_ns();
+			if (now >= next_perf_print) {
+				if (next_perf_print)
+					trace_print_perf_statistics(trace, NULL, stderr);
+				next_perf_print = now +
+					trace->config.perf_stats_interval * 1000000ull;
+			}
+		}
 	}
 
 	// Flush out whats left now all our threads have finished
+	start = perf_start(trace);
 	trace->combiner.read_final(trace, &trace->combiner);
+	perf_record(t, PERF_STAGE_COMBINE, start);
 
 	// GOODBYE
         send_message(trace, t, MESSAGE_PAUSING,(libtrace_generic_t) {0}, t);
@@ -1225,8 +1770,16 @@ done:
 	return NULL;
 }
 
+/* When playing back in trace time, the final stretch before a packet is due
+ * is busy-waited rather than slept, as a sleep may overshoot by this much */
+#define TRACETIME_SPIN_USEC 100
+
 /**
- * Delays a packets playback so the playback will be in trace time.
+ * Delays a packets playback so the playback will be in trace time, sped up
+ * by the tracetime_speedup factor. Packets due within the tracetime_window
+ * are released immediately, so a burst of packets only waits once.
+ * Deadlines are measured on a monotonic clock, so changes to the system
+ * time do not disturb playback.
  * This may break early if a message becomes available.
  *
  * Requires the first packet for this thread to be received.
@@ -1236,46 +1789,60 @@ done:
  * @return Either READ_MESSAGE(-2) or 0 is successful
  */
 static inline int delay_tracetime(libtrace_t *libtrace, libtrace_packet_t *packet, libtrace_thread_t *t) {
-	struct timeval curr_tv, pkt_tv;
-	uint64_t next_release = t->tracetime_offset_usec;
-	uint64_t curr_usec;
+	struct timeval pkt_tv;
+	uint64_t next_release = t->tracetime_start_usec;
+	uint64_t first_usec = t->tracetime_first_usec;
+	uint64_t curr_usec, pkt_usec;
 
-	if (!t->tracetime_offset_usec) {
+	if (!t->tracetime_start_usec) {
 		const libtrace_packet_t *first_pkt;
-		const struct timeval *sys_tv;
-		int64_t initial_offset;
-		int stable = trace_get_first_packet(libtrace, NULL, &first_pkt, &sys_tv);
+		int stable = get_first_packet(libtrace, NULL, &first_pkt, NULL,
+		                              &next_release);
                 if (!first_pkt)
                         return 0;
 		pkt_tv = trace_get_timeval(first_pkt);
-		initial_offset = (int64_t)tv_to_usec(sys_tv) - (int64_t)tv_to_usec(&pkt_tv);
-		/* In the unlikely case offset is 0, change it to 1 */
-		if (stable)
-			t->tracetime_offset_usec = initial_offset ? initial_offset: 1;
-		next_release = initial_offset;
+		first_usec = tv_to_usec(&pkt_tv);
+		if (stable) {
+			t->tracetime_start_usec = next_release;
+			t->tracetime_first_usec = first_usec;
+		}
 	}
-	/* next_release == offset */
+	/* Packets are due at an absolute time, relative to when the first
+	 * packet was seen, so any oversleeping does not accumulate */
 	pkt_tv = trace_get_timeval(packet);
-	next_release += tv_to_usec(&pkt_tv);
-	gettimeofday(&curr_tv, NULL);
-	curr_usec = tv_to_usec(&curr_tv);
-	if (next_release > curr_usec) {
-		int ret, mesg_fd = libtrace_message_queue_get_fd(&t->messages);
-		struct timeval delay_tv = usec_to_tv(next_release-curr_usec);
-		fd_set rfds;
-		FD_ZERO(&rfds);
-		FD_SET(mesg_fd, &rfds);
-		// We need to wait
-		ret = select(mesg_fd+1, &rfds, NULL, NULL, &delay_tv);
-		if (ret == 0) {
+	pkt_usec = tv_to_usec(&pkt_tv);
+	if (pkt_usec > first_usec)
+		next_release += (pkt_usec - first_usec) /
+		                libtrace->config.tracetime_speedup;
+
+	for (;;) {
+		/* Release everything due within the window without sleeping,
+		 * which is the same as waking up a window early */
+		curr_usec = monotonic_ns() / 1000 +
+		            libtrace->config.tracetime_window;
+		if (next_release <= curr_usec)
 			return 0;
-		} else if (ret > 0) {
-			return READ_MESSAGE;
-		} else {
-			assert(!"trace_delay_packet: Unexpected return from select");
+
+		if (next_release - curr_usec > TRACETIME_SPIN_USEC) {
+			int ret, mesg_fd = libtrace_message_queue_get_fd(&t->messages);
+			struct timeval delay_tv = usec_to_tv(next_release -
+			                          curr_usec - TRACETIME_SPIN_USEC);
+			fd_set rfds;
+			FD_ZERO(&rfds);
+			FD_SET(mesg_fd, &rfds);
+			// We need to wait
+			ret = select(mesg_fd+1, &rfds, NULL, NULL, &delay_tv);
+			if (ret > 0) {
+				return READ_MESSAGE;
+			} else if (ret < 0 && errno != EINTR) {
+				assert(!"trace_delay_packet: Unexpected return from select");
+			}
+			continue;
 		}
+
+		/* Too close to the deadline to trust the scheduler */
+		cpu_relax();
 	}
-	return 0;
 }
 
 /* Discards packets that don't match the filter.
@@ -1417,14 +1984,30 @@ static int trace_prestart(libtrace_t * libtrace, void *global_blob,
 
 	/* Reset delay */
 	for (i = 0; i < libtrace->perpkt_thread_count; ++i) {
-		libtrace->perpkt_threads[i].tracetime_offset_usec = 0;
+		libtrace->perpkt_threads[i].tracetime_start_usec = 0;
+		libtrace->perpkt_threads[i].tracetime_first_usec = 0;
 	}
 
 	/* Reset statistics */
 	for (i = 0; i < libtrace->perpkt_thread_count; ++i) {
 		libtrace->perpkt_threads[i].accepted_packets = 0;
 		libtrace->perpkt_threads[i].filtered_packets = 0;
+		memset(&libtrace->perpkt_threads[i].wait_stats, 0,
+		       sizeof(libtrace_wait_stat_t));
 	}
+	memset(&libtrace->hasher_thread.wait_stats, 0, sizeof(libtrace_wait_stat_t));
+	memset(&libtrace->reporter_thread.wait_stats, 0, sizeof(libtrace_wait_stat_t));
+	for (i = 0; i < libtrace->perpkt_thread_count; ++i) {
+		if (libtrace->perpkt_threads[i].perf_stats)
+			memset(libtrace->perpkt_threads[i].perf_stats, 0,
+			       sizeof(libtrace_perf_stat_t));
+	}
+	if (libtrace->hasher_thread.perf_stats)
+		memset(libtrace->hasher_thread.perf_stats, 0,
+		       sizeof(libtrace_perf_stat_t));
+	if (libtrace->reporter_thread.perf_stats)
+		memset(libtrace->reporter_thread.perf_stats, 0,
+		       sizeof(libtrace_perf_stat_t));
 	libtrace->accepted_packets = 0;
 	libtrace->filtered_packets = 0;
 
@@ -1505,6 +2088,10 @@ static void verify_configuration(libtrace_t *libtrace) {
 		libtrace->config.reporter_thold = 100;
 	if (libtrace->config.burst_size <= 0)
 		libtrace->config.burst_size = 32;
+	if (libtrace->config.spin_count == SPIN_COUNT_DEFAULT)
+		libtrace->config.spin_count = 1000;
+	if (libtrace->config.tracetime_speedup == 0)
+		libtrace->config.tracetime_speedup = 1;
 	if (libtrace->config.thread_cache_size <= 0)
 		libtrace->config.thread_cache_size = 64;
 	if (libtrace->config.cache_size <= 0)
@@ -1576,10 +2163,15 @@ static int trace_start_thread(libtrace_t *trace,
 		return -1;
 	}
 	libtrace_message_queue_init(&t->messages, sizeof(libtrace_message_t));
+	if (trace->pread == trace_pread_packet_work_stealing &&
+	    type == THREAD_PERPKT) {
+		libtrace_deque_init(&t->batches, packet_batch_size(trace));
+	}
 	if (trace_has_dedicated_hasher(trace) && type == THREAD_PERPKT) {
 		libtrace_ringbuffer_init(&t->rbuffer,
 		                         trace->config.hasher_queue_size,
-		                         trace->config.hasher_polling?
+		                         (trace->config.hasher_polling ||
+		                          trace->config.wait_policy == WAIT_POLLING)?
 		                                 LIBTRACE_RINGBUFFER_POLLING:
 		                                 LIBTRACE_RINGBUFFER_BLOCKING);
 	}
@@ -1767,6 +2359,9 @@ DLLEXPORT int trace_pstart(libtrace_t *libtrace, void* global_blob,
 			 * introduces delay. */
 			if (libtrace->format->info.live) {
 				libtrace->config.burst_size = 1;
+			} else if (libtrace->config.work_stealing) {
+				libtrace->pread = trace_pread_packet_work_stealing;
+				libtrace->batch_read_status = 1;
 			}
 		}
 		else {
@@ -2003,6 +2598,7 @@ DLLEXPORT int trace_ppause(libtrace_t *libtrace)
                 return 0;
         }
 	if (!libtrace->started || libtrace->state != STATE_RUNNING) {
+		ASSERT_RET(pthread_mutex_unlock(&libtrace->libtrace_lock), == 0);
 		trace_set_err(libtrace,TRACE_ERR_BAD_STATE, "You must call trace_start() before calling trace_ppause()");
 		return -1;
 	}
@@ -2241,6 +2837,14 @@ DLLEXPORT void trace_join(libtrace_t *libtrace) {
 		libtrace_packet_t * packet;
 		while(libtrace_ringbuffer_try_read(&libtrace->perpkt_threads[i].rbuffer, (void **) &packet))
 			trace_destroy_packet(packet);
+		if (libtrace->pread == trace_pread_packet_work_stealing) {
+			PACKET_BATCH_STORAGE(libtrace, storage);
+			struct packet_batch *batch = (struct packet_batch *) storage;
+			size_t j;
+			while (libtrace_deque_pop_front(&libtrace->perpkt_threads[i].batches, batch))
+				for (j = 0; j < batch->nb_packets; ++j)
+					trace_destroy_packet(batch->packets[j]);
+		}
 		if (trace_has_dedicated_hasher(libtrace)) {
 			assert(libtrace_ringbuffer_is_empty(&libtrace->perpkt_threads[i].rbuffer));
 			libtrace_ringbuffer_destroy(&libtrace->perpkt_threads[i].rbuffer);
@@ -2354,11 +2958,14 @@ DLLEXPORT int trace_message_perpkts(libtrace_t * libtrace, libtrace_message_t *
  */
 DLLEXPORT void trace_publish_result(libtrace_t *libtrace, libtrace_thread_t *t, uint64_t key, libtrace_generic_t value, int type) {
 	libtrace_result_t res;
+	uint64_t start;
 	res.type = type;
 	res.key = key;
 	res.value = value;
 	assert(libtrace->combiner.publish);
+	start = perf_start(libtrace);
 	libtrace->combiner.publish(libtrace, t->perpkt_num, &libtrace->combiner, &res);
+	perf_record(t, PERF_STAGE_PUBLISH, start);
 	return;
 }
 
@@ -2434,6 +3041,27 @@ DLLEXPORT int trace_set_tracetime(libtrace_t *trace, bool tracetime) {
 	return 0;
 }
 
+DLLEXPORT int trace_set_tracetime_speedup(libtrace_t *trace, size_t speedup) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.tracetime_speedup = speedup;
+	return 0;
+}
+
+DLLEXPORT int trace_set_tracetime_window(libtrace_t *trace, size_t usec) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.tracetime_window = usec;
+	return 0;
+}
+
+DLLEXPORT int trace_set_decompress_threads(libtrace_t *trace, size_t threads) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.decompress_threads = threads;
+	return 0;
+}
+
 DLLEXPORT int trace_set_cache_size(libtrace_t *trace, size_t size) {
 	if (!trace_is_configurable(trace)) return -1;
 
@@ -2490,6 +3118,160 @@ DLLEXPORT int trace_set_reporter_thold(libtrace_t *trace, size_t thold) {
 	return 0;
 }
 
+DLLEXPORT int trace_set_work_stealing(libtrace_t *trace, bool stealing) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.work_stealing = stealing;
+	return 0;
+}
+
+DLLEXPORT int trace_set_wait_policy(libtrace_t *trace,
+                                    enum wait_policies policy) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.wait_policy = policy;
+	return 0;
+}
+
+DLLEXPORT int trace_set_spin_count(libtrace_t *trace, size_t count) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.spin_count = count;
+	return 0;
+}
+
+static void add_wait_statistics(libtrace_wait_stat_t *total,
+                                const libtrace_wait_stat_t *stat) {
+	total->spins += stat->spins;
+	total->sleeps += stat->sleeps;
+	total->spin_ns += stat->spin_ns;
+	total->sleep_ns += stat->sleep_ns;
+}
+
+DLLEXPORT int trace_get_thread_wait_statistics(libtrace_t *trace,
+                                               libtrace_thread_t *t,
+                                               libtrace_wait_stat_t *stat) {
+	int i;
+	assert(trace && stat);
+
+	if (t) {
+		if (t->trace != trace)
+			return -1;
+		*stat = t->wait_stats;
+		return 0;
+	}
+
+	memset(stat, 0, sizeof(libtrace_wait_stat_t));
+	if (trace->state == STATE_NEW)
+		return 0;
+	for (i = 0; i < trace->perpkt_thread_count; ++i)
+		add_wait_statistics(stat, &trace->perpkt_threads[i].wait_stats);
+	add_wait_statistics(stat, &trace->hasher_thread.wait_stats);
+	add_wait_statistics(stat, &trace->reporter_thread.wait_stats);
+	return 0;
+}
+
+DLLEXPORT int trace_set_perf_stats(libtrace_t *trace, bool enabled) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.perf_stats = enabled;
+	return 0;
+}
+
+DLLEXPORT int trace_set_perf_stats_interval(libtrace_t *trace,
+                                            size_t millisec) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.perf_stats_interval = millisec;
+	return 0;
+}
+
+static void add_perf_statistics(libtrace_perf_stat_t *total,
+                                const libtrace_perf_stat_t *stat) {
+	int i;
+	size_t j;
+
+	if (!stat)
+		return;
+	for (i = 0; i < PERF_STAGE_MAX; ++i) {
+		total->stages[i].count += stat->stages[i].count;
+		total->stages[i].total_ns += stat->stages[i].total_ns;
+		if (stat->stages[i].max_ns > total->stages[i].max_ns)
+			total->stages[i].max_ns = stat->stages[i].max_ns;
+		for (j = 0; j < LIBTRACE_PERF_BUCKETS; ++j)
+			total->stages[i].buckets[j] += stat->stages[i].buckets[j];
+	}
+}
+
+DLLEXPORT int trace_get_thread_perf_statistics(libtrace_t *trace,
+                                               libtrace_thread_t *t,
+                                               libtrace_perf_stat_t *stat) {
+	int i;
+	assert(trace && stat);
+
+	memset(stat, 0, sizeof(libtrace_perf_stat_t));
+	if (t) {
+		if (t->trace != trace)
+			return -1;
+		add_perf_statistics(stat, t->perf_stats);
+		return 0;
+	}
+
+	if (trace->state == STATE_NEW)
+		return 0;
+	for (i = 0; i < trace->perpkt_thread_count; ++i)
+		add_perf_statistics(stat, trace->perpkt_threads[i].perf_stats);
+	add_perf_statistics(stat, trace->hasher_thread.perf_stats);
+	add_perf_statistics(stat, trace->reporter_thread.perf_stats);
+	return 0;
+}
+
+DLLEXPORT uint64_t trace_get_perf_percentile(
+                const libtrace_perf_stage_stat_t *stat, double percentile) {
+	uint64_t target, seen = 0;
+	size_t i;
+
+	if (stat->count == 0)
+		return 0;
+	if (percentile >= 100)
+		return stat->max_ns;
+	target = (uint64_t) (stat->count * (percentile / 100.0));
+	for (i = 0; i < LIBTRACE_PERF_BUCKETS; ++i) {
+		seen += stat->buckets[i];
+		if (seen > target)
+			return perf_bucket_value(i);
+	}
+	return stat->max_ns;
+}
+
+DLLEXPORT void trace_print_perf_statistics(libtrace_t *trace,
+                                           libtrace_thread_t *t, FILE *out) {
+	static const char *names[PERF_STAGE_MAX] = {
+#define X(name) #name,
+		LIBTRACE_PERF_STAGES
+#undef X
+	};
+	libtrace_perf_stat_t stat;
+	int i;
+
+	if (trace_get_thread_perf_statistics(trace, t, &stat) != 0)
+		return;
+
+	fprintf(out, "%-10s %12s %10s %10s %10s %10s %12s\n", "Stage",
+	        "Count", "Mean(ns)", "p50", "p99", "p99.9", "Max");
+	for (i = 0; i < PERF_STAGE_MAX; ++i) {
+		libtrace_perf_stage_stat_t *s = &stat.stages[i];
+		if (s->count == 0)
+			continue;
+		fprintf(out, "%-10s %12"PRIu64" %10"PRIu64" %10"PRIu64
+		        " %10"PRIu64" %10"PRIu64" %12"PRIu64"\n", names[i],
+		        s->count, s->total_ns / s->count,
+		        trace_get_perf_percentile(s, 50),
+		        trace_get_perf_percentile(s, 99),
+		        trace_get_perf_percentile(s, 99.9), s->max_ns);
+	}
+}
+
 DLLEXPORT int trace_set_debug_state(libtrace_t *trace, bool debug_state) {
 	if (!trace_is_configurable(trace)) return -1;
 
@@ -2506,6 +3288,26 @@ static bool config_bool_parse(char *value, size_t nvalue) {
 		return strtoll(value, NULL, 10) != 0;
 }
 
+static bool config_name_match(const char *value, size_t nvalue,
+		const char *name) {
+	return strnlen(value, nvalue) == strlen(name) &&
+			strncmp(value, name, nvalue) == 0;
+}
+
+/* Returns false for anything but the name of a wait policy */
+static bool config_wait_policy_parse(char *value, size_t nvalue,
+		enum wait_policies *policy) {
+	if (config_name_match(value, nvalue, "blocking"))
+		*policy = WAIT_BLOCKING;
+	else if (config_name_match(value, nvalue, "polling"))
+		*policy = WAIT_POLLING;
+	else if (config_name_match(value, nvalue, "adaptive"))
+		*policy = WAIT_ADAPTIVE;
+	else
+		return false;
+	return true;
+}
+
 /* Note update documentation on trace_set_configuration */
 static void config_string(struct user_configuration *uc, char *key, size_t nkey, char *value, size_t nvalue) {
 	assert(key);
@@ -2547,6 +3349,32 @@ static void config_string(struct user_configuration *uc, char *key, size_t nkey,
 	} else if (strncmp(key, "debug_state", nkey) == 0
 	           || strncmp(key, "ds", nkey) == 0) {
 		uc->debug_state = config_bool_parse(value, nvalue);
+	} else if (strncmp(key, "work_stealing", nkey) == 0
+	           || strncmp(key, "ws", nkey) == 0) {
+		uc->work_stealing = config_bool_parse(value, nvalue);
+	} else if (strncmp(key, "wait_policy", nkey) == 0
+	           || strncmp(key, "wp", nkey) == 0) {
+		if (!config_wait_policy_parse(value, nvalue, &uc->wait_policy))
+			fprintf(stderr, "Unknown wait_policy %s, ignoring\n",
+					value);
+	} else if (strncmp(key, "spin_count", nkey) == 0
+	           || strncmp(key, "sc", nkey) == 0) {
+		uc->spin_count = strtoll(value, NULL, 10);
+	} else if (strncmp(key, "perf_stats", nkey) == 0
+	           || strncmp(key, "ps", nkey) == 0) {
+		uc->perf_stats = config_bool_parse(value, nvalue);
+	} else if (strncmp(key, "perf_stats_interval", nkey) == 0
+	           || strncmp(key, "psi", nkey) == 0) {
+		uc->perf_stats_interval = strtoll(value, NULL, 10);
+	} else if (strncmp(key, "tracetime_speedup", nkey) == 0
+	           || strncmp(key, "tts", nkey) == 0) {
+		uc->tracetime_speedup = strtoll(value, NULL, 10);
+	} else if (strncmp(key, "tracetime_window", nkey) == 0
+	           || strncmp(key, "ttw", nkey) == 0) {
+		uc->tracetime_window = strtoll(value, NULL, 10);
+	} else if (strncmp(key, "decompress_threads", nkey) == 0
+	           || strncmp(key, "dt", nkey) == 0) {
+		uc->decompress_threads = strtoll(value, NULL, 10);
 	} else {
 		fprintf(stderr, "No matching option %s(=%s), ignoring\n", key, value);
 	}
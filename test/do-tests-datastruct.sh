@@ -21,6 +21,12 @@ echo Testing deque
 do_test ./test-datastruct-deque
 echo Testing ringbuffer
 do_test ./test-datastruct-ringbuffer
+echo Testing object cache
+do_test ./test-datastruct-ocache
+echo Testing flow table
+do_test ./test-datastruct-flowtable
+echo Testing time bins
+do_test ./test-datastruct-timebins
 echo
 echo "Tests passed: $OK"
 echo "Tests failed: $FAIL"
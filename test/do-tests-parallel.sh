@@ -59,15 +59,45 @@ do_test ./test-format-parallel-singlethreaded erf
 echo \* Read testing single-threaded hasher datapath
 do_test ./test-format-parallel-singlethreaded-hasher erf
 
+echo \* Read testing work stealing between threads
+do_test env LIBTRACE_CONF="work_stealing=true" ./test-format-parallel erf
+
+echo \* Read testing work stealing with a slow thread and a small cache
+do_test ./test-format-parallel-workstealing erf
+
+echo \* Read testing count ticks with the ordered combiner
+do_test ./test-format-parallel-ticks erf
+
+echo \* Read testing count ticks with the ordered combiner and work stealing
+do_test env LIBTRACE_CONF="work_stealing=true" ./test-format-parallel-ticks erf
+
+echo \* Read testing hasher with adaptive waiting
+do_test env LIBTRACE_CONF="wait_policy=adaptive" ./test-format-parallel-hasher erf
+
+echo \* Read testing hasher with busy polling
+do_test env LIBTRACE_CONF="wait_policy=polling" ./test-format-parallel-hasher erf
+
+echo \* Read testing hasher with performance statistics
+do_test env LIBTRACE_CONF="perf_stats=true" ./test-format-parallel-hasher erf
+
+echo \* Read testing performance statistics histograms
+do_test ./test-format-parallel-perfstats erf
+
 echo \* Read stress testing with 100 threads
 do_test ./test-format-parallel-stressthreads erf
 
 echo \* Read testing reporter thread
 do_test ./test-format-parallel-reporter erf
 
+echo \* Write testing an output sharded between threads
+do_test ./test-output-shards erf
+
 echo \* Testing Trace-Time Playback
 do_test ./test-tracetime-parallel
 
+echo \* Testing Trace-Time Playback speedup and window
+do_test ./test-tracetime-speedup
+
 echo
 echo "Tests passed: $OK"
 echo "Tests failed: $FAIL"
@@ -76,6 +76,9 @@ do_test ./test-decode pcapng
 echo \* Testing pcap-bpf
 do_test ./test-pcap-bpf
 
+echo \* Testing filter sets
+do_test ./test-filter-set
+
 echo \* Testing payload length
 do_test ./test-plen
 
@@ -85,6 +88,12 @@ do_test ./test-ports
 echo \* Testing fragment parsing
 do_test ./test-fragment
 
+echo \* Testing header rewriting
+do_test ./test-rewrite
+
+echo \* Testing traceanon CryptoPAn
+do_test ./test-anon
+
 echo \* Testing event framework
 do_test ./test-event
 
@@ -110,6 +119,27 @@ do_test ./test-time tsh
 echo \* pcapng
 do_test ./test-time pcapng
 
+echo \* Testing seeking
+echo \* ERF
+do_test ./test-seek erf
+echo \* ERF with an index
+do_test ./test-seek erf index
+echo \* ERF with an index written by the output
+do_test ./test-seek erf write
+echo \* pcapfile
+do_test ./test-seek pcapfile
+echo \* pcapfile with an index
+do_test ./test-seek pcapfile index
+echo \* pcapng
+do_test ./test-seek pcapng
+echo \* pcapng with an index
+do_test ./test-seek pcapng index
+
+echo \* Testing merging traces
+do_test ./test-merge
+echo \* Testing merging traces with the parallel API
+do_test ./test-merge parallel
+
 echo \* Testing directions
 do_test ./test-dir
 
@@ -174,6 +204,38 @@ echo " * pcapfile -> pcapfile"
 rm -f traces/*.out.*
 do_test ./test-convert pcapfile pcapfile
 
+echo " * erf -> erf (batched)"
+rm -f traces/*.out.*
+do_test ./test-convert erf erf batch
+
+echo " * pcapfile -> pcapfile (batched)"
+rm -f traces/*.out.*
+do_test ./test-convert pcapfile pcapfile batch
+
+echo " * pcap -> erf (batched)"
+rm -f traces/*.out.*
+do_test ./test-convert pcap erf batch
+
+echo " * erf -> pcap (batched)"
+rm -f traces/*.out.*
+do_test ./test-convert erf pcap batch
+
+echo " * erf -> erf (parallel gzip)"
+rm -f traces/*.out.*
+do_test ./test-convert erf erf compress
+
+echo " * pcapfile -> pcapfile (parallel gzip)"
+rm -f traces/*.out.*
+do_test ./test-convert pcapfile pcapfile compress
+
+echo " * erf -> erf (zstd)"
+rm -f traces/*.out.*
+do_test ./test-convert erf erf zstd
+
+echo " * erf -> erf (lz4)"
+rm -f traces/*.out.*
+do_test ./test-convert erf erf lz4
+
 echo " * pcapfilens -> pcapfile"
 rm -f traces/*.out.*
 do_test ./test-convert pcapfilens pcapfile
@@ -0,0 +1,202 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id: test-rtclient.c,v 1.2 2006/02/27 03:41:12 perry Exp $
+ *
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+#include "Anon.h"
+
+#ifdef HAVE_LIBCRYPTO
+
+/* The key from the CryptoPAn reference implementation. The reference pads
+ * with the second half of the key encrypted under the first, so that is done
+ * here already. */
+static uint8_t key[32] = {
+	0x15, 0x22, 0x17, 0x8d, 0x33, 0xa4, 0xcf, 0x80,
+	0x13, 0x0a, 0x5b, 0x16, 0x49, 0x90, 0x7d, 0x10,
+	0x8d, 0x51, 0x14, 0x96, 0xa0, 0x44, 0x6f, 0x67,
+	0xa6, 0x91, 0xf2, 0x93, 0x3b, 0x1f, 0x67, 0x35,
+};
+
+/* Taken from the output of the CryptoPAn reference implementation */
+static const char *ipv4_vectors[][2] = {
+	{"128.11.68.132", "135.242.180.132"},
+	{"129.118.74.4", "134.136.186.123"},
+	{"130.132.252.244", "133.68.164.234"},
+	{"141.223.7.43", "141.167.8.160"},
+	{"192.102.249.13", "252.138.62.131"},
+	{"207.33.151.131", "241.1.233.131"},
+	{"212.204.172.118", "228.71.195.169"},
+	/* Previously mapped to itself, see traceanon(1) */
+	{"0.0.0.0", "120.255.240.1"},
+};
+
+/* Each half of an IPv6 address is encrypted separately and the padding is
+ * read in host byte order, so these only hold on little endian machines */
+static const char *ipv6_vectors[][2] = {
+	{"::", "1dff:3fe0:7df0:ffb:1dff:3fe0:7df0:ffb"},
+	{"::1", "1dff:3fe0:7df0:ffb:1dff:3fe0:7df0:ffa"},
+	{"2001:db8::1", "2339:324f:83f3:c000:1dff:3fe0:7df0:ffa"},
+	{"2001:db8::2", "2339:324f:83f3:c000:1dff:3fe0:7df0:ff9"},
+	{"fe80::1:2:3:4", "f187:fc00:3:f07c:1dfe:c002:71f0:c004"},
+};
+
+#define NUM_VECTORS(v) (sizeof(v) / sizeof(v[0]))
+
+/* Enough addresses to fill several batches, with repeats so that the
+ * recent and prefix caches are hit */
+#define BATCH_ADDRS 1000
+
+static uint32_t parse_ipv4(const char *str) {
+	struct in_addr addr;
+
+	assert(inet_pton(AF_INET, str, &addr) == 1);
+	return ntohl(addr.s_addr);
+}
+
+static int test_ipv4(CryptoAnon *anon, const char *name) {
+	int error = 0;
+
+	for (size_t i = 0; i < NUM_VECTORS(ipv4_vectors); i++) {
+		uint32_t orig = parse_ipv4(ipv4_vectors[i][0]);
+		uint32_t expected = parse_ipv4(ipv4_vectors[i][1]);
+		uint32_t result = anon->anonIPv4(orig);
+
+		if (result != expected) {
+			struct in_addr addr;
+			addr.s_addr = htonl(result);
+			printf("%s: %s mapped to %s expected %s\n", name,
+					ipv4_vectors[i][0], inet_ntoa(addr),
+					ipv4_vectors[i][1]);
+			error = 1;
+		}
+	}
+	return error;
+}
+
+static int test_ipv6(CryptoAnon *anon, const char *name) {
+	int error = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (size_t i = 0; i < NUM_VECTORS(ipv6_vectors); i++) {
+		uint8_t orig[16], expected[16], result[16];
+		char str[INET6_ADDRSTRLEN];
+
+		assert(inet_pton(AF_INET6, ipv6_vectors[i][0], orig) == 1);
+		assert(inet_pton(AF_INET6, ipv6_vectors[i][1], expected) == 1);
+		anon->anonIPv6(orig, result);
+
+		if (memcmp(result, expected, 16) != 0) {
+			inet_ntop(AF_INET6, result, str, sizeof(str));
+			printf("%s: %s mapped to %s expected %s\n", name,
+					ipv6_vectors[i][0], str,
+					ipv6_vectors[i][1]);
+			error = 1;
+		}
+	}
+#endif
+	return error;
+}
+
+/* Checks that batches of addresses, including batches larger than are
+ * encrypted at once, map exactly as each address does alone */
+static int test_batch(void) {
+	CryptoAnon single(key, 32, 8);
+	CryptoAnon batch(key, 32, 24);
+	uint32_t orig[BATCH_ADDRS];
+	uint32_t expected[BATCH_ADDRS];
+	uint32_t result[BATCH_ADDRS];
+	size_t done = 0;
+	size_t size = 1;
+
+	srand(1);
+	for (size_t i = 0; i < BATCH_ADDRS; i++) {
+		if (i > 0 && rand() % 4 == 0)
+			orig[i] = orig[rand() % i];
+		else
+			orig[i] = ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+		expected[i] = single.anonIPv4(orig[i]);
+	}
+
+	while (done < BATCH_ADDRS) {
+		if (size > BATCH_ADDRS - done)
+			size = BATCH_ADDRS - done;
+		batch.anonIPv4Batch(orig + done, result + done, size);
+		done += size;
+		size = size * 2 + 1;
+	}
+
+	for (size_t i = 0; i < BATCH_ADDRS; i++) {
+		if (result[i] != expected[i]) {
+			printf("batch: address %zu mapped to %08x expected "
+					"%08x\n", i, result[i], expected[i]);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main() {
+	int error = 0;
+	CryptoPanCache cache(16);
+	CryptoAnon anon(key, 32, 24);
+	CryptoAnon first(key, 32, &cache);
+	CryptoAnon second(key, 32, &cache);
+
+	error |= test_ipv4(&anon, "ipv4");
+	error |= test_ipv6(&anon, "ipv6");
+
+	/* A second pass is answered from the caches */
+	error |= test_ipv4(&anon, "ipv4 cached");
+	error |= test_ipv6(&anon, "ipv6 cached");
+
+	/* Prefixes cached by one instance are used by another */
+	error |= test_ipv4(&first, "ipv4 shared");
+	error |= test_ipv4(&second, "ipv4 shared");
+	error |= test_ipv6(&first, "ipv6 shared");
+	error |= test_ipv6(&second, "ipv6 shared");
+
+	error |= test_batch();
+
+	if (error == 0)
+		printf("success: CryptoPAn matches the reference\n");
+	return error;
+}
+
+#else
+
+int main() {
+	printf("skipped: built without libcrypto\n");
+	return 0;
+}
+
+#endif
@@ -114,6 +114,9 @@ char *lookup_out_uri(const char *type) {
 	return "unknown";
 }
 
+/* The number of packets written at once when testing trace_write_packets */
+#define BATCH_SIZE 10
+
 static int time_changed(libtrace_packet_t *packet, 
 		libtrace_packet_t *packet2) {
 
@@ -174,6 +177,10 @@ int main(int argc, char *argv[]) {
 	libtrace_packet_t *packet,*packet2;
 	const char *trace1name;
 	const char *trace2name;
+	libtrace_packet_t *batch[BATCH_SIZE];
+	int nb_batch = 0;
+	int batched = argc > 3 && strcmp(argv[3], "batch") == 0;
+	int compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
 
 	trace = trace_create(lookup_uri(argv[1]));
 	iferr(trace);
@@ -184,7 +191,21 @@ int main(int argc, char *argv[]) {
 	outtrace = trace_create_output(lookup_out_uri(argv[2]));
 	iferrout(outtrace);
 
+	if (argc > 3 && strcmp(argv[3], "compress") == 0)
+		compress_type = TRACE_OPTION_COMPRESSTYPE_ZLIB;
+	else if (argc > 3 && strcmp(argv[3], "zstd") == 0)
+		compress_type = TRACE_OPTION_COMPRESSTYPE_ZSTD;
+	else if (argc > 3 && strcmp(argv[3], "lz4") == 0)
+		compress_type = TRACE_OPTION_COMPRESSTYPE_LZ4;
+
 	level=0;
+	if (compress_type != TRACE_OPTION_COMPRESSTYPE_NONE) {
+		/* Compress in blocks on several threads */
+		int threads = 4;
+		level = 1;
+		trace_config_output(outtrace,TRACE_OPTION_OUTPUT_COMPRESSTYPE,&compress_type);
+		trace_config_output(outtrace,TRACE_OPTION_OUTPUT_COMPRESS_THREADS,&threads);
+	}
 	trace_config_output(outtrace,TRACE_OPTION_OUTPUT_COMPRESS,&level);
 	if (trace_is_err_output(outtrace)) {
 		trace_perror_output(outtrace,"WARNING: ");
@@ -193,10 +214,23 @@ int main(int argc, char *argv[]) {
 	trace_start(trace);
 	iferr(trace);
 	trace_start_output(outtrace);
+	if (compress_type != TRACE_OPTION_COMPRESSTYPE_ZLIB &&
+			trace_get_err_output(outtrace).err_num == TRACE_ERR_UNSUPPORTED_COMPRESS) {
+		printf("skipped: %s\n", trace_get_err_output(outtrace).problem);
+		return 0;
+	}
 	iferrout(outtrace);
 	
-	packet=trace_create_packet();
+	if (batched) {
+		for (psize = 0; psize < BATCH_SIZE; psize++)
+			batch[psize] = trace_create_packet();
+	} else
+		packet=trace_create_packet();
         for (;;) {
+		if (batched) {
+			/* Read into the next free packet in the batch */
+			packet = batch[nb_batch];
+		}
 		if ((psize = trace_read_packet(trace, packet)) <0) {
 			error = 1;
 			break;
@@ -205,13 +239,30 @@ int main(int argc, char *argv[]) {
 			error = 0;
 			break;
 		}
+		if (batched) {
+			if (!IS_LIBTRACE_META_PACKET(packet))
+				count ++;
+			if (++nb_batch < BATCH_SIZE)
+				continue;
+			if (trace_write_packets(outtrace, batch, nb_batch) < 0)
+				iferrout(outtrace);
+			nb_batch = 0;
+			continue;
+		}
 		if (trace_write_packet(outtrace,packet) > 0)
 		        count ++;
 		iferrout(outtrace);
 		if (count>100)
 			break;
         }
-	trace_destroy_packet(packet);
+	if (batched) {
+		if (nb_batch > 0 &&
+				trace_write_packets(outtrace, batch, nb_batch) < 0)
+			iferrout(outtrace);
+		for (psize = 0; psize < BATCH_SIZE; psize++)
+			trace_destroy_packet(batch[psize]);
+	} else
+		trace_destroy_packet(packet);
 	if (error == 0) {
 		if (count != expected) {
 			printf("failure: %d packets expected, %d seen\n",expected,count);
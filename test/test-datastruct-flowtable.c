@@ -0,0 +1,150 @@
+#include "data-struct/flow_table.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_SIZE 100000
+
+struct counter {
+	uint64_t packets;
+	uint64_t bytes;
+};
+
+static void count_flow(const void *key, void *value, void *data) {
+	const uint32_t *k = key;
+	struct counter *c = value;
+
+	assert(c->packets == *k);
+	(*(size_t *)data)++;
+}
+
+static void add_counters(void *value, const void *other, void *data UNUSED) {
+	struct counter *c = value;
+	const struct counter *o = other;
+
+	c->packets += o->packets;
+	c->bytes += o->bytes;
+}
+
+static void note_expired(const void *key, void *value UNUSED, void *data) {
+	const uint32_t *k = key;
+	uint8_t *expired = data;
+
+	expired[*k] = 1;
+}
+
+/**
+ * Tests the flow table, first adding, finding and removing flows, then
+ * merging tables and expiring idle flows.
+ */
+int main() {
+	libtrace_flowtable_t *ft, *other;
+	struct counter *c;
+	uint8_t *expired;
+	uint32_t i, key;
+	size_t count = 0;
+	bool created;
+
+	ft = libtrace_flowtable_create(sizeof(uint32_t), sizeof(struct counter));
+	assert(ft);
+	assert(libtrace_flowtable_size(ft) == 0);
+
+	/* Key i is seen i times */
+	for (i = 0; i < TEST_SIZE; i++) {
+		c = libtrace_flowtable_get(ft, &i, 0, &created);
+		assert(c && created);
+		assert(c->packets == 0);
+		c->packets = i;
+	}
+	assert(libtrace_flowtable_size(ft) == TEST_SIZE);
+	for (i = 0; i < TEST_SIZE; i++) {
+		c = libtrace_flowtable_get(ft, &i, 0, &created);
+		assert(c && !created);
+		assert(c->packets == i);
+	}
+	key = TEST_SIZE;
+	assert(libtrace_flowtable_find(ft, &key) == NULL);
+
+	libtrace_flowtable_foreach(ft, count_flow, &count);
+	assert(count == TEST_SIZE);
+
+	/* Remove the odd keys, the rest must be untouched */
+	for (i = 1; i < TEST_SIZE; i += 2)
+		assert(libtrace_flowtable_remove(ft, &i));
+	assert(!libtrace_flowtable_remove(ft, &key));
+	assert(libtrace_flowtable_size(ft) == TEST_SIZE / 2);
+	for (i = 0; i < TEST_SIZE; i++) {
+		c = libtrace_flowtable_find(ft, &i);
+		if (i % 2) {
+			assert(c == NULL);
+		} else {
+			assert(c && c->packets == i);
+		}
+	}
+	for (i = 0; i < libtrace_flowtable_size(ft); i++) {
+		const uint32_t *k;
+		c = libtrace_flowtable_entry(ft, i, (const void **)&k);
+		assert(c && c->packets == *k && *k % 2 == 0);
+	}
+	assert(libtrace_flowtable_entry(ft, i, NULL) == NULL);
+
+	/* Merging adds the new flows and combines the shared ones */
+	other = libtrace_flowtable_create(sizeof(uint32_t),
+			sizeof(struct counter));
+	for (i = 0; i < TEST_SIZE; i += 3) {
+		c = libtrace_flowtable_get(other, &i, 0, NULL);
+		c->packets = i;
+	}
+	libtrace_flowtable_merge(ft, other, add_counters, NULL);
+	for (i = 0; i < TEST_SIZE; i++) {
+		uint64_t expect = (i % 2 == 0 ? i : 0) + (i % 3 == 0 ? i : 0);
+		c = libtrace_flowtable_find(ft, &i);
+		if (i % 2 && i % 3) {
+			assert(c == NULL);
+		} else {
+			assert(c && c->packets == expect);
+		}
+	}
+	libtrace_flowtable_destroy(other);
+
+	libtrace_flowtable_clear(ft);
+	assert(libtrace_flowtable_size(ft) == 0);
+	i = 0;
+	assert(libtrace_flowtable_find(ft, &i) == NULL);
+	libtrace_flowtable_destroy(ft);
+
+	/* Flow i is seen at time i / 100, and flows below TEST_SIZE / 2 again
+	 * at time i / 50, with a 10 second timeout */
+	expired = calloc(TEST_SIZE, 1);
+	ft = libtrace_flowtable_create(sizeof(uint32_t), sizeof(struct counter));
+	libtrace_flowtable_set_timeout(ft, 10, note_expired, expired);
+	for (i = 0; i < TEST_SIZE; i++) {
+		double now = i / 100.0;
+
+		libtrace_flowtable_get(ft, &i, now, NULL);
+		if (i % 2 == 0) {
+			key = i / 2;
+			libtrace_flowtable_get(ft, &key, now, NULL);
+		}
+		libtrace_flowtable_expire(ft, now);
+
+		/* Nothing that has been seen within the timeout is gone */
+		key = i >= 900 ? i - 900 : i;
+		assert(libtrace_flowtable_find(ft, &key));
+		key = i / 2;
+		assert(libtrace_flowtable_find(ft, &key));
+	}
+	/* Everything idle for more than a timeout and a tick is gone */
+	for (i = 0; i < TEST_SIZE; i++) {
+		double last = (i < TEST_SIZE / 2) ? i / 50.0 : i / 100.0;
+		if (last + 10 + 10.0 / 64 < (TEST_SIZE - 1) / 100.0) {
+			assert(expired[i]);
+			assert(libtrace_flowtable_find(ft, &i) == NULL);
+		} else if (!expired[i]) {
+			assert(libtrace_flowtable_find(ft, &i));
+		}
+	}
+	libtrace_flowtable_destroy(ft);
+	free(expired);
+	return 0;
+}
@@ -0,0 +1,101 @@
+#include "data-struct/object_cache.h"
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#define TEST_SIZE 1000000
+#define BUFFER_SIZE 1000
+#define THREAD_CACHE_SIZE 32
+#define BURST_SIZE 10
+
+static int nb_objects = 0;
+
+static void *alloc_object(void) {
+	__sync_fetch_and_add(&nb_objects, 1);
+	return malloc(sizeof(int));
+}
+
+static void free_object(void *obj) {
+	__sync_fetch_and_sub(&nb_objects, 1);
+	free(obj);
+}
+
+static libtrace_ringbuffer_t queue;
+
+/* Allocates objects and passes them to the consumer, like the hasher */
+static void * producer(void * a) {
+	libtrace_ocache_t *oc = (libtrace_ocache_t *) a;
+	void *values[BURST_SIZE];
+	int i, j;
+	for (i = 0; i < TEST_SIZE; i += BURST_SIZE) {
+		assert(libtrace_ocache_alloc(oc, values, BURST_SIZE, BURST_SIZE) == BURST_SIZE);
+		for (j = 0; j < BURST_SIZE; j++) {
+			*(int *) values[j] = i + j;
+			libtrace_ringbuffer_write(&queue, values[j]);
+		}
+	}
+	libtrace_ocache_unregister_thread(oc);
+	return 0;
+}
+
+/* Frees objects allocated by the producer, like a perpkt thread */
+static void * consumer(void * a) {
+	libtrace_ocache_t *oc = (libtrace_ocache_t *) a;
+	void *value;
+	int i;
+	for (i = 0; i < TEST_SIZE; i++) {
+		value = libtrace_ringbuffer_read(&queue);
+		assert(*(int *) value == i);
+		assert(libtrace_ocache_free(oc, &value, 1, 1) == 1);
+	}
+	libtrace_ocache_unregister_thread(oc);
+	return 0;
+}
+
+static void test_cross_thread(bool limit_size) {
+	pthread_t t[2];
+	libtrace_ocache_t oc;
+
+	assert(libtrace_ocache_init(&oc, &alloc_object, &free_object,
+	                            THREAD_CACHE_SIZE, BUFFER_SIZE, limit_size) == 0);
+	pthread_create(&t[0], NULL, &producer, (void *) &oc);
+	pthread_create(&t[1], NULL, &consumer, (void *) &oc);
+	pthread_join(t[0], NULL);
+	pthread_join(t[1], NULL);
+	assert(libtrace_ringbuffer_is_empty(&queue));
+	if (limit_size)
+		assert(nb_objects <= BUFFER_SIZE);
+	assert(libtrace_ocache_destroy(&oc) == 0);
+	assert(nb_objects == 0);
+}
+
+/**
+ * Tests the object cache, first single threaded, allocating and freeing more
+ * objects than fit in a thread's cache, then with objects always freed on a
+ * different thread to that which allocated them.
+ */
+int main() {
+	libtrace_ocache_t oc;
+	void *values[BUFFER_SIZE / 2];
+	int round;
+
+	libtrace_ringbuffer_init(&queue, BUFFER_SIZE / 4, LIBTRACE_RINGBUFFER_BLOCKING);
+
+	assert(libtrace_ocache_init(&oc, &alloc_object, &free_object,
+	                            THREAD_CACHE_SIZE, BUFFER_SIZE, true) == 0);
+	for (round = 0; round < 10; round++) {
+		assert(libtrace_ocache_alloc(&oc, values, BUFFER_SIZE / 2, BUFFER_SIZE / 2) == BUFFER_SIZE / 2);
+		assert(libtrace_ocache_free(&oc, values, BUFFER_SIZE / 2, BUFFER_SIZE / 2) == BUFFER_SIZE / 2);
+	}
+	// Everything was recycled
+	assert(nb_objects == BUFFER_SIZE / 2);
+	libtrace_ocache_unregister_thread(&oc);
+	assert(libtrace_ocache_destroy(&oc) == 0);
+	assert(nb_objects == 0);
+
+	test_cross_thread(true);
+	test_cross_thread(false);
+
+	libtrace_ringbuffer_destroy(&queue);
+	return 0;
+}
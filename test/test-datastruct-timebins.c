@@ -0,0 +1,184 @@
+#include "data-struct/time_bins.h"
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WRITERS 4
+#define TEST_SIZE 100000
+/* Each interval holds this many packets, spread across the writers */
+#define PER_INTERVAL 7
+#define INTERVALS ((TEST_SIZE + PER_INTERVAL - 1) / PER_INTERVAL)
+
+/* ERF timestamp of a number of milliseconds, rounded up like the starts of
+ * merged intervals */
+#define MS(x) ((((uint64_t)(x) / 1000) << 32) + \
+		((((uint64_t)(x) % 1000) << 32) + 999) / 1000)
+/* Milliseconds of an ERF timestamp, rounded down */
+#define TO_MS(x) (((x) >> 32) * 1000 + (((x) & 0xffffffffULL) * 1000 >> 32))
+
+struct merged {
+	uint64_t start[16];
+	uint64_t packets[16];
+	uint64_t bytes[16];
+	int count;
+};
+
+static void save_bin(uint64_t start, const uint64_t *counters, void *data) {
+	struct merged *m = data;
+
+	assert(m->count < 16);
+	m->start[m->count] = start;
+	m->packets[m->count] = counters[0];
+	m->bytes[m->count] = counters[1];
+	m->count++;
+}
+
+struct writer_arg {
+	libtrace_timebins_t *tb;
+	int writer;
+};
+
+int writers_done = 0;
+uint64_t *totals;
+uint64_t last_start = 0;
+size_t reported = 0;
+
+static void check_bin(uint64_t start, const uint64_t *counters, void *data) {
+	uint64_t interval = TO_MS(start);
+
+	(void)data;
+	/* Intervals are merged once each, in time order */
+	assert(reported == 0 || start > last_start);
+	assert(interval < INTERVALS);
+	last_start = start;
+	totals[interval] += counters[0];
+	assert(counters[1] == counters[0] * 100);
+	reported++;
+}
+
+/* Writer w counts packets w, w + WRITERS, ... like a perpkt thread reading
+ * from a shared trace, PER_INTERVAL packets fall in each millisecond */
+static void *writer(void *a) {
+	struct writer_arg *arg = a;
+	uint64_t i, *c;
+
+	for (i = arg->writer; i < TEST_SIZE; i += WRITERS) {
+		uint64_t ts = MS(i / PER_INTERVAL) +
+				(i % PER_INTERVAL) * (MS(1) / PER_INTERVAL);
+		c = libtrace_timebins_get(arg->tb, arg->writer, ts, NULL);
+		c[0]++;
+		c[1] += 100;
+	}
+	libtrace_timebins_finish(arg->tb, arg->writer);
+	__sync_fetch_and_add(&writers_done, 1);
+	return NULL;
+}
+
+static void *reader(void *a) {
+	libtrace_timebins_t *tb = a;
+
+	while (__atomic_load_n(&writers_done, __ATOMIC_ACQUIRE) < WRITERS) {
+		if (libtrace_timebins_merge(tb, check_bin, NULL) == 0)
+			sched_yield();
+	}
+	libtrace_timebins_merge(tb, check_bin, NULL);
+	return NULL;
+}
+
+/**
+ * Tests the time bins, first the closing and merging of a single writer's
+ * bins, then several writers counting concurrently with a reader merging
+ * their bins.
+ */
+int main() {
+	libtrace_timebins_t *tb;
+	struct merged m;
+	struct writer_arg args[WRITERS];
+	pthread_t threads[WRITERS + 1];
+	uint64_t *c, *c2;
+	bool closed;
+	int i;
+
+	assert(libtrace_timebins_create(0, 2, 1, 4) == NULL);
+
+	tb = libtrace_timebins_create(1, 2, 2, 4);
+	assert(tb);
+	memset(&m, 0, sizeof(m));
+
+	/* Nothing is merged until every writer has closed the interval */
+	c = libtrace_timebins_get(tb, 0, MS(10200), &closed);
+	assert(!closed);
+	c[0]++;
+	c2 = libtrace_timebins_get(tb, 0, MS(10700), &closed);
+	assert(c2 == c && !closed);
+	c2[0]++;
+	c = libtrace_timebins_get(tb, 0, MS(12100), &closed);
+	assert(closed);
+	c[0]++;
+	assert(libtrace_timebins_merge(tb, save_bin, &m) == 0);
+	assert(libtrace_timebins_advance(tb, 1, MS(11000)));
+	assert(!libtrace_timebins_advance(tb, 1, MS(11500)));
+	assert(libtrace_timebins_merge(tb, save_bin, &m) == 1);
+	assert(m.start[0] == MS(10000) && m.packets[0] == 2);
+
+	/* Late packets are counted in the current interval, even after it is
+	 * closed */
+	c = libtrace_timebins_get(tb, 0, MS(11500), NULL);
+	c[0]++;
+	assert(libtrace_timebins_advance(tb, 0, MS(13000)));
+	c = libtrace_timebins_get(tb, 0, MS(12900), NULL);
+	c[0]++;
+	c = libtrace_timebins_get(tb, 1, MS(12500), NULL);
+	c[1] += 5;
+	libtrace_timebins_finish(tb, 0);
+	libtrace_timebins_finish(tb, 1);
+	assert(libtrace_timebins_merge(tb, save_bin, &m) == 2);
+	assert(m.start[1] == MS(12000) && m.packets[1] == 2 && m.bytes[1] == 5);
+	assert(m.start[2] == MS(13000) && m.packets[2] == 1);
+	assert(libtrace_timebins_merge(tb, save_bin, &m) == 0);
+
+	/* Empty intervals are skipped, and the bins can be reused */
+	libtrace_timebins_reset(tb);
+	memset(&m, 0, sizeof(m));
+	for (i = 0; i < 10; i++) {
+		c = libtrace_timebins_get(tb, 0, MS(1000 * (i * i)), NULL);
+		c[0] += i;
+		libtrace_timebins_advance(tb, 1, MS(1000 * (i * i)));
+		libtrace_timebins_merge(tb, save_bin, &m);
+	}
+	libtrace_timebins_finish(tb, 0);
+	libtrace_timebins_finish(tb, 1);
+	libtrace_timebins_merge(tb, save_bin, &m);
+	assert(m.count == 10);
+	for (i = 0; i < 10; i++)
+		assert(m.start[i] == MS(1000 * (i * i)) &&
+				m.packets[i] == (uint64_t)i);
+	libtrace_timebins_destroy(tb);
+
+	/* Millisecond intervals filled concurrently, with a small window so
+	 * writers have to wait for the reader */
+	totals = calloc(INTERVALS, sizeof(uint64_t));
+	tb = libtrace_timebins_create(0.001, 2, WRITERS, 16);
+	assert(tb);
+	for (i = 0; i < WRITERS; i++) {
+		args[i].tb = tb;
+		args[i].writer = i;
+		pthread_create(&threads[i], NULL, writer, &args[i]);
+	}
+	pthread_create(&threads[WRITERS], NULL, reader, tb);
+	for (i = 0; i <= WRITERS; i++)
+		pthread_join(threads[i], NULL);
+
+	assert(reported == INTERVALS);
+	for (i = 0; i < INTERVALS; i++) {
+		if (i == INTERVALS - 1 && TEST_SIZE % PER_INTERVAL)
+			assert(totals[i] == TEST_SIZE % PER_INTERVAL);
+		else
+			assert(totals[i] == PER_INTERVAL);
+	}
+	libtrace_timebins_destroy(tb);
+	free(totals);
+	return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libtrace.h"
+
+/* Filters sharing more or less of their programs, the list is repeated to
+ * give a set larger than one word of matches */
+static const char *filterstrings[] = {
+	"tcp", "udp", "ip", "port 80", "tcp and port 80", "not port 80",
+	"tcp[tcpflags] & tcp-syn != 0", "udp and port 53", "icmp",
+	"src net 10.0.0.0/8", "ip6", "len > 100",
+};
+#define NUM_STRINGS (sizeof(filterstrings) / sizeof(filterstrings[0]))
+#define NUM_FILTERS 70
+
+static void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	const char *uri = "erf:traces/100_packets.erf";
+	libtrace_filter_t *filters[NUM_FILTERS];
+	libtrace_filter_set_t *set;
+	libtrace_packet_t *packet;
+	libtrace_t *trace;
+	uint64_t matches[(NUM_FILTERS + 63) / 64];
+	int i, ret, count = 0, matched = 0;
+
+	if (argc > 1)
+		uri = argv[1];
+
+	set = trace_create_filter_set();
+	for (i = 0; i < NUM_FILTERS; i++) {
+		filters[i] = trace_create_filter(
+				filterstrings[i % NUM_STRINGS]);
+		if (trace_filter_set_add(set,
+				filterstrings[i % NUM_STRINGS]) != i) {
+			printf("failure: filter %d was given the wrong index\n",
+					i);
+			return 1;
+		}
+	}
+
+	trace = trace_create(uri);
+	iferr(trace);
+	if (trace_start(trace) == -1)
+		iferr(trace);
+
+	packet = trace_create_packet();
+	while ((ret = trace_read_packet(trace, packet)) > 0) {
+		int expected = 0;
+
+		ret = trace_apply_filter_set(set, packet, matches);
+		iferr(trace);
+		for (i = 0; i < NUM_FILTERS; i++) {
+			int single = trace_apply_filter(filters[i], packet) > 0;
+			int bit = (matches[i / 64] >> (i % 64)) & 1;
+
+			iferr(trace);
+			if (single != bit) {
+				printf("failure: packet %d filter \"%s\" %s the "
+						"set but %s alone\n", count,
+						filterstrings[i % NUM_STRINGS],
+						bit ? "matched" : "didn't match",
+						single ? "matched" : "didn't");
+				return 1;
+			}
+			expected += single;
+		}
+		if (ret != expected) {
+			printf("failure: packet %d matched %d filters, %d "
+					"expected\n", count, ret, expected);
+			return 1;
+		}
+		matched += ret;
+		count++;
+	}
+	iferr(trace);
+
+	/* Adding to a set that is in use is an error */
+	if (trace_filter_set_add(set, "tcp") != -1) {
+		printf("failure: filter added to a set in use\n");
+		return 1;
+	}
+
+	trace_destroy_packet(packet);
+	trace_destroy(trace);
+	for (i = 0; i < NUM_FILTERS; i++)
+		trace_destroy_filter(filters[i]);
+	trace_destroy_filter_set(set);
+
+	if (count == 0 || matched == 0) {
+		printf("failure: %d packets read, %d matches\n", count,
+				matched);
+		return 1;
+	}
+	printf("success: %d packets, %d matches\n", count, matched);
+	return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id: test-rtclient.c,v 1.2 2006/02/27 03:41:12 perry Exp $
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "libtrace_parallel.h"
+
+static int published = 0;
+static int received = 0;
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+const char *lookup_uri(const char *type) {
+	if (strchr(type,':'))
+		return type;
+	if (!strcmp(type,"erf"))
+		return "erf:traces/100_packets.erf";
+	if (!strcmp(type,"pcapfile"))
+		return "pcapfile:traces/100_packets.pcap";
+	return type;
+}
+
+/* Checks the histogram of a stage accounts for every time it was timed */
+static void check_stage(const libtrace_perf_stage_stat_t *stat,
+                        const char *name) {
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < LIBTRACE_PERF_BUCKETS; i++)
+		sum += stat->buckets[i];
+	if (sum != stat->count) {
+		printf("%s: histogram holds %" PRIu64 " of %" PRIu64 "\n",
+		       name, sum, stat->count);
+		assert(0);
+	}
+	assert(stat->total_ns >= stat->max_ns);
+	assert(trace_get_perf_percentile(stat, 50) <=
+	       trace_get_perf_percentile(stat, 99));
+	assert(trace_get_perf_percentile(stat, 99) <= stat->max_ns);
+}
+
+static void check_stat(const libtrace_perf_stat_t *stat) {
+	static const char *names[PERF_STAGE_MAX] = {
+#define X(name) #name,
+		LIBTRACE_PERF_STAGES
+#undef X
+	};
+	int i;
+
+	for (i = 0; i < PERF_STAGE_MAX; i++)
+		check_stage(&stat->stages[i], names[i]);
+}
+
+static void *start_processing(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED, void *global UNUSED) {
+	return calloc(1, sizeof(int));
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
+                void *global UNUSED, void *tls, libtrace_packet_t *packet) {
+	int *count = (int *)tls;
+
+	(*count)++;
+	trace_publish_result(trace, t, trace_packet_get_order(packet),
+	                     (libtrace_generic_t){.sint = 1}, RESULT_USER);
+	__sync_fetch_and_add(&published, 1);
+	return packet;
+}
+
+static void stop_processing(libtrace_t *trace, libtrace_thread_t *t,
+                void *global UNUSED, void *tls) {
+	libtrace_perf_stat_t stat;
+	int *count = (int *)tls;
+
+	/* Each packet this thread saw went through the callback once */
+	assert(trace_get_thread_perf_statistics(trace, t, &stat) == 0);
+	check_stat(&stat);
+	assert(stat.stages[PERF_STAGE_CALLBACK].count == (uint64_t) *count);
+	assert(stat.stages[PERF_STAGE_PUBLISH].count == (uint64_t) *count);
+	if (*count)
+		assert(stat.stages[PERF_STAGE_DEQUEUE].count > 0);
+	trace_post_reporter(trace);
+	free(count);
+}
+
+static void report_cb(libtrace_t *trace UNUSED,
+                libtrace_thread_t *sender UNUSED, void *global UNUSED,
+                void *tls UNUSED, libtrace_result_t *res) {
+	assert(res->type == RESULT_USER);
+	received += res->value.sint;
+}
+
+/**
+ * Test that with performance statistics enabled every stage of a hashed
+ * parallel trace is timed, and that each histogram holds every timing.
+ */
+int main(int argc, char *argv[]) {
+	const char *tracename;
+	libtrace_t *trace;
+	libtrace_callback_set_t *processing;
+	libtrace_callback_set_t *reporter;
+	libtrace_perf_stat_t stat;
+	int i;
+
+	if (argc<2) {
+		fprintf(stderr,"usage: %s type\n",argv[0]);
+		return 1;
+	}
+
+	tracename = lookup_uri(argv[1]);
+
+	trace = trace_create(tracename);
+	iferr(trace,tracename);
+
+	processing = trace_create_callback_set();
+	trace_set_starting_cb(processing, start_processing);
+	trace_set_stopping_cb(processing, stop_processing);
+	trace_set_packet_cb(processing, per_packet);
+
+	reporter = trace_create_callback_set();
+	trace_set_result_cb(reporter, report_cb);
+
+	trace_set_perpkt_threads(trace, 2);
+	trace_set_hasher(trace, HASHER_BIDIRECTIONAL, NULL, NULL);
+	assert(trace_set_perf_stats(trace, true) == 0);
+
+	trace_pstart(trace, NULL, processing, reporter);
+	iferr(trace,tracename);
+	trace_join(trace);
+	iferr(trace,tracename);
+
+	assert(published == 100);
+	assert(received == 100);
+
+	assert(trace_get_thread_perf_statistics(trace, NULL, &stat) == 0);
+	check_stat(&stat);
+	for (i = 0; i < PERF_STAGE_MAX; i++)
+		assert(stat.stages[i].count > 0);
+
+	/* Every packet is hashed, queued, passed to the callback and has its
+	 * result published and combined. Reads also count the final EOF. */
+	assert(stat.stages[PERF_STAGE_READ].count > 100);
+	assert(stat.stages[PERF_STAGE_HASH].count == 100);
+	assert(stat.stages[PERF_STAGE_ENQUEUE].count == 100);
+	assert(stat.stages[PERF_STAGE_CALLBACK].count == 100);
+	assert(stat.stages[PERF_STAGE_PUBLISH].count == 100);
+
+	trace_print_perf_statistics(trace, NULL, stdout);
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+	trace_destroy_callback_set(reporter);
+	return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id: test-rtclient.c,v 1.2 2006/02/27 03:41:12 perry Exp $
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "libtrace_parallel.h"
+
+/* Tests that count ticks let the ordered combiner pass on the results of
+ * one thread while the other threads publish nothing but ticks. Without
+ * the ticks nothing would reach the reporter until every thread stopped. */
+
+#define TICK_COUNT 10
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+const char *lookup_uri(const char *type) {
+	if (strchr(type,':'))
+		return type;
+	if (!strcmp(type,"erf"))
+		return "erf:traces/100_packets.erf";
+	if (!strcmp(type,"pcapfile"))
+		return "pcapfile:traces/100_packets.pcap";
+	return type;
+}
+
+struct TLS {
+	bool keeper;
+	uint64_t last;
+	int kept;
+};
+
+/* Set when the thread which keeps packets has seen the reporter catch up */
+static volatile bool caught_up = false;
+static volatile int received = 0;
+static volatile int published = 0;
+
+static void report_cb(libtrace_t *trace,
+                libtrace_thread_t *sender UNUSED,
+                void *global UNUSED, void *tls UNUSED, libtrace_result_t *res) {
+        static uint64_t last = 0;
+
+        if (res->type != RESULT_PACKET)
+                return;
+        assert(res->key >= last);
+        last = res->key;
+        received ++;
+        trace_free_packet(trace, res->value.pkt);
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace,
+                libtrace_thread_t *t,
+                void *global UNUSED, void *tls, libtrace_packet_t *packet) {
+        struct TLS *storage = (struct TLS *)tls;
+        uint64_t order = trace_packet_get_order(packet);
+
+        /* Only the thread with the first packet keeps any */
+        if (order == 0)
+                storage->keeper = true;
+        if (!storage->keeper)
+                return packet;
+
+        storage->last = order;
+        storage->kept ++;
+        published ++;
+        trace_publish_result(trace, t, order,
+                        (libtrace_generic_t){.pkt = packet}, RESULT_PACKET);
+        return NULL;
+}
+
+static void process_tick(libtrace_t *trace, libtrace_thread_t *t,
+                void *global UNUSED, void *tls, uint64_t tick) {
+        struct TLS *storage = (struct TLS *)tls;
+        int expected;
+        int i;
+
+        assert(tick % TICK_COUNT == 0);
+        trace_publish_result(trace, t, tick, (libtrace_generic_t){0},
+                        RESULT_TICK_COUNT);
+        trace_post_reporter(trace);
+
+        if (!storage->keeper || caught_up || tick == 0)
+                return;
+
+        /* Every packet kept before the tick can be passed on once the
+         * other threads publish this tick, or a later one */
+        expected = storage->kept;
+        if (storage->last == tick)
+                expected --;
+        assert(expected > 0);
+        for (i = 0; i < 10000 && received < expected; i++)
+                usleep(1000);
+        printf("Reporter has %d of %d packets at tick %lu\n", received,
+                        expected, (unsigned long) tick);
+        assert(received >= expected);
+        caught_up = true;
+}
+
+static void *start_processing(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED,
+                void *global UNUSED) {
+        return calloc(1, sizeof(struct TLS));
+}
+
+static void stop_processing(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED,
+                void *global UNUSED, void *tls) {
+        free(tls);
+}
+
+int main(int argc, char *argv[]) {
+	const char *tracename;
+	libtrace_t *trace;
+        libtrace_callback_set_t *processing = NULL;
+        libtrace_callback_set_t *reporter = NULL;
+
+	if (argc<2) {
+		fprintf(stderr,"usage: %s type\n",argv[0]);
+		return 1;
+	}
+
+	tracename = lookup_uri(argv[1]);
+
+	trace = trace_create(tracename);
+	iferr(trace,tracename);
+
+        processing = trace_create_callback_set();
+        trace_set_starting_cb(processing, start_processing);
+        trace_set_stopping_cb(processing, stop_processing);
+        trace_set_packet_cb(processing, per_packet);
+        trace_set_tick_count_cb(processing, process_tick);
+
+        reporter = trace_create_callback_set();
+        trace_set_result_cb(reporter, report_cb);
+
+        trace_set_perpkt_threads(trace, 4);
+        trace_set_combiner(trace, &combiner_ordered, (libtrace_generic_t){0});
+        trace_set_tick_count(trace, TICK_COUNT);
+
+	trace_pstart(trace, NULL, processing, reporter);
+	iferr(trace,tracename);
+
+	/* Wait for all threads to stop */
+	trace_join(trace);
+	iferr(trace,tracename);
+
+        assert(caught_up);
+        assert(received == published);
+
+        trace_destroy(trace);
+        trace_destroy_callback_set(processing);
+        trace_destroy_callback_set(reporter);
+        return 0;
+}
@@ -0,0 +1,221 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id: test-rtclient.c,v 1.2 2006/02/27 03:41:12 perry Exp $
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/types.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "libtrace_parallel.h"
+
+/* Tests reading with work stealing between the packet processing threads.
+ * One thread is slow, so that the others have to steal batches from it,
+ * the packet cache is small and ticks are requested. Checks every packet is
+ * seen once and that each thread sees its packets and ticks in order. */
+
+#define TICK_COUNT 10
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+const char *lookup_uri(const char *type) {
+	if (strchr(type,':'))
+		return type;
+	if (!strcmp(type,"erf"))
+		return "erf:traces/100_packets.erf";
+	if (!strcmp(type,"pcapfile"))
+		return "pcapfile:traces/100_packets.pcap";
+	return type;
+}
+
+struct TLS {
+	uint64_t last;
+	int count;
+	int ticks;
+};
+
+struct final {
+        int threads;
+        int packets;
+        int ticks;
+};
+
+static void *report_start(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED,
+                void *global UNUSED) {
+        struct final *final = calloc(1, sizeof(struct final));
+
+        return final;
+}
+
+static void report_cb(libtrace_t *trace UNUSED,
+                libtrace_thread_t *sender UNUSED,
+                void *global UNUSED, void *tls, libtrace_result_t *res) {
+        struct final *final = (struct final *)tls;
+
+        if (res->key == 0) {
+                final->threads ++;
+                final->packets += res->value.sint;
+        } else {
+                assert(res->key == 1);
+                final->ticks += res->value.sint;
+        }
+}
+
+static void report_end(libtrace_t *trace, libtrace_thread_t *t UNUSED,
+                void *global UNUSED, void *tls) {
+        struct final *final = (struct final *)tls;
+
+        printf("%d packets and %d ticks\n", final->packets, final->ticks);
+        assert(final->threads == trace_get_perpkt_threads(trace));
+        assert(final->packets == 100);
+        assert(final->ticks > 0);
+
+        free(final);
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t,
+                void *global UNUSED, void *tls, libtrace_packet_t *packet) {
+        struct TLS *storage = (struct TLS *)tls;
+        uint64_t order = trace_packet_get_order(packet);
+
+        assert(order >= storage->last);
+        storage->last = order;
+        storage->count ++;
+
+        if (storage->count > 100) {
+                fprintf(stderr, "Too many packets -- someone should stop me!\n");
+                kill(getpid(), SIGTERM);
+        }
+
+        /* Let the other threads steal from the first */
+        if (trace_get_perpkt_thread_id(t) == 0)
+                usleep(10000);
+        else
+                usleep(1000);
+
+        return packet;
+}
+
+static void process_tick(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+                void *global UNUSED, void *tls, uint64_t tick) {
+        struct TLS *storage = (struct TLS *)tls;
+
+        assert(tick % TICK_COUNT == 0);
+        assert(tick >= storage->last);
+        storage->last = tick;
+        storage->ticks ++;
+}
+
+static void *start_processing(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED,
+                void *global UNUSED) {
+        return calloc(1, sizeof(struct TLS));
+}
+
+static void stop_processing(libtrace_t *trace, libtrace_thread_t *t,
+                void *global UNUSED, void *tls) {
+        struct TLS *storage = (struct TLS *)tls;
+
+        trace_publish_result(trace, t, (uint64_t) 0,
+                        (libtrace_generic_t){.sint = storage->count},
+                        RESULT_USER);
+        trace_publish_result(trace, t, (uint64_t) 1,
+                        (libtrace_generic_t){.sint = storage->ticks},
+                        RESULT_USER);
+        trace_post_reporter(trace);
+        free(storage);
+}
+
+int main(int argc, char *argv[]) {
+	const char *tracename;
+	libtrace_t *trace;
+        libtrace_callback_set_t *processing = NULL;
+        libtrace_callback_set_t *reporter = NULL;
+
+	if (argc<2) {
+		fprintf(stderr,"usage: %s type\n",argv[0]);
+		return 1;
+	}
+
+	tracename = lookup_uri(argv[1]);
+
+	trace = trace_create(tracename);
+	iferr(trace,tracename);
+
+        processing = trace_create_callback_set();
+        trace_set_starting_cb(processing, start_processing);
+        trace_set_stopping_cb(processing, stop_processing);
+        trace_set_packet_cb(processing, per_packet);
+        trace_set_tick_count_cb(processing, process_tick);
+
+        reporter = trace_create_callback_set();
+        trace_set_starting_cb(reporter, report_start);
+        trace_set_stopping_cb(reporter, report_end);
+        trace_set_result_cb(reporter, report_cb);
+
+        trace_set_perpkt_threads(trace, 4);
+        trace_set_work_stealing(trace, true);
+        trace_set_tick_count(trace, TICK_COUNT);
+        /* Leave few packets spare beyond those held by the threads, so
+         * that batches cannot always be queued */
+        trace_set_burst_size(trace, 10);
+        trace_set_hasher_queue_size(trace, 4);
+        trace_set_cache_size(trace, 20);
+        trace_set_thread_cache_size(trace, 10);
+        trace_set_fixed_count(trace, true);
+
+	trace_pstart(trace, NULL, processing, reporter);
+	iferr(trace,tracename);
+
+	/* Make sure no packets are lost or reordered by a pause */
+	trace_ppause(trace);
+	iferr(trace,tracename);
+	trace_pstart(trace, NULL, NULL, NULL);
+	iferr(trace,tracename);
+
+	/* Wait for all threads to stop */
+	trace_join(trace);
+	iferr(trace,tracename);
+
+        trace_destroy(trace);
+        trace_destroy_callback_set(processing);
+        trace_destroy_callback_set(reporter);
+        return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "libtrace_parallel.h"
+
+static const char *inputs[] = {
+	"erf:traces/100_packets.erf",
+	"pcapfile:traces/100_seconds.pcap",
+	"pcapng:traces/100_packets.pcapng",
+	NULL
+};
+
+static char merge_uri[1024];
+
+void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+/* Counts the packets in a trace, returning -1 if the timestamps of the
+ * packets ever go backwards */
+static int count_packets(const char *uri) {
+	libtrace_t *trace;
+	libtrace_packet_t *packet;
+	uint64_t ts, last = 0;
+	int count = 0;
+	int outoforder = 0;
+
+	trace = trace_create(uri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+
+	packet = trace_create_packet();
+	while (trace_read_packet(trace, packet) > 0) {
+		if (IS_LIBTRACE_META_PACKET(packet))
+			continue;
+		ts = trace_get_erf_timestamp(packet);
+		if (ts < last)
+			outoforder ++;
+		last = ts;
+		count ++;
+	}
+	iferr(trace);
+	trace_destroy_packet(packet);
+	trace_destroy(trace);
+
+	if (outoforder) {
+		printf("%s: %d packets out of order\n", uri, outoforder);
+		return -1;
+	}
+	return count;
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global, void *tls UNUSED,
+		libtrace_packet_t *packet) {
+	if (!IS_LIBTRACE_META_PACKET(packet))
+		__sync_fetch_and_add((int *)global, 1);
+	return packet;
+}
+
+static int count_packets_parallel(const char *uri) {
+	libtrace_t *trace;
+	libtrace_callback_set_t *processing;
+	int count = 0;
+
+	trace = trace_create(uri);
+	iferr(trace);
+	trace_set_perpkt_threads(trace, 2);
+
+	processing = trace_create_callback_set();
+	trace_set_packet_cb(processing, per_packet);
+	trace_pstart(trace, &count, processing, NULL);
+	iferr(trace);
+	trace_join(trace);
+	iferr(trace);
+
+	trace_destroy_callback_set(processing);
+	trace_destroy(trace);
+	return count;
+}
+
+int main(int argc, char *argv[]) {
+	int expected = 0;
+	int count, i;
+
+	strcpy(merge_uri, "merge:");
+	for (i = 0; inputs[i]; i++) {
+		if (i > 0)
+			strcat(merge_uri, ",");
+		strcat(merge_uri, inputs[i]);
+		expected += count_packets(inputs[i]);
+	}
+
+	if (argc > 1 && strcmp(argv[1], "parallel") == 0)
+		count = count_packets_parallel(merge_uri);
+	else
+		count = count_packets(merge_uri);
+
+	if (count != expected) {
+		printf("failure: expected %d packets, got %d\n", expected,
+				count);
+		return 1;
+	}
+	printf("success: %d packets\n", count);
+	return 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id: test-rtclient.c,v 1.2 2006/02/27 03:41:12 perry Exp $
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "libtrace_parallel.h"
+
+/* Tests writing a sharded output from several packet processing threads,
+ * each thread writes a compressed file of its own which are then read
+ * back and checked against the packets each thread wrote. */
+
+#define THREADS 4
+#define OUTPUT "pcapfile:traces/shards.out.pcap.gz"
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+void iferrout(libtrace_out_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err_output(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+const char *lookup_uri(const char *type) {
+	if (strchr(type,':'))
+		return type;
+	if (!strcmp(type,"erf"))
+		return "erf:traces/100_packets.erf";
+	if (!strcmp(type,"pcapfile"))
+		return "pcapfile:traces/100_packets.pcap";
+	return type;
+}
+
+struct TLS {
+	libtrace_out_t *output;
+	int written;
+};
+
+/* The packets written by each thread, indexed by thread ID */
+static int written[THREADS];
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED,
+                void *global UNUSED, void *tls, libtrace_packet_t *packet) {
+        struct TLS *storage = (struct TLS *)tls;
+
+        if (trace_write_packet(storage->output, packet) < 0) {
+                iferrout(storage->output, "write");
+                exit(1);
+        }
+        storage->written ++;
+        /* Give the other threads a turn at reading */
+        usleep(1000);
+        return packet;
+}
+
+static void *start_processing(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t, void *global) {
+        libtrace_out_shards_t *shards = (libtrace_out_shards_t *)global;
+        struct TLS *storage = calloc(1, sizeof(struct TLS));
+
+        storage->output = trace_get_output_shard(shards, t);
+        assert(storage->output);
+        iferrout(storage->output, "shard");
+        /* The same shard is given back to the same thread */
+        assert(trace_get_output_shard(shards, t) == storage->output);
+        return storage;
+}
+
+static void stop_processing(libtrace_t *trace UNUSED, libtrace_thread_t *t,
+                void *global UNUSED, void *tls) {
+        struct TLS *storage = (struct TLS *)tls;
+        int id = trace_get_perpkt_thread_id(t);
+
+        assert(id >= 0 && id < THREADS);
+        written[id] = storage->written;
+        free(storage);
+}
+
+/* Reads back a thread's shard, returning the number of packets in it */
+static int count_shard(int id) {
+        char name[100];
+        unsigned char magic[2];
+        libtrace_t *trace;
+        libtrace_packet_t *packet;
+        FILE *f;
+        int count = 0;
+
+        /* A pcapfile is only created once the first packet is written */
+        snprintf(name, sizeof(name), "traces/shards-%d.out.pcap.gz", id);
+        if (written[id] == 0) {
+                assert(access(name, F_OK) != 0);
+                return 0;
+        }
+
+        /* Check the compression option reached the shard */
+        f = fopen(name, "rb");
+        assert(f);
+        assert(fread(magic, 1, 2, f) == 2);
+        assert(magic[0] == 0x1f && magic[1] == 0x8b);
+        fclose(f);
+
+        snprintf(name, sizeof(name), "pcapfile:traces/shards-%d.out.pcap.gz",
+                        id);
+        trace = trace_create(name);
+        iferr(trace, name);
+        trace_start(trace);
+        iferr(trace, name);
+        packet = trace_create_packet();
+        while (trace_read_packet(trace, packet) > 0)
+                count ++;
+        iferr(trace, name);
+        trace_destroy_packet(packet);
+        trace_destroy(trace);
+        return count;
+}
+
+int main(int argc, char *argv[]) {
+	const char *tracename;
+	libtrace_t *trace;
+        libtrace_out_shards_t *shards;
+        libtrace_callback_set_t *processing = NULL;
+        int compresstype = TRACE_OPTION_COMPRESSTYPE_ZLIB;
+        int level = 1;
+        int total = 0;
+        int used = 0;
+        int i;
+
+	if (argc<2) {
+		fprintf(stderr,"usage: %s type\n",argv[0]);
+		return 1;
+	}
+
+	tracename = lookup_uri(argv[1]);
+
+	trace = trace_create(tracename);
+	iferr(trace,tracename);
+
+        shards = trace_create_output_shards(OUTPUT);
+        assert(shards);
+        assert(trace_config_output_shards(shards,
+                        TRACE_OPTION_OUTPUT_COMPRESSTYPE, &compresstype) == 0);
+        assert(trace_config_output_shards(shards,
+                        TRACE_OPTION_OUTPUT_COMPRESS, &level) == 0);
+
+        processing = trace_create_callback_set();
+        trace_set_starting_cb(processing, start_processing);
+        trace_set_stopping_cb(processing, stop_processing);
+        trace_set_packet_cb(processing, per_packet);
+
+        trace_set_perpkt_threads(trace, THREADS);
+
+	trace_pstart(trace, shards, processing, NULL);
+	iferr(trace,tracename);
+
+	/* Wait for all threads to stop */
+	trace_join(trace);
+	iferr(trace,tracename);
+
+        /* Options can no longer change once shards exist */
+        assert(trace_config_output_shards(shards,
+                        TRACE_OPTION_OUTPUT_COMPRESS, &level) == -1);
+        trace_destroy_output_shards(shards);
+
+        for (i = 0; i < THREADS; i++) {
+                int count = count_shard(i);
+
+                printf("Thread %d wrote %d packets\n", i, count);
+                assert(count == written[i]);
+                total += count;
+                if (count > 0)
+                        used ++;
+        }
+        assert(total == 100);
+        assert(used > 1);
+
+        trace_destroy(trace);
+        trace_destroy_callback_set(processing);
+        return 0;
+}
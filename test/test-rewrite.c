@@ -0,0 +1,328 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson
+ *          Perry Lorier
+ *          Shane Alcock
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id$
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "libtrace.h"
+
+#define PAYLOAD 301
+
+/* Sums 16 bit words in memory order, odd lengths are padded with zero */
+static uint32_t sum_words(const void *data, size_t len, uint32_t sum) {
+	const uint8_t *p = (const uint8_t *)data;
+	size_t i;
+
+	for (i = 0; i + 1 < len; i += 2) {
+		uint16_t w;
+		memcpy(&w, p + i, 2);
+		sum += w;
+	}
+	if (len & 1) {
+		uint16_t w = 0;
+		memcpy(&w, p + len - 1, 1);
+		sum += w;
+	}
+	return sum;
+}
+
+static uint16_t fold(uint32_t sum) {
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)sum;
+}
+
+/* Checks that the checksums in a packet are correct, by summing everything
+ * they cover including the checksum itself */
+static int valid(libtrace_packet_t *packet, int *transport_checked) {
+	uint16_t ethertype, word;
+	uint32_t remaining, sum = 0;
+	uint8_t proto;
+	uint8_t *l3 = trace_get_layer3(packet, &ethertype, &remaining);
+	uint8_t *l4;
+	size_t l4len;
+
+	if (ethertype == TRACE_ETHERTYPE_IP) {
+		libtrace_ip_t *ip = (libtrace_ip_t *)l3;
+
+		if (fold(sum_words(ip, ip->ip_hl * 4, 0)) != 0xffff)
+			return 0;
+		proto = ip->ip_p;
+		l4 = l3 + ip->ip_hl * 4;
+		l4len = ntohs(ip->ip_len) - ip->ip_hl * 4;
+		if (proto == TRACE_IPPROTO_ICMP)
+			return 1;
+		sum = sum_words(&ip->ip_src, 8, 0);
+	} else {
+		libtrace_ip6_t *ip6 = (libtrace_ip6_t *)l3;
+
+		proto = ip6->nxt;
+		l4 = l3 + sizeof(libtrace_ip6_t);
+		l4len = ntohs(ip6->plen);
+		sum = sum_words(&ip6->ip_src, 32, 0);
+	}
+
+	if (proto == TRACE_IPPROTO_UDP && ethertype == TRACE_ETHERTYPE_IP &&
+			((libtrace_udp_t *)l4)->check == 0)
+		return 1;
+
+	word = htons(proto);
+	sum = sum_words(&word, 2, sum);
+	word = htons(l4len);
+	sum = sum_words(&word, 2, sum);
+	sum = sum_words(l4, l4len, sum);
+	*transport_checked = 1;
+	return fold(sum) == 0xffff;
+}
+
+/* Builds an Ethernet frame holding IPv4 or IPv6 and a transport header
+ * followed by a payload, with correct checksums */
+static void build(libtrace_packet_t *packet, int v6, uint8_t proto,
+		uint16_t frag) {
+	uint8_t buf[14 + 40 + 20 + PAYLOAD];
+	uint8_t *l3 = buf + 14;
+	uint8_t *l4;
+	size_t l4len, hdrlen, i;
+	uint32_t sum;
+	uint16_t word;
+	size_t csum_off;
+
+	memset(buf, 0, sizeof(buf));
+	buf[12] = v6 ? 0x86 : 0x08;
+	buf[13] = v6 ? 0xdd : 0x00;
+
+	hdrlen = proto == TRACE_IPPROTO_TCP ? 20 : 8;
+	l4len = hdrlen + PAYLOAD;
+	l4 = l3 + (v6 ? 40 : 20);
+	for (i = 0; i < l4len; i++)
+		l4[i] = (uint8_t)(i * 37 + 11);
+
+	if (v6) {
+		libtrace_ip6_t *ip6 = (libtrace_ip6_t *)l3;
+		ip6->flow = htonl(0x60000000);
+		ip6->plen = htons(l4len);
+		ip6->nxt = proto;
+		ip6->hlim = 64;
+		for (i = 0; i < 16; i++) {
+			ip6->ip_src.s6_addr[i] = 0x20 + i;
+			ip6->ip_dst.s6_addr[i] = 0xf0 - i;
+		}
+		sum = sum_words(&ip6->ip_src, 32, 0);
+	} else {
+		libtrace_ip_t *ip = (libtrace_ip_t *)l3;
+		ip->ip_v = 4;
+		ip->ip_hl = 5;
+		ip->ip_len = htons(20 + l4len);
+		ip->ip_off = htons(frag);
+		ip->ip_ttl = 64;
+		ip->ip_p = proto;
+		ip->ip_src.s_addr = inet_addr("10.1.2.3");
+		ip->ip_dst.s_addr = inet_addr("192.168.200.1");
+		ip->ip_sum = ~fold(sum_words(ip, 20, 0));
+		sum = sum_words(&ip->ip_src, 8, 0);
+	}
+
+	if (proto == TRACE_IPPROTO_TCP) {
+		libtrace_tcp_t *tcp = (libtrace_tcp_t *)l4;
+		tcp->doff = 5;
+		csum_off = 16;
+	} else if (proto == TRACE_IPPROTO_UDP) {
+		libtrace_udp_t *udp = (libtrace_udp_t *)l4;
+		udp->len = htons(l4len);
+		csum_off = 6;
+	} else {
+		csum_off = 2;
+	}
+	memset(l4 + csum_off, 0, 2);
+
+	if (proto == TRACE_IPPROTO_ICMP)
+		sum = 0;
+	else {
+		word = htons(proto);
+		sum = sum_words(&word, 2, sum);
+		word = htons(l4len);
+		sum = sum_words(&word, 2, sum);
+	}
+	word = ~fold(sum_words(l4, l4len, sum));
+	memcpy(l4 + csum_off, &word, 2);
+
+	trace_construct_packet(packet, TRACE_TYPE_ETH, buf,
+			14 + (v6 ? 40 : 20) + l4len);
+}
+
+static int rewrite_all(libtrace_packet_t *packet, int v6, const char *name,
+		int ports) {
+	struct in_addr a4;
+	struct in6_addr a6;
+	uint16_t port;
+	uint8_t ttl;
+	int i, checked = 0;
+
+	for (i = 0; i < 16; i++)
+		a6.s6_addr[i] = 0x3f ^ (i * 7);
+	a4.s_addr = inet_addr("130.217.250.13");
+
+	if (trace_rewrite_field(packet, TRACE_REWRITE_SRC_ADDR,
+				v6 ? (void *)&a6 : (void *)&a4) != 0 ||
+			!valid(packet, &checked)) {
+		printf("failure: %s source address\n", name);
+		return 1;
+	}
+	a4.s_addr = inet_addr("1.255.0.7");
+	a6.s6_addr[15] = 0xff;
+	if (trace_rewrite_field(packet, TRACE_REWRITE_DST_ADDR,
+				v6 ? (void *)&a6 : (void *)&a4) != 0 ||
+			!valid(packet, &checked)) {
+		printf("failure: %s destination address\n", name);
+		return 1;
+	}
+	port = htons(65535);
+	if (trace_rewrite_field(packet, TRACE_REWRITE_SRC_PORT, &port) !=
+			(ports ? 0 : -1) || !valid(packet, &checked)) {
+		printf("failure: %s source port\n", name);
+		return 1;
+	}
+	port = htons(443);
+	if (trace_rewrite_field(packet, TRACE_REWRITE_DST_PORT, &port) !=
+			(ports ? 0 : -1) || !valid(packet, &checked)) {
+		printf("failure: %s destination port\n", name);
+		return 1;
+	}
+	ttl = 3;
+	if (trace_rewrite_field(packet, TRACE_REWRITE_TTL, &ttl) != 0 ||
+			!valid(packet, &checked)) {
+		printf("failure: %s TTL\n", name);
+		return 1;
+	}
+	if (ports && trace_get_source_port(packet) != 65535) {
+		printf("failure: %s port was not changed\n", name);
+		return 1;
+	}
+	return 0;
+}
+
+/* Compares trace_checksum_update() with summing the whole buffer */
+static int random_updates(void) {
+	uint8_t data[64], old[64];
+	uint16_t csum, want;
+	int i, j;
+
+	srand(1234);
+	for (i = 0; i < (int)sizeof(data); i++)
+		data[i] = rand();
+	csum = ~fold(sum_words(data, sizeof(data), 0));
+
+	for (i = 0; i < 10000; i++) {
+		int start = (rand() % 32) * 2;
+		int len = 1 + rand() % ((int)sizeof(data) - start);
+
+		memcpy(old, data + start, len);
+		for (j = 0; j < len; j++)
+			data[start + j] = (i % 7 == 0) ? 0 : rand();
+		trace_checksum_update(&csum, old, data + start, len);
+
+		/* 0 and 0xffff are both zero in one's complement */
+		want = ~fold(sum_words(data, sizeof(data), 0));
+		if (csum != want && !((csum == 0 || csum == 0xffff) &&
+					(want == 0 || want == 0xffff))) {
+			printf("failure: incremental update %d (%d bytes at %d)"
+					"\n", i, len, start);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(void) {
+	libtrace_packet_t *packet = trace_create_packet();
+	uint8_t zero[2] = {0, 0};
+	int v6;
+	struct in_addr a4;
+	uint8_t buf[60], check[2];
+
+	if (random_updates())
+		return 1;
+
+	for (v6 = 0; v6 < 2; v6++) {
+		build(packet, v6, TRACE_IPPROTO_TCP, 0);
+		if (rewrite_all(packet, v6, v6 ? "IPv6 TCP" : "IPv4 TCP", 1))
+			return 1;
+		build(packet, v6, TRACE_IPPROTO_UDP, 0);
+		if (rewrite_all(packet, v6, v6 ? "IPv6 UDP" : "IPv4 UDP", 1))
+			return 1;
+	}
+	build(packet, 1, TRACE_IPPROTO_ICMPV6, 0);
+	if (rewrite_all(packet, 1, "ICMPv6", 0))
+		return 1;
+	build(packet, 0, TRACE_IPPROTO_ICMP, 0);
+	if (rewrite_all(packet, 0, "ICMP", 0))
+		return 1;
+
+	/* A UDP checksum of zero stays zero */
+	build(packet, 0, TRACE_IPPROTO_UDP, 0);
+	memset((uint8_t *)trace_get_udp(packet) + 6, 0, 2);
+	if (rewrite_all(packet, 0, "IPv4 UDP without checksum", 1))
+		return 1;
+	if (memcmp((uint8_t *)trace_get_udp(packet) + 6, zero, 2) != 0) {
+		printf("failure: UDP checksum of zero was changed\n");
+		return 1;
+	}
+
+	/* Later fragments don't hold a transport header to update */
+	build(packet, 0, TRACE_IPPROTO_TCP, 100);
+	memcpy(check, (uint8_t *)trace_get_ip(packet) + 20 + 16, 2);
+	a4.s_addr = inet_addr("8.8.4.4");
+	if (trace_rewrite_field(packet, TRACE_REWRITE_SRC_ADDR, &a4) != 0 ||
+			trace_rewrite_field(packet, TRACE_REWRITE_SRC_PORT,
+				zero) != -1) {
+		printf("failure: rewriting a fragment\n");
+		return 1;
+	}
+	if (memcmp(check, (uint8_t *)trace_get_ip(packet) + 20 + 16, 2) != 0) {
+		printf("failure: fragment payload was changed\n");
+		return 1;
+	}
+
+	/* Not IP */
+	memset(buf, 0, sizeof(buf));
+	buf[12] = 0x08;
+	buf[13] = 0x06;
+	trace_construct_packet(packet, TRACE_TYPE_ETH, buf, sizeof(buf));
+	if (trace_rewrite_field(packet, TRACE_REWRITE_SRC_ADDR, &a4) != -1) {
+		printf("failure: rewrote the address of an ARP packet\n");
+		return 1;
+	}
+
+	trace_destroy_packet(packet);
+	printf("success\n");
+	return 0;
+}
@@ -59,45 +59,130 @@ void iferr(libtrace_t *trace)
 	exit(1);
 }
 
-int main(int argc, char *argv[]) {
-        char *uri = "erf:traces/100_packets.erf";
-        int psize = 0;
-	int error = 0;
+const char *lookup_uri(const char *type) {
+	if (strchr(type,':'))
+		return type;
+	if (!strcmp(type,"erf"))
+		return "erf:traces/100_packets.erf";
+	if (!strcmp(type,"pcapfile"))
+		return "pcapfile:traces/100_packets.pcap";
+	if (!strcmp(type,"pcapng"))
+		return "pcapng:traces/100_packets.pcapng";
+	return "unknown";
+}
+
+/* Seeks to a timestamp and counts the packets from there to the end */
+int count_from(uint64_t ts) {
+	libtrace_packet_t *packet;
+	int psize;
 	int count = 0;
+
+	trace_seek_erf_timestamp(trace,ts);
+	iferr(trace);
+
+	packet=trace_create_packet();
+	while ((psize = trace_read_packet(trace, packet)) > 0) {
+		if (!IS_LIBTRACE_META_PACKET(packet))
+			count ++;
+	}
+	trace_destroy_packet(packet);
+	if (psize < 0)
+		iferr(trace);
+	return count;
+}
+
+/* Copies a trace to an ERF file, writing an index as it goes */
+const char *write_indexed(const char *uri) {
+	const char *outuri = "erf:traces/100_packets.out.erf";
+	libtrace_out_t *out;
 	libtrace_packet_t *packet;
+	int spacing = 1000;
 
 	trace = trace_create(uri);
 	iferr(trace);
-
 	trace_start(trace);
 	iferr(trace);
 
-	trace_seek_erf_timestamp(trace,4704246759960519168ULL);
+	out = trace_create_output(outuri);
+	if (trace_config_output(out, TRACE_OPTION_OUTPUT_INDEX, &spacing) ||
+			trace_start_output(out)) {
+		trace_perror_output(out, "Writing %s", outuri);
+		exit(1);
+	}
+
+	packet = trace_create_packet();
+	while (trace_read_packet(trace, packet) > 0) {
+		if (trace_write_packet(out, packet) < 0) {
+			trace_perror_output(out, "Writing %s", outuri);
+			exit(1);
+		}
+	}
 	iferr(trace);
-	
-	packet=trace_create_packet();
-        for (;;) {
-		if ((psize = trace_read_packet(trace, packet)) <0) {
-			error = 1;
-			break;
+	trace_destroy_packet(packet);
+	trace_destroy_output(out);
+	trace_destroy(trace);
+	return outuri;
+}
+
+/* Seeks forwards and backwards through the trace, optionally indexing it
+ * first so the seeks use the index, or writing an indexed copy of it */
+int main(int argc, char *argv[]) {
+	const char *uri = lookup_uri(argc > 1 ? argv[1] : "erf");
+	int use_index = argc > 2 && !strcmp(argv[2], "index");
+	int write_index = argc > 2 && !strcmp(argv[2], "write");
+	uint64_t seeks[] = {4704246759960000000ULL, 0,
+		4704246759961000000ULL, 4704246759958000000ULL, ~0ULL};
+	int expected[] = {4, 100, 1, 8, 0};
+	char indexname[1024];
+	int error = 0;
+	int count;
+	int i;
+
+	if (write_index)
+		uri = write_indexed(uri);
+	snprintf(indexname, sizeof(indexname), "%s.idx", strchr(uri, ':') + 1);
+	if (write_index) {
+		FILE *f = fopen(indexname, "rb");
+		if (f == NULL) {
+			printf("failure: %s was not written\n", indexname);
+			return 1;
 		}
-		if (psize == 0) {
-			error = 0;
-			break;
+		fclose(f);
+	} else if (use_index) {
+		trace = trace_create(uri);
+		iferr(trace);
+		trace_start(trace);
+		iferr(trace);
+		/* Small enough that the trace gets several entries */
+		if (trace_create_index(trace, NULL, 1000) <= 1) {
+			iferr(trace);
+			printf("failure: too few index entries\n");
+			return 1;
 		}
-		count ++;
-        }
-	trace_destroy_packet(packet);
-	if (error == 0) {
-		if (count == 4) {
-			printf("success: 4 packets read\n");
-		} else {
-			printf("failure: 4 packets expected, %d seen\n",count);
+		trace_destroy(trace);
+	}
+
+	trace = trace_create(uri);
+	iferr(trace);
+
+	trace_start(trace);
+	iferr(trace);
+
+	for (i = 0; i < (int)(sizeof(seeks) / sizeof(seeks[0])); i++) {
+		count = count_from(seeks[i]);
+		if (count != expected[i]) {
+			printf("failure: %d packets expected, %d seen\n",
+					expected[i], count);
 			error = 1;
 		}
-	} else {
-		iferr(trace);
 	}
-        trace_destroy(trace);
-        return error;
+	if (error == 0)
+		printf("success: all seeks found the right packets\n");
+
+	trace_destroy(trace);
+	if (use_index || write_index)
+		remove(indexname);
+	if (write_index)
+		remove(strchr(uri, ':') + 1);
+	return error;
 }
@@ -0,0 +1,189 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson 
+ *          Perry Lorier 
+ *          
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND 
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * $Id: test-rtclient.c,v 1.2 2006/02/27 03:41:12 perry Exp $
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include "libtrace_parallel.h"
+
+#define PACKETS 100
+#define SPEEDUP 50
+
+/* Slack allowed for scheduling when checking release times */
+#define EARLY_SLACK 0.002
+#define LATE_SLACK 0.25
+
+static double arrival[PACKETS];
+static double trace_ts[PACKETS];
+static int count = 0;
+
+static double now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1000000000.0;
+}
+
+static void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+static void record_packet(libtrace_packet_t *packet) {
+	assert(count < PACKETS);
+	arrival[count] = now_seconds();
+	trace_ts[count] = trace_get_seconds(packet);
+	count++;
+}
+
+/* Checks each packet was released when it was due, relative to the first
+ * packet, sped up by speedup and brought forward by up to window seconds */
+static void check_release(double speedup, double window) {
+	int i;
+
+	assert(count == PACKETS);
+	for (i = 0; i < count; i++) {
+		double due = (trace_ts[i] - trace_ts[0]) / speedup - window;
+		double have = arrival[i] - arrival[0];
+
+		if (due < 0)
+			due = 0;
+		if (have < due - EARLY_SLACK || have > due + LATE_SLACK) {
+			printf("Packet %d released at %f expected %f\n", i,
+			       have, due);
+			assert(0);
+		}
+	}
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED, void *global UNUSED,
+                void *tls UNUSED, libtrace_packet_t *packet) {
+	record_packet(packet);
+	return packet;
+}
+
+/**
+ * Test that trace-time playback is sped up by tracetime_speedup and that
+ * packets due within tracetime_window are released early.
+ */
+static void test_tracetime(const char *tracename, const char *config,
+                           double window) {
+	libtrace_t *trace;
+	libtrace_callback_set_t *processing;
+
+	count = 0;
+	trace = trace_create(tracename);
+	iferr(trace, tracename);
+
+	trace_set_perpkt_threads(trace, 1);
+	trace_set_tracetime(trace, true);
+	if (config) {
+		trace_set_configuration(trace, config);
+	} else {
+		assert(trace_set_tracetime_speedup(trace, SPEEDUP) == 0);
+		assert(trace_set_tracetime_window(trace, window * 1000000) == 0);
+	}
+
+	processing = trace_create_callback_set();
+	trace_set_packet_cb(processing, per_packet);
+
+	trace_pstart(trace, NULL, processing, NULL);
+	iferr(trace, tracename);
+	trace_join(trace);
+	iferr(trace, tracename);
+
+	check_release(SPEEDUP, window);
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+}
+
+/**
+ * Test that the event API replays a trace sped up by the replay speedup.
+ */
+static void test_event(const char *tracename) {
+	libtrace_t *trace;
+	libtrace_packet_t *packet;
+	int running = 1;
+
+	count = 0;
+	trace = trace_create(tracename);
+	iferr(trace, tracename);
+
+	assert(trace_set_replay_speedup(trace, 0) == -1);
+	trace_get_err(trace);
+	assert(trace_set_replay_speedup(trace, SPEEDUP) == 0);
+
+	trace_start(trace);
+	iferr(trace, tracename);
+
+	packet = trace_create_packet();
+	while (running) {
+		libtrace_eventobj_t ev = trace_event(trace, packet);
+		switch (ev.type) {
+			case TRACE_EVENT_SLEEP:
+				usleep((long)(ev.seconds * 1e6));
+				break;
+			case TRACE_EVENT_PACKET:
+				record_packet(packet);
+				break;
+			case TRACE_EVENT_TERMINATE:
+				running = 0;
+				break;
+			default:
+				assert(0);
+		}
+		iferr(trace, tracename);
+	}
+
+	check_release(SPEEDUP, 0);
+	trace_destroy_packet(packet);
+	trace_destroy(trace);
+}
+
+int main() {
+	const char *tracename = "pcapfile:traces/100_seconds.pcap";
+
+	fprintf(stderr, "Testing trace-time speedup\n");
+	test_tracetime(tracename, NULL, 0);
+	fprintf(stderr, "Testing trace-time window\n");
+	test_tracetime(tracename, NULL, 0.5);
+	fprintf(stderr, "Testing trace-time configuration\n");
+	test_tracetime(tracename, "tts=50,ttw=250000", 0.25);
+	fprintf(stderr, "Testing event API replay speedup\n");
+	test_event(tracename);
+
+	printf("success: trace replayed at %dx\n", SPEEDUP);
+	return 0;
+}
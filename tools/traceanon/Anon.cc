@@ -49,6 +49,12 @@ Anonymiser::Anonymiser () {
     /* empty constructor */
 }
 
+void Anonymiser::anonIPv4Batch(const uint32_t *orig, uint32_t *result,
+        size_t count) {
+    for (size_t i = 0; i < count; i++)
+        result[i] = this->anonIPv4(orig[i]);
+}
+
 PrefixSub::PrefixSub(const char *ipv4_key, const char *ipv6_key) : Anonymiser() {
     this->ipv4_mask = 0;
     this->ipv4_prefix = 0;
@@ -98,9 +104,94 @@ void PrefixSub::anonIPv6(uint8_t *orig, uint8_t *result) {
 #ifdef HAVE_LIBCRYPTO
 #include <openssl/evp.h>
 
+/* The most IPv4 addresses encrypted in one go by anonIPv4Batch() */
+#define IPV4_BATCH 8
+
+static inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+CryptoPanCache::CryptoPanCache(uint8_t cachebits) {
+    /* IPv4 masks only use the top cachebits bits, so the bottom bit of a
+     * slot can mark it as filled in */
+    assert(cachebits > 0 && cachebits < 32);
+    this->cachebits = cachebits;
+
+    /* Pages are only touched as prefixes are seen */
+    this->ipv4_slots = (uint32_t *)calloc((size_t)1 << cachebits,
+            sizeof(uint32_t));
+    this->ipv6_slots = (IPv6Slot *)calloc((size_t)1 << cachebits,
+            sizeof(IPv6Slot));
+}
+
+CryptoPanCache::~CryptoPanCache() {
+    free(this->ipv4_slots);
+    free(this->ipv6_slots);
+}
+
+bool CryptoPanCache::lookupv4(uint32_t prefix, uint32_t *mask) {
+    uint32_t slot = __atomic_load_n(
+            &this->ipv4_slots[prefix >> (32 - this->cachebits)],
+            __ATOMIC_RELAXED);
+
+    if ((slot & 1) == 0)
+        return false;
+    *mask = slot & ~1U;
+    return true;
+}
+
+void CryptoPanCache::storev4(uint32_t prefix, uint32_t mask) {
+    __atomic_store_n(&this->ipv4_slots[prefix >> (32 - this->cachebits)],
+            mask | 1, __ATOMIC_RELAXED);
+}
+
+bool CryptoPanCache::lookupv6(uint64_t half, uint64_t *mask) {
+    IPv6Slot *slot = &this->ipv6_slots[mix64(half) &
+            (((uint64_t)1 << this->cachebits) - 1)];
+    uint64_t check = __atomic_load_n(&slot->check, __ATOMIC_RELAXED);
+    uint64_t m = __atomic_load_n(&slot->mask, __ATOMIC_RELAXED);
+
+    /* A slot holding another half, or half written by another thread,
+     * won't match */
+    if ((check ^ m) != half)
+        return false;
+    *mask = m;
+    return true;
+}
+
+void CryptoPanCache::storev6(uint64_t half, uint64_t mask) {
+    IPv6Slot *slot = &this->ipv6_slots[mix64(half) &
+            (((uint64_t)1 << this->cachebits) - 1)];
+
+    __atomic_store_n(&slot->mask, mask, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->check, half ^ mask, __ATOMIC_RELAXED);
+}
+
 CryptoAnon::CryptoAnon(uint8_t *key, uint8_t len, uint8_t cachebits) :
         Anonymiser() {
 
+    this->cachebits = cachebits;
+    this->cache = new CryptoPanCache(cachebits);
+    this->owns_cache = true;
+    this->init(key, len);
+}
+
+CryptoAnon::CryptoAnon(uint8_t *key, uint8_t len, CryptoPanCache *cache) :
+        Anonymiser() {
+
+    this->cachebits = cache->getCacheBits();
+    this->cache = cache;
+    this->owns_cache = false;
+    this->init(key, len);
+}
+
+void CryptoAnon::init(uint8_t *key, uint8_t len) {
+
     assert(len >= 32);
     memcpy(this->key, key, 16);
     memcpy(this->padding, key + 16, 16);
@@ -111,20 +202,14 @@ CryptoAnon::CryptoAnon(uint8_t *key, uint8_t len, uint8_t cachebits) :
 
     EVP_EncryptInit_ex(this->ctx, this->cipher, NULL, this->key, NULL);
 
-    this->cachebits = cachebits;
-
-    this->ipv4_cache = new IPv4AnonCache();
-    this->ipv6_cache = new IPv6AnonCache();
-    this->recent_ipv4_cache[0][0] = 0;
-    this->recent_ipv4_cache[0][1] = 0;
-    this->recent_ipv4_cache[1][0] = 0;
-    this->recent_ipv4_cache[0][1] = 0;
-
+    this->recent_ipv4_count = 0;
+    this->ipv6_zero_mask = this->encrypt64Bits(0);
 }
 
 
 CryptoAnon::~CryptoAnon() {
-    delete(this->ipv4_cache);
+    if (this->owns_cache)
+        delete(this->cache);
     EVP_CIPHER_CTX_cleanup(this->ctx);
     EVP_CIPHER_CTX_free(this->ctx);
 }
@@ -138,32 +223,73 @@ static inline uint32_t generateFirstPad(uint8_t *pad) {
 
 }
 
-uint32_t CryptoAnon::anonIPv4(uint32_t orig) {
-    uint32_t cacheprefix =
-            (orig >> (32 - this->cachebits)) << (32 - this->cachebits);
-    uint32_t result = 0;
+bool CryptoAnon::lookupRecent(uint32_t orig, uint32_t *result) {
 
-    if (this->recent_ipv4_cache[0][0] == orig)
-        return this->recent_ipv4_cache[0][1];
-    else if (this->recent_ipv4_cache[1][0] == orig) {
+    if (this->recent_ipv4_count > 0 && this->recent_ipv4_cache[0][0] == orig) {
+        *result = this->recent_ipv4_cache[0][1];
+        return true;
+    } else if (this->recent_ipv4_count > 1 &&
+            this->recent_ipv4_cache[1][0] == orig) {
         uint32_t tmp = this->recent_ipv4_cache[1][1];
         this->recent_ipv4_cache[1][0] = this->recent_ipv4_cache[0][0];
         this->recent_ipv4_cache[1][1] = this->recent_ipv4_cache[0][1];
         this->recent_ipv4_cache[0][0] = orig;
         this->recent_ipv4_cache[0][1] = tmp;
-        return tmp;
-
+        *result = tmp;
+        return true;
     }
+    return false;
+}
 
-    result = this->lookupv4Cache(cacheprefix);
-    result = this->encrypt32Bits(orig, this->cachebits, 32, result);
+void CryptoAnon::addRecent(uint32_t orig, uint32_t result) {
 
     this->recent_ipv4_cache[1][0] = this->recent_ipv4_cache[0][0];
     this->recent_ipv4_cache[1][1] = this->recent_ipv4_cache[0][1];
     this->recent_ipv4_cache[0][0] = orig;
-    this->recent_ipv4_cache[0][1] = result ^ orig;
+    this->recent_ipv4_cache[0][1] = result;
+    if (this->recent_ipv4_count < 2)
+        this->recent_ipv4_count ++;
+}
+
+uint32_t CryptoAnon::anonIPv4(uint32_t orig) {
+    uint32_t result;
 
-    return this->recent_ipv4_cache[0][1];
+    this->anonIPv4Batch(&orig, &result, 1);
+    return result;
+}
+
+void CryptoAnon::anonIPv4Batch(const uint32_t *orig, uint32_t *result,
+        size_t count) {
+    uint32_t todo[IPV4_BATCH];
+    uint32_t masks[IPV4_BATCH];
+    size_t where[IPV4_BATCH];
+    size_t i = 0;
+
+    while (i < count) {
+        size_t n = 0;
+
+        for (; i < count && n < IPV4_BATCH; i++) {
+            uint32_t cacheprefix;
+
+            if (this->lookupRecent(orig[i], &result[i]))
+                continue;
+
+            /* The mask of the cached prefix comes from the shared cache,
+             * the remaining bits of every address are encrypted together */
+            cacheprefix = (orig[i] >> (32 - this->cachebits)) <<
+                    (32 - this->cachebits);
+            todo[n] = orig[i];
+            masks[n] = this->lookupv4Cache(cacheprefix);
+            where[n] = i;
+            n ++;
+        }
+
+        this->encrypt32BitsBatch(todo, masks, n, this->cachebits, 32);
+        for (size_t j = 0; j < n; j++) {
+            result[where[j]] = masks[j] ^ todo[j];
+            this->addRecent(todo[j], result[where[j]]);
+        }
+    }
 }
 
 static uint64_t swap64(uint64_t num) {
@@ -201,82 +327,101 @@ void CryptoAnon::anonIPv6(uint8_t *orig, uint8_t *result) {
 }
 
 uint32_t CryptoAnon::lookupv4Cache(uint32_t prefix) {
+    uint32_t prefmask;
 
-    IPv4AnonCache::iterator it = this->ipv4_cache->find(prefix);
-
-    if (it == this->ipv4_cache->end()) {
-        uint32_t prefmask = this->encrypt32Bits(prefix, 0, this->cachebits, 0);
-        (*this->ipv4_cache)[prefix] = prefmask;
+    if (this->cache->lookupv4(prefix, &prefmask))
         return prefmask;
-    }
-    return it->second;
+    prefmask = this->encrypt32Bits(prefix, 0, this->cachebits, 0);
+    this->cache->storev4(prefix, prefmask);
+    return prefmask;
 
 }
 
 uint64_t CryptoAnon::lookupv6Cache(uint64_t prefix) {
-    IPv6AnonCache::iterator it = this->ipv6_cache->find(prefix);
+    uint64_t prefmask;
 
-    if (it == this->ipv6_cache->end()) {
-        uint64_t prefmask = this->encrypt64Bits(prefix);
-        (*this->ipv6_cache)[prefix] = prefmask;
+    if (prefix == 0)
+        return this->ipv6_zero_mask;
+    if (this->cache->lookupv6(prefix, &prefmask))
         return prefmask;
-    }
-    return it->second;
+    prefmask = this->encrypt64Bits(prefix);
+    this->cache->storev6(prefix, prefmask);
+    return prefmask;
 }
 
 uint32_t CryptoAnon::encrypt32Bits(uint32_t orig, uint8_t start, uint8_t stop, 
         uint32_t res) {
-    uint8_t rin_output[32];
-    uint8_t rin_input[16];
-    uint32_t first4pad;
-    int outl = 32;
 
-    memcpy(rin_input, this->padding, 16);
-    first4pad = generateFirstPad(this->padding);
-
-    for (int pos = start; pos < stop; pos ++) {
-        uint32_t input;
+    this->encrypt32BitsBatch(&orig, &res, 1, start, stop);
+    return res;
+}
 
-        /* The MS bits are taken from the original address. The remaining
-         * bits are taken from padding. first4pad is used to help ensure we
-         * use the right bits from padding when pos < 32.
-         */
-        if (pos == 0) {
-            input = first4pad;
-        } else {
-            input = ((orig >> (32 - pos)) << (32 - pos)) |
-                    ((first4pad << pos) >> pos);
-        }
+void CryptoAnon::encrypt32BitsBatch(const uint32_t *orig, uint32_t *res,
+        size_t count, uint8_t start, uint8_t stop) {
+    uint8_t rin_output[(IPV4_BATCH * 32 + 1) * 16];
+    uint8_t rin_input[IPV4_BATCH * 32 * 16];
+    uint32_t first4pad;
+    int bits = stop - start;
+    int outl = sizeof(rin_output);
 
-        rin_input[0] = (uint8_t) (input >> 24);
-        rin_input[1] = (uint8_t) ((input << 8) >> 24);
-        rin_input[2] = (uint8_t) ((input << 16) >> 24);
-        rin_input[3] = (uint8_t) ((input << 24) >> 24);
+    assert(count <= IPV4_BATCH);
+    if (bits <= 0 || count == 0)
+        return;
 
-        /* Encryption: we're using AES as a pseudorandom function. For each
-         * bit in the original address, we use the first bit of the resulting
-         * encrypted output as part of an XOR mask */
-        EVP_EncryptUpdate(this->ctx, (unsigned char *)rin_output, &outl, 
-                (unsigned char *)rin_input, 16);
+    first4pad = generateFirstPad(this->padding);
 
-        /* Put the first bit of the output into the right slot of our mask */
-        res |= (((uint32_t)rin_output[0]) >> 7) << (31 - pos);
+    for (size_t i = 0; i < count; i++) {
+        for (int pos = start; pos < stop; pos ++) {
+            uint8_t *block = rin_input + (i * bits + pos - start) * 16;
+            uint32_t input;
+
+            /* The MS bits are taken from the original address. The
+             * remaining bits are taken from padding. first4pad is used to
+             * help ensure we use the right bits from padding when
+             * pos < 32.
+             */
+            if (pos == 0) {
+                input = first4pad;
+            } else {
+                input = ((orig[i] >> (32 - pos)) << (32 - pos)) |
+                        ((first4pad << pos) >> pos);
+            }
 
+            memcpy(block, this->padding, 16);
+            block[0] = (uint8_t) (input >> 24);
+            block[1] = (uint8_t) ((input << 8) >> 24);
+            block[2] = (uint8_t) ((input << 16) >> 24);
+            block[3] = (uint8_t) ((input << 24) >> 24);
+        }
     }
-    return res;
 
+    /* Encryption: we're using AES as a pseudorandom function. For each
+     * bit in the original address, we use the first bit of the resulting
+     * encrypted output as part of an XOR mask. The input for each bit only
+     * depends on the address, so every block is encrypted in one call,
+     * which lets the cipher work on several blocks at once (e.g. with
+     * AES-NI). */
+    EVP_EncryptUpdate(this->ctx, (unsigned char *)rin_output, &outl,
+            (unsigned char *)rin_input, count * bits * 16);
+
+    /* Put the first bit of each output into the right slot of our mask */
+    for (size_t i = 0; i < count; i++) {
+        for (int pos = start; pos < stop; pos ++) {
+            res[i] |= (((uint32_t)rin_output[(i * bits + pos - start) * 16])
+                    >> 7) << (31 - pos);
+        }
+    }
 }
 
 uint64_t CryptoAnon::encrypt64Bits(uint64_t orig) {
 
-    /* See encrypt32Bits for more explanation of how this works */
-    uint8_t rin_output[32];
-    uint8_t rin_input[16];
+    /* See encrypt32BitsBatch for more explanation of how this works */
+    uint8_t rin_output[65 * 16];
+    uint8_t rin_input[64 * 16];
     uint64_t first8pad;
-    int outl = 32;
+    int outl = sizeof(rin_output);
     uint64_t result = 0;
 
-    memcpy(rin_input, this->padding, 16);
     memcpy(&first8pad, this->padding, 8);
 
     for (int pos = 0; pos < 64; pos ++) {
@@ -289,13 +434,15 @@ uint64_t CryptoAnon::encrypt64Bits(uint64_t orig) {
                     ((first8pad << pos) >> pos);
         }
 
-        memcpy(rin_input, &input, 8);
+        memcpy(rin_input + pos * 16, this->padding, 16);
+        memcpy(rin_input + pos * 16, &input, 8);
+    }
 
-        EVP_EncryptUpdate(this->ctx, (unsigned char *)rin_output, &outl,
-                (unsigned char *)rin_input, 16);
+    EVP_EncryptUpdate(this->ctx, (unsigned char *)rin_output, &outl,
+            (unsigned char *)rin_input, sizeof(rin_input));
 
-        result |= ((((uint64_t)rin_output[0]) >> 7) << (63 - pos));
-    }
+    for (int pos = 0; pos < 64; pos ++)
+        result |= ((((uint64_t)rin_output[pos * 16]) >> 7) << (63 - pos));
 
     return result;
 }
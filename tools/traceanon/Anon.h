@@ -41,6 +41,12 @@ public:
     virtual uint32_t anonIPv4(uint32_t orig) = 0;
     virtual void anonIPv6(uint8_t *orig, uint8_t *result) = 0;
 
+    /* Anonymises count IPv4 addresses at once, which lets anonymisers that
+     * encrypt do so in fewer, larger operations. Addresses are in host byte
+     * order. */
+    virtual void anonIPv4Batch(const uint32_t *orig, uint32_t *result,
+            size_t count);
+
 };
 
 class PrefixSub: public Anonymiser {
@@ -61,18 +67,51 @@ private:
 
 #ifdef HAVE_LIBCRYPTO
 #include <openssl/evp.h>
-#include <map>
 
-typedef std::map<uint32_t, uint32_t> IPv4AnonCache;
-typedef std::map<uint64_t, uint64_t> IPv6AnonCache;
+/* The encrypted masks of address prefixes, which can be shared by the
+ * CryptoAnon instances of several threads as long as they use the same key.
+ *
+ * The IPv4 cache has a slot for every prefix of cachebits bits. The IPv6
+ * cache is a direct mapped table of 2^cachebits 64 bit halves of addresses,
+ * each slot holding the half XORed with its mask next to the mask, so a slot
+ * that is being overwritten by another thread simply reads as a miss.
+ * Lookups never lock, and as masks only depend on the key any thread can fill
+ * in a slot.
+ */
+class CryptoPanCache {
+public:
+    CryptoPanCache(uint8_t cachebits);
+    ~CryptoPanCache();
+
+    uint8_t getCacheBits() const { return cachebits; }
+
+    bool lookupv4(uint32_t prefix, uint32_t *mask);
+    void storev4(uint32_t prefix, uint32_t mask);
+    bool lookupv6(uint64_t half, uint64_t *mask);
+    void storev6(uint64_t half, uint64_t mask);
+
+private:
+    struct IPv6Slot {
+        uint64_t check;
+        uint64_t mask;
+    };
+
+    uint8_t cachebits;
+    uint32_t *ipv4_slots;
+    IPv6Slot *ipv6_slots;
+};
 
 class CryptoAnon : public Anonymiser {
 public:
     CryptoAnon(uint8_t *key, uint8_t len, uint8_t cachebits);
+    /* Uses a prefix cache that may be shared with other instances, which
+     * must have the same key */
+    CryptoAnon(uint8_t *key, uint8_t len, CryptoPanCache *cache);
     ~CryptoAnon();
 
     uint32_t anonIPv4(uint32_t orig);
     void anonIPv6(uint8_t *orig, uint8_t *result);
+    void anonIPv4Batch(const uint32_t *orig, uint32_t *result, size_t count);
 
 
 private:
@@ -80,18 +119,26 @@ private:
     uint8_t key[16];
     uint8_t cachebits;
 
-    IPv4AnonCache *ipv4_cache;
-    IPv6AnonCache *ipv6_cache;
+    CryptoPanCache *cache;
+    bool owns_cache;
+    /* An empty IPv6 cache slot looks like the mask of 0, so keep it here */
+    uint64_t ipv6_zero_mask;
 
     uint32_t recent_ipv4_cache[2][2];
+    int recent_ipv4_count;
     const EVP_CIPHER *cipher;
     EVP_CIPHER_CTX *ctx;
 
+    void init(uint8_t *key, uint8_t len);
     uint32_t encrypt32Bits(uint32_t orig, uint8_t start, uint8_t stop,
             uint32_t res);
+    void encrypt32BitsBatch(const uint32_t *orig, uint32_t *res, size_t count,
+            uint8_t start, uint8_t stop);
     uint64_t encrypt64Bits(uint64_t orig); 
     uint32_t lookupv4Cache(uint32_t prefix);
     uint64_t lookupv6Cache(uint64_t prefix);
+    bool lookupRecent(uint32_t orig, uint32_t *result);
+    void addRecent(uint32_t orig, uint32_t result);
 
 };
 #endif
@@ -47,14 +47,32 @@ enum enc_type_t {
 
 bool enc_source = false;
 bool enc_dest 	= false;
+/* If set checksums are updated to match the new addresses, otherwise they
+ * are zeroed */
+bool update_checksums = false;
 enum enc_type_t enc_type = ENC_NONE;
 char *key = NULL;
 
 int level = -1;
 trace_option_compresstype_t compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
 
+/* If set each thread writes its own output file, unordered */
+libtrace_out_shards_t *shards = NULL;
+
 struct libtrace_t *trace = NULL;
 
+#ifdef HAVE_LIBCRYPTO
+/* The CryptoPan prefix cache, shared by the packet processing threads */
+CryptoPanCache *crypto_cache = NULL;
+#endif
+
+/* The per thread state of the packet processing threads */
+struct anon_thread_t {
+        Anonymiser *anon;
+        /* The thread's output shard, if writing sharded output */
+        libtrace_out_t *writer;
+};
+
 static void cleanup_signal(int signal)
 {
 	(void)signal;
@@ -79,25 +97,39 @@ static void usage(char *argv0)
         "-t --threads=max       Use this number of threads for packet processing\n"
         "-f --filter=expr       Discard all packets that do not match the\n"
         "                       provided BPF expression\n"
+        "-S --sharded           Each thread writes a separate output file,\n"
+        "                       packets are not kept in order\n"
+        "-u --update-checksums  Update checksums to match the new addresses\n"
+        "                       instead of zeroing them\n"
 	,argv0);
 	exit(1);
 }
 
-/* Incrementally update a checksum */
-static void update_in_cksum(uint16_t *csum, uint16_t old, uint16_t newval)
-{
-	uint32_t sum = (~htons(*csum) & 0xFFFF)
-		     + (~htons(old) & 0xFFFF)
-		     + htons(newval);
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	*csum = htons(~(sum + (sum >> 16)));
-}
-
-UNUSED static void update_in_cksum32(uint16_t *csum, uint32_t old,
-                uint32_t newval)
+/* Writes an anonymised address (in network byte order) into an IPv4 header.
+ *
+ * If checksums are being kept valid, the outermost header is rewritten by
+ * libtrace so that the IP and transport checksums both follow the new
+ * address. Headers quoted inside ICMP errors are not part of the packet's own
+ * headers, so only their IP checksum is updated here.
+ */
+static void set_ipv4_address(libtrace_packet_t *packet, struct libtrace_ip *ip,
+                bool source, uint32_t addr)
 {
-	update_in_cksum(csum,(uint16_t)(old>>16),(uint16_t)(newval>>16));
-	update_in_cksum(csum,(uint16_t)(old&0xFFFF),(uint16_t)(newval&0xFFFF));
+	char *field = (char *)ip + (source ?
+			offsetof(struct libtrace_ip, ip_src) :
+			offsetof(struct libtrace_ip, ip_dst));
+
+	if (!update_checksums) {
+		memcpy(field, &addr, sizeof(addr));
+	} else if (packet) {
+		trace_rewrite_field(packet, source ? TRACE_REWRITE_SRC_ADDR :
+				TRACE_REWRITE_DST_ADDR, &addr);
+	} else {
+		trace_checksum_update((uint16_t *)((char *)ip +
+				offsetof(struct libtrace_ip, ip_sum)),
+				field, &addr, sizeof(addr));
+		memcpy(field, &addr, sizeof(addr));
+	}
 }
 
 /* Ok this is remarkably complicated
@@ -110,19 +142,28 @@ UNUSED static void update_in_cksum32(uint16_t *csum, uint32_t old,
  * the opposite direction so we need to encrypt the destination and
  * source instead of the source and destination!
  */
-static void encrypt_ips(Anonymiser *anon, struct libtrace_ip *ip,
-                bool enc_source,bool enc_dest)
+static void encrypt_ips(Anonymiser *anon, libtrace_packet_t *packet,
+                struct libtrace_ip *ip, bool enc_source,bool enc_dest)
 {
 	libtrace_icmp_t *icmp=trace_get_icmp_from_ip(ip,NULL);
-
-	if (enc_source) {
-		uint32_t new_ip=htonl(anon->anonIPv4(ntohl(ip->ip_src.s_addr)));
-		ip->ip_src.s_addr = new_ip;
-	}
-
-	if (enc_dest) {
-		uint32_t new_ip=htonl(anon->anonIPv4(ntohl(ip->ip_dst.s_addr)));
-		ip->ip_dst.s_addr = new_ip;
+	uint32_t orig[2], new_ip[2];
+	int count = 0;
+
+	/* Anonymise both addresses together */
+	if (enc_source)
+		orig[count++] = ntohl(ip->ip_src.s_addr);
+	if (enc_dest)
+		orig[count++] = ntohl(ip->ip_dst.s_addr);
+	if (count > 0) {
+		anon->anonIPv4Batch(orig, new_ip, count);
+
+		count = 0;
+		if (enc_source)
+			set_ipv4_address(packet, ip, true,
+					htonl(new_ip[count++]));
+		if (enc_dest)
+			set_ipv4_address(packet, ip, false,
+					htonl(new_ip[count++]));
 	}
 
 	if (icmp) {
@@ -134,31 +175,51 @@ static void encrypt_ips(Anonymiser *anon, struct libtrace_ip *ip,
 				|| icmp->type == 5 
 				|| icmp->type == 11) {
 			char *ptr = (char *)icmp;
-			encrypt_ips(anon,
-				(struct libtrace_ip*)(ptr+
-					sizeof(struct libtrace_icmp)),
+			char *inner = ptr + sizeof(struct libtrace_icmp);
+			/* The inner checksum and addresses, which are all
+			 * covered by the ICMP checksum */
+			char prev[10];
+
+			memcpy(prev, inner + 10, sizeof(prev));
+			encrypt_ips(anon, NULL,
+				(struct libtrace_ip*)inner,
 				enc_dest,
 				enc_source);
+			if (update_checksums)
+				trace_checksum_update((uint16_t *)(ptr +
+					offsetof(libtrace_icmp_t, checksum)),
+					prev, inner + 10, sizeof(prev));
 		}
 
-		if (enc_source || enc_dest)
+		if (!update_checksums && (enc_source || enc_dest))
 			icmp->checksum = 0;
 	}
 }
 
-static void encrypt_ipv6(Anonymiser *anon, libtrace_ip6_t *ip6,
-                bool enc_source, bool enc_dest) {
+static void encrypt_ipv6(Anonymiser *anon, libtrace_packet_t *packet,
+                libtrace_ip6_t *ip6, bool enc_source, bool enc_dest) {
 
         uint8_t previp[16];
+        uint8_t newip[16];
 
 	if (enc_source) {
                 memcpy(previp, &(ip6->ip_src.s6_addr), 16);
-		anon->anonIPv6(previp, (uint8_t *)&(ip6->ip_src.s6_addr));
+		anon->anonIPv6(previp, newip);
+                if (update_checksums)
+                        trace_rewrite_field(packet, TRACE_REWRITE_SRC_ADDR,
+                                        newip);
+                else
+                        memcpy(&(ip6->ip_src.s6_addr), newip, 16);
 	}
 
 	if (enc_dest) {
                 memcpy(previp, &(ip6->ip_dst.s6_addr), 16);
-		anon->anonIPv6(previp, (uint8_t *)&(ip6->ip_dst.s6_addr));
+		anon->anonIPv6(previp, newip);
+                if (update_checksums)
+                        trace_rewrite_field(packet, TRACE_REWRITE_DST_ADDR,
+                                        newip);
+                else
+                        memcpy(&(ip6->ip_dst.s6_addr), newip, 16);
 	}
 
 }
@@ -172,7 +233,8 @@ static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
 	libtrace_udp_t *udp = NULL;
 	libtrace_tcp_t *tcp = NULL;
         libtrace_icmp6_t *icmp6 = NULL;
-        Anonymiser *anon = (Anonymiser *)tls;
+        struct anon_thread_t *state = (struct anon_thread_t *)tls;
+        Anonymiser *anon = state->anon;
         libtrace_generic_t result;
 
         if (IS_LIBTRACE_META_PACKET(packet))
@@ -182,42 +244,49 @@ static libtrace_packet_t *per_packet(libtrace_t *trace, libtrace_thread_t *t,
         ip6 = trace_get_ip6(packet);
 
         if (ipptr && (enc_source || enc_dest)) {
-                encrypt_ips(anon, ipptr,enc_source,enc_dest);
-                ipptr->ip_sum = 0;
+                encrypt_ips(anon, packet, ipptr,enc_source,enc_dest);
+                if (!update_checksums)
+                        ipptr->ip_sum = 0;
         } else if (ip6 && (enc_source || enc_dest)) {
-                encrypt_ipv6(anon, ip6, enc_source, enc_dest);
+                encrypt_ipv6(anon, packet, ip6, enc_source, enc_dest);
         }
 
 
-        /* Replace checksums so that IP encryption cannot be
-         * reversed -- TODO allow checksums to be updated and remain valid
-         * for the new addresses */
+        /* Unless the checksums were updated to match the new addresses,
+         * replace them so that IP encryption cannot be reversed */
+        if (!update_checksums && (enc_source || enc_dest)) {
+                /* XXX replace with nice use of trace_get_transport() */
 
-        /* XXX replace with nice use of trace_get_transport() */
+                udp = trace_get_udp(packet);
+                if (udp)
+                        udp->check = 0;
 
-        udp = trace_get_udp(packet);
-        if (udp && (enc_source || enc_dest)) {
-                udp->check = 0;
-        }
+                tcp = trace_get_tcp(packet);
+                if (tcp)
+                        tcp->check = 0;
 
-        tcp = trace_get_tcp(packet);
-        if (tcp && (enc_source || enc_dest)) {
-                tcp->check = 0;
+                icmp6 = trace_get_icmp6(packet);
+                if (icmp6)
+                        icmp6->checksum = 0;
         }
 
-        icmp6 = trace_get_icmp6(packet);
-        if (icmp6 && (enc_source || enc_dest)) {
-                icmp6->checksum = 0;
+        /* TODO: Encrypt IP's in ARP packets */
+        if (shards) {
+                if (state->writer != NULL &&
+                                trace_write_packet(state->writer, packet) == -1) {
+                        trace_perror_output(state->writer, "writer");
+                        trace_interrupt();
+                }
+                return packet;
         }
 
-        /* TODO: Encrypt IP's in ARP packets */
         result.pkt = packet;
         trace_publish_result(trace, t, trace_packet_get_order(packet), result, RESULT_PACKET);
 
         return NULL;
 }
 
-static void *start_anon(libtrace_t *trace, libtrace_thread_t *t, void *global)
+static Anonymiser *create_anon(void)
 {
         if (enc_type == ENC_PREFIX_SUBSTITUTION) {
                 PrefixSub *sub = new PrefixSub(key, NULL);
@@ -232,7 +301,7 @@ static void *start_anon(libtrace_t *trace, libtrace_thread_t *t, void *global)
 		}
 #ifdef HAVE_LIBCRYPTO                
                 CryptoAnon *anon = new CryptoAnon((uint8_t *)key,
-                        (uint8_t)strlen(key), 20);
+                        (uint8_t)strlen(key), crypto_cache);
                 return anon;
 #else
                 /* TODO nicer way of exiting? */
@@ -245,11 +314,28 @@ static void *start_anon(libtrace_t *trace, libtrace_thread_t *t, void *global)
         return NULL;
 }
 
+static void *start_anon(libtrace_t *trace, libtrace_thread_t *t, void *global)
+{
+        struct anon_thread_t *state = new anon_thread_t;
+
+        state->anon = create_anon();
+        state->writer = NULL;
+        if (shards) {
+                state->writer = trace_get_output_shard(shards, t);
+                if (trace_is_err_output(state->writer)) {
+                        trace_perror_output(state->writer, "Output shard");
+                        state->writer = NULL;
+                        trace_interrupt();
+                }
+        }
+        return state;
+}
+
 static void end_anon(libtrace_t *trace, libtrace_thread_t *t, void *global,
                 void *tls) {
-        Anonymiser *anon = (Anonymiser *)tls;
-        delete(anon);
-
+        struct anon_thread_t *state = (struct anon_thread_t *)tls;
+        delete(state->anon);
+        delete(state);
 }
 
 static void *init_output(libtrace_t *trace, libtrace_thread_t *t, void *global)
@@ -264,13 +350,6 @@ static void *init_output(libtrace_t *trace, libtrace_thread_t *t, void *global)
 		trace_destroy_output(writer);
 		return NULL;
 	}
-	
-	/* Hopefully this will deal nicely with people who want to crank the
-	 * compression level up to 11 :) */
-	if (level > 9) {
-		fprintf(stderr, "WARNING: Compression level > 9 specified, setting to 9 instead\n");
-		level = 9;
-	}
 
 	if (level >= 0 && trace_config_output(writer, 
 			TRACE_OPTION_OUTPUT_COMPRESS, &level) == -1) {
@@ -327,6 +406,7 @@ int main(int argc, char *argv[])
         int exitcode = 0;
         char *filterstring = NULL;
         libtrace_filter_t *filter = NULL;
+        bool sharded = false;
 
 	if (argc<2)
 		usage(argv[0]);
@@ -343,11 +423,13 @@ int main(int argc, char *argv[])
 			{ "filter",		1, 0, 'f' },
 			{ "compress-level",	1, 0, 'z' },
 			{ "compress-type",	1, 0, 'Z' },
+			{ "sharded",		0, 0, 'S' },
+			{ "update-checksums",	0, 0, 'u' },
 			{ "help",        	0, 0, 'h' },
 			{ NULL,			0, 0, 0   },
 		};
 
-		int c=getopt_long(argc, argv, "Z:z:sc:f:dp:ht:f:",
+		int c=getopt_long(argc, argv, "Z:z:sc:f:dp:ht:f:Su",
 				long_options, &option_index);
 
 		if (c==-1)
@@ -389,6 +471,12 @@ int main(int argc, char *argv[])
                         case 'f':
                                   filterstring = optarg;
                                   break;
+                        case 'S':
+                                  sharded = true;
+                                  break;
+                        case 'u':
+                                  update_checksums = true;
+                                  break;
 		        case 'p':
 				  if (key!=NULL) {
 					  fprintf(stderr,"You can only have one encryption type and one key\n");
@@ -432,6 +520,10 @@ int main(int argc, char *argv[])
                 compress_type = TRACE_OPTION_COMPRESSTYPE_BZ2;
         } else if (strncmp(compress_type_str, "lzo", 3) == 0) {
                 compress_type = TRACE_OPTION_COMPRESSTYPE_LZO;
+        } else if (strncmp(compress_type_str, "zst", 3) == 0) {
+                compress_type = TRACE_OPTION_COMPRESSTYPE_ZSTD;
+        } else if (strncmp(compress_type_str, "lz4", 3) == 0) {
+                compress_type = TRACE_OPTION_COMPRESSTYPE_LZ4;
         } else if (strncmp(compress_type_str, "no", 2) == 0) {
                 compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
         } else {
@@ -440,6 +532,13 @@ int main(int argc, char *argv[])
                 return 1;
         }
 
+	/* Hopefully this will deal nicely with people who want to crank the
+	 * compression level up to 11 :) */
+	if (level > 9) {
+		fprintf(stderr, "WARNING: Compression level > 9 specified, setting to 9 instead\n");
+		level = 9;
+	}
+
 	/* open input uri */
 	trace = trace_create(argv[optind]);
 	if (trace_is_err(trace)) {
@@ -458,21 +557,43 @@ int main(int argc, char *argv[])
 	}
 	// OK parallel changes start here
 
-	/* Set a special mode flag that means the output is timestamped
-	 * and ordered before its read into reduce. Seems like a good
-	 * special case to have.
-	 */
-	trace_set_combiner(trace, &combiner_ordered, (libtrace_generic_t){0});
+#ifdef HAVE_LIBCRYPTO
+        if (enc_type == ENC_CRYPTOPAN)
+                crypto_cache = new CryptoPanCache(20);
+#endif
 
         pktcbs = trace_create_callback_set();
         trace_set_packet_cb(pktcbs, per_packet);
         trace_set_stopping_cb(pktcbs, end_anon);
         trace_set_starting_cb(pktcbs, start_anon);
 
-        repcbs = trace_create_callback_set();
-        trace_set_result_cb(repcbs, write_packet);
-        trace_set_stopping_cb(repcbs, end_output);
-        trace_set_starting_cb(repcbs, init_output);
+        if (sharded) {
+                /* Each thread writes its own packets, no reporter */
+                if (optind + 1 >= argc) {
+                        fprintf(stderr, "An output URI is required when writing sharded output\n");
+                        exitcode = 1;
+                        goto exitanon;
+                }
+                shards = trace_create_output_shards(output);
+                if (level >= 0)
+                        trace_config_output_shards(shards,
+                                        TRACE_OPTION_OUTPUT_COMPRESS, &level);
+                trace_config_output_shards(shards,
+                                TRACE_OPTION_OUTPUT_COMPRESSTYPE,
+                                &compress_type);
+        } else {
+                /* Set a special mode flag that means the output is
+                 * timestamped and ordered before its read into reduce.
+                 * Seems like a good special case to have.
+                 */
+                trace_set_combiner(trace, &combiner_ordered,
+                                (libtrace_generic_t){0});
+
+                repcbs = trace_create_callback_set();
+                trace_set_result_cb(repcbs, write_packet);
+                trace_set_stopping_cb(repcbs, end_output);
+                trace_set_starting_cb(repcbs, init_output);
+        }
 
         trace_set_perpkt_threads(trace, maxthreads);
 
@@ -510,5 +631,11 @@ exitanon:
                 trace_destroy_callback_set(repcbs);
         if (trace)
         	trace_destroy(trace);
+        if (shards)
+                trace_destroy_output_shards(shards);
+#ifdef HAVE_LIBCRYPTO
+        if (crypto_cache)
+                delete(crypto_cache);
+#endif
 	return exitcode;
 }
@@ -27,7 +27,7 @@
 
 #define __STDC_FORMAT_MACROS
 
-#include <libtrace.h>
+#include <libtrace_parallel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
@@ -41,8 +41,10 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <vector>
+#include <algorithm>
 
-#include <map>
+#include "data-struct/flow_table.h"
 
 typedef struct end_counter {
 	uint64_t src_bytes;
@@ -54,32 +56,17 @@ typedef struct end_counter {
 
 	double last_active;
 
+	/* Only used with a heavy hitter limit: the bytes used to rank the
+	 * endpoint and its position in the thread's heap */
+	uint64_t weight;
+	uint32_t heap_pos;
+
 } end_counter_t;
 
 typedef struct mac_addr {
 	uint8_t addr[6];
 } mac_addr_t;
 
-struct v6comp {
-	bool operator() (const struct in6_addr &a, const struct in6_addr &b) const {
-		if (memcmp(&a, &b, sizeof(struct in6_addr)) < 0)
-			return true;
-		return false;
-	}
-};
-	
-struct maccomp {
-	bool operator() (const mac_addr_t &a, const mac_addr_t &b) const {
-		if (memcmp(&a, &b, sizeof(mac_addr_t)) < 0)
-			return true;
-		return false;
-	}
-};
-
-typedef std::map<uint32_t, end_counter_t *> IP4EndMap;
-typedef std::map<struct in6_addr, end_counter_t *, v6comp> IP6EndMap;
-typedef std::map<mac_addr_t, end_counter_t *, maccomp> MacEndMap;
-
 enum {
 	MODE_MAC,
 	MODE_IPV4,
@@ -88,9 +75,23 @@ enum {
 
 int mode = MODE_IPV4;
 
-IP4EndMap ipv4;
-IP6EndMap ipv6;
-MacEndMap mac;
+/* Endpoints keyed on their address, the key size depends on the mode. Each
+ * perpkt thread counts into its own table and the reporter merges them into
+ * this one. */
+libtrace_flowtable_t *ends = NULL;
+size_t key_size = 0;
+
+/* If not zero, only keep the endpoints with the most bytes */
+size_t top_k = 0;
+
+/* How often live traces hand their counts to the reporter, in milliseconds */
+#define TICK_INTERVAL 10000
+
+typedef struct thread_ends {
+	libtrace_flowtable_t *ends;
+	/* A min-heap of the endpoints in ends by weight, if top_k is set */
+	std::vector<uint32_t> heap;
+} thread_ends_t;
 
 static int usage(char *argv0)
 {
@@ -99,31 +100,28 @@ static int usage(char *argv0)
         "-f --filter=bpf        Only output packets that match filter\n"
         "-H --help     		Print this message\n"
         "-A --address=addr     	Specifies which address type to match (mac, v4, v6)\n"
+        "-t --threads=max      	Use this many threads for packet processing\n"
+        "-k --top=count        	Only keep the count endpoints with the most bytes\n"
         ,argv0);
         exit(1);
 }
 
 volatile int done=0;
+struct libtrace_t *volatile input = NULL;
+volatile int stopping = 0;
+
+static void stop_trace(void)
+{
+	/* trace_pstop() must only be called once per trace */
+	if (input && __sync_bool_compare_and_swap(&stopping, 0, 1))
+		trace_pstop(input);
+}
 
 static void cleanup_signal(int sig)
 {
         (void)sig;
         done=1;
-	trace_interrupt();
-}
-
-static end_counter_t *create_counter() {
-	end_counter_t *c = (end_counter_t *)malloc(sizeof(end_counter_t));
-
-	c->src_bytes = 0;
-	c->src_pbytes = 0;
-	c->src_pkts = 0;
-	c->dst_pkts = 0;
-	c->dst_bytes = 0;
-	c->dst_pbytes = 0;
-
-	c->last_active = 0.0;
-	return c;
+	stop_trace();
 }
 
 static char *mac_string(mac_addr_t m, char *str) {
@@ -135,200 +133,187 @@ static char *mac_string(mac_addr_t m, char *str) {
 	return str;
 }
 
-static void dump_mac_map() {
-	MacEndMap::iterator it;
-	char str[80];
-	char timestr[80];
-	struct tm *tm;
-	time_t t;
-	
-	for (it = mac.begin(); it != mac.end(); it++) {
-		t = (time_t)(it->second->last_active);
-		tm = localtime(&t);
-		strftime(timestr, 80, "%d/%m,%H:%M:%S", tm);
-		printf("%18s %16s %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 "\n", 
-				mac_string(it->first, str),
-				timestr,
-				it->second->src_pkts,
-				it->second->src_bytes,
-				it->second->src_pbytes,
-				it->second->dst_pkts,
-				it->second->dst_bytes,
-				it->second->dst_pbytes);
-	}
-}
+static int compare_ends(const void *a, const void *b) {
+	const void *ka, *kb;
 
-static void dump_ipv4_map() {
-	IP4EndMap::iterator it;
-	struct in_addr in;
-	char timestr[80];
-	struct tm *tm;
-	time_t t;
-	for (it = ipv4.begin(); it != ipv4.end(); it++) {
-		in.s_addr = it->first;
-		t = (time_t)(it->second->last_active);
-		tm = localtime(&t);
-		strftime(timestr, 80, "%d/%m,%H:%M:%S", tm);
-		printf("%16s %16s %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 "\n", 
-				inet_ntoa(in),
-				timestr,
-				it->second->src_pkts,
-				it->second->src_bytes,
-				it->second->src_pbytes,
-				it->second->dst_pkts,
-				it->second->dst_bytes,
-				it->second->dst_pbytes);
-	}
+	libtrace_flowtable_entry(ends, *(const size_t *)a, &ka);
+	libtrace_flowtable_entry(ends, *(const size_t *)b, &kb);
+	return memcmp(ka, kb, key_size);
 }
 
-static void dump_ipv6_map() {
-	IP6EndMap::iterator it;
-	struct in6_addr in;
-	char ip6_addr[128];
+/* Prints the endpoints in order of address */
+static void dump_ends() {
+	size_t count = libtrace_flowtable_size(ends);
+	size_t *order = (size_t *)malloc(sizeof(size_t) * (count + 1));
+	size_t i;
+	char str[128];
 	char timestr[80];
 	struct tm *tm;
 	time_t t;
 
-	for (it = ipv6.begin(); it != ipv6.end(); it++) {
-		in = it->first;
-		t = (time_t)(it->second->last_active);
+	for (i = 0; i < count; i++)
+		order[i] = i;
+	qsort(order, count, sizeof(size_t), compare_ends);
+
+	for (i = 0; i < count; i++) {
+		const void *key;
+		end_counter_t *c = (end_counter_t *)libtrace_flowtable_entry(
+				ends, order[i], &key);
+
+		t = (time_t)(c->last_active);
 		tm = localtime(&t);
 		strftime(timestr, 80, "%d/%m,%H:%M:%S", tm);
-		printf("%40s %16s %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 "\n", 
-				inet_ntop(AF_INET6, &in, ip6_addr, 128),
+
+		if (mode == MODE_MAC)
+			printf("%18s ", mac_string(*(const mac_addr_t *)key, str));
+		else if (mode == MODE_IPV4)
+			printf("%16s ", inet_ntop(AF_INET, key, str, 128));
+		else
+			printf("%40s ", inet_ntop(AF_INET6, key, str, 128));
+
+		printf("%16s %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 "\n", 
 				timestr,
-				it->second->src_pkts,
-				it->second->src_bytes,
-				it->second->src_pbytes,
-				it->second->dst_pkts,
-				it->second->dst_bytes,
-				it->second->dst_pbytes);
+				c->src_pkts,
+				c->src_bytes,
+				c->src_pbytes,
+				c->dst_pkts,
+				c->dst_bytes,
+				c->dst_pbytes);
 	}
+	free(order);
 }
 
-static void update_ipv6(libtrace_ip6_t *ip, uint16_t ip_len, uint32_t rem, 
-		uint32_t plen, 	double ts) {
-
-	struct in6_addr key;
-	IP6EndMap::iterator it;
-	end_counter_t *c = NULL;
+static end_counter_t *heap_entry(thread_ends_t *te, uint32_t pos) {
+	return (end_counter_t *)libtrace_flowtable_entry(te->ends, te->heap[pos],
+			NULL);
+}
 
-	if (rem < sizeof(libtrace_ip6_t))
-		return;
-	
-	key = ip->ip_src;
-	
-	it = ipv6.find(key);
-	if (it == ipv6.end()) {
-		c = create_counter();
-		ipv6[key] = c;
-	} else {
-		c = it->second;
-	}
+static void heap_swap(thread_ends_t *te, uint32_t a, uint32_t b) {
+	std::swap(te->heap[a], te->heap[b]);
+	heap_entry(te, a)->heap_pos = a;
+	heap_entry(te, b)->heap_pos = b;
+}
 
-	c->src_pkts ++;
-	c->src_pbytes += plen;
-	c->src_bytes += ip_len;
-	c->last_active = ts;
-	
-	key = ip->ip_dst;
-	
-	it = ipv6.find(key);
-	if (it == ipv6.end()) {
-		c = create_counter();
-		ipv6[key] = c;
-	} else {
-		c = it->second;
+/* Moves an endpoint whose weight has grown down the heap */
+static void heap_sift_down(thread_ends_t *te, uint32_t pos) {
+	uint32_t size = te->heap.size();
+
+	for (;;) {
+		uint32_t smallest = pos;
+		uint32_t child = pos * 2 + 1;
+
+		if (child < size && heap_entry(te, child)->weight <
+				heap_entry(te, smallest)->weight)
+			smallest = child;
+		child++;
+		if (child < size && heap_entry(te, child)->weight <
+				heap_entry(te, smallest)->weight)
+			smallest = child;
+		if (smallest == pos)
+			return;
+		heap_swap(te, pos, smallest);
+		pos = smallest;
 	}
-
-	c->dst_pkts ++;
-	c->dst_pbytes += plen;
-	c->dst_bytes += ip_len;
-	c->last_active = ts;
 }
 
-static void update_mac(uint8_t *src, uint8_t *dst, uint16_t ip_len,
-		uint32_t plen, double ts) {
+static void heap_sift_up(thread_ends_t *te, uint32_t pos) {
+	while (pos > 0) {
+		uint32_t parent = (pos - 1) / 2;
 
-	mac_addr_t key;
-	end_counter_t *c = NULL;
-	MacEndMap::iterator it;
-
-	memcpy(&(key.addr), src, sizeof(key.addr));
-	it = mac.find(key);
-	
-	if (it == mac.end()) {
-		c = create_counter();
-		mac[key] = c;
-	} else {
-		c = it->second;
+		if (heap_entry(te, parent)->weight <=
+				heap_entry(te, pos)->weight)
+			return;
+		heap_swap(te, pos, parent);
+		pos = parent;
 	}
+}
 
-	c->src_pkts ++;
-	c->src_pbytes += plen;
-	c->src_bytes += ip_len;
-	c->last_active = ts;
-
-	memcpy(&key.addr, dst, sizeof(key.addr));
-	it = mac.find(key);
-	
-	if (it == mac.end()) {
-		c = create_counter();
-		mac[key] = c;
-	} else {
-		c = it->second;
+/* Finds the counter for an endpoint. With a heavy hitter limit, a new
+ * endpoint in a full table replaces the one with the fewest bytes and
+ * inherits its weight (the Space-Saving algorithm), so any endpoint with more
+ * than 1/top_k of the bytes is always kept. */
+static end_counter_t *get_end(thread_ends_t *te, const void *addr,
+		double ts) {
+	end_counter_t *c;
+	uint64_t weight = 0;
+	bool created;
+
+	if (top_k == 0)
+		return (end_counter_t *)libtrace_flowtable_get(te->ends, addr,
+				ts, NULL);
+
+	c = (end_counter_t *)libtrace_flowtable_find(te->ends, addr);
+	if (c)
+		return c;
+
+	if (te->heap.size() >= top_k) {
+		const void *key;
+		uint32_t index = te->heap[0];
+		uint8_t old[16];
+
+		weight = heap_entry(te, 0)->weight;
+		libtrace_flowtable_entry(te->ends, index, &key);
+		memcpy(old, key, key_size);
+		libtrace_flowtable_remove(te->ends, old);
+
+		/* The last endpoint in the table has moved into the slot */
+		c = (end_counter_t *)libtrace_flowtable_entry(te->ends, index,
+				NULL);
+		if (c)
+			te->heap[c->heap_pos] = index;
+		te->heap[0] = te->heap.back();
+		te->heap.pop_back();
+		if (!te->heap.empty()) {
+			heap_entry(te, 0)->heap_pos = 0;
+			heap_sift_down(te, 0);
+		}
 	}
 
-	c->dst_pkts ++;
-	c->dst_pbytes += plen;
-	c->dst_bytes += ip_len;
-	c->last_active = ts;
+	c = (end_counter_t *)libtrace_flowtable_get(te->ends, addr, ts,
+			&created);
+	if (c == NULL)
+		return NULL;
+	c->weight = weight;
+	c->heap_pos = te->heap.size();
+	te->heap.push_back(libtrace_flowtable_size(te->ends) - 1);
+	heap_sift_up(te, c->heap_pos);
+	return c;
 }
 
-static void update_ipv4(libtrace_ip_t *ip, uint16_t ip_len, uint32_t rem, 
-		uint32_t plen, 	double ts) {
+static void add_weight(thread_ends_t *te, end_counter_t *c, uint16_t ip_len) {
+	if (top_k == 0)
+		return;
+	c->weight += ip_len;
+	heap_sift_down(te, c->heap_pos);
+}
 
-	uint32_t key;
-	IP4EndMap::iterator it;
-	end_counter_t *c = NULL;
+static void update_ends(thread_ends_t *te, const void *src, const void *dst,
+		uint16_t ip_len, uint32_t plen, double ts) {
 
-	if (rem < sizeof(libtrace_ip_t))
-		return;
-	
-	key = ip->ip_src.s_addr;
-	
-	it = ipv4.find(key);
-	if (it == ipv4.end()) {
-		c = create_counter();
-		ipv4[key] = c;
-	} else {
-		c = it->second;
-	}
+	end_counter_t *c;
 
-	c->src_pkts ++;
-	c->src_pbytes += plen;
-	c->src_bytes += ip->ip_len;
-        if (ts != 0)
-        	c->last_active = ts;
-	
-	key = ip->ip_dst.s_addr;
-	
-	it = ipv4.find(key);
-	if (it == ipv4.end()) {
-		c = create_counter();
-		ipv4[key] = c;
-	} else {
-		c = it->second;
+	c = get_end(te, src, ts);
+	if (c) {
+		c->src_pkts ++;
+		c->src_pbytes += plen;
+		c->src_bytes += ip_len;
+		if (ts != 0)
+			c->last_active = ts;
+		add_weight(te, c, ip_len);
 	}
 
-	c->dst_pkts ++;
-	c->dst_pbytes += plen;
-	c->dst_bytes += ip_len;
-        if (ts != 0)
-        	c->last_active = ts;
+	c = get_end(te, dst, ts);
+	if (c) {
+		c->dst_pkts ++;
+		c->dst_pbytes += plen;
+		c->dst_bytes += ip_len;
+		if (ts != 0)
+			c->last_active = ts;
+		add_weight(te, c, ip_len);
+	}
 }
 
-static int per_packet(libtrace_packet_t *packet) {
+static int per_packet(thread_ends_t *te, libtrace_packet_t *packet) {
 
 	void *header;
 	uint16_t ethertype;
@@ -351,7 +336,8 @@ static int per_packet(libtrace_packet_t *packet) {
 			return 1;
 		ip_len = ntohs(ip->ip_len);
 		if (mode == MODE_IPV4 && ip) {
-			update_ipv4(ip, ip_len, rem, plen, ts);
+			update_ends(te, &ip->ip_src, &ip->ip_dst, ip_len, plen,
+					ts);
 			return 1;
 		}
 	}
@@ -362,7 +348,8 @@ static int per_packet(libtrace_packet_t *packet) {
 			return 1;
 		ip_len = ntohs(ip6->plen) + sizeof(libtrace_ip6_t);
 		if (mode == MODE_IPV6 && ip6) {
-			update_ipv6(ip6, ip_len, rem, plen, ts);
+			update_ends(te, &ip6->ip_src, &ip6->ip_dst, ip_len,
+					plen, ts);
 			return 1;
 		}
 	}
@@ -373,19 +360,130 @@ static int per_packet(libtrace_packet_t *packet) {
 
 		if (src_mac == NULL || dst_mac == NULL)
 			return 1;
-		update_mac(src_mac, dst_mac, ip_len, plen, ts);
+		update_ends(te, src_mac, dst_mac, ip_len, plen, ts);
 	}
 
 	return 1;
 }
 
+static void *cb_starting(libtrace_t *trace, libtrace_thread_t *t,
+		void *global) {
+	(void)trace; (void)t; (void)global;
+	thread_ends_t *te = new thread_ends_t;
+
+	te->ends = libtrace_flowtable_create(key_size, sizeof(end_counter_t));
+	return te;
+}
+
+static libtrace_packet_t *cb_packet(libtrace_t *trace, libtrace_thread_t *t,
+		void *global, void *tls, libtrace_packet_t *packet) {
+	(void)trace; (void)t; (void)global;
+	thread_ends_t *te = (thread_ends_t *)tls;
+
+	if (IS_LIBTRACE_META_PACKET(packet) || te->ends == NULL)
+		return packet;
+	per_packet(te, packet);
+	return packet;
+}
+
+/* Hands the endpoints counted so far to the reporter and starts a new table */
+static void publish_ends(libtrace_t *trace, libtrace_thread_t *t,
+		thread_ends_t *te) {
+	libtrace_generic_t gen;
+
+	if (te->ends == NULL || libtrace_flowtable_size(te->ends) == 0)
+		return;
+	gen.ptr = te->ends;
+	trace_publish_result(trace, t, 0, gen, RESULT_USER);
+	te->ends = libtrace_flowtable_create(key_size, sizeof(end_counter_t));
+	te->heap.clear();
+}
+
+static void cb_tick(libtrace_t *trace, libtrace_thread_t *t, void *global,
+		void *tls, uint64_t tick) {
+	(void)global; (void)tick;
+	publish_ends(trace, t, (thread_ends_t *)tls);
+}
+
+static void cb_stopping(libtrace_t *trace, libtrace_thread_t *t,
+		void *global, void *tls) {
+	(void)global;
+	thread_ends_t *te = (thread_ends_t *)tls;
+
+	publish_ends(trace, t, te);
+	if (te->ends)
+		libtrace_flowtable_destroy(te->ends);
+	delete te;
+}
+
+static void merge_end(void *value, const void *other, void *data) {
+	(void)data;
+	end_counter_t *c = (end_counter_t *)value;
+	const end_counter_t *o = (const end_counter_t *)other;
+
+	c->src_bytes += o->src_bytes;
+	c->src_pbytes += o->src_pbytes;
+	c->src_pkts += o->src_pkts;
+	c->dst_pkts += o->dst_pkts;
+	c->dst_bytes += o->dst_bytes;
+	c->dst_pbytes += o->dst_pbytes;
+	c->weight += o->weight;
+	if (o->last_active > c->last_active)
+		c->last_active = o->last_active;
+}
+
+static bool heavier(const std::pair<uint64_t, size_t> &a,
+		const std::pair<uint64_t, size_t> &b) {
+	return a.first > b.first;
+}
+
+/* Drops all but the top_k endpoints with the highest weight */
+static void trim_ends(void) {
+	size_t count = libtrace_flowtable_size(ends);
+	std::vector<std::pair<uint64_t, size_t> > order;
+	std::vector<uint8_t> drop;
+	size_t i;
+
+	if (top_k == 0 || count <= top_k)
+		return;
+
+	for (i = 0; i < count; i++) {
+		end_counter_t *c = (end_counter_t *)libtrace_flowtable_entry(
+				ends, i, NULL);
+		order.push_back(std::make_pair(c->weight, i));
+	}
+	std::nth_element(order.begin(), order.begin() + top_k, order.end(),
+			heavier);
+
+	/* Copy the keys first, as removing an endpoint moves another */
+	drop.resize((count - top_k) * key_size);
+	for (i = top_k; i < count; i++) {
+		const void *key;
+
+		libtrace_flowtable_entry(ends, order[i].second, &key);
+		memcpy(&drop[(i - top_k) * key_size], key, key_size);
+	}
+	for (i = 0; i < count - top_k; i++)
+		libtrace_flowtable_remove(ends, &drop[i * key_size]);
+}
+
+static void cb_result(libtrace_t *trace, libtrace_thread_t *sender,
+		void *global, void *tls, libtrace_result_t *result) {
+	(void)trace; (void)sender; (void)global; (void)tls;
+	libtrace_flowtable_t *src = (libtrace_flowtable_t *)result->value.ptr;
+
+	libtrace_flowtable_merge(ends, src, merge_end, NULL);
+	libtrace_flowtable_destroy(src);
+	trim_ends();
+}
+
 int main(int argc, char *argv[]) {
 
         int i;
+        int threadcount = 1;
         struct sigaction sigact;
 	struct libtrace_filter_t *filter=NULL;
-        struct libtrace_t *input = NULL;
-        struct libtrace_packet_t *packet = trace_create_packet();
+	libtrace_callback_set_t *pktcbs, *repcbs;
 
         while(1) {
                 int option_index;
@@ -393,10 +491,12 @@ int main(int argc, char *argv[]) {
                         { "filter",        1, 0, 'f' },
                         { "help", 	   0, 0, 'H' },
 			{ "addresses", 	   1, 0, 'A' },	
+			{ "threads",	   1, 0, 't' },
+			{ "top",	   1, 0, 'k' },
                         { NULL,            0, 0, 0   },
                 };
 
-                int c=getopt_long(argc, argv, "A:f:H",
+                int c=getopt_long(argc, argv, "A:f:Ht:k:",
                                 long_options, &option_index);
 
                 if (c==-1)
@@ -420,6 +520,14 @@ int main(int argc, char *argv[]) {
 			case 'H':
                                 usage(argv[0]);
                                 break;
+			case 't':
+				threadcount = atoi(optarg);
+				if (threadcount <= 0)
+					threadcount = 1;
+				break;
+			case 'k':
+				top_k = strtoul(optarg, NULL, 10);
+				break;
 			default:
                                 fprintf(stderr,"Unknown option: %c\n",c);
                                 usage(argv[0]);
@@ -427,6 +535,19 @@ int main(int argc, char *argv[]) {
 		}
 
 	}
+	if (mode == MODE_MAC)
+		key_size = sizeof(mac_addr_t);
+	else if (mode == MODE_IPV4)
+		key_size = sizeof(struct in_addr);
+	else
+		key_size = sizeof(struct in6_addr);
+
+	ends = libtrace_flowtable_create(key_size, sizeof(end_counter_t));
+	if (!ends) {
+		fprintf(stderr, "Unable to allocate endpoint table\n");
+		return 1;
+	}
+
         sigact.sa_handler = cleanup_signal;
         sigemptyset(&sigact.sa_mask);
         sigact.sa_flags = SA_RESTART;
@@ -436,52 +557,61 @@ int main(int argc, char *argv[]) {
         sigaction(SIGPIPE, &sigact, NULL);
         sigaction(SIGHUP, &sigact, NULL);
 
-	for (i = optind; i < argc; i++) {
-		input = trace_create(argv[i]);
+	pktcbs = trace_create_callback_set();
+	trace_set_starting_cb(pktcbs, cb_starting);
+	trace_set_packet_cb(pktcbs, cb_packet);
+	trace_set_tick_interval_cb(pktcbs, cb_tick);
+	trace_set_stopping_cb(pktcbs, cb_stopping);
 
-                if (trace_is_err(input)) {
-                        trace_perror(input,"%s",argv[i]);
+	repcbs = trace_create_callback_set();
+	trace_set_result_cb(repcbs, cb_result);
+
+	for (i = optind; i < argc && !done; i++) {
+		libtrace_t *trace = trace_create(argv[i]);
+
+                if (trace_is_err(trace)) {
+                        trace_perror(trace,"%s",argv[i]);
                         return 1;
                 }
 
-                if (filter && trace_config(input, TRACE_OPTION_FILTER, filter) == 1) {
-                        trace_perror(input, "Configuring filter for %s",
+                if (filter && trace_config(trace, TRACE_OPTION_FILTER, filter) == 1) {
+                        trace_perror(trace, "Configuring filter for %s",
                                         argv[i]);
                         return 1;
                 }
 
-                if (trace_start(input)==-1) {
-                        trace_perror(input,"%s",argv[i]);
-                        return 1;
-                }
+		trace_set_perpkt_threads(trace, threadcount);
+		/* Merge counts periodically when reading live, so that they
+		 * are not all held by the perpkt threads until the end */
+		if (trace_get_information(trace)->live)
+			trace_set_tick_interval(trace, TICK_INTERVAL);
 
-		while (trace_read_packet(input,packet)>0) {
-                        if (IS_LIBTRACE_META_PACKET(packet))
-                                continue;
-                        if (per_packet(packet) < 1)
-                                done = 1;
-                        if (done)
-                                break;
+		stopping = 0;
+		input = trace;
+
+                if (trace_pstart(trace, NULL, pktcbs, repcbs)==-1) {
+                        trace_perror(trace,"%s",argv[i]);
+                        return 1;
                 }
 
-                if (done)
-                        break;
+		trace_join(trace);
+		input = NULL;
 
-                if (trace_is_err(input)) {
-                        trace_perror(input,"Reading packets");
-                        trace_destroy(input);
+                if (trace_is_err(trace)) {
+                        trace_perror(trace,"Reading packets");
+                        trace_destroy(trace);
                         break;
                 }
 
-                trace_destroy(input);
+                trace_destroy(trace);
         }
 
 	/* Dump results */
-	if (mode == MODE_IPV4)
-		dump_ipv4_map();
-	if (mode == MODE_IPV6)
-		dump_ipv6_map();
-	if (mode == MODE_MAC)
-		dump_mac_map();
+	dump_ends();
+	libtrace_flowtable_destroy(ends);
+	trace_destroy_callback_set(pktcbs);
+	trace_destroy_callback_set(repcbs);
+	if (filter)
+		trace_destroy_filter(filter);
 	return 0;
 }
@@ -0,0 +1,111 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+/* Tool that writes a timestamp index for trace files, so that seeking to a
+ * time in the trace doesn't have to read the trace from the start
+ */
+
+#include "libtrace.h"
+#include <stdio.h>
+#include <getopt.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+static void usage(char *prog) {
+	printf("Usage instructions for %s\n\n", prog);
+	printf("\t%s [options] inputuri [inputuri ...]\n\n", prog);
+	printf("Supported options:\n");
+	printf("\t-s <bytes>    Write an index entry every <bytes> of trace (default 1MB)\n");
+	printf("\t-o <file>     Write the index to <file> rather than <trace>.idx\n");
+	printf("\t-q            Don't print the number of entries written\n");
+}
+
+int main(int argc, char *argv[])
+{
+	libtrace_t *trace;
+	char *indexname = NULL;
+	uint64_t spacing = 0;
+	int quiet = 0;
+	int ret = 0;
+	int entries;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:o:qh")) != EOF) {
+		switch (opt) {
+			case 's':
+				spacing = strtoull(optarg, NULL, 10);
+				break;
+			case 'o':
+				indexname = optarg;
+				break;
+			case 'q':
+				quiet = 1;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (indexname && optind + 1 < argc) {
+		fprintf(stderr, "-o can only be used with a single trace\n");
+		return 1;
+	}
+
+	for (; optind < argc; optind++) {
+		trace = trace_create(argv[optind]);
+		if (trace_is_err(trace)) {
+			trace_perror(trace, "Opening trace file");
+			trace_destroy(trace);
+			ret = 1;
+			continue;
+		}
+
+		if (trace_start(trace)) {
+			trace_perror(trace, "Starting trace");
+			trace_destroy(trace);
+			ret = 1;
+			continue;
+		}
+
+		entries = trace_create_index(trace, indexname, spacing);
+		if (entries < 0) {
+			trace_perror(trace, "Indexing trace");
+			ret = 1;
+		} else if (!quiet) {
+			printf("%s: %d index entries\n", argv[optind], entries);
+		}
+		trace_destroy(trace);
+	}
+
+	return ret;
+}
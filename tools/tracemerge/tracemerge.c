@@ -148,6 +148,10 @@ int main(int argc, char *argv[])
                 compress_type = TRACE_OPTION_COMPRESSTYPE_LZO;
         } else if (strncmp(compress_type_str, "xz", 2) == 0) {
                 compress_type = TRACE_OPTION_COMPRESSTYPE_LZMA;
+        } else if (strncmp(compress_type_str, "zst", 3) == 0) {
+                compress_type = TRACE_OPTION_COMPRESSTYPE_ZSTD;
+        } else if (strncmp(compress_type_str, "lz4", 3) == 0) {
+                compress_type = TRACE_OPTION_COMPRESSTYPE_LZ4;
         } else if (strncmp(compress_type_str, "no", 2) == 0) {
                 compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
         } else {
@@ -39,12 +39,15 @@ Authors: Andreas Loef and Yuwei Wang
  */
 
 
+#include "config.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <libtrace.h>
 #include <getopt.h>
 #include <arpa/inet.h>
@@ -133,11 +136,59 @@ static libtrace_packet_t * per_packet(libtrace_packet_t *packet) {
 
 
 
+/* The final stretch of a sleep is busy-waited, as waking from a sleep can
+ * overshoot by tens of microseconds */
+#define SPIN_NSEC 100000
+
+#if HAVE_CLOCK_GETTIME
+static void timespec_add_nsec(struct timespec *ts, int64_t nsec) {
+	int64_t total = ts->tv_nsec + nsec;
+
+	ts->tv_sec += total / 1000000000;
+	ts->tv_nsec = total % 1000000000;
+	if (ts->tv_nsec < 0) {
+		ts->tv_sec--;
+		ts->tv_nsec += 1000000000;
+	}
+}
+
+static int timespec_before(const struct timespec *a, const struct timespec *b) {
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+#endif
+
+/* Waits for the given number of seconds */
+static void precise_sleep(double seconds)
+{
+#if HAVE_CLOCK_GETTIME
+	struct timespec deadline, wake, now;
+
+	/* Sleep to an absolute deadline so a wakeup by a signal cannot
+	 * extend the total wait */
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	timespec_add_nsec(&deadline, (int64_t) (seconds * 1000000000.0));
+	wake = deadline;
+	timespec_add_nsec(&wake, -SPIN_NSEC);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake,
+				NULL) == EINTR);
+
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (timespec_before(&now, &deadline));
+#else
+	/* select offers good precision for sleeping */
+	struct timeval sleep_tv;
+	sleep_tv.tv_sec = (int)seconds;
+	sleep_tv.tv_usec = (int) ((seconds - sleep_tv.tv_sec) * 1000000.0);
+	select(0, NULL, NULL, NULL, &sleep_tv);
+#endif
+}
+
 static uint32_t event_read_packet(libtrace_t *trace, libtrace_packet_t *packet) 
 {
 	libtrace_eventobj_t obj;
 	fd_set rfds;
-	struct timeval sleep_tv;
 
 	FD_ZERO(&rfds);
 
@@ -157,10 +208,7 @@ static uint32_t event_read_packet(libtrace_t *trace, libtrace_packet_t *packet)
 				/* Replaying a trace in tracetime and the next packet
 				 * is not due yet */
 			case TRACE_EVENT_SLEEP:
-				/* select offers good precision for sleeping */
-				sleep_tv.tv_sec = (int)obj.seconds;
-				sleep_tv.tv_usec = (int) ((obj.seconds - sleep_tv.tv_sec) * 1000000.0);
-				select(0, NULL, NULL, NULL, &sleep_tv);
+				precise_sleep(obj.seconds);
 				continue;
 
 				/* We've got a packet! */
@@ -193,6 +241,10 @@ static void usage(char * argv) {
 	fprintf(stderr, " -b\n");
 	fprintf(stderr, " --broadcast\n");
 	fprintf(stderr, "\t\tSend ethernet frames to broadcast address\n");
+	fprintf(stderr, " -X speedup\n");
+	fprintf(stderr, " --speedup speedup\n");
+	fprintf(stderr, "\t\tReplay <speedup> times faster than trace time, or as fast as\n");
+	fprintf(stderr, "\t\tpossible if <speedup> is max\n");
 
 }
 
@@ -206,6 +258,7 @@ int main(int argc, char *argv[]) {
 	char *uri = 0;
 	libtrace_packet_t * new;
 	int snaplen = 0;
+	int speedup = 1;
 
 
 	while(1) {
@@ -215,10 +268,11 @@ int main(int argc, char *argv[]) {
 			{ "help",	0, 0, 'h'},
 			{ "snaplen",	1, 0, 's'},
 			{ "broadcast",	0, 0, 'b'},
+			{ "speedup",	1, 0, 'X'},
 			{ NULL,		0, 0, 0}
 		};
 
-		int c = getopt_long(argc, argv, "bhs:f:",
+		int c = getopt_long(argc, argv, "bhs:f:X:",
 				long_options, &option_index);
 
 		if(c == -1)
@@ -236,6 +290,17 @@ int main(int argc, char *argv[]) {
 				broadcast = 1;
 				break;
 
+			case 'X':
+				if (strcmp(optarg, "max") == 0) {
+					speedup = 0;
+				} else if ((speedup = atoi(optarg)) < 1) {
+					fprintf(stderr, "Invalid speedup: %s\n",
+							optarg);
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+
 			case 'h':
 
 				usage(argv[0]);
@@ -279,6 +344,17 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	/* apply speedup, max ignores the gaps between packets entirely */
+	if (speedup == 0) {
+		if (trace_set_event_realtime(trace, true)) {
+			trace_perror(trace, "ignoring speedup: ");
+		}
+	} else if (speedup > 1) {
+		if (trace_set_replay_speedup(trace, speedup)) {
+			trace_perror(trace, "ignoring speedup: ");
+		}
+	}
+
 	/* Starting the trace */
 	if (trace_start(trace) != 0) {
 		trace_perror(trace, "trace_start");
@@ -29,19 +29,44 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
+struct dir_state {
+	uint64_t bytes[8];
+	uint64_t packets[8];
+};
+
 static uint64_t dir_bytes[8];
 static uint64_t dir_packets[8];
 
-void dir_per_packet(struct libtrace_packet_t *packet)
+void *dir_start(void)
+{
+	return calloc(1, sizeof(struct dir_state));
+}
+
+void dir_per_packet(void *state, struct libtrace_packet_t *packet)
 {
+	struct dir_state *ds = (struct dir_state *)state;
+
 	if (trace_get_direction(packet)==-1)
 		return;
-	dir_bytes[trace_get_direction(packet)]+=trace_get_wire_length(packet);
-	++dir_packets[trace_get_direction(packet)];
+	ds->bytes[trace_get_direction(packet)]+=trace_get_wire_length(packet);
+	++ds->packets[trace_get_direction(packet)];
+}
+
+void dir_merge(void *state)
+{
+	struct dir_state *ds = (struct dir_state *)state;
+	int i;
+
+	for(i=0;i<8;++i) {
+		dir_bytes[i]+=ds->bytes[i];
+		dir_packets[i]+=ds->packets[i];
+	}
+	free(ds);
 }
 
 void dir_report(void)
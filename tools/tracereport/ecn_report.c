@@ -29,14 +29,21 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
 static stat_t ecn_stat[3][4] = {{{0,0}}} ;
 
-void ecn_per_packet(struct libtrace_packet_t *packet)
+void *ecn_start(void)
 {
+	return calloc(1, sizeof(ecn_stat));
+}
+
+void ecn_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	stat_t (*stat)[4] = (stat_t (*)[4])state;
 	struct libtrace_ip *ip = trace_get_ip(packet);
 	libtrace_direction_t dir = trace_get_direction(packet);
 	int ecn;
@@ -48,8 +55,22 @@ void ecn_per_packet(struct libtrace_packet_t *packet)
 		dir = TRACE_DIR_OTHER;
 	
 	ecn = ip->ip_tos & 0x2;
-	ecn_stat[dir][ecn].count++;
-	ecn_stat[dir][ecn].bytes+=trace_get_wire_length(packet);
+	stat[dir][ecn].count++;
+	stat[dir][ecn].bytes+=trace_get_wire_length(packet);
+}
+
+void ecn_merge(void *state)
+{
+	stat_t (*stat)[4] = (stat_t (*)[4])state;
+	int i,j;
+
+	for(i=0;i<3;++i) {
+		for(j=0;j<4;++j) {
+			ecn_stat[i][j].count+=stat[i][j].count;
+			ecn_stat[i][j].bytes+=stat[i][j].bytes;
+		}
+	}
+	free(state);
 }
 
 void ecn_report(void)
@@ -29,21 +29,34 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
+struct error_state {
+	uint64_t rx_errors;
+	uint64_t ip_errors;
+	uint64_t tcp_errors;
+};
+
 static uint64_t rx_errors = 0;
 static uint64_t ip_errors = 0;
 static uint64_t tcp_errors = 0;
 
-void error_per_packet(struct libtrace_packet_t *packet)
+void *error_start(void)
+{
+	return calloc(1, sizeof(struct error_state));
+}
+
+void error_per_packet(void *state, struct libtrace_packet_t *packet)
 {
+	struct error_state *es = (struct error_state *)state;
 	struct libtrace_ip *ip = trace_get_ip(packet);
 	struct libtrace_tcp *tcp = trace_get_tcp(packet);
 	void *link = trace_get_packet_buffer(packet,NULL,NULL);
 	if (!link) {
-		++rx_errors;
+		++es->rx_errors;
 	}
 	
 	/* This isn't quite as simple as it seems.
@@ -56,14 +69,24 @@ void error_per_packet(struct libtrace_packet_t *packet)
 	 */
 	if (ip) {
 		if (ntohs(ip->ip_sum)!=0)
-			++ip_errors;
+			++es->ip_errors;
 	}
 	if (tcp) {
 		if (ntohs(tcp->check)!=0)
-			++tcp_errors;
+			++es->tcp_errors;
 	}
 }
 
+void error_merge(void *state)
+{
+	struct error_state *es = (struct error_state *)state;
+
+	rx_errors += es->rx_errors;
+	ip_errors += es->ip_errors;
+	tcp_errors += es->tcp_errors;
+	free(es);
+}
+
 void error_report(void)
 {
 	FILE *out = fopen("error.rpt", "w");
@@ -32,47 +32,42 @@
 #include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
-#include "contain.h"
+#include "data-struct/flow_table.h"
 #include "report.h"
 
-static uint64_t flow_count=0;
+static libtrace_flowtable_t *flows = NULL;
 
-struct fivetuple_t {
-	uint32_t ipa;
-	uint32_t ipb;
-	uint16_t porta;
-	uint16_t portb;
-	uint8_t prot;
-};
-
-static int fivetuplecmp(struct fivetuple_t a, struct fivetuple_t b)
+/* Each thread counts flows in its own table. As both directions of a flow go
+ * to the same thread, the tables rarely overlap when they are merged. */
+void *flow_start(void)
 {
-	if (a.porta != b.porta) return a.porta-b.porta;
-	if (a.portb != b.portb) return a.portb-b.portb;
-	if (a.ipa != b.ipa) return a.ipa-b.ipa;
-	if (a.ipb != b.ipb) return a.ipb-b.ipb;
-	return a.prot - b.prot;
+	return libtrace_flowtable_create(sizeof(libtrace_flow_key_t), 0);
 }
 
-static int flowset_cmp(const splay *a, const splay *b);
-SET_CREATE(flowset,struct fivetuple_t,fivetuplecmp)
-
-void flow_per_packet(struct libtrace_packet_t *packet)
+void flow_per_packet(void *state, struct libtrace_packet_t *packet)
 {
-	struct libtrace_ip *ip = trace_get_ip(packet);
-	struct fivetuple_t ft;
-	if (!ip)
+	libtrace_flowtable_t *ft = (libtrace_flowtable_t *)state;
+	libtrace_flow_key_t key;
+
+	if (!ft)
 		return;
-	ft.ipa=ip->ip_src.s_addr;
-	ft.ipb=ip->ip_dst.s_addr;
-	ft.porta=trace_get_source_port(packet);
-	ft.portb=trace_get_destination_port(packet);
-	ft.prot = 0;
+	if (libtrace_flow_key_from_packet(packet, &key, false) == -1)
+		return;
+	libtrace_flowtable_get(ft, &key, 0, NULL);
+}
 
-	if (!SET_CONTAINS(flowset,ft)) {
-		SET_INSERT(flowset,ft);
-		flow_count++;
+void flow_merge(void *state)
+{
+	libtrace_flowtable_t *ft = (libtrace_flowtable_t *)state;
+
+	if (!ft)
+		return;
+	if (!flows) {
+		flows = ft;
+		return;
 	}
+	libtrace_flowtable_merge(flows, ft, NULL, NULL);
+	libtrace_flowtable_destroy(ft);
 }
 
 void flow_report(void)
@@ -82,6 +77,7 @@ void flow_report(void)
 		perror("fopen");
 		return;
 	}
-	fprintf(out, "Flows: %" PRIu64 "\n",flow_count);
+	fprintf(out, "Flows: %" PRIu64 "\n",
+			flows ? (uint64_t)libtrace_flowtable_size(flows) : 0);
 	fclose(out);
 }
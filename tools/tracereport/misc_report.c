@@ -30,10 +30,19 @@
 #include <stdbool.h>
 #include <time.h>
 #include <string.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
+struct misc_state {
+	double starttime;
+	double endtime;
+	bool has_time;
+	uint64_t packets;
+	uint64_t capture_bytes;
+};
+
 static double starttime;
 static double endtime;
 static bool has_starttime = false;
@@ -42,16 +51,38 @@ static uint64_t packets = 0;
 
 static uint64_t capture_bytes = 0;
 
-void misc_per_packet(struct libtrace_packet_t *packet)
+void *misc_start(void)
+{
+	return calloc(1, sizeof(struct misc_state));
+}
+
+void misc_per_packet(void *state, struct libtrace_packet_t *packet)
 {
+	struct misc_state *ms = (struct misc_state *)state;
 	double ts = trace_get_seconds(packet);
-	if (ts != 0 && (!has_starttime || starttime > ts))
-		starttime = ts;
-	if (ts != 0 && (!has_endtime || endtime < ts))
-		endtime = ts;
-	has_starttime = has_endtime = true;
-	++packets;
-	capture_bytes += trace_get_capture_length(packet) + trace_get_framing_length(packet);
+	if (ts != 0 && (!ms->has_time || ms->starttime > ts))
+		ms->starttime = ts;
+	if (ts != 0 && (!ms->has_time || ms->endtime < ts))
+		ms->endtime = ts;
+	if (ts != 0)
+		ms->has_time = true;
+	++ms->packets;
+	ms->capture_bytes += trace_get_capture_length(packet) + trace_get_framing_length(packet);
+}
+
+void misc_merge(void *state)
+{
+	struct misc_state *ms = (struct misc_state *)state;
+
+	if (ms->has_time && (!has_starttime || starttime > ms->starttime))
+		starttime = ms->starttime;
+	if (ms->has_time && (!has_endtime || endtime < ms->endtime))
+		endtime = ms->endtime;
+	if (ms->has_time)
+		has_starttime = has_endtime = true;
+	packets += ms->packets;
+	capture_bytes += ms->capture_bytes;
+	free(ms);
 }
 
 static char *ts_to_date(double ts)
@@ -29,14 +29,21 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
 static stat_t nlp_stat[3][65536] = {{{0,0}}} ;
 
-void nlp_per_packet(struct libtrace_packet_t *packet)
+void *nlp_start(void)
 {
+	return calloc(1, sizeof(nlp_stat));
+}
+
+void nlp_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	stat_t (*stat)[65536] = (stat_t (*)[65536])state;
 	uint16_t ethertype;
 	void *link;
 	libtrace_direction_t dir = trace_get_direction(packet);
@@ -49,8 +56,22 @@ void nlp_per_packet(struct libtrace_packet_t *packet)
 	if (dir != TRACE_DIR_INCOMING && dir != TRACE_DIR_OUTGOING)
 		dir = TRACE_DIR_OTHER;
 	
-	nlp_stat[dir][ethertype].count++;
-	nlp_stat[dir][ethertype].bytes+=trace_get_wire_length(packet);
+	stat[dir][ethertype].count++;
+	stat[dir][ethertype].bytes+=trace_get_wire_length(packet);
+}
+
+void nlp_merge(void *state)
+{
+	stat_t (*stat)[65536] = (stat_t (*)[65536])state;
+	int i,j;
+
+	for(i=0;i<3;++i) {
+		for(j=0;j<65536;++j) {
+			nlp_stat[i][j].count+=stat[i][j].count;
+			nlp_stat[i][j].bytes+=stat[i][j].bytes;
+		}
+	}
+	free(state);
 }
 
 void nlp_report(void){
@@ -33,15 +33,25 @@
 #include <string.h>
 #include "libtrace.h"
 #include "tracereport.h"
-#include "contain.h"
 #include "report.h"
 
+struct port_state {
+	stat_t *ports[3][256];
+	bool seen[3];
+};
+
 stat_t *ports[3][256] = {{NULL}};
 char protn[256]={0};
 static bool suppress[3] = {true,true,true};
 
-void port_per_packet(struct libtrace_packet_t *packet)
+void *port_start(void)
+{
+	return calloc(1, sizeof(struct port_state));
+}
+
+void port_per_packet(void *state, struct libtrace_packet_t *packet)
 {
+	struct port_state *ps = (struct port_state *)state;
 	uint8_t proto;
 	int port;
 	libtrace_direction_t dir = trace_get_direction(packet);
@@ -58,12 +68,39 @@ void port_per_packet(struct libtrace_packet_t *packet)
 		? trace_get_source_port(packet)
 		: trace_get_destination_port(packet);
 
-	if (!ports[dir][proto])
-		ports[dir][proto]=calloc(65536,sizeof(stat_t));
-	ports[dir][proto][port].bytes+=trace_get_wire_length(packet);
-	ports[dir][proto][port].count++;
-	protn[proto]=1;
-	suppress[dir] = false;
+	if (!ps->ports[dir][proto])
+		ps->ports[dir][proto]=calloc(65536,sizeof(stat_t));
+	ps->ports[dir][proto][port].bytes+=trace_get_wire_length(packet);
+	ps->ports[dir][proto][port].count++;
+	ps->seen[dir] = true;
+}
+
+void port_merge(void *state)
+{
+	struct port_state *ps = (struct port_state *)state;
+	int i,j,k;
+
+	for(i=0;i<3;++i) {
+		for(j=0;j<256;++j) {
+			if (!ps->ports[i][j])
+				continue;
+			protn[j]=1;
+			/* The first thread to see a protocol hands over its
+			 * counts rather than copying them */
+			if (!ports[i][j]) {
+				ports[i][j]=ps->ports[i][j];
+				continue;
+			}
+			for(k=0;k<65536;++k) {
+				ports[i][j][k].bytes+=ps->ports[i][j][k].bytes;
+				ports[i][j][k].count+=ps->ports[i][j][k].count;
+			}
+			free(ps->ports[i][j]);
+		}
+		if (ps->seen[i])
+			suppress[i] = false;
+	}
+	free(ps);
 }
 
 
@@ -29,15 +29,27 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
+struct protocol_state {
+	stat_t stat[3][256];
+	bool seen[3];
+};
+
 static stat_t prot_stat[3][256] = {{{0,0}}} ;
 static bool suppress[3] = {true,true,true};
 
-void protocol_per_packet(struct libtrace_packet_t *packet)
+void *protocol_start(void)
+{
+	return calloc(1, sizeof(struct protocol_state));
+}
+
+void protocol_per_packet(void *state, struct libtrace_packet_t *packet)
 {
+	struct protocol_state *ps = (struct protocol_state *)state;
 	uint8_t proto;
 	libtrace_direction_t dir = trace_get_direction(packet);
 	
@@ -47,9 +59,25 @@ void protocol_per_packet(struct libtrace_packet_t *packet)
 	if (dir != TRACE_DIR_INCOMING && dir != TRACE_DIR_OUTGOING)
 		dir = TRACE_DIR_OTHER;
 	
-	prot_stat[dir][proto].count++;
-	prot_stat[dir][proto].bytes+=trace_get_wire_length(packet);
-	suppress[dir] = false;
+	ps->stat[dir][proto].count++;
+	ps->stat[dir][proto].bytes+=trace_get_wire_length(packet);
+	ps->seen[dir] = true;
+}
+
+void protocol_merge(void *state)
+{
+	struct protocol_state *ps = (struct protocol_state *)state;
+	int i,j;
+
+	for(i=0;i<3;++i) {
+		for(j=0;j<256;++j) {
+			prot_stat[i][j].count+=ps->stat[i][j].count;
+			prot_stat[i][j].bytes+=ps->stat[i][j].bytes;
+		}
+		if (ps->seen[i])
+			suppress[i] = false;
+	}
+	free(ps);
 }
 
 void protocol_report(void)
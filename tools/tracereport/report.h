@@ -28,19 +28,52 @@
 #ifndef REPORT_H
 #define REPORT_H
 
-void dir_per_packet(struct libtrace_packet_t *packet);
-void error_per_packet(struct libtrace_packet_t *packet);
-void flow_per_packet(struct libtrace_packet_t *packet);
-void misc_per_packet(struct libtrace_packet_t *packet);
-void port_per_packet(struct libtrace_packet_t *packet);
-void protocol_per_packet(struct libtrace_packet_t *packet);
-void tos_per_packet(struct libtrace_packet_t *packet);
-void ttl_per_packet(struct libtrace_packet_t *packet);
-void tcpopt_per_packet(struct libtrace_packet_t *packet);
-void synopt_per_packet(struct libtrace_packet_t *packet);
-void nlp_per_packet(struct libtrace_packet_t *packet);
-void ecn_per_packet(struct libtrace_packet_t *packet);
-void tcpseg_per_packet(struct libtrace_packet_t *packet);
+/* Each report counts packets into per-thread state, so the per-packet
+ * threads never share anything. X_start() creates the state for a thread,
+ * X_per_packet() updates it and X_merge() adds it to the totals used by
+ * X_report() and frees it. X_merge() is only called from the reporter thread.
+ */
+void *dir_start(void);
+void *error_start(void);
+void *flow_start(void);
+void *misc_start(void);
+void *port_start(void);
+void *protocol_start(void);
+void *tos_start(void);
+void *ttl_start(void);
+void *tcpopt_start(void);
+void *synopt_start(void);
+void *nlp_start(void);
+void *ecn_start(void);
+void *tcpseg_start(void);
+
+void dir_per_packet(void *state, struct libtrace_packet_t *packet);
+void error_per_packet(void *state, struct libtrace_packet_t *packet);
+void flow_per_packet(void *state, struct libtrace_packet_t *packet);
+void misc_per_packet(void *state, struct libtrace_packet_t *packet);
+void port_per_packet(void *state, struct libtrace_packet_t *packet);
+void protocol_per_packet(void *state, struct libtrace_packet_t *packet);
+void tos_per_packet(void *state, struct libtrace_packet_t *packet);
+void ttl_per_packet(void *state, struct libtrace_packet_t *packet);
+void tcpopt_per_packet(void *state, struct libtrace_packet_t *packet);
+void synopt_per_packet(void *state, struct libtrace_packet_t *packet);
+void nlp_per_packet(void *state, struct libtrace_packet_t *packet);
+void ecn_per_packet(void *state, struct libtrace_packet_t *packet);
+void tcpseg_per_packet(void *state, struct libtrace_packet_t *packet);
+
+void dir_merge(void *state);
+void error_merge(void *state);
+void flow_merge(void *state);
+void misc_merge(void *state);
+void port_merge(void *state);
+void protocol_merge(void *state);
+void tos_merge(void *state);
+void ttl_merge(void *state);
+void tcpopt_merge(void *state);
+void synopt_merge(void *state);
+void nlp_merge(void *state);
+void ecn_merge(void *state);
+void tcpseg_merge(void *state);
 
 void drops_per_trace(libtrace_t *trace);
 
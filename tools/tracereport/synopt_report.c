@@ -29,6 +29,7 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
@@ -67,6 +68,13 @@ struct opt_counter synack_counts = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
 uint64_t total_syns = 0;
 uint64_t total_synacks = 0;
 
+struct synopt_state {
+	struct opt_counter syn_counts;
+	struct opt_counter synack_counts;
+	uint64_t total_syns;
+	uint64_t total_synacks;
+};
+
 static void classify_packet(struct tcp_opts opts, struct opt_counter *counts) {
 	if (!opts.mss && !opts.sack && !opts.winscale && !opts.ts && !opts.ttcp && !opts.other)
 	{
@@ -125,8 +133,34 @@ static void classify_packet(struct tcp_opts opts, struct opt_counter *counts) {
 		counts->other ++;	
 }
 
-void synopt_per_packet(struct libtrace_packet_t *packet)
+static void add_counts(struct opt_counter *counts,
+		const struct opt_counter *other) {
+	counts->no_options += other->no_options;
+	counts->mss_only += other->mss_only;
+	counts->ts_only += other->ts_only;
+	counts->ms += other->ms;
+	counts->mw += other->mw;
+	counts->msw += other->msw;
+	counts->mt += other->mt;
+	counts->all_four += other->all_four;
+	counts->ts_and_sack += other->ts_and_sack;
+	counts->wt += other->wt;
+	counts->tms += other->tms;
+	counts->tws += other->tws;
+	counts->tmw += other->tmw;
+	counts->ts_and_another += other->ts_and_another;
+	counts->ttcp += other->ttcp;
+	counts->other += other->other;
+}
+
+void *synopt_start(void)
 {
+	return calloc(1, sizeof(struct synopt_state));
+}
+
+void synopt_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct synopt_state *ss = (struct synopt_state *)state;
 	struct libtrace_tcp *tcp = trace_get_tcp(packet);
 	unsigned char *opt_ptr;
 	libtrace_direction_t dir = trace_get_direction(packet);
@@ -180,14 +214,25 @@ void synopt_per_packet(struct libtrace_packet_t *packet)
 	}
 
 	if (tcp->ack) {
-		total_synacks ++;
-		classify_packet(opts_seen, &synack_counts);
+		ss->total_synacks ++;
+		classify_packet(opts_seen, &ss->synack_counts);
 	} else {
-		total_syns ++;
-		classify_packet(opts_seen, &syn_counts);
+		ss->total_syns ++;
+		classify_packet(opts_seen, &ss->syn_counts);
 	}
 }
 
+void synopt_merge(void *state)
+{
+	struct synopt_state *ss = (struct synopt_state *)state;
+
+	add_counts(&syn_counts, &ss->syn_counts);
+	add_counts(&synack_counts, &ss->synack_counts);
+	total_syns += ss->total_syns;
+	total_synacks += ss->total_synacks;
+	free(ss);
+}
+
 
 void synopt_report(void)
 {
@@ -29,14 +29,21 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
 static stat_t tcpopt_stat[3][256] = {{{0,0}}};
 
-void tcpopt_per_packet(struct libtrace_packet_t *packet)
+void *tcpopt_start(void)
 {
+	return calloc(1, sizeof(tcpopt_stat));
+}
+
+void tcpopt_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	stat_t (*stat)[256] = (stat_t (*)[256])state;
 	struct libtrace_tcp *tcp = trace_get_tcp(packet);
 	unsigned char *opt_ptr;
 	libtrace_direction_t dir = trace_get_direction(packet);
@@ -61,12 +68,26 @@ void tcpopt_per_packet(struct libtrace_packet_t *packet)
 		/* I don't think we need to count NO-OPs */
 		if (type == 1)
 			continue;
-		tcpopt_stat[dir][type].count++;
-		tcpopt_stat[dir][type].bytes+= tcp_payload;
+		stat[dir][type].count++;
+		stat[dir][type].bytes+= tcp_payload;
 	}
 	
 }
 
+void tcpopt_merge(void *state)
+{
+	stat_t (*stat)[256] = (stat_t (*)[256])state;
+	int i,j;
+
+	for(i=0;i<3;++i) {
+		for(j=0;j<256;++j) {
+			tcpopt_stat[i][j].count+=stat[i][j].count;
+			tcpopt_stat[i][j].bytes+=stat[i][j].bytes;
+		}
+	}
+	free(state);
+}
+
 
 void tcpopt_report(void)
 {
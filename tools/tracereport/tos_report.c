@@ -28,15 +28,27 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
+struct tos_state {
+	stat_t stat[3][256];
+	bool seen[3];
+};
+
 static stat_t tos_stat[3][256] = {{{0,0}}} ;
 static bool suppress[3] = {true,true,true};
 
-void tos_per_packet(struct libtrace_packet_t *packet)
+void *tos_start(void)
+{
+	return calloc(1, sizeof(struct tos_state));
+}
+
+void tos_per_packet(void *state, struct libtrace_packet_t *packet)
 {
+	struct tos_state *ts = (struct tos_state *)state;
 	struct libtrace_ip *ip = trace_get_ip(packet);
 	libtrace_direction_t dir = trace_get_direction(packet);
 	
@@ -46,9 +58,25 @@ void tos_per_packet(struct libtrace_packet_t *packet)
 	if (dir != TRACE_DIR_INCOMING && dir != TRACE_DIR_OUTGOING)
 		dir = TRACE_DIR_OTHER;
 	
-	tos_stat[dir][ip->ip_tos].count++;
-	tos_stat[dir][ip->ip_tos].bytes+=trace_get_wire_length(packet);
-	suppress[dir] = false;
+	ts->stat[dir][ip->ip_tos].count++;
+	ts->stat[dir][ip->ip_tos].bytes+=trace_get_wire_length(packet);
+	ts->seen[dir] = true;
+}
+
+void tos_merge(void *state)
+{
+	struct tos_state *ts = (struct tos_state *)state;
+	int i,j;
+
+	for(i=0;i<3;++i) {
+		for(j=0;j<256;++j) {
+			tos_stat[i][j].count+=ts->stat[i][j].count;
+			tos_stat[i][j].bytes+=ts->stat[i][j].bytes;
+		}
+		if (ts->seen[i])
+			suppress[i] = false;
+	}
+	free(ts);
 }
 
 
@@ -40,30 +40,124 @@
 #include <inttypes.h>
 #include <signal.h>
 
-#include "libtrace.h"
+#include "libtrace_parallel.h"
 #include "tracereport.h"
 #include "report.h"
 
-struct libtrace_t *trace;
+struct libtrace_t *trace = NULL;
 uint32_t reports_required = 0;
-int packets_read = 0;
+volatile uint64_t packets_read = 0;
+int packet_count = -1;
 
 static volatile int done=0;
+/* Set by whichever of the signal handler or a per-packet thread stops the
+ * trace first, as the trace must only be stopped once */
+static volatile int stopping=0;
 
 static void cleanup_signal(int sig UNUSED)
 {
 	done=1;
-	trace_interrupt();
+	if (trace && __sync_bool_compare_and_swap(&stopping, 0, 1))
+		trace_pstop(trace);
+}
+
+/* The reports, in the order they are run on each packet */
+static const struct {
+	report_type_t type;
+	void *(*start)(void);
+	void (*per_packet)(void *state, libtrace_packet_t *packet);
+	void (*merge)(void *state);
+} reports[] = {
+	{ REPORT_TYPE_MISC, misc_start, misc_per_packet, misc_merge },
+	{ REPORT_TYPE_ERROR, error_start, error_per_packet, error_merge },
+	{ REPORT_TYPE_PORT, port_start, port_per_packet, port_merge },
+	{ REPORT_TYPE_PROTO, protocol_start, protocol_per_packet, protocol_merge },
+	{ REPORT_TYPE_TOS, tos_start, tos_per_packet, tos_merge },
+	{ REPORT_TYPE_TTL, ttl_start, ttl_per_packet, ttl_merge },
+	{ REPORT_TYPE_FLOW, flow_start, flow_per_packet, flow_merge },
+	{ REPORT_TYPE_TCPOPT, tcpopt_start, tcpopt_per_packet, tcpopt_merge },
+	{ REPORT_TYPE_SYNOPT, synopt_start, synopt_per_packet, synopt_merge },
+	{ REPORT_TYPE_NLP, nlp_start, nlp_per_packet, nlp_merge },
+	{ REPORT_TYPE_DIR, dir_start, dir_per_packet, dir_merge },
+	{ REPORT_TYPE_ECN, ecn_start, ecn_per_packet, ecn_merge },
+	{ REPORT_TYPE_TCPSEG, tcpseg_start, tcpseg_per_packet, tcpseg_merge },
+};
+
+#define REPORT_COUNT (sizeof(reports) / sizeof(reports[0]))
+
+/* Each per-packet thread keeps its own state for every report */
+static void *fn_starting(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+		void *global UNUSED) {
+	void **states = calloc(REPORT_COUNT, sizeof(void *));
+	size_t i;
+
+	for (i = 0; i < REPORT_COUNT; i++) {
+		if (reports_required & reports[i].type)
+			states[i] = reports[i].start();
+	}
+	return states;
+}
+
+static libtrace_packet_t *fn_packet(libtrace_t *trace,
+		libtrace_thread_t *t UNUSED, void *global UNUSED, void *tls,
+		libtrace_packet_t *packet) {
+	void **states = (void **)tls;
+	size_t i;
+
+	if (IS_LIBTRACE_META_PACKET(packet))
+		return packet;
+
+	/* Stop after reading the maximum number of packets, across all the
+	 * traces */
+	if (packet_count >= 0) {
+		if (__sync_fetch_and_add(&packets_read, 1) >= (uint64_t)packet_count) {
+			done = 1;
+			if (__sync_bool_compare_and_swap(&stopping, 0, 1))
+				trace_pstop(trace);
+			return packet;
+		}
+	}
+
+	for (i = 0; i < REPORT_COUNT; i++) {
+		if (states[i])
+			reports[i].per_packet(states[i], packet);
+	}
+	return packet;
+}
+
+/* Hands the thread's state to the reporter once the trace is finished */
+static void fn_stopping(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls) {
+	libtrace_generic_t gen;
+
+	gen.ptr = tls;
+	trace_publish_result(trace, t, 0, gen, RESULT_USER);
+}
+
+/* The reporter merges each thread's state into the report totals, so the
+ * reports themselves never need a lock */
+static void fn_result(libtrace_t *trace UNUSED,
+		libtrace_thread_t *sender UNUSED, void *global UNUSED,
+		void *tls UNUSED, libtrace_result_t *result) {
+	void **states = (void **)result->value.ptr;
+	size_t i;
+
+	for (i = 0; i < REPORT_COUNT; i++) {
+		if (states[i])
+			reports[i].merge(states[i]);
+	}
+	free(states);
 }
 
 /* Process a trace, counting packets that match filter(s) */
-static void run_trace(char *uri, libtrace_filter_t *filter, int count) 
+static void run_trace(char *uri, libtrace_filter_t *filter, int threadcount)
 {
-	struct libtrace_packet_t *packet = trace_create_packet();
+	libtrace_callback_set_t *pktcbs, *rescbs;
 
 	/* Already read the maximum number of packets - don't need to read
 	 * anything from this trace */
-	if ((count >= 0 && packets_read >= count) || done)
+	if ((packet_count >= 0 && packets_read >= (uint64_t)packet_count)
+			|| done)
 		return;
 
 	trace = trace_create(uri);
@@ -77,57 +171,41 @@ static void run_trace(char *uri, libtrace_filter_t *filter, int count)
 		trace_config(trace,TRACE_OPTION_FILTER,filter);
 	}
 
-	if (trace_start(trace)==-1) {
-		trace_perror(trace,"trace_start");
+	pktcbs = trace_create_callback_set();
+	rescbs = trace_create_callback_set();
+
+	trace_set_starting_cb(pktcbs, fn_starting);
+	trace_set_packet_cb(pktcbs, fn_packet);
+	trace_set_stopping_cb(pktcbs, fn_stopping);
+	trace_set_result_cb(rescbs, fn_result);
+
+	if (threadcount != 0)
+		trace_set_perpkt_threads(trace, threadcount);
+	/* Keep both directions of a flow on one thread, so that the flow
+	 * tables of the threads hardly overlap */
+	trace_set_hasher(trace, HASHER_BIDIRECTIONAL, NULL, NULL);
+
+	stopping = 0;
+	if (trace_pstart(trace, NULL, pktcbs, rescbs)==-1) {
+		trace_perror(trace,"trace_pstart");
+		trace_destroy(trace);
+		trace = NULL;
+		trace_destroy_callback_set(pktcbs);
+		trace_destroy_callback_set(rescbs);
 		return;
 	}
 
-	while (1) {
-		int psize;
-		
-		if (count >= 0 && packets_read >= count)
-			break;
-		if (done)
-			break;
-		if ((psize = trace_read_packet(trace, packet)) <1) {
-			break;
-		}
-                if (IS_LIBTRACE_META_PACKET(packet))
-                        continue;
-
-		if (reports_required & REPORT_TYPE_MISC)
-			misc_per_packet(packet);
-		if (reports_required & REPORT_TYPE_ERROR)
-			error_per_packet(packet);
-		if (reports_required & REPORT_TYPE_PORT)
-			port_per_packet(packet);
-		if (reports_required & REPORT_TYPE_PROTO)
-			protocol_per_packet(packet);
-		if (reports_required & REPORT_TYPE_TOS)
-			tos_per_packet(packet);
-		if (reports_required & REPORT_TYPE_TTL)
-			ttl_per_packet(packet);
-		if (reports_required & REPORT_TYPE_FLOW)
-			flow_per_packet(packet);
-		if (reports_required & REPORT_TYPE_TCPOPT)
-			tcpopt_per_packet(packet);
-		if (reports_required & REPORT_TYPE_SYNOPT)
-			synopt_per_packet(packet);
-		if (reports_required & REPORT_TYPE_NLP)
-			nlp_per_packet(packet);
-		if (reports_required & REPORT_TYPE_DIR)
-			dir_per_packet(packet);
-		if (reports_required & REPORT_TYPE_ECN)
-			ecn_per_packet(packet);
-		if (reports_required & REPORT_TYPE_TCPSEG)
-			tcpseg_per_packet(packet);
-
-		packets_read ++;
-	}
+	trace_join(trace);
+
+	if (trace_is_err(trace))
+		trace_perror(trace,"%s",uri);
+
 	if (reports_required & REPORT_TYPE_DROPS)
 		drops_per_trace(trace);
-        trace_destroy_packet(packet);
 	trace_destroy(trace);
+	trace = NULL;
+	trace_destroy_callback_set(pktcbs);
+	trace_destroy_callback_set(rescbs);
 }
 
 static void usage(char *argv0)
@@ -149,6 +227,8 @@ static void usage(char *argv0)
 	"-d --direction		Report direction\n"
 	"-C --ecn		Report TCP ECN information\n"
 	"-s --tcpsegment	\tReport TCP segment size\n"
+	"-D --drops		Report packet drops\n"
+	"-j --threads=N		Use N threads to process packets\n"
 	"-H --help		Print libtrace runtime documentation\n"
 	,argv0);
 	exit(1);
@@ -160,7 +240,7 @@ int main(int argc, char *argv[]) {
 	int opt;
 	char *filterstring=NULL;
 	struct sigaction sigact;
-	int count = -1;
+	int threadcount = 1;
 
 	libtrace_filter_t *filter = NULL;/*trace_bpf_setfilter(filterstring); */
 
@@ -184,16 +264,17 @@ int main(int argc, char *argv[]) {
 			{ "tcpsegment", 	0, 0, 's' },
 			{ "tos",		0, 0, 'T' },
 			{ "ttl", 		0, 0, 't' },
+			{ "threads",		1, 0, 'j' },
 			{ NULL, 		0, 0, 0 }
 		};
-		opt = getopt_long(argc, argv, "Df:HemFPpTtOondCsc:", 
+		opt = getopt_long(argc, argv, "Df:HemFPpTtOondCsc:j:", 
 				long_options, &option_index);
 		if (opt == -1)
 			break;
 		
 		switch (opt) {
 			case 'c':
-				count = atoi(optarg);
+				packet_count = atoi(optarg);
 				break;
 			case 'C':
 				reports_required |= REPORT_TYPE_ECN;
@@ -243,6 +324,11 @@ int main(int argc, char *argv[]) {
 			case 't':
 				reports_required |= REPORT_TYPE_TTL;
 				break;
+			case 'j':
+				threadcount = atoi(optarg);
+				if (threadcount <= 0)
+					threadcount = 1;
+				break;
 			default:
 				usage(argv[0]);
 		}
@@ -278,7 +364,7 @@ int main(int argc, char *argv[]) {
 		 * we are - printing to stderr because we use stdout for
 		 * genuine output at the moment */
 		fprintf(stderr, "Reading from trace: %s\n", argv[i]);
-		run_trace(argv[i],filter, count);
+		run_trace(argv[i],filter, threadcount);
 	}
 
 	if (reports_required & REPORT_TYPE_MISC)
@@ -38,6 +38,7 @@ struct output_type_t *output_formats[] = {
 	&output_txt,
 	&output_csv,
 	&output_html,
+	&output_bin,
 #ifdef HAVE_LIBGDC
 	&output_png,
 #endif
@@ -61,6 +61,7 @@ extern struct output_type_t output_txt;
 extern struct output_type_t output_csv;
 extern struct output_type_t output_html;
 extern struct output_type_t output_png;
+extern struct output_type_t output_bin;
 
 
 struct output_data_t *output_init(char *title, char *format);
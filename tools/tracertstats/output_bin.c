@@ -0,0 +1,223 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* A compact binary format that can be mapped into memory rather than parsed.
+ * Everything is little endian.
+ *
+ * The header is:
+ *   8 bytes	magic, "LTRTSTAT"
+ *   uint32	version, 1
+ *   uint32	the number of columns
+ *   uint32	the length of the header, where the first row starts
+ *   uint32	the length of each row
+ * followed by each column:
+ *   uint8	type, one of BIN_TYPE_*
+ *   uint8	reserved, 0
+ *   uint16	the length of the label
+ *   		the label, not nul terminated
+ * padded with zeroes to a multiple of 8 bytes.
+ *
+ * Each row then holds 8 bytes for every column, so a column is an array with
+ * a stride of the row length. The header is written with the first row, as
+ * that is when the types of the columns are known.
+ */
+
+#include "output.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <lt_inttypes.h>
+
+#define BIN_MAGIC "LTRTSTAT"
+#define BIN_VERSION 1
+#define BIN_BUFFER_SIZE 65536
+
+enum {
+	BIN_TYPE_INT = 0,	/* uint64 */
+	BIN_TYPE_FLOAT = 1,	/* IEEE 754 double */
+	BIN_TYPE_TIME = 2,	/* IEEE 754 double, seconds since the epoch */
+};
+
+struct output_bin_t {
+	char *buffer;
+	size_t used;
+	size_t size;
+	int header_written;
+	/* Rows are written out at least this often, so the file can be
+	 * followed while it grows */
+	time_t last_write;
+};
+
+static void put_le(char *p, uint64_t value, int bytes)
+{
+	int i;
+	for (i = 0; i < bytes; i++) {
+		p[i] = (char)(value & 0xff);
+		value >>= 8;
+	}
+}
+
+static void bin_write_out(struct output_bin_t *bin)
+{
+	if (bin->used > 0) {
+		fwrite(bin->buffer, 1, bin->used, stdout);
+		fflush(stdout);
+		bin->used = 0;
+	}
+	bin->last_write = time(NULL);
+}
+
+/* Returns space for len bytes in the buffer, writing out what is already
+ * there if it is full */
+static char *bin_reserve(struct output_bin_t *bin, size_t len)
+{
+	char *p;
+
+	if (bin->used + len > bin->size)
+		bin_write_out(bin);
+	if (len > bin->size) {
+		bin->buffer = realloc(bin->buffer, len);
+		bin->size = len;
+	}
+	p = bin->buffer + bin->used;
+	bin->used += len;
+	return p;
+}
+
+static void bin_write_header(struct output_data_t *out,
+		struct output_bin_t *bin)
+{
+	size_t len = 24;
+	char *p;
+	int i;
+
+	for (i = 0; i < out->columns; ++i)
+		len += 4 + strlen(out->labels[i]);
+	len = (len + 7) & ~(size_t)7;
+
+	p = bin_reserve(bin, len);
+	memset(p, 0, len);
+	memcpy(p, BIN_MAGIC, 8);
+	put_le(p + 8, BIN_VERSION, 4);
+	put_le(p + 12, out->columns, 4);
+	put_le(p + 16, len, 4);
+	put_le(p + 20, out->columns * 8, 4);
+	p += 24;
+	for (i = 0; i < out->columns; ++i) {
+		size_t label = strlen(out->labels[i]);
+		switch (out->data[i].type) {
+			case TYPE_float:
+				p[0] = BIN_TYPE_FLOAT;
+				break;
+			case TYPE_time:
+				p[0] = BIN_TYPE_TIME;
+				break;
+			default:
+				p[0] = BIN_TYPE_INT;
+				break;
+		}
+		put_le(p + 2, label, 2);
+		memcpy(p + 4, out->labels[i], label);
+		p += 4 + label;
+	}
+	bin->header_written = 1;
+}
+
+static void output_bin_init(struct output_data_t *out)
+{
+	struct output_bin_t *bin = malloc(sizeof(struct output_bin_t));
+
+	bin->buffer = malloc(BIN_BUFFER_SIZE);
+	bin->size = BIN_BUFFER_SIZE;
+	bin->used = 0;
+	bin->header_written = 0;
+	bin->last_write = time(NULL);
+	out->private_format_data = bin;
+}
+
+static void output_bin_flush(struct output_data_t *out)
+{
+	struct output_bin_t *bin = out->private_format_data;
+	uint64_t value;
+	char *p;
+	int i;
+
+	if (!bin->header_written)
+		bin_write_header(out, bin);
+
+	p = bin_reserve(bin, out->columns * 8);
+	for(i=0;i<out->columns;++i) {
+		switch (out->data[i].type) {
+			case TYPE_int:
+				value = out->data[i].d.d_int;
+				break;
+			case TYPE_str:
+				/* Strings don't fit in a fixed width row, none
+				 * of the columns tracertstats reports are */
+				free(out->data[i].d.d_str);
+				value = 0;
+				break;
+			case TYPE_float:
+				memcpy(&value, &out->data[i].d.d_float, 8);
+				break;
+			case TYPE_time:
+				memcpy(&value, &out->data[i].d.d_time, 8);
+				break;
+			default:
+				value = 0;
+				break;
+		}
+		put_le(p + i * 8, value, 8);
+	}
+
+	if (time(NULL) != bin->last_write)
+		bin_write_out(bin);
+}
+
+static void output_bin_destroy(struct output_data_t *out)
+{
+	struct output_bin_t *bin = out->private_format_data;
+
+	/* Column types default to integers if no rows were reported */
+	if (!bin->header_written) {
+		int i;
+		for (i = 0; i < out->columns; ++i)
+			out->data[i].type = TYPE_int;
+		bin_write_header(out, bin);
+	}
+	bin_write_out(bin);
+	free(bin->buffer);
+	free(bin);
+}
+
+struct output_type_t output_bin = {
+.name= "bin",
+.init= output_bin_init,
+.flush= output_bin_flush,
+.destroy= output_bin_destroy,
+};
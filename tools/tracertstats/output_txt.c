@@ -67,7 +67,12 @@ static void output_txt_flush(struct output_data_t *out)
 				printf("%*f ",COLWIDTH-1,out->data[i].d.d_float);
 				break;
 			case TYPE_time:
-				printf("%*.0f ",COLWIDTH-1,out->data[i].d.d_time);
+				/* Only sub-second intervals need the fraction */
+				if (out->data[i].d.d_time !=
+						(uint64_t)out->data[i].d.d_time)
+					printf("%*.3f ",COLWIDTH-1,out->data[i].d.d_time);
+				else
+					printf("%*.0f ",COLWIDTH-1,out->data[i].d.d_time);
 				break;
 		}
 	}
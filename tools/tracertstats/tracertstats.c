@@ -47,9 +47,11 @@
 #include <getopt.h>
 #include <inttypes.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include <lt_inttypes.h>
 #include "libtrace_parallel.h"
+#include "data-struct/time_bins.h"
 #include "output.h"
 #include "rt_protocol.h"
 #include "dagformat.h"
@@ -59,6 +61,8 @@
 #endif
 
 #define DEFAULT_OUTPUT_FMT "txt"
+/* The number of intervals each thread can count ahead of the slowest thread */
+#define BINS_WINDOW 256
 
 char *output_format=NULL;
 int merge_inputs = 0;
@@ -68,18 +72,21 @@ int burstsize=10;
 
 struct filter_t {
 	char *expr;
-	struct libtrace_filter_t *filter;
-	uint64_t count;
-	uint64_t bytes;
 } *filters = NULL;
 
+libtrace_filter_set_t *filter_set = NULL;
+
 uint64_t packet_count=UINT64_MAX;
 double packet_interval=UINT32_MAX;
 
 struct output_data_t *output = NULL;
 
-uint64_t count;
-uint64_t bytes;
+/* The packet and byte counts of each interval, the totals followed by the
+ * counts for each filter */
+libtrace_timebins_t *bins = NULL;
+pthread_mutex_t bins_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t packets_seen = 0;
+bool stopped = false;
 
 struct libtrace_t *currenttrace;
 
@@ -89,18 +96,24 @@ static void cleanup_signal(int signal UNUSED) {
         }
 }
 
-static void report_results(double ts,uint64_t count,uint64_t bytes)
+static void report_results(uint64_t start, const uint64_t *counters,
+		void *data UNUSED)
 {
 	int i=0;
-	output_set_data_time(output,0,ts);
-	output_set_data_int(output,1,count);
-	output_set_data_int(output,2,bytes);
+
+	if (stopped)
+		return;
+
+	output_set_data_time(output,0,start / 4294967296.0);
+	output_set_data_int(output,1,counters[0]);
+	output_set_data_int(output,2,counters[1]);
 	for(i=0;i<filter_count;++i) {
-		output_set_data_int(output,i*2+3,filters[i].count);
-		output_set_data_int(output,i*2+4,filters[i].bytes);
-		filters[i].count=filters[i].bytes=0;
+		output_set_data_int(output,i*2+3,counters[i*2+2]);
+		output_set_data_int(output,i*2+4,counters[i*2+3]);
 	}
 	output_flush_row(output);
+
+	packets_seen += counters[0];
 }
 
 static void create_output(char *title) {
@@ -125,134 +138,108 @@ static void create_output(char *title) {
 
 }
 
-typedef struct statistic {
-	uint64_t count;
-	uint64_t bytes;
-} statistic_t;
-
-typedef struct result {
-	struct statistic total;
-	struct statistic filters[0];
-} result_t;
-
-static uint64_t glob_last_ts = 0;
 static void cb_result(libtrace_t *trace, libtrace_thread_t *sender UNUSED,
                 void *global UNUSED, void *tls UNUSED,
-                libtrace_result_t *result) {
-	uint64_t ts = 0;
-        static bool stopped = false;
-        static uint64_t packets_seen = 0;
-	int j;
-	result_t *res;
-
-        if (stopped)
-                return;
-
-        ts = result->key;
-        res = result->value.ptr;
-        if (glob_last_ts == 0)
-                glob_last_ts = ts;
-        while ((glob_last_ts >> 32) < (ts >> 32)) {
-                report_results(glob_last_ts >> 32, count, bytes);
-                count = 0;
-                bytes = 0;
-                for (j = 0; j < filter_count; j++)
-                        filters[j].count = filters[j].bytes = 0;
-                glob_last_ts = ts;
-        }
-        count += res->total.count;
-        packets_seen += res->total.count;
-        bytes += res->total.bytes;
-        for (j = 0; j < filter_count; j++) {
-                filters[j].count += res->filters[j].count;
-                filters[j].bytes += res->filters[j].bytes;
-        }
-        free(res);
+                libtrace_result_t *result UNUSED) {
+
+	/* A thread has closed some intervals, report those that every thread
+	 * has finished with */
+	libtrace_timebins_merge(bins, report_results, NULL);
 
         /* Be careful to only call pstop once from within this thread! */
-        if (packets_seen > packet_count) {
-                trace_pstop(trace);
+        if (!stopped && packets_seen > packet_count) {
+                /* The trace may have already reached the end of its input,
+                 * so it cannot be stopped and that is not an error */
+                if (trace_pstop(trace) == -1) {
+                        libtrace_err_t err = trace_get_err(trace);
+                        if (err.err_num != TRACE_ERR_BAD_STATE)
+                                fprintf(stderr, "Failed to stop trace: %s\n",
+                                                err.problem);
+                }
                 stopped = true;
         }
 }
 
-typedef struct threadlocal {
-        result_t *results;
-        uint64_t last_key;
-} thread_data_t;
+/* Lets the reporter know there may be intervals to report */
+static void publish_closed(libtrace_t *trace, libtrace_thread_t *t) {
+	libtrace_generic_t tmp = {.uint64 = 0};
 
-static void *cb_starting(libtrace_t *trace UNUSED,
-        libtrace_thread_t *t UNUSED, void *global UNUSED)
-{
-        thread_data_t *td = calloc(1, sizeof(thread_data_t));
-	td->results = calloc(1, sizeof(result_t) +
-                        sizeof(statistic_t) * filter_count);
-        return td;
+	trace_publish_result(trace, t, 0, tmp, RESULT_USER);
+	trace_post_reporter(trace);
 }
 
 static libtrace_packet_t *cb_packet(libtrace_t *trace, libtrace_thread_t *t,
-                void *global UNUSED, void *tls, libtrace_packet_t *packet) {
+                void *global UNUSED, void *tls UNUSED,
+                libtrace_packet_t *packet) {
 
-        uint64_t key;
-        thread_data_t *td = (thread_data_t *)tls;
+        uint64_t *counters;
+        uint64_t matches[filter_count / 64 + 1];
         int i;
         size_t wlen;
+        bool closed;
 
         if (IS_LIBTRACE_META_PACKET(packet)) {
                 return packet;
         }
 
-        key = trace_get_erf_timestamp(packet);
-        if ((key >> 32) >= (td->last_key >> 32) + packet_interval) {
-                libtrace_generic_t tmp = {.ptr = td->results};
-		trace_publish_result(trace, t, key,
-                                tmp, RESULT_USER);
-                trace_post_reporter(trace);
-                td->last_key = key;
-                td->results = calloc(1, sizeof(result_t) +
-                                sizeof(statistic_t) * filter_count);
-        }
         wlen = trace_get_wire_length(packet);
         if (wlen == 0) {
                 /* Don't count ERF provenance and similar packets */
                 return packet;
         }
-        for(i=0;i<filter_count;++i) {
-                if(trace_apply_filter(filters[i].filter, packet)) {
-                        td->results->filters[i].count++;
-                        td->results->filters[i].bytes+=wlen;
+
+        counters = libtrace_timebins_get(bins, trace_get_perpkt_thread_id(t),
+                        trace_get_erf_timestamp(packet), &closed);
+        if (closed)
+                publish_closed(trace, t);
+
+        if (filter_set) {
+                trace_apply_filter_set(filter_set, packet, matches);
+                for(i=0;i<filter_count;++i) {
+                        if (matches[i / 64] & ((uint64_t)1 << (i % 64))) {
+                                counters[i*2+2]++;
+                                counters[i*2+3]+=wlen;
+                        }
                 }
         }
 
-        td->results->total.count++;
-        td->results->total.bytes += wlen;
+        counters[0]++;
+        counters[1] += wlen;
         return packet;
 }
 
-static void cb_stopping(libtrace_t *trace, libtrace_thread_t *t,
-                void *global UNUSED, void *tls) {
-
-        thread_data_t *td = (thread_data_t *)tls;
-        if (td->results->total.count) {
-                libtrace_generic_t tmp = {.ptr = td->results};
-                trace_publish_result(trace, t, td->last_key, tmp, RESULT_USER);
-                trace_post_reporter(trace);
-                td->results = NULL;
+static void *cb_starting(libtrace_t *trace,
+        libtrace_thread_t *t UNUSED, void *global UNUSED)
+{
+        /* The number of perpkt threads is only known once the trace has
+         * started, so the first thread creates the bins for all of them */
+        pthread_mutex_lock(&bins_lock);
+        if (!bins) {
+                bins = libtrace_timebins_create(packet_interval,
+                                2 + 2 * filter_count,
+                                trace_get_perpkt_threads(trace), BINS_WINDOW);
+                if (!bins) {
+                        fprintf(stderr, "Failed to create time bins\n");
+                        exit(1);
+                }
         }
+        pthread_mutex_unlock(&bins_lock);
+        return NULL;
+}
+
+static void cb_stopping(libtrace_t *trace, libtrace_thread_t *t,
+                void *global UNUSED, void *tls UNUSED) {
+
+        libtrace_timebins_finish(bins, trace_get_perpkt_thread_id(t));
+        publish_closed(trace, t);
 }
 
 static void cb_tick(libtrace_t *trace, libtrace_thread_t *t,
-                void *global UNUSED, void *tls, uint64_t order) {
-
-        thread_data_t *td = (thread_data_t *)tls;
-        if (order > td->last_key) {
-		libtrace_generic_t tmp = {.ptr = td->results};
-                trace_publish_result(trace, t, order, tmp, RESULT_USER);
-                trace_post_reporter(trace);
-                td->last_key = order;
-                td->results = calloc(1, sizeof(result_t) +
-                                sizeof(statistic_t) * filter_count);
-        }
+                void *global UNUSED, void *tls UNUSED, uint64_t order) {
+
+        if (libtrace_timebins_advance(bins, trace_get_perpkt_thread_id(t),
+                                order))
+                publish_closed(trace, t);
 }
 
 /* Process a trace, counting packets that match filter(s) */
@@ -275,12 +262,17 @@ static void run_trace(char *uri)
 			output_destroy(output);
 		return;
 	}
-	trace_set_combiner(trace, &combiner_ordered, (libtrace_generic_t){0});
         trace_set_perpkt_threads(trace, threadcount);
 	trace_set_burst_size(trace, burstsize);
 
 	if (trace_get_information(trace)->live) {
-                trace_set_tick_interval(trace, (int) (packet_interval * 1000));
+                /* Ticks are in milliseconds, shorter intervals are closed
+                 * by a tick that covers several of them */
+                if (packet_interval < 0.001)
+                        trace_set_tick_interval(trace, 1);
+                else
+                        trace_set_tick_interval(trace,
+                                        (int) (packet_interval * 1000));
 	} else {
 		trace_set_tracetime(trace, true);
 	}
@@ -289,7 +281,6 @@ static void run_trace(char *uri)
         trace_set_starting_cb(pktcbs, cb_starting);
         trace_set_stopping_cb(pktcbs, cb_stopping);
         trace_set_packet_cb(pktcbs, cb_packet);
-        trace_set_tick_count_cb(pktcbs, cb_tick);
         trace_set_tick_interval_cb(pktcbs, cb_tick);
 
         repcbs = trace_create_callback_set();
@@ -310,8 +301,12 @@ static void run_trace(char *uri)
 	// Wait for all threads to stop
 	trace_join(trace);
 	
-	// Flush the last one out
-	report_results((glob_last_ts >> 32), count, bytes);
+	// Report the intervals closed as the threads stopped
+	if (bins) {
+		libtrace_timebins_merge(bins, report_results, NULL);
+		libtrace_timebins_destroy(bins);
+		bins = NULL;
+	}
 	if (trace_is_err(trace))
 		trace_perror(trace,"%s",uri);
 
@@ -332,7 +327,7 @@ static void usage(char *argv0)
        	"-i --interval=seconds	Duration of reporting interval in seconds\n"
 	"-c --count=packets	Exit after count packets have been processed\n"
 	"-t --threads=max	Create 'max' processing threads (default: 4)\n"
-	"-o --output-format=txt|csv|html|png Reporting output format\n"
+	"-o --output-format=txt|csv|html|png|bin Reporting output format\n"
 	"-f --filter=bpf	Apply BPF filter. Can be specified multiple times\n"
 	"-m --merge-inputs	Do not create separate outputs for each input trace\n"
 	"-N --nobuffer		Disable packet buffering within libtrace to force faster\n"
@@ -374,9 +369,10 @@ int main(int argc, char *argv[]) {
 				++filter_count;
 				filters=realloc(filters,filter_count*sizeof(struct filter_t));
 				filters[filter_count-1].expr=strdup(optarg);
-				filters[filter_count-1].filter=trace_create_filter(optarg);
-				filters[filter_count-1].count=0;
-				filters[filter_count-1].bytes=0;
+				if (!filter_set)
+					filter_set = trace_create_filter_set();
+				if (filter_set)
+					trace_filter_set_add(filter_set, optarg);
 				break;
                         case 't':
                                 threadcount = atoi(optarg);
@@ -385,6 +381,10 @@ int main(int argc, char *argv[]) {
                                 break;
 			case 'i':
 				packet_interval=atof(optarg);
+				if (packet_interval < 0.000001) {
+					fprintf(stderr, "Interval must be at least 1 microsecond\n");
+					return 1;
+				}
 				break;
 			case 'c':
 				packet_count=strtoul(optarg, NULL, 10);
@@ -439,7 +439,7 @@ int main(int argc, char *argv[]) {
         sigaction(SIGTERM, &sigact, NULL);
 
 
-	for(i=optind;i<argc;++i) {
+	for(i=optind;i<argc && !stopped;++i) {
 		run_trace(argv[i]);
 	}
 
@@ -448,6 +448,8 @@ int main(int argc, char *argv[]) {
 		output_destroy(output);
 	}
 
+	if (filter_set)
+		trace_destroy_filter_set(filter_set);
 
 	return 0;
 }
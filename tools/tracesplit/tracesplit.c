@@ -26,6 +26,7 @@
 
 
 #include <libtrace.h>
+#include <libtrace_parallel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
@@ -56,6 +57,15 @@ int verbose=0;
 int compress_level=-1;
 trace_option_compresstype_t compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
 char *output_base = NULL;
+int threadcount = 1;
+
+/* Published in order in place of the first packet after the end time, or a
+ * packet whose link type cannot be determined, to stop the split there */
+#define RESULT_STOP RESULT_USER
+
+/* The processing threads publish a tick every this many packets, so one that
+ * is dropping everything doesn't hold back the packets the others keep */
+#define TICK_COUNT 10000
 
 
 static char *strdupcat(char *str,char *app)
@@ -86,6 +96,7 @@ static int usage(char *argv0)
         "-j --jump=n            Jump to the nth IP header\n"
 	"-H --libtrace-help	Print libtrace runtime documentation\n"
 	"-S --snaplen		Snap packets at the specified length\n"
+	"-t --threads=n		Use n threads for filtering and snapping\n"
 	"-v --verbose		Output statistics\n"
 	"-z --compress-level	Set compression level\n"
 	"-Z --compress-type 	Set compression type\n"
@@ -94,12 +105,25 @@ static int usage(char *argv0)
 }
 
 volatile int done=0;
+struct libtrace_t *volatile input = NULL;
+volatile int stopping = 0;
+
+static void stop_trace(void)
+{
+	/* trace_pstop() must only be called once per trace */
+	if (input && __sync_bool_compare_and_swap(&stopping, 0, 1)) {
+		/* The trace may have already finished reading, in which
+		 * case it cannot be stopped and that is not an error */
+		if (trace_pstop(input) == -1 && trace_has_finished(input))
+			trace_get_err(input);
+	}
+}
 
 static void cleanup_signal(int sig)
 {
 	(void)sig;
 	done=1;
-	trace_interrupt();
+	stop_trace();
 }
 
 
@@ -183,35 +207,67 @@ static libtrace_packet_t *perform_jump(libtrace_packet_t *packet, int jump)
 }
 
 
-/* Return values:
- *  1 = continue reading packets
- *  0 = stop reading packets, cos we're done
- *  -1 = stop reading packets, we've got an error
- */
-static int per_packet(libtrace_packet_t **packet) {
-        if (IS_LIBTRACE_META_PACKET((*packet))) {
-                return 1;
+/* Filters and snaps packets in the processing threads, the packets that are
+ * kept are passed to the reporter in their original order to be written */
+static libtrace_packet_t *cb_packet(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls UNUSED,
+		libtrace_packet_t *packet) {
+	libtrace_generic_t gen;
+
+        if (IS_LIBTRACE_META_PACKET(packet)) {
+                return packet;
         }
 
-	if (trace_get_link_type(*packet) == -1) {
+	if (trace_get_link_type(packet) == -1) {
 		fprintf(stderr, "Halted due to being unable to determine linktype - input trace may be corrupt.\n");
-		return -1;
+		gen.sint = -1;
+		trace_publish_result(trace, t, trace_packet_get_order(packet),
+				gen, RESULT_STOP);
+		return packet;
 	}
 
 	if (snaplen>0) {
-		trace_set_capture_length(*packet,snaplen);
+		trace_set_capture_length(packet,snaplen);
 	}
 
-	if (trace_get_seconds(*packet)<starttime) {
-		return 1;
+	if (trace_get_seconds(packet)<starttime) {
+		return packet;
 	}
 
-	if (trace_get_seconds(*packet)>endtime) {
-		return 0;
+	if (trace_get_seconds(packet)>endtime) {
+		gen.sint = 0;
+		trace_publish_result(trace, t, trace_packet_get_order(packet),
+				gen, RESULT_STOP);
+		return packet;
 	}
 
+	gen.pkt = packet;
+	trace_publish_result(trace, t, trace_packet_get_order(packet), gen,
+			RESULT_PACKET);
+	return NULL;
+}
+
+/* Lets the ordered combiner move past packets this thread has dropped */
+static void cb_tick(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls UNUSED, uint64_t tick) {
+	libtrace_generic_t gen = {0};
+
+	trace_publish_result(trace, t, tick, gen, RESULT_TICK_COUNT);
+}
+
+/* Writes a packet, starting a new output file first if it is due.
+ *
+ * Return values:
+ *  1 = continue reading packets
+ *  0 = stop reading packets, cos we're done
+ *  -1 = stop reading packets, we've got an error
+ */
+static int per_packet(libtrace_packet_t *packet) {
+	libtrace_packet_t *jumped = NULL;
+	int ret;
+
 	if (firsttime==0) {
-		time_t now = trace_get_seconds(*packet);
+		time_t now = trace_get_seconds(packet);
 		if (now != 0 && starttime != 0) {
 			firsttime=now-((now - starttime)%interval);
 		}
@@ -220,7 +276,7 @@ static int per_packet(libtrace_packet_t **packet) {
 		}
 	}
 
-	if (output && trace_get_seconds(*packet)>firsttime+interval) {
+	if (output && trace_get_seconds(packet)>firsttime+interval) {
 		trace_destroy_output(output);
 		output=NULL;
 		firsttime+=interval;
@@ -232,7 +288,7 @@ static int per_packet(libtrace_packet_t **packet) {
 	}
 
 	pktcount++;
-	totbytes+=trace_get_capture_length(*packet);
+	totbytes+=trace_get_capture_length(packet);
 	if (output && totbytes-totbyteslast>=bytes) {
 		trace_destroy_output(output);
 		output=NULL;
@@ -315,25 +371,25 @@ static int per_packet(libtrace_packet_t **packet) {
 	 * lets sort that out now and truncate them properly
 	 */
 
-	if (trace_get_capture_length(*packet)
-			> trace_get_wire_length(*packet)) {
-		trace_set_capture_length(*packet,
-                        trace_get_wire_length(*packet));
+	if (trace_get_capture_length(packet)
+			> trace_get_wire_length(packet)) {
+		trace_set_capture_length(packet,
+                        trace_get_wire_length(packet));
 	}
 
         /* Support "jump"ping to the nth IP header. */
         if (jump) {
             /* Skip headers */
-            void *newpacket = perform_jump(*packet, jump);
-            if (newpacket) {
-                trace_destroy_packet(*packet);
-                *packet = newpacket;
-            }
-            else /* Skip packet */
+            jumped = perform_jump(packet, jump);
+            if (!jumped) /* Skip packet */
                 return 1;
+            packet = jumped;
         }
 
-	if (trace_write_packet(output, *packet)==-1) {
+	ret = trace_write_packet(output, packet);
+	if (jumped)
+		trace_destroy_packet(jumped);
+	if (ret==-1) {
 		trace_perror_output(output,"write_packet");
 		return -1;
 	}
@@ -342,12 +398,35 @@ static int per_packet(libtrace_packet_t **packet) {
 
 }
 
+static void cb_result(libtrace_t *trace, libtrace_thread_t *sender UNUSED,
+		void *global UNUSED, void *tls UNUSED,
+		libtrace_result_t *result) {
+	libtrace_packet_t *packet;
+
+	if (result->type == RESULT_TICK_COUNT)
+		return;
+
+	if (result->type == RESULT_STOP) {
+		done = 1;
+		stop_trace();
+		return;
+	}
+
+	packet = (libtrace_packet_t *)result->value.pkt;
+	/* Packets that were already queued when we stopped are dropped */
+	if (!done && per_packet(packet) < 1) {
+		done = 1;
+		stop_trace();
+	}
+	trace_free_packet(trace, packet);
+}
+
 int main(int argc, char *argv[])
 {
 	char *compress_type_str=NULL;
 	struct libtrace_filter_t *filter=NULL;
-	struct libtrace_t *input = NULL;
-	struct libtrace_packet_t *packet = trace_create_packet();
+	libtrace_callback_set_t *pktcbs, *repcbs;
+	libtrace_stat_t *stat = NULL;
 	struct sigaction sigact;
 	int i;
 
@@ -370,13 +449,14 @@ int main(int argc, char *argv[])
 			{ "libtrace-help", 0, 0, 'H' },
 			{ "maxfiles", 	   1, 0, 'm' },
 			{ "snaplen",	   1, 0, 'S' },
+			{ "threads",	   1, 0, 't' },
 			{ "verbose",       0, 0, 'v' },
 			{ "compress-level", 1, 0, 'z' },
 			{ "compress-type", 1, 0, 'Z' },
 			{ NULL, 	   0, 0, 0   },
 		};
 
-		int c=getopt_long(argc, argv, "j:f:c:b:s:e:i:m:S:Hvz:Z:",
+		int c=getopt_long(argc, argv, "j:f:c:b:s:e:i:m:S:t:Hvz:Z:",
 				long_options, &option_index);
 
 		if (c==-1)
@@ -401,6 +481,10 @@ int main(int argc, char *argv[])
 				  break;
 			case 'S': snaplen=atoi(optarg);
 				  break;
+			case 't': threadcount=atoi(optarg);
+				  if (threadcount <= 0)
+					  threadcount = 1;
+				  break;
 			case 'H':
 				  trace_help();
 				  exit(1);
@@ -447,6 +531,10 @@ int main(int argc, char *argv[])
 		compress_type = TRACE_OPTION_COMPRESSTYPE_LZO;
 	} else if (strncmp(compress_type_str, "xz", 2) == 0) {
 		compress_type = TRACE_OPTION_COMPRESSTYPE_LZMA;
+	} else if (strncmp(compress_type_str, "zst", 3) == 0) {
+		compress_type = TRACE_OPTION_COMPRESSTYPE_ZSTD;
+	} else if (strncmp(compress_type_str, "lz4", 3) == 0) {
+		compress_type = TRACE_OPTION_COMPRESSTYPE_LZ4;
 	} else if (strncmp(compress_type_str, "no", 2) == 0) {
 		compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
 	} else {
@@ -474,53 +562,65 @@ int main(int argc, char *argv[])
 	signal(SIGINT,&cleanup_signal);
 	signal(SIGTERM,&cleanup_signal);
 
-	for (i = optind; i < argc - 1; i++) {
+	pktcbs = trace_create_callback_set();
+	trace_set_packet_cb(pktcbs, cb_packet);
+	trace_set_tick_count_cb(pktcbs, cb_tick);
 
+	repcbs = trace_create_callback_set();
+	trace_set_result_cb(repcbs, cb_result);
 
-		input = trace_create(argv[i]);
+	for (i = optind; i < argc - 1; i++) {
+		libtrace_t *trace = trace_create(argv[i]);
 
-		if (trace_is_err(input)) {
-			trace_perror(input,"%s",argv[i]);
+		if (trace_is_err(trace)) {
+			trace_perror(trace,"%s",argv[i]);
 			return 1;
 		}
 
-		if (filter && trace_config(input, TRACE_OPTION_FILTER, filter) == 1) {
-			trace_perror(input, "Configuring filter for %s",
+		if (filter && trace_config(trace, TRACE_OPTION_FILTER, filter) == 1) {
+			trace_perror(trace, "Configuring filter for %s",
 					argv[i]);
 			return 1;
 		}
 
-		if (trace_start(input)==-1) {
-			trace_perror(input,"%s",argv[i]);
+		/* Packets must be written in the order they were read */
+		trace_set_combiner(trace, &combiner_ordered,
+				(libtrace_generic_t){0});
+		trace_set_perpkt_threads(trace, threadcount);
+		trace_set_tick_count(trace, TICK_COUNT);
+
+		stopping = 0;
+		input = trace;
+
+		if (trace_pstart(trace, NULL, pktcbs, repcbs)==-1) {
+			trace_perror(trace,"%s",argv[i]);
 			return 1;
 		}
 
-		while (trace_read_packet(input,packet)>0) {
-			if (per_packet(&packet) < 1)
-				done = 1;
-			if (done)
-				break;
-		}
+		trace_join(trace);
+		input = NULL;
 
-		if (trace_is_err(input)) {
-			trace_perror(input,"Reading packets");
-			trace_destroy(input);
+		if (trace_is_err(trace)) {
+			trace_perror(trace,"Reading packets");
+			trace_destroy(trace);
 			break;
 		}
 
-		trace_destroy(input);
+		/* Kept for reporting once the trace has been destroyed */
+		if (verbose) {
+			if (!stat)
+				stat = trace_create_statistics();
+			trace_get_statistics(trace, stat);
+		}
+
+		trace_destroy(trace);
 		
 		if (done)
 			break;
 		
 	}
 
-	if (verbose) {
-                libtrace_stat_t *stat;
-                
-                stat = trace_create_statistics();
-                trace_get_statistics(input, stat);
-
+	if (verbose && stat) {
                 if (stat->received_valid)
 			fprintf(stderr,"%" PRIu64 " packets on input\n",
                                         stat->received);
@@ -539,7 +639,10 @@ int main(int argc, char *argv[])
 	if (output)
 		trace_destroy_output(output);
 
-	trace_destroy_packet(packet);
+	trace_destroy_callback_set(pktcbs);
+	trace_destroy_callback_set(repcbs);
+	if (filter)
+		trace_destroy_filter(filter);
 
 	return 0;
 }
@@ -63,10 +63,11 @@ static void cleanup_signal(int signal UNUSED)
 
 struct filter_t {
 	char *expr;
-	struct libtrace_filter_t *filter;
 } *filters = NULL;
 
 int filter_count=0;
+libtrace_filter_set_t *filter_set = NULL;
+volatile bool filter_error = false;
 
 
 typedef struct statistics {
@@ -158,6 +159,7 @@ static libtrace_packet_t* fn_packet(libtrace_t *trace,
                 libtrace_thread_t *t UNUSED,
                 void *global UNUSED, void*tls, libtrace_packet_t *pkt) {
 	statistics_t *results = (statistics_t *)tls;
+	uint64_t matches[filter_count / 64 + 1];
 	int i, wlen;
 
         if (IS_LIBTRACE_META_PACKET(pkt))
@@ -169,18 +171,19 @@ static libtrace_packet_t* fn_packet(libtrace_t *trace,
                 /* Don't count ERF provenance etc. */
                 return pkt;
         }
-	for(i=0;i<filter_count;++i) {
-		if (filters[i].filter == NULL)
-			continue;
-		if(trace_apply_filter(filters[i].filter,pkt) > 0) {
-			results[i+1].count++;
-			results[i+1].bytes+=wlen;
+	if (filter_set) {
+		if (trace_apply_filter_set(filter_set, pkt, matches) == -1
+				&& !filter_error) {
+			/* Filters that fail to compile never match again.
+			 * This is a race, but at worst prints twice */
+			filter_error = true;
+			trace_perror(trace, "trace_apply_filter_set");
 		}
-		if (trace_is_err(trace)) {
-			trace_perror(trace, "trace_apply_filter");
-			fprintf(stderr, "Removing filter from filterlist\n");
-			/* This is a race, but will be atomic */
-			filters[i].filter = NULL;
+		for(i=0;i<filter_count;++i) {
+			if (matches[i / 64] & ((uint64_t)1 << (i % 64))) {
+				results[i+1].count++;
+				results[i+1].bytes+=wlen;
+			}
 		}
 	}
 	results[0].count++;
@@ -263,7 +266,10 @@ int main(int argc, char *argv[]) {
 				++filter_count;
 				filters=realloc(filters,filter_count*sizeof(struct filter_t));
 				filters[filter_count-1].expr=strdup(optarg);
-				filters[filter_count-1].filter=trace_create_filter(optarg);
+				if (!filter_set)
+					filter_set = trace_create_filter_set();
+				if (filter_set)
+					trace_filter_set_add(filter_set, optarg);
 				break;
 			case 'h':
 			        usage(argv[0]);
@@ -295,5 +301,8 @@ int main(int argc, char *argv[]) {
 		printf("%30s:\t%12"PRIu64"\t%12" PRIu64 "\n","Total",totcount,totbytes);
 	}
 	
+	if (filter_set)
+		trace_destroy_filter_set(filter_set);
+
 	return 0;
 }
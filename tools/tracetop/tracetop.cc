@@ -30,12 +30,16 @@
  */
 #define __STDC_FORMAT_MACROS 1
 #include "config.h"
-#include "libtrace.h"
+#include "libtrace_parallel.h"
+#include "data-struct/flow_table.h"
 #include <stdio.h>
 #include <getopt.h>
 #include <stdlib.h>
-#include <map>
-#include <queue>
+#include <vector>
+#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
 #include <inttypes.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -57,72 +61,20 @@
 typedef enum { BITS_PER_SEC, BYTES, PERCENT } display_t;
 display_t display_as = BYTES;
 float interval=2;
-double last_report=0;
+int threadcount=1;
 
 bool use_sip = true;
 bool use_dip = true;
 bool use_sport = true;
 bool use_dport = true;
 bool use_protocol = true;
-bool quit = false;
+volatile bool quit = false;
 bool fullspeed = false;
 bool wide_display = false;
 
-uint64_t total_bytes=0;
-uint64_t total_packets=0;
-
-int cmp_sockaddr_in6(const struct sockaddr_in6 *a, const struct sockaddr_in6 *b)
-{
-	if (a->sin6_port != b->sin6_port)
-		return a->sin6_port - b->sin6_port;
-	return memcmp(a->sin6_addr.s6_addr,b->sin6_addr.s6_addr,sizeof(a->sin6_addr.s6_addr));
-}
-
-int cmp_sockaddr_in(const struct sockaddr_in *a, const struct sockaddr_in *b)
-{
-	if (a->sin_port != b->sin_port)
-		return a->sin_port - b->sin_port;
-	return a->sin_addr.s_addr - b->sin_addr.s_addr;
-}
-
-#ifdef HAVE_NETPACKET_PACKET_H
-int cmp_sockaddr_ll(const struct sockaddr_ll *a, const struct sockaddr_ll *b)
-{
-	return memcmp(a->sll_addr, b->sll_addr, b->sll_halen);
-}
-#else
-int cmp_sockaddr_dl(const struct sockaddr_dl *a, const struct sockaddr_dl *b)
-{
-	return memcmp(a->sdl_data, b->sdl_data, b->sdl_alen);
-}
-
-#endif
-
-
-int cmp_sockaddr(const struct sockaddr *a, const struct sockaddr *b)
-{
-	if (a->sa_family != b->sa_family) {
-		return a->sa_family - b->sa_family;
-	}
-	switch (a->sa_family) {
-		case AF_INET:
-			return cmp_sockaddr_in((struct sockaddr_in *)a,(struct sockaddr_in*)b);
-		case AF_INET6:
-			return cmp_sockaddr_in6((struct sockaddr_in6 *)a,(struct sockaddr_in6*)b);
-#ifdef HAVE_NETPACKET_PACKET_H
-		case AF_PACKET:
-			return cmp_sockaddr_ll((struct sockaddr_ll *)a,(struct sockaddr_ll*)b);
-#else
-		case AF_LINK:
-			return cmp_sockaddr_dl((struct sockaddr_dl *)a, (struct sockaddr_dl *)b);
-#endif
-		case AF_UNSPEC:
-			return 0; /* Can't compare UNSPEC's! */
-		default:
-			fprintf(stderr,"Don't know how to compare family %d\n",a->sa_family);
-			abort();
-	}
-}
+/* The number of flows the reporter keeps in its top list, at least the number
+ * of rows on the screen */
+volatile size_t topk_size=64;
 
 char *trace_sockaddr2string(const struct sockaddr *a, socklen_t salen, char *buffer, size_t bufflen)
 {
@@ -167,76 +119,135 @@ char *trace_sockaddr2string(const struct sockaddr *a, socklen_t salen, char *buf
 	return mybuf;
 }
 
-static void set_port_for_sockaddr(struct sockaddr *sa,uint16_t port)
-{
-	switch (sa->sa_family) {
-		case AF_INET:
-			((struct sockaddr_in *)sa)->sin_port = htons(port);
-			break;
-		case AF_INET6:
-			((struct sockaddr_in6 *)sa)->sin6_port = htons(port);
-			break;
+/* Flows are keyed on the address, port and family of each end, only using
+ * the fields that are being displayed. Unused fields are zero. */
+struct flowkey_t {
+	uint8_t saddr[16];
+	uint8_t daddr[16];
+	uint16_t sport;
+	uint16_t dport;
+	uint8_t sfamily;
+	uint8_t dfamily;
+	uint8_t protocol;
+	uint8_t pad;
+};
+
+struct flowdata_t {
+	uint64_t packets;
+	uint64_t bytes;
+	/* Only used by the reporter, the flow's position in the table and in
+	 * the top list */
+	uint32_t index;
+	uint32_t heap_pos;
+};
+
+#define NOT_IN_HEAP UINT32_MAX
+
+/* What a per-packet thread counted during one interval */
+struct interval_result_t {
+	libtrace_flowtable_t *flows;
+	uint64_t packets;
+	uint64_t bytes;
+};
+
+struct thread_data_t {
+	libtrace_flowtable_t *flows;
+	uint64_t packets;
+	uint64_t bytes;
+	/* The interval being counted, as the number of intervals since the
+	 * epoch, or 0 before the first packet */
+	uint64_t bucket;
+};
+
+struct flow_data_t {
+	uint64_t bytes;
+	uint64_t packets;
+	flowkey_t key;
+
+	bool operator< (const flow_data_t &b) const {
+		if (bytes != b.bytes) return bytes < b.bytes;
+		return packets < b.packets;
 	}
-}
+};
 
-static void clear_addr_for_sockaddr(struct sockaddr *sa)
+/* The reporter merges each interval's flows into one table, and keeps the
+ * largest flows in a min-heap as it goes, so finding the flows to show does
+ * not depend on how many flows there are */
+libtrace_flowtable_t *flows = NULL;
+std::vector<uint32_t> top;
+uint64_t total_bytes=0;
+uint64_t total_packets=0;
+uint64_t current_key=0;
+
+/* The last complete interval, handed from the reporter to the main thread,
+ * which owns the screen */
+pthread_mutex_t display_lock = PTHREAD_MUTEX_INITIALIZER;
+std::vector<flow_data_t> display_flows;
+uint64_t display_bytes=0;
+uint64_t display_packets=0;
+int notify_pipe[2];
+
+/* When a trace file is played back in real time, ticks carry the time on the
+ * wall clock. This is the difference to the trace's clock, measured at the
+ * first packet. */
+bool playback = false;
+volatile bool clock_set = false;
+int64_t clock_offset = 0;
+pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void sockaddr_to_key(const struct sockaddr *sa, uint8_t *addr,
+		uint16_t *port, uint8_t *family)
 {
+	*family = sa->sa_family;
 	switch (sa->sa_family) {
 		case AF_INET:
-			((struct sockaddr_in *)sa)->sin_addr.s_addr = 0;
+			memcpy(addr, &((struct sockaddr_in *)sa)->sin_addr, 4);
+			*port = ntohs(((struct sockaddr_in *)sa)->sin_port);
 			break;
 		case AF_INET6:
-			memset((void*)&((struct sockaddr_in6 *)sa)->sin6_addr,0,sizeof(((struct sockaddr_in6 *)sa)->sin6_addr));
+			memcpy(addr, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+			*port = ntohs(((struct sockaddr_in6 *)sa)->sin6_port);
 			break;
+#ifdef HAVE_NETPACKET_PACKET_H
+		case AF_PACKET:
+			memcpy(addr, ((struct sockaddr_ll *)sa)->sll_addr, 6);
+			break;
+#else
+		case AF_LINK:
+			memcpy(addr, ((struct sockaddr_dl *)sa)->sdl_data, 6);
+			break;
+#endif
 	}
 }
 
-static uint16_t get_port_from_sockaddr(struct sockaddr *sa)
+static void key_to_sockaddr(const uint8_t *addr, uint16_t port,
+		uint8_t family, struct sockaddr_storage *ss)
 {
-	switch (sa->sa_family) {
+	memset(ss, 0, sizeof(struct sockaddr_storage));
+	ss->ss_family = family;
+	switch (family) {
 		case AF_INET:
-			return ntohs(((struct sockaddr_in *)sa)->sin_port);
+			memcpy(&((struct sockaddr_in *)ss)->sin_addr, addr, 4);
+			((struct sockaddr_in *)ss)->sin_port = htons(port);
 			break;
 		case AF_INET6:
-			return ntohs(((struct sockaddr_in6 *)sa)->sin6_port);
+			memcpy(&((struct sockaddr_in6 *)ss)->sin6_addr, addr, 16);
+			((struct sockaddr_in6 *)ss)->sin6_port = htons(port);
+			break;
+#ifdef HAVE_NETPACKET_PACKET_H
+		case AF_PACKET:
+			memcpy(((struct sockaddr_ll *)ss)->sll_addr, addr, 6);
+			((struct sockaddr_ll *)ss)->sll_halen = 6;
+			break;
+#else
+		case AF_LINK:
+			memcpy(((struct sockaddr_dl *)ss)->sdl_data, addr, 6);
+			((struct sockaddr_dl *)ss)->sdl_alen = 6;
 			break;
+#endif
 	}
-
-	return 0;
 }
 
-struct flowkey_t {
-	struct sockaddr_storage sip;
-	struct sockaddr_storage dip;
-	uint16_t sport;
-	uint16_t dport;
-	uint8_t protocol;
-
-	bool operator <(const flowkey_t &b) const {
-		int c;
-
-		if (use_sip) {
-			c = cmp_sockaddr((struct sockaddr*)&sip,(struct sockaddr*)&b.sip);
-			if (c != 0) return c<0;
-		}
-		if (use_dip) {
-			c = cmp_sockaddr((struct sockaddr*)&dip,(struct sockaddr*)&b.dip);
-			if (c != 0) return c<0;
-		}
-
-		return protocol < b.protocol;
-	}
-};
-
-struct flowdata_t {
-	uint64_t packets;
-	uint64_t bytes;
-};
-
-typedef std::map<flowkey_t,flowdata_t> flows_t;
-
-flows_t flows;
-
 const char *nice_bandwidth(double bytespersec)
 {
 	static char ret[1024];
@@ -255,82 +266,315 @@ const char *nice_bandwidth(double bytespersec)
 	return ret;
 }
 
-static void per_packet(libtrace_packet_t *packet)
+static void per_packet(thread_data_t *td, libtrace_packet_t *packet)
 {
+	struct sockaddr_storage sip, dip;
 	flowkey_t flowkey;
-	flows_t::iterator it;
+	flowdata_t *flowdata;
 
-        if (IS_LIBTRACE_META_PACKET(packet))
-                return;
+	memset(&flowkey, 0, sizeof(flowkey));
 
-	if (trace_get_source_address(packet,(struct sockaddr*)&flowkey.sip)==NULL)
-		flowkey.sip.ss_family = AF_UNSPEC;
+	if (trace_get_source_address(packet,(struct sockaddr*)&sip)!=NULL)
+		sockaddr_to_key((struct sockaddr *)&sip, flowkey.saddr,
+				&flowkey.sport, &flowkey.sfamily);
 
-	if (trace_get_destination_address(packet,(struct sockaddr*)&flowkey.dip)==NULL)
-		flowkey.dip.ss_family = AF_UNSPEC;
+	if (trace_get_destination_address(packet,(struct sockaddr*)&dip)!=NULL)
+		sockaddr_to_key((struct sockaddr *)&dip, flowkey.daddr,
+				&flowkey.dport, &flowkey.dfamily);
 
 	if (!use_sip)
-		clear_addr_for_sockaddr((struct sockaddr *)&flowkey.sip);
+		memset(flowkey.saddr, 0, sizeof(flowkey.saddr));
 
 	if (!use_dip)
-		clear_addr_for_sockaddr((struct sockaddr *)&flowkey.dip);
+		memset(flowkey.daddr, 0, sizeof(flowkey.daddr));
 
 	if (!use_sport)
-		set_port_for_sockaddr((struct sockaddr *)&flowkey.sip,0);
+		flowkey.sport = 0;
 
 	if (!use_dport) 
-		set_port_for_sockaddr((struct sockaddr *)&flowkey.dip,0);
+		flowkey.dport = 0;
 
 	if (use_protocol && trace_get_transport(packet,&flowkey.protocol, NULL) == NULL)
 		flowkey.protocol = 255;
 
+	if (!td->flows)
+		td->flows = libtrace_flowtable_create(sizeof(flowkey_t),
+				sizeof(flowdata_t));
+	if (td->flows) {
+		flowdata = (flowdata_t *)libtrace_flowtable_get(td->flows,
+				&flowkey, 0, NULL);
+		if (flowdata) {
+			++flowdata->packets;
+			flowdata->bytes+=trace_get_wire_length(packet);
+		}
+	}
+
+	++td->packets;
+	td->bytes+=trace_get_wire_length(packet);
+}
+
+/* Sends the thread's counts for the current interval to the reporter. The
+ * result is keyed on the end of the interval, so every thread's counts for an
+ * interval have the same key and the ordered combiner delivers them together.
+ */
+static void publish_interval(libtrace_t *trace, libtrace_thread_t *t,
+		thread_data_t *td)
+{
+	interval_result_t *res = (interval_result_t *)malloc(sizeof(*res));
+	libtrace_generic_t gen;
+
+	res->flows = td->flows;
+	res->packets = td->packets;
+	res->bytes = td->bytes;
+	td->flows = NULL;
+	td->packets = 0;
+	td->bytes = 0;
+
+	gen.ptr = res;
+	trace_publish_result(trace, t, td->bucket + 1, gen, RESULT_USER);
+	trace_post_reporter(trace);
+}
+
+static void next_bucket(libtrace_t *trace, libtrace_thread_t *t,
+		thread_data_t *td, double seconds)
+{
+	uint64_t bucket = (uint64_t)(seconds / interval);
+
+	if (bucket <= td->bucket)
+		return;
+	if (td->bucket != 0)
+		publish_interval(trace, t, td);
+	td->bucket = bucket;
+}
+
+static void *cb_starting(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED)
+{
+	return calloc(1, sizeof(thread_data_t));
+}
+
+static libtrace_packet_t *cb_packet(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls, libtrace_packet_t *packet)
+{
+	thread_data_t *td = (thread_data_t *)tls;
 
-	it = flows.find(flowkey);
-	if (it == flows.end()) {
-		flowdata_t flowdata = { 0, 0 };
-		flows_t::value_type insdata(flowkey,flowdata);
-		std::pair<flows_t::iterator,bool> ins= flows.insert(insdata);
-		it = ins.first;
+        if (IS_LIBTRACE_META_PACKET(packet))
+                return packet;
+
+	if (playback && !clock_set) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		pthread_mutex_lock(&clock_lock);
+		if (!clock_set) {
+			clock_offset = (int64_t)(trace_get_erf_timestamp(packet) -
+				((((uint64_t)tv.tv_sec) << 32) +
+				 (((uint64_t)tv.tv_usec << 32) / 1000000)));
+			clock_set = true;
+		}
+		pthread_mutex_unlock(&clock_lock);
 	}
 
-	++it->second.packets;
-	it->second.bytes+=trace_get_wire_length(packet);
+	next_bucket(trace, t, td, trace_get_seconds(packet));
+	per_packet(td, packet);
+	return packet;
+}
 
-	++total_packets;
-	total_bytes+=trace_get_wire_length(packet);
+/* Ticks let threads that are not seeing packets finish their interval, so the
+ * reporter is not left waiting for them */
+static void cb_tick(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls, uint64_t order)
+{
+	thread_data_t *td = (thread_data_t *)tls;
 
+	if (playback) {
+		if (!clock_set)
+			return;
+		order += clock_offset;
+	}
+	next_bucket(trace, t, td, (order >> 32) +
+			(double)(order & 0xffffffff) / 4294967296.0);
 }
 
-struct flow_data_t {
-	uint64_t bytes;
-	uint64_t packets;
-	struct sockaddr_storage sip;
-	struct sockaddr_storage dip;
-	uint8_t protocol;
+static void cb_stopping(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls)
+{
+	thread_data_t *td = (thread_data_t *)tls;
 
-	bool operator< (const flow_data_t &b) const {
-		if (bytes != b.bytes) return bytes < b.bytes;
-		return packets < b.packets;
+	if (td->bucket != 0)
+		publish_interval(trace, t, td);
+	if (td->flows)
+		libtrace_flowtable_destroy(td->flows);
+	free(td);
+}
+
+static flowdata_t *top_flow(size_t pos)
+{
+	return (flowdata_t *)libtrace_flowtable_entry(flows, top[pos], NULL);
+}
+
+static bool top_less(size_t a, size_t b)
+{
+	flowdata_t *fa = top_flow(a);
+	flowdata_t *fb = top_flow(b);
+
+	if (fa->bytes != fb->bytes) return fa->bytes < fb->bytes;
+	return fa->packets < fb->packets;
+}
+
+static void top_swap(size_t a, size_t b)
+{
+	std::swap(top[a], top[b]);
+	top_flow(a)->heap_pos = a;
+	top_flow(b)->heap_pos = b;
+}
+
+static void top_sift_up(size_t pos)
+{
+	while (pos > 0 && top_less(pos, (pos - 1) / 2)) {
+		top_swap(pos, (pos - 1) / 2);
+		pos = (pos - 1) / 2;
 	}
-};
+}
 
-static void do_report()
+static void top_sift_down(size_t pos)
 {
-	typedef  std::priority_queue<flow_data_t> pq_t;
-	int row,col;
-	pq_t pq;
-	for(flows_t::const_iterator it=flows.begin();it!=flows.end();++it) {
+	for (;;) {
+		size_t smallest = pos;
+		size_t child = pos * 2 + 1;
+
+		if (child < top.size() && top_less(child, smallest))
+			smallest = child;
+		if (child + 1 < top.size() && top_less(child + 1, smallest))
+			smallest = child + 1;
+		if (smallest == pos)
+			return;
+		top_swap(pos, smallest);
+		pos = smallest;
+	}
+}
+
+/* Called whenever a flow grows. Flows only grow during an interval, so
+ * keeping the largest topk_size flows seen so far gives the exact top list.
+ */
+static void top_update(flowdata_t *flow)
+{
+	if (flow->heap_pos != NOT_IN_HEAP) {
+		top_sift_down(flow->heap_pos);
+		return;
+	}
+	if (top.size() < topk_size) {
+		top.push_back(flow->index);
+		flow->heap_pos = top.size() - 1;
+		top_sift_up(top.size() - 1);
+		return;
+	}
+	if (top.empty())
+		return;
+	flowdata_t *smallest = top_flow(0);
+	if (flow->bytes < smallest->bytes || (flow->bytes == smallest->bytes
+				&& flow->packets <= smallest->packets))
+		return;
+	smallest->heap_pos = NOT_IN_HEAP;
+	top[0] = flow->index;
+	flow->heap_pos = 0;
+	top_sift_down(0);
+}
+
+/* Hands the finished interval to the main thread and starts the next one */
+static void finish_interval()
+{
+	std::vector<flow_data_t> sorted;
+
+	for (size_t i = 0; i < top.size(); ++i) {
 		flow_data_t data;
-		data.bytes = it->second.bytes,
-		data.packets = it->second.packets,
-		data.sip = it->first.sip;
-		data.dip = it->first.dip;
-		data.protocol = it->first.protocol;
-		pq.push(data);
+		const void *key;
+		flowdata_t *flowdata = (flowdata_t *)libtrace_flowtable_entry(
+				flows, top[i], &key);
+		data.bytes = flowdata->bytes;
+		data.packets = flowdata->packets;
+		memcpy(&data.key, key, sizeof(flowkey_t));
+		sorted.push_back(data);
+	}
+	std::sort(sorted.begin(), sorted.end());
+	std::reverse(sorted.begin(), sorted.end());
+
+	pthread_mutex_lock(&display_lock);
+	display_flows.swap(sorted);
+	display_bytes = total_bytes;
+	display_packets = total_packets;
+	pthread_mutex_unlock(&display_lock);
+	if (write(notify_pipe[1], "r", 1) != 1) {
+		/* The main thread is already behind, it will see this
+		 * interval when it catches up */
+	}
+
+	libtrace_flowtable_clear(flows);
+	top.clear();
+	total_bytes = 0;
+	total_packets = 0;
+}
+
+static void cb_result(libtrace_t *trace UNUSED,
+		libtrace_thread_t *sender UNUSED, void *global UNUSED,
+		void *tls UNUSED, libtrace_result_t *result)
+{
+	interval_result_t *res = (interval_result_t *)result->value.ptr;
+
+	if (current_key != 0 && result->key > current_key)
+		finish_interval();
+	current_key = result->key;
+
+	if (res->flows) {
+		for (size_t i = 0; i < libtrace_flowtable_size(res->flows); ++i) {
+			const void *key;
+			flowdata_t *other = (flowdata_t *)
+				libtrace_flowtable_entry(res->flows, i, &key);
+			bool created;
+			flowdata_t *flowdata = (flowdata_t *)
+				libtrace_flowtable_get(flows, key, 0, &created);
+
+			if (!flowdata)
+				break;
+			if (created) {
+				/* Flows are only added between clears, so
+				 * the new flow is at the end of the table */
+				flowdata->index = libtrace_flowtable_size(flows) - 1;
+				flowdata->heap_pos = NOT_IN_HEAP;
+			}
+			flowdata->packets += other->packets;
+			flowdata->bytes += other->bytes;
+			top_update(flowdata);
+		}
+		libtrace_flowtable_destroy(res->flows);
+	}
+	total_packets += res->packets;
+	total_bytes += res->bytes;
+	free(res);
+}
+
+static void cb_reporter_stopping(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED,
+		void *tls UNUSED)
+{
+	libtrace_flowtable_clear(flows);
+	top.clear();
+	total_bytes = 0;
+	total_packets = 0;
+	current_key = 0;
+	clock_set = false;
+	if (write(notify_pipe[1], "d", 1) != 1) {
+		/* Nothing else can be done */
 	}
+}
+
+static void do_report()
+{
+	int row,col;
+
+	pthread_mutex_lock(&display_lock);
 	getmaxyx(stdscr,row,col);
 	move(0,0);
-	printw("Total Bytes: %10" PRIu64 " (%s)\tTotal Packets: %10" PRIu64, total_bytes, nice_bandwidth(total_bytes/interval), total_packets);
+	printw("Total Bytes: %10" PRIu64 " (%s)\tTotal Packets: %10" PRIu64, display_bytes, nice_bandwidth(display_bytes/interval), display_packets);
 	clrtoeol();
 	attrset(A_REVERSE);
 	move(1,0);
@@ -370,12 +614,17 @@ static void do_report()
 	attrset(A_NORMAL);
 	char sipstr[1024];
 	char dipstr[1024];
-	for(int i=1; i<row-3 && !pq.empty(); ++i) {
+	for(int i=1; i<row-3 && (size_t)i<=display_flows.size(); ++i) {
+		const flow_data_t &flow = display_flows[i-1];
+		const flowkey_t *key = &flow.key;
+		struct sockaddr_storage sip, dip;
+		key_to_sockaddr(key->saddr, key->sport, key->sfamily, &sip);
+		key_to_sockaddr(key->daddr, key->dport, key->dfamily, &dip);
 		move(i+1,0);
 		if (use_sip) {
 			printw("%*s", wide_display ? 42 : 20, 
 					trace_sockaddr2string(
-						(struct sockaddr*)&pq.top().sip,
+						(struct sockaddr*)&sip,
 						sizeof(struct sockaddr_storage),
 						sipstr,sizeof(sipstr)));
 			if (use_sport)
@@ -384,11 +633,11 @@ static void do_report()
 				printw("\t");
 		}
 		if (use_sport)
-			printw("%-5d  ", get_port_from_sockaddr((struct sockaddr*)&pq.top().sip));
+			printw("%-5d  ", key->sport);
 		if (use_dip) {
 			printw("%*s", wide_display ? 42 : 20, 
 					trace_sockaddr2string(
-						(struct sockaddr*)&pq.top().dip,
+						(struct sockaddr*)&dip,
 						sizeof(struct sockaddr_storage),
 						dipstr,sizeof(dipstr)));
 			if (use_dport)
@@ -397,94 +646,64 @@ static void do_report()
 				printw("\t");
 		}
 		if (use_dport)
-			printw("%-5d  ", get_port_from_sockaddr((struct sockaddr*)&pq.top().dip));
+			printw("%-5d  ", key->dport);
 		if (use_protocol) {
-			struct protoent *proto = getprotobynumber(pq.top().protocol);
+			struct protoent *proto = getprotobynumber(key->protocol);
 			if (proto) 
 				printw("%-10s  ", proto->p_name);
 			else
-				printw("%10d  ",pq.top().protocol);
+				printw("%10d  ",key->protocol);
 		}
 		switch (display_as) {
 			case BYTES:
 				printw("%7" PRIu64 "\t%7" PRIu64 "\n",
-						pq.top().bytes,
-						pq.top().packets);
+						flow.bytes,
+						flow.packets);
 				break;
 			case BITS_PER_SEC:
 				printw("%14.03f\t%" PRIu64 "\n",
-						8.0*pq.top().bytes/interval,
-						pq.top().packets);
+						8.0*flow.bytes/interval,
+						flow.packets);
 				break;
 			case PERCENT:
 				printw("%6.2f%%\t%6.2f%%\n",
-						100.0*pq.top().bytes/total_bytes,
-						100.0*pq.top().packets/total_packets);
+						100.0*flow.bytes/display_bytes,
+						100.0*flow.packets/display_packets);
 		}
-		pq.pop();
 	}
-	flows.clear();
-	total_packets = 0;
-	total_bytes = 0;
+
+	pthread_mutex_unlock(&display_lock);
+	topk_size = row > 64 ? row : 64;
 
 	clrtobot();
 	refresh();
 }
 
+/* Draws each interval as the reporter finishes it and handles key presses,
+ * until the trace is finished */
 static void run_trace(libtrace_t *trace)
 {
-	libtrace_packet_t *packet = trace_create_packet();
-	libtrace_eventobj_t obj;
-	fd_set rfds;
-	struct timeval sleep_tv;
-	struct timeval *tv = NULL;
-
-	do {
-		int maxfd=0;
-		FD_ZERO(&rfds);
-		FD_SET(0, &rfds); /* stdin */
-		tv=NULL;
-		maxfd=0;
-
-		obj = trace_event(trace, packet);
-		switch(obj.type) {
-			case TRACE_EVENT_IOWAIT:
-				FD_SET(obj.fd, &rfds);
-				maxfd = obj.fd;
-				break;
+	bool stopped = false;
 
-			case TRACE_EVENT_SLEEP:
-				sleep_tv.tv_sec = (int)obj.seconds;
-				sleep_tv.tv_usec = (int)((obj.seconds - sleep_tv.tv_sec)*1000000.0);
+	for (;;) {
+		fd_set rfds;
+		int maxfd = notify_pipe[0];
 
-				tv = &sleep_tv;
-				break;;
-
-			case TRACE_EVENT_TERMINATE:
-				trace_destroy_packet(packet);
-				return;
+		FD_ZERO(&rfds);
+		FD_SET(0, &rfds); /* stdin */
+		FD_SET(notify_pipe[0], &rfds);
 
-			case TRACE_EVENT_PACKET:
-				if (obj.size == -1)
-					break;
-				if (trace_get_seconds(packet) - last_report >= interval) {
-					do_report();
-					last_report=trace_get_seconds(packet);
-				}
-				if (trace_read_packet(trace,packet) <= 0) {
-					obj.size = -1;
-					break;
-				}
-				per_packet(packet);
-				continue;
-		}
+		if (select(maxfd+1, &rfds, 0, 0, NULL) < 0)
+			continue;
 
-		if (tv && tv->tv_sec > interval) {
-			tv->tv_sec = (int)interval;
-			tv->tv_usec = 0;
+		if (FD_ISSET(notify_pipe[0], &rfds)) {
+			char c;
+			if (read(notify_pipe[0], &c, 1) == 1) {
+				if (c == 'd')
+					return;
+				do_report();
+			}
 		}
-
-		select(maxfd+1, &rfds, 0, 0, tv);
 		if (FD_ISSET(0, &rfds)) {
 			switch (getch()) {
 				case '%':
@@ -499,8 +718,10 @@ static void run_trace(libtrace_t *trace)
 				case '\x1b': /* Escape */
 				case 'q':
 					quit = true;
-					trace_destroy_packet(packet);
-					return;
+					if (!stopped)
+						trace_pstop(trace);
+					stopped = true;
+					break;
 				case '1': use_sip 	= !use_sip; break;
 				case '2': use_sport 	= !use_sport; break;
 				case '3': use_dip 	= !use_dip; break;
@@ -508,9 +729,7 @@ static void run_trace(libtrace_t *trace)
 				case '5': use_protocol 	= !use_protocol; break;
 			}
 		}
-	} while (obj.type != TRACE_EVENT_TERMINATE || obj.size == -1);
-
-	trace_destroy_packet(packet);
+	}
 } 
 
 static void usage(char *argv0)
@@ -537,11 +756,18 @@ static void usage(char *argv0)
 	fprintf(stderr," --wide\n");
 	fprintf(stderr," -w\n");
 	fprintf(stderr,"\t\tExpand IP address fields to fit IPv6 addresses\n");
+	fprintf(stderr," --fast\n");
+	fprintf(stderr," -F\n");
+	fprintf(stderr,"\t\tRead trace files as fast as possible, not in real time\n");
+	fprintf(stderr," --threads int\n");
+	fprintf(stderr," -t int\n");
+	fprintf(stderr,"\t\tUse int threads to process packets\n");
 }
 
 int main(int argc, char *argv[])
 {
 	libtrace_t *trace;
+	libtrace_callback_set_t *pktcbs, *repcbs;
 	libtrace_filter_t *filter=NULL;
 	int snaplen=-1;
 	int promisc=-1;
@@ -561,10 +787,11 @@ int main(int argc, char *argv[])
 			{ "interval",		1, 0, 'i' },
 			{ "fast",		0, 0, 'F' },
 			{ "wide", 		0, 0, 'w' },
+			{ "threads",		1, 0, 't' },
 			{ NULL,			0, 0, 0 }
 		};
 
-		int c= getopt_long(argc, argv, "BPf:Fs:p:hHi:w12345",
+		int c= getopt_long(argc, argv, "BPf:Fs:p:hHi:t:w12345",
 				long_options, &option_index);
 
 		if (c==-1)
@@ -602,6 +829,11 @@ int main(int argc, char *argv[])
 			case 'w':
 				wide_display = true;
 				break;
+			case 't':
+				threadcount = atoi(optarg);
+				if (threadcount <= 0)
+					threadcount = 1;
+				break;
 			case '1': use_sip 	= !use_sip; break;
 			case '2': use_sport 	= !use_sport; break;
 			case '3': use_dip 	= !use_dip; break;
@@ -622,7 +854,29 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	flows = libtrace_flowtable_create(sizeof(flowkey_t),
+			sizeof(flowdata_t));
+	if (!flows) {
+		fprintf(stderr,"Unable to allocate flow table\n");
+		return 1;
+	}
+	if (pipe(notify_pipe) == -1) {
+		perror("pipe");
+		return 1;
+	}
+
+	pktcbs = trace_create_callback_set();
+	trace_set_starting_cb(pktcbs, cb_starting);
+	trace_set_packet_cb(pktcbs, cb_packet);
+	trace_set_tick_interval_cb(pktcbs, cb_tick);
+	trace_set_stopping_cb(pktcbs, cb_stopping);
+
+	repcbs = trace_create_callback_set();
+	trace_set_result_cb(repcbs, cb_result);
+	trace_set_stopping_cb(repcbs, cb_reporter_stopping);
+
 	initscr(); cbreak(); noecho();
+	topk_size = LINES > 64 ? LINES : 64;
 
 	while (!quit && optind<argc) {
 		trace = trace_create(argv[optind]);
@@ -647,14 +901,20 @@ int main(int argc, char *argv[])
 				trace_perror(trace,"ignoring: ");
 			}
 		}
-		if (fullspeed) {
-			int flag=1;
-			if (trace_config(trace,TRACE_OPTION_EVENT_REALTIME,&flag)) {
-				trace_perror(trace,"Setting EVENT_REALTIME option");
-			}
-		}
 
-		if (trace_start(trace)) {
+		trace_set_combiner(trace, &combiner_ordered,
+				(libtrace_generic_t){0});
+		trace_set_perpkt_threads(trace, threadcount);
+		trace_set_hasher(trace, HASHER_BIDIRECTIONAL, NULL, NULL);
+		/* Play trace files back at the speed they were captured,
+		 * unless asked not to */
+		playback = !trace_get_information(trace)->live && !fullspeed;
+		if (playback)
+			trace_set_tracetime(trace, true);
+		if (playback || trace_get_information(trace)->live)
+			trace_set_tick_interval(trace, (size_t)(interval * 1000));
+
+		if (trace_pstart(trace, NULL, pktcbs, repcbs)) {
 			endwin();
 			trace_perror(trace,"Starting trace");
 			trace_destroy(trace);
@@ -662,6 +922,7 @@ int main(int argc, char *argv[])
 		}
 
 		run_trace(trace);
+		trace_join(trace);
 
 		if (trace_is_err(trace)) {
 			trace_perror(trace,"Reading packets");
@@ -672,6 +933,9 @@ int main(int argc, char *argv[])
 
 	endwin();
 	endprotoent();
+	trace_destroy_callback_set(pktcbs);
+	trace_destroy_callback_set(repcbs);
+	libtrace_flowtable_destroy(flows);
 
 	return 0;
 }